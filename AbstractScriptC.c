@@ -1,8 +1,151 @@
-﻿#include <stdio.h>
+﻿#ifndef _WIN32
+#define _XOPEN_SOURCE 700
+#endif
+
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <errno.h>
+#include <math.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#include <io.h>
+#include <process.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#else
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#endif
+
+// SSE2 is part of x86-64, so only the AVX kernels need a check at runtime
+#if defined(__x86_64__) || defined(_M_X64) || (defined(__i386__) && defined(__SSE2__))
+#define ASC_X86_KERNELS
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#include "AbstractScriptC.h"
+
+#define ASC_VERSION "1.0.0"
+
+// Minimal threading layer over pthreads and Win32
+#ifdef _WIN32
+typedef CRITICAL_SECTION AscMutex;
+typedef CONDITION_VARIABLE AscCond;
+typedef HANDLE AscThread;
+typedef LPTHREAD_START_ROUTINE ThreadFunction;
+#define THREAD_RESULT DWORD WINAPI
+#else
+typedef pthread_mutex_t AscMutex;
+typedef pthread_cond_t AscCond;
+typedef pthread_t AscThread;
+typedef void* (*ThreadFunction)(void*);
+#define THREAD_RESULT void*
+#endif
+
+#ifdef _MSC_VER
+#define ASC_THREAD_LOCAL __declspec(thread)
+#define ASC_NORETURN __declspec(noreturn)
+#else
+#define ASC_THREAD_LOCAL _Thread_local
+#define ASC_NORETURN _Noreturn
+#endif
+
+// Set once worker threads exist; shared bookkeeping (allocation stats, trace
+// events, cache counters, lazily parsed bodies) is locked from then on
+bool threads_enabled = false;
+AscMutex mem_lock;
+AscMutex tooling_lock;
+AscMutex lazy_lock;
+
+// Script errors jump here instead of exiting when set, so a speculative parse
+// on a worker thread fails quietly and an embedded interpreter returns a status
+enum { ERROR_SYNTAX = 1, ERROR_RUNTIME = 2 };
+ASC_THREAD_LOCAL jmp_buf* error_trap = NULL;
+ASC_THREAD_LOCAL char error_message[256] = "";
+ASC_THREAD_LOCAL int thread_index = 0; // 0 for the main thread, then one per worker
+
+// Allocation categories for --mem-stats. Every allocation goes through the
+// asc_* wrappers below with one of these tags.
+typedef enum {
+    MEM_TOKEN,
+    MEM_AST,
+    MEM_SCOPE,
+    MEM_CLOSURE,
+    MEM_STRING,
+    MEM_ARRAY,
+    MEM_MAP,
+    MEM_CALL,     // Argument arrays and saved scope stacks of calls
+    MEM_IMPORT,   // Import bookkeeping: paths, module registry, imported programs
+    MEM_SOURCE,   // File contents
+    MEM_RUNTIME,  // Lexer, parser and interpreter structures
+    MEM_TOOLING,  // Profilers and tracer
+    MEM_TAG_COUNT
+} MemTag;
+
+typedef struct {
+    uint64_t allocations;
+    uint64_t reallocations;
+    uint64_t frees;
+    uint64_t bytes_allocated; // Total bytes handed out, including growth by realloc
+    int64_t live_bytes;
+    int64_t peak_live_bytes;
+} MemTagStats;
+
+typedef struct {
+    MemTagStats tags[MEM_TAG_COUNT];
+    int64_t live_bytes;
+    int64_t peak_live_bytes;
+} MemStats;
+
+typedef union MemHeader MemHeader;
+
+// Allocations are charged to a heap. Parsed programs, import bookkeeping and
+// tooling live on the shared heap; scopes, values and interpreter structures
+// live on the heap of the interpreter that made them, which keeps a list of
+// its blocks so they can all be released together.
+typedef struct {
+    MemStats stats;
+    MemHeader* blocks; // Not kept for the shared heap
+    bool shared;
+} Heap;
+
+// Prepended to every block so frees can be charged to the right heap and tag
+union MemHeader {
+    struct {
+        size_t size;
+        MemTag tag;
+        Heap* heap;
+        MemHeader* prev;
+        MemHeader* next;
+    } info;
+    max_align_t align;
+};
+
+Heap shared_heap = { .shared = true };
+MemStats released_heap_stats = { 0 }; // Totals of interpreter heaps already released
+uint64_t reclaimed_blocks = 0;        // Blocks still live when their heap was released
+ASC_THREAD_LOCAL Heap* current_heap = NULL;
 
 typedef enum {
     TOKEN_NUMBER,
@@ -28,6 +171,10 @@ typedef enum {
     TOKEN_RBRACE,
     TOKEN_SEMICOLON,
     TOKEN_COMMA,
+    TOKEN_LBRACKET,
+    TOKEN_RBRACKET,
+    TOKEN_DOT,
+    TOKEN_COLON,
     TOKEN_LET,
     TOKEN_IF,
     TOKEN_ELSE,
@@ -47,18 +194,42 @@ typedef struct {
         double number_value;
         char* string_value;
     } value;
+    int line;
+    int end; // Offset just past the token in the source
 } Token;
 
 typedef struct {
-    char* input;
+    const char* input;
     int position;
     int input_length;
     char current_char;
+    int line;
+    Token* tokens; // Filled by tokenize, then handed over to the parser
+    int token_count;
 } Lexer;
 
 // Forward declarations for AST node structures
 typedef struct ASTNode ASTNode;
 
+// AST nodes live in a program image and refer to other nodes, lists and
+// strings by their offset in bytes from the referring field (0 for NULL).
+// An image therefore contains no absolute pointers and runs wherever it is
+// mapped, including straight out of a read-only mmap of a compiled file.
+typedef int32_t RelPtr;
+
+static inline void* rel_get(const RelPtr* field) {
+    return *field ? (char*)field + *field : NULL;
+}
+
+static inline void rel_set(RelPtr* field, const void* target) {
+    *field = target ? (RelPtr)((const char*)target - (const char*)field) : 0;
+}
+
+#define AST_NODE(field) ((ASTNode*)rel_get(&(field)))
+#define AST_STRING(field) ((const char*)rel_get(&(field)))
+#define AST_LIST(field) ((RelPtr*)rel_get(&(field)))
+#define AST_SET(field, target) rel_set(&(field), (target))
+
 typedef enum {
     NODE_PROGRAM,
     NODE_BLOCK_STATEMENT,
@@ -74,112 +245,245 @@ typedef enum {
     NODE_CALL_EXPRESSION,
     NODE_RETURN_STATEMENT,
     NODE_PRINT_STATEMENT,
-    NODE_IMPORT_STATEMENT
+    NODE_IMPORT_STATEMENT,
+    NODE_ARRAY_LITERAL,
+    NODE_MAP_LITERAL,
+    NODE_INDEX_EXPRESSION,
+    NODE_INDEX_ASSIGNMENT,
+    NODE_MEMBER_EXPRESSION,
+    NODE_LAZY_BODY
 } NodeType;
 
+#define NODE_TYPE_COUNT (NODE_LAZY_BODY + 1)
+
 struct ASTNode {
     NodeType type;
     union {
         struct {
-            ASTNode** body;
+            RelPtr body; // ASTNode*[body_length]
             int body_length;
         } program;
 
         struct {
-            ASTNode** body;
+            RelPtr body; // ASTNode*[body_length]
             int body_length;
         } block_statement;
 
         struct {
-            char* name;
-            ASTNode* value;
+            RelPtr name; // const char*
+            RelPtr value; // ASTNode*
         } variable_declaration;
 
         struct {
-            char* name;
-            ASTNode* value;
+            RelPtr name; // const char*
+            RelPtr value; // ASTNode*
         } assignment_expression;
 
         struct {
-            char* operator;
-            ASTNode* left;
-            ASTNode* right;
+            RelPtr operator; // const char*
+            RelPtr left; // ASTNode*
+            RelPtr right; // ASTNode*
         } binary_expression;
 
         struct {
-            char* operator;
-            ASTNode* left;
-            ASTNode* right;
+            RelPtr operator; // const char*
+            RelPtr left; // ASTNode*
+            RelPtr right; // ASTNode*
         } logical_expression;
 
         struct {
             union {
                 double number;
-                char* string;
+                RelPtr string; // const char*
                 bool boolean;
             } value;
             char value_type; // 'n' for number, 's' for string, 'b' for boolean
         } literal;
 
         struct {
-            char* name;
+            RelPtr name; // const char*
         } identifier;
 
         struct {
-            ASTNode* test;
-            ASTNode* consequent;
-            ASTNode* alternate;
+            RelPtr test; // ASTNode*
+            RelPtr consequent; // ASTNode*
+            RelPtr alternate; // ASTNode*
         } if_statement;
 
         struct {
-            ASTNode* test;
-            ASTNode* body;
+            RelPtr test; // ASTNode*
+            RelPtr body; // ASTNode*
         } while_statement;
 
         struct {
-            char* name;
-            char** params;
+            RelPtr name; // const char*
+            RelPtr params; // const char*[params_length]
             int params_length;
-            ASTNode* body;
+            RelPtr body; // ASTNode*
+            int line;
         } function_declaration;
 
         struct {
-            char* name;
-            ASTNode** arguments;
+            RelPtr name; // const char*
+            RelPtr arguments; // ASTNode*[arguments_length]
             int arguments_length;
+            int line;
+            int builtin; // Index in builtins of the builtin called unless a scope defines name, or -1
         } call_expression;
 
         struct {
-            ASTNode* argument;
+            RelPtr argument; // ASTNode*
         } return_statement;
 
+        // The pieces print writes back to back, a template already split up,
+        // see parse_print_statement
         struct {
-            ASTNode* argument;
+            RelPtr arguments; // ASTNode*[arguments_length]
+            int arguments_length;
         } print_statement;
 
-
         struct {
-            char* path;
+            RelPtr path; // const char*
         } import_statement;
+
+        struct {
+            RelPtr elements; // ASTNode*[elements_length]
+            int elements_length;
+        } array_literal;
+
+        struct {
+            RelPtr entries; // ASTNode*[2 * entries_length], each key then its value
+            int entries_length;
+        } map_literal;
+
+        // object[index]
+        struct {
+            RelPtr object; // ASTNode*
+            RelPtr index; // ASTNode*
+        } index_expression;
+
+        // object[index] = value
+        struct {
+            RelPtr object; // ASTNode*
+            RelPtr index; // ASTNode*
+            RelPtr value; // ASTNode*
+        } index_assignment;
+
+        // object.name, or object.name(arguments) when call is set
+        struct {
+            RelPtr object; // ASTNode*
+            RelPtr name; // const char*
+            RelPtr arguments; // ASTNode*[arguments_length]
+            int arguments_length;
+            bool call;
+        } member_expression;
+
+        // A function body that is only parsed when the function is first
+        // called, see lazy_function_body
+        struct {
+            RelPtr source; // const char*, the body from '{' to '}'
+            int line;      // Line of the '{'
+        } lazy_body;
     } data;
 };
 
+// Program images (.asi). An image is one contiguous block holding a header,
+// the nodes, the node and name lists, a deduplicated string pool and a table of
+// top-level declarations, all linked by RelPtr. Bump IMAGE_FORMAT whenever the
+// node layout or the order of the builtins table changes.
+#define IMAGE_MAGIC 0x49435341u // "ASCI"
+#define BUNDLE_MAGIC 0x42435341u // "ASCB", see the bundle implementation
+#define IMAGE_FORMAT 8
+#define IMAGE_ALIGNMENT 8
+
+typedef struct {
+    uint32_t magic;
+    uint32_t format;
+    uint64_t version_hash;
+    uint64_t source_hash;
+    uint64_t source_length;
+    uint32_t layout;  // sizeof(ASTNode) and sizeof(RelPtr), so a build with a different ABI rejects it
+    uint32_t size;    // Total image size in bytes
+    RelPtr root;      // ASTNode*
+    RelPtr symbols;   // ImageSymbol[symbols_length]
+    int32_t symbols_length;
+    uint32_t reserved;
+} ImageHeader;
+
+// A top-level function or variable declaration
+typedef struct {
+    RelPtr name; // const char*
+    RelPtr node; // ASTNode*
+} ImageSymbol;
+
+typedef struct {
+    char* data;
+    uint32_t size;
+    uint32_t capacity; // Fixed while parsing, so node pointers held by the parser stay valid
+    uint32_t* strings; // Open addressing table of string offsets for the pool, 0 when empty
+    int strings_capacity;
+} ImageBuilder;
+
+// Temporary list used while a node's children are being parsed
+typedef struct {
+    void** items;
+    int length;
+    int capacity;
+} NodeList;
+
+// A loaded program: either built in memory or mapped read-only from a file
+typedef struct {
+    ImageHeader* image;
+    size_t size;
+    bool mapped;
+} Program;
+
 typedef struct {
     Token* tokens;
     int position;
     int tokens_length;
     Token current_token;
+    ImageBuilder image;
+    const char* source; // Set when function bodies are skipped, to copy them from
+    NodeList** lists;   // Temporary lists, the first open_lists of them in use
+    int lists_capacity;
+    int open_lists;
 } Parser;
 
+// Bodies of functions whose parsing was deferred to their first call, keyed
+// by the NODE_LAZY_BODY node standing in for them. Programs are shared by
+// every interpreter, so this table is too.
+typedef struct LazyBody {
+    const ASTNode* node;
+    Program* program; // Holds the parsed body
+    ASTNode* body;
+    struct LazyBody* next;
+} LazyBody;
+
+typedef struct {
+    LazyBody** buckets;
+    int buckets_length;
+    int length;
+} LazyBodyTable;
+
+LazyBodyTable lazy_bodies = { 0 };
+
 typedef enum {
     VALUE_NUMBER,
     VALUE_STRING,
     VALUE_BOOLEAN,
     VALUE_FUNCTION,
-    VALUE_NULL
+    VALUE_NULL,
+    VALUE_IMPORT, // Stands in for a lazily imported name until it is first read
+    VALUE_ARRAY,
+    VALUE_MAP,
+    VALUE_NATIVE // A builtin C function, see the builtin library
 } ValueType;
 
 typedef struct Scope Scope;
+typedef struct Array Array;
+typedef struct Map Map;
+typedef struct Builtin Builtin;
 
 typedef struct {
     ValueType type;
@@ -187,6 +491,10 @@ typedef struct {
         double number;
         char* string;
         bool boolean;
+        char* import; // Canonical path of the module
+        Array* array;
+        Map* map;
+        const Builtin* native;
         struct {
             char* name;
             char** params;
@@ -198,6 +506,38 @@ typedef struct {
     } data;
 } Value;
 
+// Arrays are shared by reference, like scopes, and released with the
+// interpreter heap. An array holding only numbers keeps them unboxed in
+// numbers; storing anything else boxes every element into values for good.
+struct Array {
+    union {
+        double* numbers;
+        Value* values;
+    } items;
+    int length;
+    int capacity;
+    bool packed;
+};
+
+typedef struct {
+    Value key; // A string or a number; VALUE_NULL once deleted
+    Value value;
+    uint64_t hash;
+} MapEntry;
+
+// Maps are shared by reference like arrays. Entries are kept in insertion
+// order, which is the order of keys() and values(), and slots is an open
+// addressing table of indexes into them, probed linearly. A deleted entry
+// keeps its slot until the next rebuild.
+struct Map {
+    MapEntry* entries;
+    int entries_length; // Including deleted entries
+    int entries_capacity;
+    int32_t* slots; // MAP_EMPTY_SLOT or an index into entries
+    int slots_capacity; // A power of two
+    int length;
+};
+
 struct Scope {
     char** names;
     Value* values;
@@ -205,6 +545,51 @@ struct Scope {
     int capacity;
 };
 
+typedef struct ModuleRegistry ModuleRegistry;
+
+// Print output of an interpreter and the interpreters running its imports,
+// written out in large batches
+#define OUTPUT_BUFFER_SIZE 65536
+
+typedef struct {
+    char* data; // OUTPUT_BUFFER_SIZE bytes
+    size_t length;
+    FILE* stream; // NULL for stdout
+} OutputBuffer;
+
+// Enough for any number format_number writes
+#define NUMBER_BUFFER_SIZE 32
+#define PRINT_DEPTH_LIMIT 8
+#define MAP_EMPTY_SLOT -1
+
+// Write print output as soon as it is printed (--unbuffered)
+bool unbuffered_output = false;
+
+// A node the explicit-stack evaluator is part way through. The values of its
+// finished children sit on the value stack from base up.
+typedef struct {
+    ASTNode* node;
+    int step;            // Children started so far
+    int base;
+    int end;             // Programs: the statement to stop before. Map members: arguments taken.
+    int saved_scopes;    // Calls: where the caller's scope stack was saved
+    int saved_length;
+    uint64_t call_start;
+} MachineFrame;
+
+// One implementation of the loops behind the bulk numeric builtins. The
+// reductions take at least one number; scale and add write length results
+// to out.
+typedef struct {
+    const char* name;
+    double (*sum)(const double* values, size_t length);
+    double (*dot)(const double* a, const double* b, size_t length);
+    double (*min)(const double* values, size_t length);
+    double (*max)(const double* values, size_t length);
+    void (*scale)(double* out, const double* values, double factor, size_t length);
+    void (*add)(double* out, const double* a, const double* b, size_t length);
+} NumericKernels;
+
 typedef struct {
     Scope** scope_stack;
     int scope_stack_length;
@@ -212,13 +597,281 @@ typedef struct {
     Value return_value;
     bool has_return;
     char* base_dir;
+    ModuleRegistry* modules; // Shared with the interpreters created for its imports
+    OutputBuffer* output;    // Where print writes, owned by its AscInterpreter
+    Value* stack;            // Arguments of the native calls in progress
+    int stack_length;
+    int stack_capacity;
+    const NumericKernels* kernels; // Loops of the bulk numeric builtins
+    MachineFrame* frames;          // Nodes in progress on the explicit-stack evaluator
+    int frames_length;
+    int frames_capacity;
+    Scope** saved_scopes;          // Scope stacks of its callers while their calls run
+    int saved_scopes_length;
+    int saved_scopes_capacity;
 } Interpreter;
 
-char** imported_files = NULL;
-int imported_files_length = 0;
-int imported_files_capacity = 0;
+// Natives get their arguments as a slice of the interpreter's value stack,
+// already checked against min_args and max_args (-1 for any number)
+typedef Value (*NativeFunction)(Interpreter* interpreter, Value* args, int args_length);
+
+struct Builtin {
+    const char* name;
+    NativeFunction function;
+    int min_args;
+    int max_args;
+};
+
+// Interned strings with stable integer ids
+typedef struct {
+    char** names;
+    int length;
+    int capacity;
+    int* slots; // Open addressing table of ids, -1 when empty
+    int slots_capacity;
+} NameTable;
+
+// A module loaded through import. Its program stays alive as long as the
+// registry, since the functions it defines point into its image.
+typedef struct {
+    Program* program;
+    Scope* exports;   // Scope its top level ran in
+    bool queued;      // Handed to the import loader
+    bool prefetching; // A worker is still reading or parsing it
+    bool running;     // Its top level has started
+    bool loaded;      // Still false while its top level runs, e.g. in an import cycle
+} Module;
+
+typedef struct {
+    Module* module;
+    char* path;
+} LoadJob;
+
+// Worker pool that reads and parses imports ahead of evaluation. Its lock
+// also guards the registry the pool belongs to.
+typedef struct {
+    AscMutex lock;
+    AscCond changed; // A job was queued or finished, or the pool is stopping
+    LoadJob* jobs;   // FIFO from jobs_head to jobs_length
+    int jobs_head;
+    int jobs_length;
+    int jobs_capacity;
+    int pending;     // Jobs queued or being parsed
+    AscThread* threads;
+    int threads_length;
+    int threads_capacity;
+    int workers_started;
+    bool stopping;
+} ImportLoader;
+
+// Identifies one version of a file, to notice when it has been edited
+typedef struct {
+    int64_t modified;
+    int64_t size;
+    uint64_t inode;
+} FileStamp;
+
+// Parsed programs shared between the module registries of several
+// interpreters, keyed by canonical path. A program whose file has changed is
+// replaced, but kept until the store is freed since it may still be running.
+typedef struct {
+    AscMutex lock;
+    NameTable paths; // Canonical path -> index into programs
+    Program** programs;
+    FileStamp* stamps;
+    int length;
+    int capacity;
+    Program** retired;
+    int retired_length;
+    int retired_capacity;
+} ProgramStore;
+
+// The modules of a bundle (.asb). Imports are resolved by normalizing the
+// path they name, so running a bundle never looks at the file system.
+typedef struct {
+    NameTable aliases;  // Normalized import path -> index into alias_modules
+    int* alias_modules; // Index into paths and programs
+    char** paths;       // Path each module is registered under
+    Program** programs; // Program 0 is the entry script
+    int length;
+} Bundle;
+
+// Loaded modules keyed by canonical path, so every file is loaded once no
+// matter how it is spelled or how many modules import it
+struct ModuleRegistry {
+    NameTable paths; // Canonical path -> index into modules
+    Module** modules;
+    int length;
+    int capacity;
+    ImportLoader* loader; // Created on the first prefetch
+    ProgramStore* store;  // Owns the modules' programs when set
+    const Bundle* bundle; // Resolves imports and holds their programs when set
+};
+
+// Number of import loader threads; -1 picks one per CPU, 0 disables prefetching
+int import_threads = -1;
+
+// When set, import only binds a module's top-level names, and the module runs
+// the first time one of them is read (--lazy-imports)
+bool lazy_imports = false;
+
+// When set, scripts run on the explicit-stack evaluator, which keeps the
+// nodes in progress on the heap instead of recursing in C (--explicit-stack)
+bool explicit_stack = false;
+
+// Bytes an interpreter's evaluation stacks may grow to before the script
+// fails with a stack overflow (--stack-limit=MB)
+size_t stack_limit = (size_t)256 << 20;
+
+// Function-level profiler (--profile)
+typedef struct {
+    uint64_t calls;
+    uint64_t inclusive_ns;
+    uint64_t exclusive_ns;
+    int active; // Activations currently on the stack, so recursion is not counted twice
+} ProfileFunction;
+
+typedef struct {
+    int caller;
+    int callee;
+    uint64_t calls;
+    uint64_t inclusive_ns;
+} ProfileEdge;
+
+typedef struct {
+    int function;
+    uint64_t start_ns;
+    uint64_t child_ns;
+} ProfileFrame;
+
+typedef struct {
+    bool enabled;
+    const char* output_path;
+    const char* script_name;
+
+    NameTable names;
+    ProfileFunction* functions; // Indexed by name id
+    int functions_capacity;
+
+    ProfileEdge* edges;
+    int edges_length;
+    int edges_capacity;
+    int* edge_slots;
+    int edge_slots_capacity;
+
+    ProfileFrame* frames;
+    int frames_length;
+    int frames_capacity;
+} Profiler;
+
+Profiler profiler = { 0 };
+
+// Sampling profiler (--sample). The interpreter keeps a shadow stack of active
+// script calls which the SIGPROF handler folds into a preallocated table, so the
+// handler never allocates or takes locks.
+#define SHADOW_STACK_CAPACITY 1024
+#define SAMPLE_STACKS_CAPACITY 16384 // Must be a power of two
+#define SAMPLE_FRAMES_CAPACITY (1 << 20)
+
+typedef struct {
+    int function; // Id in sampler.names
+    int line;     // Line of the call site, 0 for the root frame
+} ShadowFrame;
+
+typedef struct {
+    uint64_t hash;
+    uint64_t count; // 0 marks an empty slot
+    int frames_offset;
+    int depth;
+    bool truncated;
+} SampleStack;
+
+typedef struct {
+    bool enabled;
+    bool running;
+    const char* output_path;
+    int frequency;
+    NameTable names;
+    SampleStack* stacks;
+    ShadowFrame* frames;
+    int frames_length;
+    uint64_t samples;
+    uint64_t dropped;
+} Sampler;
+
+Sampler sampler = { 0 };
+volatile ShadowFrame shadow_stack[SHADOW_STACK_CAPACITY];
+volatile sig_atomic_t shadow_stack_depth = 0;
+
+// Phase tracing (--trace) in Chrome trace event format. Every span is recorded
+// as a complete ("X") event; viewers nest them by their time ranges.
+typedef struct {
+    char* name;
+    const char* category;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    int thread; // 0 for the main thread, then one per import worker
+} TraceEvent;
+
+typedef struct {
+    bool enabled;
+    bool trace_calls;
+    const char* output_path;
+    uint64_t call_threshold_ns;
+    uint64_t origin_ns;
+    TraceEvent* events;
+    int events_length;
+    int events_capacity;
+} Tracer;
+
+Tracer tracer = { 0 };
+
+// Runtime operation counters (--stats). Compiled in for debug builds, and for
+// release builds only when configured with ASC_ENABLE_STATS.
+#if !defined(NDEBUG) || defined(ASC_ENABLE_STATS)
+#define ASC_STATS 1
+#endif
+
+#ifdef ASC_STATS
+#define STATS(expr) (expr)
+#else
+#define STATS(expr) ((void)0)
+#endif
+
+#define STATS_HISTOGRAM_BUCKETS 17
+
+typedef struct {
+    uint64_t evaluations[NODE_TYPE_COUNT];
+    uint64_t lookups;
+    uint64_t lookup_scopes[STATS_HISTOGRAM_BUCKETS]; // Scopes searched: 1..16, then 17+
+    uint64_t lookup_names[STATS_HISTOGRAM_BUCKETS];  // Names compared: power-of-two buckets
+    uint64_t lookup_scopes_total;
+    uint64_t lookup_names_total;
+    uint64_t scopes_created;
+    uint64_t function_calls;
+    uint64_t native_calls;
+    uint64_t string_concatenations;
+    uint64_t string_bytes_copied;
+} RuntimeStats;
+
+// Per thread, so interpreters on different threads count separately
+ASC_THREAD_LOCAL RuntimeStats runtime_stats = { 0 };
+
+// On-disk cache of compiled program images, keyed by a hash of the source
+// text and the interpreter version
+
+typedef struct {
+    bool enabled;
+    char* directory;
+    uint64_t hits;
+    uint64_t misses;
+} ModuleCache;
+
+ModuleCache module_cache = { true, NULL, 0, 0 };
 
-Lexer* create_lexer(char* input);
+ASC_NORETURN void syntax_error(const char* format, ...);
+ASC_NORETURN void runtime_error(const char* format, ...);
+Lexer* create_lexer(const char* input);
 void advance_lexer(Lexer* lexer);
 void skip_whitespace(Lexer* lexer);
 Token get_number_token(Lexer* lexer);
@@ -227,8 +880,9 @@ Token get_string_token(Lexer* lexer);
 Token get_next_token(Lexer* lexer);
 Token* tokenize(Lexer* lexer, int* token_count);
 void free_lexer(Lexer* lexer);
+void free_tokens(Token* tokens, int count);
 
-Parser* create_parser(Token* tokens, int tokens_length);
+Parser* create_parser(Token* tokens, int tokens_length, const char* source);
 void advance_parser(Parser* parser);
 Token eat(Parser* parser, TokenType type);
 ASTNode* parse_program(Parser* parser);
@@ -238,9 +892,15 @@ ASTNode* parse_variable_declaration(Parser* parser);
 ASTNode* parse_if_statement(Parser* parser);
 ASTNode* parse_while_statement(Parser* parser);
 ASTNode* parse_function_declaration(Parser* parser);
-ASTNode* parse_function_call(Parser* parser, char* name);
+ASTNode* skip_function_body(Parser* parser);
+ASTNode* parse_function_call(Parser* parser, const char* name);
 ASTNode* parse_return_statement(Parser* parser);
 ASTNode* parse_print_statement(Parser* parser);
+ASTNode* parse_array_literal(Parser* parser);
+ASTNode* parse_map_literal(Parser* parser);
+ASTNode* parse_postfix(Parser* parser, ASTNode* node);
+ASTNode* parse_postfix_statement(Parser* parser, ASTNode* target);
+void expand_print_template(Parser* parser, NodeList* arguments);
 ASTNode* parse_import_statement(Parser* parser);
 ASTNode* parse_expression(Parser* parser);
 ASTNode* parse_logical_or(Parser* parser);
@@ -252,21 +912,54 @@ ASTNode* parse_multiplication(Parser* parser);
 ASTNode* parse_primary(Parser* parser);
 ASTNode* parse(Parser* parser);
 void free_parser(Parser* parser);
-void free_ast_node(ASTNode* node);
+void free_failed_compile(Lexer* lexer, Parser* parser);
+
+void init_image_builder(ImageBuilder* builder, Token* tokens, int tokens_length, size_t source_length);
+void reserve_image_builder(ImageBuilder* builder, size_t capacity, size_t strings);
+void free_image_builder(ImageBuilder* builder);
+ASTNode* create_node(Parser* parser, NodeType type);
+const char* image_string(ImageBuilder* builder, const char* str);
+void node_list_push(NodeList* list, void* item);
+RelPtr* image_node_list(ImageBuilder* builder, NodeList* list);
+NodeList* open_list(Parser* parser);
+RelPtr* close_list(Parser* parser, NodeList* list);
+void fill_image_header(ImageHeader* header, const char* code);
+Program* finish_image(ImageBuilder* builder, ASTNode* root, const char* code);
+ASTNode* program_root(Program* program);
+ASTNode* program_find_symbol(Program* program, const char* name);
+Program* load_program_image(const char* path, const ImageHeader* expected);
+bool write_program_image(Program* program, const char* path);
+void free_program_image(Program* program);
+void free_program(Program* program);
+ASTNode* try_lazy_function_body(const ASTNode* node);
+ASTNode* lazy_function_body(const ASTNode* node);
+bool find_lazy_body(const ASTNode* body, const ASTNode** node, const Program** program);
+void free_lazy_bodies(const Program* program);
 
 Interpreter* create_interpreter(void);
+const NumericKernels* select_numeric_kernels(void);
 Scope* create_scope(void);
 void push_scope(Interpreter* interpreter, Scope* scope);
 Scope* pop_scope(Interpreter* interpreter);
 Scope* get_current_scope(Interpreter* interpreter);
-void define_variable(Scope* scope, char* name, Value value);
-Value* lookup_variable(Interpreter* interpreter, char* name);
+void define_variable(Scope* scope, const char* name, Value value);
+Value* find_variable(Interpreter* interpreter, const char* name);
+Value* lookup_variable(Interpreter* interpreter, const char* name);
+int find_builtin(const char* name);
+uint64_t build_hash(void);
+extern const Builtin builtins[];
+Value call_native(Interpreter* interpreter, const Builtin* builtin, ASTNode* node);
+void check_native_arity(const Builtin* builtin, int args_length);
+Value invoke_native(Interpreter* interpreter, const Builtin* builtin, int base, int args_length);
 Value evaluate(Interpreter* interpreter, ASTNode* node);
 Value evaluate_program(Interpreter* interpreter, ASTNode* node);
+Value evaluate_program_range(Interpreter* interpreter, ASTNode* node, int from, int to);
 Value evaluate_block_statement(Interpreter* interpreter, ASTNode* node);
 Value evaluate_variable_declaration(Interpreter* interpreter, ASTNode* node);
 Value evaluate_assignment_expression(Interpreter* interpreter, ASTNode* node);
 Value evaluate_binary_expression(Interpreter* interpreter, ASTNode* node);
+Value binary_operation(ASTNode* node, Value left, Value right);
+Value assign_variable(Interpreter* interpreter, ASTNode* node, Value value);
 Value evaluate_logical_expression(Interpreter* interpreter, ASTNode* node);
 Value evaluate_literal(Interpreter* interpreter, ASTNode* node);
 Value evaluate_identifier(Interpreter* interpreter, ASTNode* node);
@@ -274,1987 +967,11244 @@ Value evaluate_if_statement(Interpreter* interpreter, ASTNode* node);
 Value evaluate_while_statement(Interpreter* interpreter, ASTNode* node);
 Value evaluate_function_declaration(Interpreter* interpreter, ASTNode* node);
 Value evaluate_call_expression(Interpreter* interpreter, ASTNode* node);
+Value call_function(Interpreter* interpreter, Value function, Value* args, int args_length, int line);
+uint64_t enter_function(Interpreter* interpreter, const Value* func_value, Value* args, int args_length, int line,
+                        Scope** previous_scope);
+Value leave_function(Interpreter* interpreter, const Value* func_value, Value result, Scope** previous_scope,
+                     int previous_scope_length, uint64_t call_start);
+Value run_machine(Interpreter* interpreter, ASTNode* node, int from, int to);
 Value evaluate_return_statement(Interpreter* interpreter, ASTNode* node);
 Value evaluate_print_statement(Interpreter* interpreter, ASTNode* node);
+bool print_literal(OutputBuffer* output, const ASTNode* argument);
+void print_argument(OutputBuffer* output, const ASTNode* argument, Value value);
+Value end_print_line(OutputBuffer* output);
+void write_value(OutputBuffer* output, Value value);
+void write_array(OutputBuffer* output, const Array* array, int depth);
+void write_map(OutputBuffer* output, const Map* map, int depth);
+const char* value_text(Value value, char* number);
+bool is_temporary_string(const ASTNode* node, Value value);
+int format_number(double value, char* buffer);
+void init_output(OutputBuffer* output);
+void output_write(OutputBuffer* output, const char* data, size_t length);
+void output_flush(OutputBuffer* output);
+void free_output(OutputBuffer* output);
+void write_output(AscInterpreter* handle, const char* text);
+void flush_output(AscInterpreter* handle);
 Value evaluate_import_statement(Interpreter* interpreter, ASTNode* node);
+Value evaluate_array_literal(Interpreter* interpreter, ASTNode* node);
+Value evaluate_map_literal(Interpreter* interpreter, ASTNode* node);
+Value evaluate_index_expression(Interpreter* interpreter, ASTNode* node);
+Value evaluate_index_assignment(Interpreter* interpreter, ASTNode* node);
+Value evaluate_member_expression(Interpreter* interpreter, ASTNode* node);
+Value get_index(Value object, Value index);
+void set_index(Value object, Value index, Value value);
+int check_map_member(ASTNode* node);
+Value apply_map_member(ASTNode* node, Map* map, Value* args);
+Array* create_array(int capacity);
+void array_push(Array* array, Value value);
+Value array_get(const Array* array, int index);
+void array_set(Array* array, int index, Value value);
+Map* create_map(int capacity);
+Value* map_find(Map* map, Value key);
+void map_set(Map* map, Value key, Value value);
+bool map_delete(Map* map, Value key);
+Value import_module(Interpreter* interpreter, const char* path, const char* file_path, Scope* scope);
+void bind_import_stubs(Interpreter* interpreter, const char* path, const char* file_path, Scope* scope);
+void resolve_import(Interpreter* interpreter, Value* value, const char* name);
 void free_interpreter(Interpreter* interpreter);
 void free_scope(Scope* scope);
+Value copy_value(Value value);
 void free_value(Value value);
 
-Value process_import(char* code, Scope* global_scope, char* base_dir);
-Value run_interpreter(char* code, bool is_main_file);
+Program* compile_source(const char* code);
+Program* try_compile_source(const char* code);
+AscProgram* create_asc_program(Program* program, const char* base_dir);
+void share_module_programs(AscInterpreter* handle, ProgramStore* store);
+AscStatus run_program_statements(AscInterpreter* handle, AscProgram* program, int from, int to, AscValue* result);
+int count_init_statements(AscProgram* program);
+bool write_snapshot(const char* path, const char* script_path, AscInterpreter* handle, AscProgram* program, int statements);
+bool load_snapshot(const char* path, const char* script_path, AscInterpreter** interpreter, AscProgram** program, int* statements);
+AscProgram* load_bundle(const char* path);
+void free_bundle(Bundle* bundle);
+Value process_import(Interpreter* parent, Module* module, const char* base_dir);
 
 bool is_keyword(char* identifier);
 char* read_file(const char* filename);
-void add_imported_file(char* filename);
-bool is_file_imported(char* filename);
-void clear_imported_files(void);
-char* strdup(const char* str);
+char* canonical_path(const char* path);
+char* normalize_path(const char* path);
+char* resolve_import_path(ModuleRegistry* registry, const char* directory, const char* file_path);
+bool get_file_stamp(const char* path, FileStamp* stamp);
+bool same_file_stamp(const FileStamp* a, const FileStamp* b);
+void mutex_init(AscMutex* mutex);
+void mutex_lock(AscMutex* mutex);
+void mutex_unlock(AscMutex* mutex);
+void mutex_destroy(AscMutex* mutex);
+void cond_init(AscCond* cond);
+void cond_wait(AscCond* cond, AscMutex* mutex);
+void cond_broadcast(AscCond* cond);
+void cond_destroy(AscCond* cond);
+bool thread_start(AscThread* thread, ThreadFunction function, void* arg);
+void thread_join(AscThread thread);
+int cpu_count(void);
+void enable_threads(void);
+void shared_lock(AscMutex* mutex);
+void shared_unlock(AscMutex* mutex);
+void* asc_malloc(size_t size, MemTag tag);
+void* asc_calloc(size_t count, size_t size, MemTag tag);
+void* asc_realloc(void* ptr, size_t size, MemTag tag);
+char* asc_strdup(const char* str, MemTag tag);
+void asc_free(void* ptr);
+Heap* use_heap(Heap* heap);
+void release_heap(Heap* heap);
+void print_mem_stats(void);
+void record_lookup(Interpreter* interpreter, int scope_index, int name_index);
+void print_runtime_stats(void);
+uint64_t hash_string(const char* str);
+uint64_t hash_bytes(const void* data, size_t length, uint64_t seed);
+uint64_t monotonic_ns(void);
+
+void profiler_start(const char* script_name);
+void profiler_enter(const char* name);
+void profiler_exit(void);
+void profiler_stop(void);
+void profiler_report(void);
+bool profiler_write_callgrind(const char* path);
+void free_profiler(void);
+
+int intern_name(NameTable* table, const char* name);
+int find_name(const NameTable* table, const char* name);
+void free_name_table(NameTable* table);
+
+ModuleRegistry* create_module_registry(void);
+Module* get_module(ModuleRegistry* registry, const char* path);
+void bind_module_exports(Module* module, Scope* scope);
+void reset_module_registry(ModuleRegistry* registry);
+void abort_module_loads(ModuleRegistry* registry);
+void free_module_registry(ModuleRegistry* registry);
+
+void init_program_store(ProgramStore* store);
+Program* find_shared_program(ProgramStore* store, const char* path);
+Program* share_program(ProgramStore* store, const char* path, Program* program);
+void free_program_store(ProgramStore* store);
+
+char* path_directory(const char* path);
+void registry_lock(ModuleRegistry* registry);
+void registry_unlock(ModuleRegistry* registry);
+void prefetch_imports(ModuleRegistry* registry, ASTNode* node, const char* directory);
+Module* begin_import(ModuleRegistry* registry, const char* path, bool* first);
+Module* wait_for_module(ModuleRegistry* registry, const char* path);
+void stop_import_loader(ImportLoader* loader);
+
+Program* load_cached_program(const char* code);
+void store_cached_program(Program* program);
+void free_module_cache(void);
+
+void tracer_start(void);
+void trace_event(const char* name, const char* category, uint64_t start_ns);
+bool tracer_write_json(const char* path);
+void free_tracer(void);
+
+bool sampler_start(const char* script_name);
+void sampler_push(const char* name, int line);
+void sampler_pop(void);
+void sampler_stop(void);
+bool sampler_write_folded(const char* path);
+void free_sampler(void);
+
+// Command-line front end, left out of the library build
+#ifndef ASC_LIBRARY
+int run_batch(const char* manifest_path, int workers);
+int run_bundle_command(int argc, char* argv[], const char* program);
+#ifndef _WIN32
+int run_server(const char* socket_path, int workers);
+int run_client(const char* socket_path, int argc, char* argv[]);
+#endif
+
+void print_usage(const char* program) {
+    printf("Usage: %s [options] <filename.as|filename.asi|filename.asb>\n", program);
+    printf("       %s bundle <entry.as> [-o FILE]\n", program);
+    printf("       %s [options] --batch MANIFEST [-j N]\n", program);
+    printf("       %s [options] --serve SOCKET [-j N]\n", program);
+    printf("       %s --connect SOCKET <filename.as> [name=value ...]\n", program);
+    printf("Options:\n");
+    printf("  -i                  Show interpreter information\n");
+    printf("  --profile[=FILE]    Profile script functions; writes a callgrind call graph to FILE\n");
+    printf("                      (default: callgrind.out)\n");
+    printf("  --sample[=FILE]     Sample script call stacks with SIGPROF; writes folded stacks for\n");
+    printf("                      flamegraph tools to FILE (default: asc.folded)\n");
+    printf("  --sample-hz=N       Sampling frequency for --sample (default: 997)\n");
+    printf("  --trace=FILE        Write a Chrome trace (JSON) of read/tokenize/parse/evaluate phases\n");
+    printf("                      and imports to FILE\n");
+    printf("  --trace-calls[=US]  With --trace, also trace script calls taking at least US\n");
+    printf("                      microseconds (default: 100)\n");
+    printf("  --mem-stats         Print allocation counts, bytes and peak live bytes per subsystem\n");
+    printf("  --stats             Print evaluation, variable lookup, scope, call and string counters\n");
+    printf("  --no-cache          Do not read or write the parsed module cache\n");
+    printf("  --unbuffered        Write print output immediately instead of in large batches\n");
+    printf("  --compile=FILE      Compile to a program image (.asi) at FILE instead of running\n");
+    printf("  --snapshot=FILE     Start from the state saved in FILE after the script's imports,\n");
+    printf("                      functions and lets; saves it there first if missing or stale\n");
+    printf("  --import-threads=N  Threads that read and parse imports ahead of execution\n");
+    printf("                      (default: one per CPU, up to 8; 0 loads imports when reached)\n");
+    printf("  --lazy-imports      Bind imported names without running the module until one of\n");
+    printf("                      them is first used\n");
+    printf("  --explicit-stack    Evaluate on a stack on the heap instead of recursing in C, so deep\n");
+    printf("                      script recursion ends in a stack overflow error, not a crash\n");
+    printf("  --stack-limit=MB    Stack the script may use with --explicit-stack (default: 256)\n");
+    printf("  --batch MANIFEST    Run the jobs in MANIFEST, one 'script.as name=value ...' per line,\n");
+    printf("                      printing each job's output in order and a timing summary\n");
+    printf("  --serve SOCKET      Keep warm interpreters and parsed modules in memory and run scripts\n");
+    printf("                      sent to the Unix socket SOCKET until interrupted\n");
+    printf("  --connect SOCKET    Run a script on a --serve server, with name=value globals\n");
+    printf("  -j N                Worker threads for --batch and --serve (default: one per CPU)\n");
+}
 
 int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        printf("Usage: %s <filename.as>\n", argv[0]);
-        return 1;
-    }
-    char* ithink = "-i";
-    if (argv[1] == ithink) {
-        printf("AbstractScript interpretator, proted to C");
-        return 1;
+    if (argc > 1 && strcmp(argv[1], "bundle") == 0) {
+        return run_bundle_command(argc - 2, argv + 2, argv[0]);
     }
 
-    if (argc == 2) {
-        char* filename = argv[1];
-        char* code = read_file(filename);
-
-        if (code == NULL) {
-            printf("Error: Could not read file '%s'\n", filename);
+    char* filename = NULL;
+    const char* compile_path = NULL;
+    const char* batch_path = NULL;
+    const char* serve_path = NULL;
+    const char* snapshot_path = NULL;
+    int batch_workers = 0;
+    bool show_mem_stats = false;
+    bool show_runtime_stats = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-i") == 0) {
+            printf("AbstractScript interpretator, proted to C");
             return 1;
         }
+        else if (strcmp(argv[i], "--profile") == 0) {
+            profiler.enabled = true;
+        }
+        else if (strncmp(argv[i], "--profile=", 10) == 0) {
+            profiler.enabled = true;
+            profiler.output_path = argv[i] + 10;
+        }
+        else if (strcmp(argv[i], "--sample") == 0) {
+            sampler.enabled = true;
+        }
+        else if (strncmp(argv[i], "--sample=", 9) == 0) {
+            sampler.enabled = true;
+            sampler.output_path = argv[i] + 9;
+        }
+        else if (strncmp(argv[i], "--sample-hz=", 12) == 0) {
+            sampler.frequency = atoi(argv[i] + 12);
+            if (sampler.frequency <= 0) {
+                fprintf(stderr, "Invalid sampling frequency '%s'\n", argv[i] + 12);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--mem-stats") == 0) {
+            show_mem_stats = true;
+        }
+        else if (strcmp(argv[i], "--stats") == 0) {
+            show_runtime_stats = true;
+        }
+        else if (strcmp(argv[i], "--no-cache") == 0) {
+            module_cache.enabled = false;
+        }
+        else if (strncmp(argv[i], "--import-threads=", 17) == 0) {
+            import_threads = atoi(argv[i] + 17);
+            if (import_threads < 0) {
+                fprintf(stderr, "Invalid import thread count '%s'\n", argv[i] + 17);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--lazy-imports") == 0) {
+            lazy_imports = true;
+        }
+        else if (strcmp(argv[i], "--unbuffered") == 0) {
+            unbuffered_output = true;
+        }
+        else if (strcmp(argv[i], "--explicit-stack") == 0) {
+            explicit_stack = true;
+        }
+        else if (strncmp(argv[i], "--stack-limit=", 14) == 0) {
+            int megabytes = atoi(argv[i] + 14);
+            if (megabytes <= 0) {
+                fprintf(stderr, "Invalid stack limit '%s'\n", argv[i] + 14);
+                return 1;
+            }
 
-        printf("Running %s...\n\n", filename);
-        run_interpreter(code, true);
+            stack_limit = (size_t)megabytes << 20;
+        }
+        else if (strncmp(argv[i], "--compile=", 10) == 0) {
+            compile_path = argv[i] + 10;
+        }
+        else if (strncmp(argv[i], "--snapshot=", 11) == 0) {
+            snapshot_path = argv[i] + 11;
+        }
+        else if (strncmp(argv[i], "--batch=", 8) == 0) {
+            batch_path = argv[i] + 8;
+        }
+        else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batch_path = argv[++i];
+        }
+        else if (strncmp(argv[i], "--serve=", 8) == 0) {
+            serve_path = argv[i] + 8;
+        }
+        else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            serve_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--connect") == 0 && i + 2 < argc) {
+            // Everything after the script is passed on as its arguments
+#ifdef _WIN32
+            fprintf(stderr, "--connect is not supported on Windows\n");
+            return 1;
+#else
+            return run_client(argv[i + 1], argc - i - 2, argv + i + 2);
+#endif
+        }
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            batch_workers = atoi(argv[++i]);
+            if (batch_workers <= 0) {
+                fprintf(stderr, "Invalid job count '%s'\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strncmp(argv[i], "--trace=", 8) == 0) {
+            tracer.enabled = true;
+            tracer.output_path = argv[i] + 8;
+        }
+        else if (strcmp(argv[i], "--trace-calls") == 0) {
+            tracer.trace_calls = true;
+            tracer.call_threshold_ns = 100000;
+        }
+        else if (strncmp(argv[i], "--trace-calls=", 14) == 0) {
+            tracer.trace_calls = true;
+            tracer.call_threshold_ns = (uint64_t)(atof(argv[i] + 14) * 1000.0);
+        }
+        else if (argv[i][0] == '-' || filename != NULL) {
+            fprintf(stderr, "Unknown argument '%s'\n", argv[i]);
+            print_usage(argv[0]);
+            return 1;
+        }
+        else {
+            filename = argv[i];
+        }
+    }
 
-        free(code);
-        return 0;
+    if ((filename != NULL) + (batch_path != NULL) + (serve_path != NULL) != 1) {
+        print_usage(argv[0]);
+        return 1;
     }
-}
 
-// String duplication (not available in all C standard libraries)
-char* strdup(const char* str) {
-    size_t len = strlen(str) + 1;
-    char* new_str = (char*)malloc(len);
-    if (new_str) {
-        memcpy(new_str, str, len);
+    if (tracer.trace_calls && !tracer.enabled) {
+        fprintf(stderr, "--trace-calls requires --trace=FILE\n");
+        return 1;
     }
-    return new_str;
-}
 
-// Lexer implementation
-Lexer* create_lexer(char* input) {
-    Lexer* lexer = (Lexer*)malloc(sizeof(Lexer));
-    if (!lexer) {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(1);
+    if ((batch_path || serve_path) && (profiler.enabled || sampler.enabled || show_runtime_stats || compile_path || snapshot_path)) {
+        fprintf(stderr, "%s cannot be combined with --profile, --sample, --stats, --compile or --snapshot\n",
+            batch_path ? "--batch" : "--serve");
+        return 1;
     }
 
-    lexer->input = input;
-    lexer->position = 0;
-    lexer->input_length = strlen(input);
-    lexer->current_char = (lexer->input_length > 0) ? input[0] : '\0';
-    return lexer;
-}
+    if (snapshot_path && compile_path) {
+        fprintf(stderr, "--snapshot cannot be combined with --compile\n");
+        return 1;
+    }
 
-void advance_lexer(Lexer* lexer) {
-    lexer->position++;
-    if (lexer->position < lexer->input_length) {
-        lexer->current_char = lexer->input[lexer->position];
+    if (tracer.enabled) {
+        tracer_start();
     }
-    else {
-        lexer->current_char = '\0';
+
+    if (batch_path || serve_path) {
+        // Jobs already run in parallel, so imports load on the job's thread
+        // unless import threads are asked for
+        if (import_threads < 0) {
+            import_threads = 0;
+        }
+
+        int workers = batch_workers > 0 ? batch_workers : cpu_count();
+#ifdef _WIN32
+        if (serve_path) {
+            fprintf(stderr, "--serve is not supported on Windows\n");
+            return 1;
+        }
+        int result = run_batch(batch_path, workers);
+#else
+        int result = batch_path ? run_batch(batch_path, workers) : run_server(serve_path, workers);
+#endif
+
+        if (tracer.enabled) {
+            if (!tracer_write_json(tracer.output_path)) {
+                fprintf(stderr, "Error: Could not write trace to '%s'\n", tracer.output_path);
+            }
+
+            free_tracer();
+        }
+
+        free_module_cache();
+
+        if (show_mem_stats) {
+            print_mem_stats();
+        }
+
+        return result;
     }
-}
 
-void skip_whitespace(Lexer* lexer) {
-    while (lexer->current_char && isspace(lexer->current_char)) {
-        advance_lexer(lexer);
+    // A valid snapshot replaces reading, compiling and the init statements
+    AscProgram* script = NULL;
+    AscInterpreter* interpreter = NULL;
+    int init_statements = 0;
+    uint64_t snapshot_start = tracer.enabled ? monotonic_ns() : 0;
+    bool restored = snapshot_path && load_snapshot(snapshot_path, filename, &interpreter, &script, &init_statements);
+
+    if (tracer.enabled && snapshot_path) {
+        trace_event("load_snapshot", "io", snapshot_start);
     }
-}
 
-Token get_number_token(Lexer* lexer) {
-    Token token;
-    token.type = TOKEN_NUMBER;
+    uint64_t read_start = tracer.enabled ? monotonic_ns() : 0;
+    char* code = restored ? NULL : read_file(filename);
 
-    char* number_str = (char*)malloc(64);
-    if (!number_str) {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(1);
+    if (tracer.enabled && !restored) {
+        trace_event("read_file", "io", read_start);
     }
 
-    int i = 0;
+    if (code == NULL && !restored) {
+        printf("Error: Could not read file '%s'\n", filename);
+        return 1;
+    }
 
-    // Get integer part
-    while (lexer->current_char && isdigit(lexer->current_char)) {
-        number_str[i++] = lexer->current_char;
-        advance_lexer(lexer);
+    // Compiled images are mapped and run as they are
+    Program* program = NULL;
+    uint32_t magic = 0;
+    if (code) {
+        memcpy(&magic, code, strlen(code) >= sizeof(magic) ? sizeof(magic) : 0);
     }
 
-    // Get decimal part if exists
-    if (lexer->current_char == '.') {
-        number_str[i++] = lexer->current_char;
-        advance_lexer(lexer);
+    if (magic == IMAGE_MAGIC) {
+        program = load_program_image(filename, NULL);
+        if (program == NULL) {
+            fprintf(stderr, "Error: '%s' is not a program image for this version\n", filename);
+            asc_free(code);
+            return 1;
+        }
+    }
+    else if (magic == BUNDLE_MAGIC) {
+        if (compile_path || snapshot_path) {
+            fprintf(stderr, "A bundle cannot be run with --compile or --snapshot\n");
+            asc_free(code);
+            return 1;
+        }
 
-        while (lexer->current_char && isdigit(lexer->current_char)) {
-            number_str[i++] = lexer->current_char;
-            advance_lexer(lexer);
+        script = load_bundle(filename);
+        if (script == NULL) {
+            fprintf(stderr, "Error: '%s' is not a bundle for this version\n", filename);
+            asc_free(code);
+            return 1;
         }
     }
 
-    number_str[i] = '\0';
-    token.value.number_value = atof(number_str);
-    free(number_str);
+    if (compile_path) {
+        if (program == NULL) {
+            module_cache.enabled = false;
+            program = compile_source(code);
+        }
 
-    return token;
-}
+        bool written = write_program_image(program, compile_path);
+        if (written) {
+            fprintf(stderr, "%s: %llu bytes written to %s\n", filename, (unsigned long long)program->size, compile_path);
+        }
+        else {
+            fprintf(stderr, "Error: Could not write program image to '%s'\n", compile_path);
+        }
 
-Token get_identifier_token(Lexer* lexer) {
-    Token token;
+        free_program(program);
+        asc_free(code);
+        free_module_cache();
+        return written ? 0 : 1;
+    }
 
-    char* identifier = (char*)malloc(256);
-    if (!identifier) {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(1);
+    if (interpreter == NULL) {
+        interpreter = asc_interpreter_create();
     }
 
-    int i = 0;
+    write_output(interpreter, "Running ");
+    write_output(interpreter, filename);
+    write_output(interpreter, "...\n\n");
 
-    while (lexer->current_char && (isalnum(lexer->current_char) || lexer->current_char == '_')) {
-        identifier[i++] = lexer->current_char;
-        advance_lexer(lexer);
+    if (profiler.enabled) {
+        profiler_start(filename);
     }
 
-    identifier[i] = '\0';
-
-    // Check if it's a keyword
-    if (strcmp(identifier, "let") == 0) token.type = TOKEN_LET;
-    else if (strcmp(identifier, "if") == 0) token.type = TOKEN_IF;
-    else if (strcmp(identifier, "else") == 0) token.type = TOKEN_ELSE;
-    else if (strcmp(identifier, "while") == 0) token.type = TOKEN_WHILE;
-    else if (strcmp(identifier, "function") == 0) token.type = TOKEN_FUNCTION;
-    else if (strcmp(identifier, "return") == 0) token.type = TOKEN_RETURN;
-    else if (strcmp(identifier, "true") == 0) token.type = TOKEN_TRUE;
-    else if (strcmp(identifier, "false") == 0) token.type = TOKEN_FALSE;
-    else if (strcmp(identifier, "print") == 0) token.type = TOKEN_PRINT;
-    else if (strcmp(identifier, "import") == 0) token.type = TOKEN_IMPORT;
-    else {
-        token.type = TOKEN_IDENTIFIER;
-        token.value.string_value = strdup(identifier);
+    if (sampler.enabled && !sampler_start(filename)) {
+        asc_interpreter_free(interpreter);
+        asc_free(code);
+        return 1;
     }
 
-    free(identifier);
-    return token;
-}
+    uint64_t run_start = tracer.enabled ? monotonic_ns() : 0;
+    AscStatus status = ASC_OK;
 
-Token get_string_token(Lexer* lexer) {
-    Token token;
-    token.type = TOKEN_STRING;
+    if (!restored) {
+        if (script == NULL && program) {
+            script = create_asc_program(program, NULL);
+        }
+        status = script ? ASC_OK : asc_compile(code, NULL, &script);
+    }
 
-    advance_lexer(lexer); // Skip opening quote
+    // Without a valid snapshot, run the init statements first and save the
+    // state they leave for the next run
+    if (status == ASC_OK && snapshot_path && !restored) {
+        init_statements = count_init_statements(script);
+        status = run_program_statements(interpreter, script, 0, init_statements, NULL);
 
-    char* string = (char*)malloc(1024);
-    if (!string) {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(1);
+        if (status == ASC_OK && !write_snapshot(snapshot_path, filename, interpreter, script, init_statements)) {
+            fprintf(stderr, "Error: Could not write snapshot to '%s'\n", snapshot_path);
+        }
     }
 
-    int i = 0;
+    if (status == ASC_OK) {
+        status = run_program_statements(interpreter, script, init_statements, -1, NULL);
+    }
 
-    while (lexer->current_char && lexer->current_char != '"') {
-        string[i++] = lexer->current_char;
-        advance_lexer(lexer);
+    if (status != ASC_OK) {
+        flush_output(interpreter);
+        fputs(asc_error_message(), stderr);
     }
 
-    string[i] = '\0';
-    token.value.string_value = strdup(string);
+    if (tracer.enabled) {
+        trace_event(filename, "run", run_start);
 
-    advance_lexer(lexer); // Skip closing quote
-    free(string);
+        if (!tracer_write_json(tracer.output_path)) {
+            fprintf(stderr, "Error: Could not write trace to '%s'\n", tracer.output_path);
+        }
 
-    return token;
-}
+        free_tracer();
+    }
 
-Token get_next_token(Lexer* lexer) {
-    Token token;
+    if (sampler.enabled) {
+        sampler_stop();
 
-    while (lexer->current_char) {
-        if (isspace(lexer->current_char)) {
-            skip_whitespace(lexer);
-            continue;
+        const char* path = sampler.output_path ? sampler.output_path : "asc.folded";
+        if (sampler_write_folded(path)) {
+            fprintf(stderr, "%llu samples written to %s\n", (unsigned long long)sampler.samples, path);
         }
-
-        if (isdigit(lexer->current_char)) {
-            return get_number_token(lexer);
+        else {
+            fprintf(stderr, "Error: Could not write samples to '%s'\n", path);
         }
 
-        if (isalpha(lexer->current_char) || lexer->current_char == '_') {
-            return get_identifier_token(lexer);
-        }
+        free_sampler();
+    }
 
-        if (lexer->current_char == '"') {
-            return get_string_token(lexer);
-        }
+    if (profiler.enabled) {
+        profiler_stop();
+        profiler_report();
+        free_profiler();
+    }
 
-        if (lexer->current_char == '+') {
-            token.type = TOKEN_PLUS;
-            advance_lexer(lexer);
-            return token;
-        }
+    asc_interpreter_free(interpreter);
+    asc_program_free(script);
+    asc_free(code);
+    free_module_cache();
 
-        if (lexer->current_char == '-') {
-            token.type = TOKEN_MINUS;
-            advance_lexer(lexer);
-            return token;
-        }
+    if (show_mem_stats) {
+        print_mem_stats();
+    }
 
-        if (lexer->current_char == '*') {
-            token.type = TOKEN_MULTIPLY;
-            advance_lexer(lexer);
-            return token;
-        }
+    if (show_runtime_stats) {
+        print_runtime_stats();
+    }
 
-        if (lexer->current_char == '/') {
-            advance_lexer(lexer);
+    return status == ASC_OK ? 0 : 1;
+}
 
-            // Check for comments
-            if (lexer->current_char == '/') {
-                // Skip single-line comment
-                while (lexer->current_char && lexer->current_char != '\n') {
-                    advance_lexer(lexer);
-                }
-                continue;
-            }
+// Batch mode implementation
+// A manifest has one job per line: a script path followed by name=value
+// globals to define before it runs. Blank lines and lines starting with #
+// are skipped. Workers share compiled scripts and imported programs, and
+// each job's output is captured separately and printed in manifest order.
+typedef struct {
+    char* path;
+    AscProgram* program;
+    AscStatus status;
+    char* error;    // Compile error, when status is not ASC_OK
+    bool compiling;
+    bool compiled;
+} BatchScript;
 
-            token.type = TOKEN_DIVIDE;
-            return token;
-        }
+typedef struct {
+    int script;
+    int line;
+    char** args; // name=value strings pointing into the manifest
+    int args_length;
+    FILE* output;
+    AscStatus status;
+    uint64_t latency_ns;
+    bool done;
+} BatchJob;
 
-        if (lexer->current_char == '=') {
-            advance_lexer(lexer);
+typedef struct {
+    AscMutex lock;
+    AscCond changed; // A job finished or a script was compiled
+    char* manifest;
+    NameTable script_paths; // Path as written -> index into scripts
+    BatchScript* scripts;
+    int scripts_length;
+    int scripts_capacity;
+    BatchJob* jobs;
+    int jobs_length;
+    int jobs_capacity;
+    int next_job;
+    int workers_started;
+    ProgramStore store;
+} Batch;
+
+static bool load_batch_manifest(Batch* batch, const char* path) {
+    batch->manifest = read_file(path);
+    if (batch->manifest == NULL) {
+        fprintf(stderr, "Error: Could not read manifest '%s'\n", path);
+        return false;
+    }
 
-            if (lexer->current_char == '=') {
-                advance_lexer(lexer);
-                token.type = TOKEN_EQUALS;
-            }
-            else {
-                token.type = TOKEN_ASSIGN;
-            }
+    char* line = batch->manifest;
+    int line_number = 0;
 
-            return token;
+    while (line && *line) {
+        char* next = strchr(line, '\n');
+        if (next) {
+            *next++ = '\0';
         }
+        line_number++;
 
-        if (lexer->current_char == '>') {
-            advance_lexer(lexer);
+        // Split into words in place
+        char* words[64];
+        int words_length = 0;
+        char* cursor = line;
 
-            if (lexer->current_char == '=') {
-                advance_lexer(lexer);
-                token.type = TOKEN_GTE;
+        while (*cursor) {
+            while (*cursor && isspace((unsigned char)*cursor)) {
+                *cursor++ = '\0';
             }
-            else {
-                token.type = TOKEN_GT;
+
+            if (*cursor == '\0') {
+                break;
             }
 
-            return token;
+            if (words_length == 64) {
+                fprintf(stderr, "%s:%d: too many arguments\n", path, line_number);
+                return false;
+            }
+
+            words[words_length++] = cursor;
+            while (*cursor && !isspace((unsigned char)*cursor)) {
+                cursor++;
+            }
         }
 
-        if (lexer->current_char == '<') {
-            advance_lexer(lexer);
+        if (words_length == 0 || words[0][0] == '#') {
+            line = next;
+            continue;
+        }
 
-            if (lexer->current_char == '=') {
-                advance_lexer(lexer);
-                token.type = TOKEN_LTE;
+        for (int i = 1; i < words_length; i++) {
+            if (strchr(words[i], '=') == NULL || words[i][0] == '=') {
+                fprintf(stderr, "%s:%d: expected name=value, got '%s'\n", path, line_number, words[i]);
+                return false;
             }
-            else {
-                token.type = TOKEN_LT;
+        }
+
+        int script = intern_name(&batch->script_paths, words[0]);
+        if (script == batch->scripts_length) {
+            if (batch->scripts_length >= batch->scripts_capacity) {
+                batch->scripts_capacity = batch->scripts_capacity ? batch->scripts_capacity * 2 : 16;
+                batch->scripts = (BatchScript*)asc_realloc(batch->scripts, sizeof(BatchScript) * batch->scripts_capacity, MEM_RUNTIME);
+                if (!batch->scripts) {
+                    fprintf(stderr, "Memory allocation failed\n");
+                    exit(1);
+                }
             }
 
-            return token;
+            memset(&batch->scripts[script], 0, sizeof(BatchScript));
+            batch->scripts[script].path = words[0];
+            batch->scripts_length++;
         }
 
-        if (lexer->current_char == '!') {
-            advance_lexer(lexer);
-
-            if (lexer->current_char == '=') {
-                advance_lexer(lexer);
-                token.type = TOKEN_NOT_EQUALS;
-                return token;
+        if (batch->jobs_length >= batch->jobs_capacity) {
+            batch->jobs_capacity = batch->jobs_capacity ? batch->jobs_capacity * 2 : 64;
+            batch->jobs = (BatchJob*)asc_realloc(batch->jobs, sizeof(BatchJob) * batch->jobs_capacity, MEM_RUNTIME);
+            if (!batch->jobs) {
+                fprintf(stderr, "Memory allocation failed\n");
+                exit(1);
             }
+        }
 
-            fprintf(stderr, "Unexpected character after '!'\n");
+        BatchJob* job = &batch->jobs[batch->jobs_length++];
+        memset(job, 0, sizeof(BatchJob));
+        job->script = script;
+        job->line = line_number;
+        job->args_length = words_length - 1;
+        job->args = (char**)asc_malloc(sizeof(char*) * words_length, MEM_RUNTIME);
+        if (!job->args) {
+            fprintf(stderr, "Memory allocation failed\n");
             exit(1);
         }
 
-        if (lexer->current_char == '&' && lexer->position + 1 < lexer->input_length &&
-            lexer->input[lexer->position + 1] == '&') {
-            advance_lexer(lexer);
-            advance_lexer(lexer);
-            token.type = TOKEN_AND;
-            return token;
+        for (int i = 1; i < words_length; i++) {
+            job->args[i - 1] = words[i];
         }
 
-        if (lexer->current_char == '|' && lexer->position + 1 < lexer->input_length &&
-            lexer->input[lexer->position + 1] == '|') {
-            advance_lexer(lexer);
-            advance_lexer(lexer);
-            token.type = TOKEN_OR;
-            return token;
-        }
+        line = next;
+    }
 
-        if (lexer->current_char == '(') {
-            token.type = TOKEN_LPAREN;
-            advance_lexer(lexer);
-            return token;
-        }
+    return true;
+}
 
-        if (lexer->current_char == ')') {
-            token.type = TOKEN_RPAREN;
-            advance_lexer(lexer);
-            return token;
-        }
+// Numbers and true/false are passed as such, anything else as a string
+static AscValue parse_batch_argument(const char* text) {
+    char* end;
+    double number = strtod(text, &end);
 
-        if (lexer->current_char == '{') {
-            token.type = TOKEN_LBRACE;
-            advance_lexer(lexer);
-            return token;
-        }
+    if (*text != '\0' && *end == '\0') {
+        return asc_number(number);
+    }
 
-        if (lexer->current_char == '}') {
-            token.type = TOKEN_RBRACE;
-            advance_lexer(lexer);
-            return token;
-        }
+    if (strcmp(text, "true") == 0 || strcmp(text, "false") == 0) {
+        return asc_boolean(text[0] == 't');
+    }
 
-        if (lexer->current_char == ';') {
-            token.type = TOKEN_SEMICOLON;
-            advance_lexer(lexer);
-            return token;
-        }
+    return asc_string(text);
+}
 
-        if (lexer->current_char == ',') {
-            token.type = TOKEN_COMMA;
-            advance_lexer(lexer);
-            return token;
+static AscStatus compile_batch_script(const char* path, AscProgram** program) {
+    char* code = read_file(path);
+    if (code == NULL) {
+        snprintf(error_message, sizeof(error_message), "Could not read file '%s'\n", path);
+        return ASC_ERROR_IO;
+    }
+
+    AscStatus status = ASC_OK;
+    uint32_t magic = 0;
+    memcpy(&magic, code, strlen(code) >= sizeof(magic) ? sizeof(magic) : 0);
+
+    if (magic == IMAGE_MAGIC) {
+        Program* image = load_program_image(path, NULL);
+        if (image) {
+            *program = create_asc_program(image, NULL);
+        }
+        else {
+            snprintf(error_message, sizeof(error_message), "'%s' is not a program image for this version\n", path);
+            status = ASC_ERROR_IO;
         }
+    }
+    else {
+        status = asc_compile(code, NULL, program);
+    }
 
-        if (lexer->current_char == '%') {
-            token.type = TOKEN_MODULO;
-            advance_lexer(lexer);
-            return token;
+    asc_free(code);
+    return status;
+}
+
+// The first worker to reach a script compiles it while the others wait
+static BatchScript* get_batch_script(Batch* batch, BatchJob* job) {
+    BatchScript* script = &batch->scripts[job->script];
+
+    if (!script->compiled && !script->compiling) {
+        script->compiling = true;
+        mutex_unlock(&batch->lock);
+
+        uint64_t start = tracer.enabled ? monotonic_ns() : 0;
+        AscProgram* program = NULL;
+        AscStatus status = compile_batch_script(script->path, &program);
+        char* error = status == ASC_OK ? NULL : asc_strdup(asc_error_message(), MEM_RUNTIME);
+
+        if (tracer.enabled) {
+            trace_event(script->path, "compile", start);
         }
 
-        // If we get here, we have an invalid character
-        fprintf(stderr, "Invalid character: %c\n", lexer->current_char);
-        exit(1);
+        mutex_lock(&batch->lock);
+        script->program = program;
+        script->status = status;
+        script->error = error;
+        script->compiled = true;
+        cond_broadcast(&batch->changed);
     }
 
-    token.type = TOKEN_EOF;
-    return token;
+    while (!script->compiled) {
+        cond_wait(&batch->changed, &batch->lock);
+    }
+
+    return script;
 }
 
-Token* tokenize(Lexer* lexer, int* token_count) {
-    int capacity = 1024;
-    Token* tokens = (Token*)malloc(sizeof(Token) * capacity);
-    if (!tokens) {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(1);
+static void run_batch_job(AscInterpreter* interpreter, BatchScript* script, BatchJob* job) {
+    job->output = tmpfile();
+    if (job->output == NULL) {
+        job->status = ASC_ERROR_IO;
+        return;
     }
 
-    int count = 0;
+    if (script->status != ASC_OK) {
+        fputs(script->error, job->output);
+        job->status = script->status;
+        return;
+    }
 
-    Token token = get_next_token(lexer);
-    while (token.type != TOKEN_EOF) {
-        if (count >= capacity) {
-            capacity *= 2;
-            tokens = (Token*)realloc(tokens, sizeof(Token) * capacity);
-            if (!tokens) {
-                fprintf(stderr, "Memory allocation failed\n");
-                exit(1);
-            }
+    for (int i = 0; i < job->args_length; i++) {
+        char* separator = strchr(job->args[i], '=');
+        *separator = '\0';
+        asc_set_global(interpreter, job->args[i], parse_batch_argument(separator + 1));
+        *separator = '=';
+    }
+
+    asc_set_output(interpreter, job->output);
+    job->status = asc_run(interpreter, script->program, NULL);
+
+    if (job->status != ASC_OK) {
+        fputs(asc_error_message(), job->output);
+    }
+
+    asc_reset(interpreter);
+}
+
+static THREAD_RESULT batch_worker(void* arg) {
+    Batch* batch = (Batch*)arg;
+    AscInterpreter* interpreter = asc_interpreter_create();
+    share_module_programs(interpreter, &batch->store);
+
+    mutex_lock(&batch->lock);
+    thread_index = ++batch->workers_started;
+
+    while (batch->next_job < batch->jobs_length) {
+        BatchJob* job = &batch->jobs[batch->next_job++];
+        BatchScript* script = get_batch_script(batch, job);
+        mutex_unlock(&batch->lock);
+
+        uint64_t start = monotonic_ns();
+        run_batch_job(interpreter, script, job);
+        job->latency_ns = monotonic_ns() - start;
+
+        if (tracer.enabled) {
+            trace_event(script->path, "job", start);
         }
 
-        tokens[count++] = token;
-        token = get_next_token(lexer);
+        mutex_lock(&batch->lock);
+        job->done = true;
+        cond_broadcast(&batch->changed);
     }
 
-    tokens[count++] = token; // Add EOF token
-    *token_count = count;
+    mutex_unlock(&batch->lock);
+    asc_interpreter_free(interpreter);
+    return 0;
+}
 
-    return tokens;
+static int compare_latencies(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
 }
 
-void free_lexer(Lexer* lexer) {
-    free(lexer);
+// Nearest-rank percentile p of n sorted latencies: the smallest one that at
+// least p percent of them do not exceed
+static uint64_t latency_percentile(const uint64_t* latencies, int n, int p) {
+    int64_t rank = ((int64_t)p * n + 99) / 100;
+    return latencies[rank > 0 ? rank - 1 : 0];
 }
 
-// Parser implementation
-Parser* create_parser(Token* tokens, int tokens_length) {
-    Parser* parser = (Parser*)malloc(sizeof(Parser));
-    if (!parser) {
+static void print_batch_summary(Batch* batch, int workers, uint64_t elapsed_ns) {
+    uint64_t* latencies = (uint64_t*)asc_malloc(sizeof(uint64_t) * (batch->jobs_length + 1), MEM_TOOLING);
+    if (!latencies) {
         fprintf(stderr, "Memory allocation failed\n");
         exit(1);
     }
 
-    parser->tokens = tokens;
-    parser->tokens_length = tokens_length;
-    parser->position = 0;
-    parser->current_token = tokens[0];
-    return parser;
-}
+    uint64_t total_ns = 0;
+    int failed = 0;
 
-void advance_parser(Parser* parser) {
-    parser->position++;
-    if (parser->position < parser->tokens_length) {
-        parser->current_token = parser->tokens[parser->position];
+    for (int i = 0; i < batch->jobs_length; i++) {
+        latencies[i] = batch->jobs[i].latency_ns;
+        total_ns += latencies[i];
+        failed += batch->jobs[i].status != ASC_OK;
     }
-    else {
-        parser->current_token.type = TOKEN_EOF;
+
+    qsort(latencies, batch->jobs_length, sizeof(uint64_t), compare_latencies);
+
+    double seconds = elapsed_ns / 1e9;
+    fprintf(stderr, "\nBatch: %d jobs, %d failed, %d scripts, %d workers\n",
+        batch->jobs_length, failed, batch->scripts_length, workers);
+    fprintf(stderr, "Throughput: %.1f jobs/s (%.3f s wall)\n",
+        seconds > 0 ? batch->jobs_length / seconds : 0.0, seconds);
+
+    if (batch->jobs_length > 0) {
+        int n = batch->jobs_length;
+        fprintf(stderr, "Latency (ms): min %.3f  mean %.3f  p50 %.3f  p95 %.3f  p99 %.3f  max %.3f\n",
+            latencies[0] / 1e6,
+            total_ns / 1e6 / n,
+            latency_percentile(latencies, n, 50) / 1e6,
+            latency_percentile(latencies, n, 95) / 1e6,
+            latency_percentile(latencies, n, 99) / 1e6,
+            latencies[n - 1] / 1e6);
     }
+
+    asc_free(latencies);
 }
 
-Token eat(Parser* parser, TokenType type) {
-    if (parser->current_token.type == type) {
-        Token token = parser->current_token;
-        advance_parser(parser);
-        return token;
-    }
-    else {
-        fprintf(stderr, "Expected token type %d but got %d\n", type, parser->current_token.type);
-        exit(1);
-    }
-}
+// Runs every job in a manifest on workers threads. Returns the exit status.
+int run_batch(const char* manifest_path, int workers) {
+    Batch batch;
+    memset(&batch, 0, sizeof(Batch));
 
-ASTNode* parse_program(Parser* parser) {
-    ASTNode* node = (ASTNode*)malloc(sizeof(ASTNode));
-    if (!node) {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(1);
+    if (!load_batch_manifest(&batch, manifest_path)) {
+        asc_free(batch.manifest);
+        return 1;
     }
 
-    node->type = NODE_PROGRAM;
+    enable_threads();
+    mutex_init(&batch.lock);
+    cond_init(&batch.changed);
+    init_program_store(&batch.store);
+
+    if (workers > batch.jobs_length) {
+        workers = batch.jobs_length > 0 ? batch.jobs_length : 1;
+    }
 
-    // Allocate initial capacity for body
-    int capacity = 100;
-    node->data.program.body = (ASTNode**)malloc(sizeof(ASTNode*) * capacity);
-    if (!node->data.program.body) {
+    AscThread* threads = (AscThread*)asc_malloc(sizeof(AscThread) * workers, MEM_RUNTIME);
+    if (!threads) {
         fprintf(stderr, "Memory allocation failed\n");
         exit(1);
     }
 
-    node->data.program.body_length = 0;
+    uint64_t start = monotonic_ns();
+    int threads_length = 0;
 
-    while (parser->current_token.type != TOKEN_EOF) {
-        if (node->data.program.body_length >= capacity) {
-            capacity *= 2;
-            node->data.program.body = (ASTNode**)realloc(node->data.program.body,
-                sizeof(ASTNode*) * capacity);
-            if (!node->data.program.body) {
-                fprintf(stderr, "Memory allocation failed\n");
-                exit(1);
-            }
+    for (int i = 0; i < workers; i++) {
+        if (thread_start(&threads[threads_length], batch_worker, &batch)) {
+            threads_length++;
         }
+    }
 
-        node->data.program.body[node->data.program.body_length++] = parse_statement(parser);
+    if (threads_length == 0) {
+        fprintf(stderr, "Error: Could not start batch workers\n");
+        return 1;
     }
 
-    return node;
-}
+    // Print each job's output as soon as it and all jobs before it are done
+    int failed = 0;
+    char buffer[8192];
 
-ASTNode* parse_statement(Parser* parser) {
-    switch (parser->current_token.type) {
-    case TOKEN_LET:
-        return parse_variable_declaration(parser);
-    case TOKEN_IF:
-        return parse_if_statement(parser);
-    case TOKEN_WHILE:
-        return parse_while_statement(parser);
-    case TOKEN_FUNCTION:
-        return parse_function_declaration(parser);
-    case TOKEN_RETURN:
-        return parse_return_statement(parser);
-    case TOKEN_PRINT:
-        return parse_print_statement(parser);
-    case TOKEN_IMPORT:
-        return parse_import_statement(parser);
-    case TOKEN_IDENTIFIER: {
-        Token identifier = eat(parser, TOKEN_IDENTIFIER);
+    for (int i = 0; i < batch.jobs_length; i++) {
+        BatchJob* job = &batch.jobs[i];
 
-        if (parser->current_token.type == TOKEN_ASSIGN) {
-            eat(parser, TOKEN_ASSIGN);
-            ASTNode* value = parse_expression(parser);
-            eat(parser, TOKEN_SEMICOLON);
+        mutex_lock(&batch.lock);
+        while (!job->done) {
+            cond_wait(&batch.changed, &batch.lock);
+        }
+        mutex_unlock(&batch.lock);
 
-            ASTNode* node = (ASTNode*)malloc(sizeof(ASTNode));
-            if (!node) {
-                fprintf(stderr, "Memory allocation failed\n");
-                exit(1);
-            }
+        printf("==> %s:%d %s", manifest_path, job->line, batch.scripts[job->script].path);
+        for (int j = 0; j < job->args_length; j++) {
+            printf(" %s", job->args[j]);
+        }
+        printf(" <==\n");
 
-            node->type = NODE_ASSIGNMENT_EXPRESSION;
-            node->data.assignment_expression.name = strdup(identifier.value.string_value);
-            node->data.assignment_expression.value = value;
+        if (job->output) {
+            size_t length;
+            rewind(job->output);
 
-            return node;
+            while ((length = fread(buffer, 1, sizeof(buffer), job->output)) > 0) {
+                fwrite(buffer, 1, length, stdout);
+            }
+
+            fclose(job->output);
         }
-        else if (parser->current_token.type == TOKEN_LPAREN) {
-            ASTNode* call = parse_function_call(parser, identifier.value.string_value);
-            eat(parser, TOKEN_SEMICOLON);
-            return call;
+        else {
+            printf("Error: Could not capture job output\n");
         }
 
-        break;
-    }
-    case TOKEN_LBRACE:
-        return parse_block_statement(parser);
-    default:
-        break;
-    }
+        if (job->status != ASC_OK) {
+            failed++;
+        }
 
-    fprintf(stderr, "Unexpected token type: %d\n", parser->current_token.type);
-    exit(1);
-    return NULL; // To avoid compiler warning
-}
+        asc_free(job->args);
+    }
 
-ASTNode* parse_block_statement(Parser* parser) {
-    eat(parser, TOKEN_LBRACE);
+    fflush(stdout);
 
-    ASTNode* node = (ASTNode*)malloc(sizeof(ASTNode));
-    if (!node) {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(1);
+    for (int i = 0; i < threads_length; i++) {
+        thread_join(threads[i]);
     }
 
-    node->type = NODE_BLOCK_STATEMENT;
+    print_batch_summary(&batch, threads_length, monotonic_ns() - start);
 
-    // Allocate initial capacity for body
-    int capacity = 100;
-    node->data.block_statement.body = (ASTNode**)malloc(sizeof(ASTNode*) * capacity);
-    if (!node->data.block_statement.body) {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(1);
+    for (int i = 0; i < batch.scripts_length; i++) {
+        asc_program_free(batch.scripts[i].program);
+        asc_free(batch.scripts[i].error);
     }
 
-    node->data.block_statement.body_length = 0;
+    free_program_store(&batch.store);
+    free_name_table(&batch.script_paths);
+    cond_destroy(&batch.changed);
+    mutex_destroy(&batch.lock);
+    asc_free(threads);
+    asc_free(batch.scripts);
+    asc_free(batch.jobs);
+    asc_free(batch.manifest);
 
-    while (parser->current_token.type != TOKEN_RBRACE) {
-        if (node->data.block_statement.body_length >= capacity) {
-            capacity *= 2;
-            node->data.block_statement.body = (ASTNode**)realloc(node->data.block_statement.body,
-                sizeof(ASTNode*) * capacity);
-            if (!node->data.block_statement.body) {
-                fprintf(stderr, "Memory allocation failed\n");
-                exit(1);
-            }
+    return failed == 0 ? 0 : 1;
+}
+
+#ifndef _WIN32
+// Server mode implementation
+// A client connects to the Unix socket and sends one request: a 32-bit
+// length, then the client's working directory, the script path and its
+// name=value arguments as NUL-terminated strings. Its stdout and stderr
+// descriptors ride along as SCM_RIGHTS, so the script prints straight into
+// them. The server answers with one byte, the exit status.
+#define SERVER_MAX_REQUEST 65536
+
+typedef struct {
+    AscProgram* program;
+    FileStamp stamp;
+} ServerScript;
+
+typedef struct {
+    int listener;
+    AscMutex lock;
+    NameTable script_keys; // "directory\npath" -> index into scripts
+    ServerScript* scripts;
+    int scripts_length;
+    int scripts_capacity;
+    AscProgram** retired; // Replaced scripts, which may still be running
+    int retired_length;
+    int retired_capacity;
+    ProgramStore store;
+    uint64_t requests;
+    uint64_t failures;
+    uint64_t busy_ns;
+} Server;
+
+static bool read_fully(int fd, void* data, size_t length) {
+    char* cursor = (char*)data;
+
+    while (length > 0) {
+        ssize_t received = recv(fd, cursor, length, 0);
+        if (received <= 0) {
+            return false;
         }
 
-        node->data.block_statement.body[node->data.block_statement.body_length++] = parse_statement(parser);
+        cursor += received;
+        length -= (size_t)received;
     }
 
-    eat(parser, TOKEN_RBRACE);
-    return node;
+    return true;
 }
 
-ASTNode* parse_variable_declaration(Parser* parser) {
-    eat(parser, TOKEN_LET);
-    Token name = eat(parser, TOKEN_IDENTIFIER);
-    eat(parser, TOKEN_ASSIGN);
-    ASTNode* value = parse_expression(parser);
-    eat(parser, TOKEN_SEMICOLON);
-
-    ASTNode* node = (ASTNode*)malloc(sizeof(ASTNode));
-    if (!node) {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(1);
+// Receives the request length along with the client's output descriptors
+static bool receive_request_header(int fd, uint32_t* length, int descriptors[2]) {
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int) * 2)];
+    } control;
+    struct iovec vector = { length, sizeof(uint32_t) };
+    struct msghdr message;
+
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    ssize_t received = recvmsg(fd, &message, 0);
+    if (received < 0) {
+        return false;
     }
 
-    node->type = NODE_VARIABLE_DECLARATION;
-    node->data.variable_declaration.name = strdup(name.value.string_value);
-    node->data.variable_declaration.value = value;
+    // Anything but exactly two descriptors in one message is rejected, and
+    // every descriptor that did arrive is closed so none leak
+    bool valid = received == (ssize_t)sizeof(uint32_t) && !(message.msg_flags & MSG_CTRUNC);
+    int count = 0;
 
-    return node;
-}
+    for (struct cmsghdr* header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header)) {
+        if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) {
+            valid = false;
+            continue;
+        }
 
-ASTNode* parse_if_statement(Parser* parser) {
-    eat(parser, TOKEN_IF);
-    eat(parser, TOKEN_LPAREN);
-    ASTNode* test = parse_expression(parser);
-    eat(parser, TOKEN_RPAREN);
-    ASTNode* consequent = parse_statement(parser);
+        int received_length = (int)((header->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        for (int i = 0; i < received_length; i++) {
+            int descriptor;
+            memcpy(&descriptor, CMSG_DATA(header) + sizeof(int) * i, sizeof(int));
 
-    ASTNode* node = (ASTNode*)malloc(sizeof(ASTNode));
-    if (!node) {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(1);
+            if (count < 2) {
+                descriptors[count] = descriptor;
+            }
+            else {
+                close(descriptor);
+            }
+            count++;
+        }
     }
 
-    node->type = NODE_IF_STATEMENT;
-    node->data.if_statement.test = test;
-    node->data.if_statement.consequent = consequent;
-    node->data.if_statement.alternate = NULL;
-
-    if (parser->current_token.type == TOKEN_ELSE) {
-        eat(parser, TOKEN_ELSE);
-        node->data.if_statement.alternate = parse_statement(parser);
+    if (!valid || count != 2) {
+        for (int i = 0; i < count && i < 2; i++) {
+            close(descriptors[i]);
+        }
+        return false;
     }
 
-    return node;
+    return true;
 }
 
-ASTNode* parse_while_statement(Parser* parser) {
-    eat(parser, TOKEN_WHILE);
-    eat(parser, TOKEN_LPAREN);
-    ASTNode* test = parse_expression(parser);
-    eat(parser, TOKEN_RPAREN);
-    ASTNode* body = parse_statement(parser);
+static char* join_path(const char* directory, const char* path) {
+    if (path[0] == '/') {
+        return asc_strdup(path, MEM_RUNTIME);
+    }
 
-    ASTNode* node = (ASTNode*)malloc(sizeof(ASTNode));
-    if (!node) {
+    char* joined = (char*)asc_malloc(strlen(directory) + strlen(path) + 2, MEM_RUNTIME);
+    if (!joined) {
         fprintf(stderr, "Memory allocation failed\n");
         exit(1);
     }
 
-    node->type = NODE_WHILE_STATEMENT;
-    node->data.while_statement.test = test;
-    node->data.while_statement.body = body;
-
-    return node;
+    sprintf(joined, "%s/%s", directory, path);
+    return joined;
 }
 
-ASTNode* parse_function_declaration(Parser* parser) {
-    eat(parser, TOKEN_FUNCTION);
-    Token name = eat(parser, TOKEN_IDENTIFIER);
-    eat(parser, TOKEN_LPAREN);
-
-    ASTNode* node = (ASTNode*)malloc(sizeof(ASTNode));
-    if (!node) {
+// Returns the compiled script, compiling it on first use or after it changed.
+// Imports resolve against the client's working directory, as they would for
+// a command-line run there.
+static AscStatus get_server_script(Server* server, const char* directory, const char* path, AscProgram** program) {
+    char* full_path = join_path(directory, path);
+    char* key = (char*)asc_malloc(strlen(directory) + strlen(full_path) + 2, MEM_RUNTIME);
+    if (!key) {
         fprintf(stderr, "Memory allocation failed\n");
         exit(1);
     }
 
-    node->type = NODE_FUNCTION_DECLARATION;
-    node->data.function_declaration.name = strdup(name.value.string_value);
+    sprintf(key, "%s\n%s", directory, full_path);
 
-    // Allocate initial capacity for params
-    int capacity = 20;
-    node->data.function_declaration.params = (char**)malloc(sizeof(char*) * capacity);
-    if (!node->data.function_declaration.params) {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(1);
+    FileStamp stamp;
+    AscStatus status = ASC_OK;
+    *program = NULL;
+
+    if (!get_file_stamp(full_path, &stamp)) {
+        snprintf(error_message, sizeof(error_message), "Error: Could not read file '%s'\n", path);
+        status = ASC_ERROR_IO;
+    }
+    else {
+        mutex_lock(&server->lock);
+        int id = intern_name(&server->script_keys, key);
+        if (id < server->scripts_length && same_file_stamp(&server->scripts[id].stamp, &stamp)) {
+            *program = server->scripts[id].program;
+        }
+        mutex_unlock(&server->lock);
     }
 
-    node->data.function_declaration.params_length = 0;
+    if (status == ASC_OK && *program == NULL) {
+        char* code = read_file(full_path);
 
-    if (parser->current_token.type != TOKEN_RPAREN) {
-        Token param = eat(parser, TOKEN_IDENTIFIER);
-        node->data.function_declaration.params[node->data.function_declaration.params_length++] = strdup(param.value.string_value);
+        if (code == NULL) {
+            snprintf(error_message, sizeof(error_message), "Error: Could not read file '%s'\n", path);
+            status = ASC_ERROR_IO;
+        }
+        else {
+            status = asc_compile(code, directory, program);
+            asc_free(code);
+        }
 
-        while (parser->current_token.type == TOKEN_COMMA) {
-            eat(parser, TOKEN_COMMA);
-            param = eat(parser, TOKEN_IDENTIFIER);
-            node->data.function_declaration.params[node->data.function_declaration.params_length++] = strdup(param.value.string_value);
+        if (status == ASC_OK) {
+            mutex_lock(&server->lock);
+            int id = intern_name(&server->script_keys, key);
+
+            while (server->scripts_length <= id) {
+                if (server->scripts_length >= server->scripts_capacity) {
+                    server->scripts_capacity = server->scripts_capacity ? server->scripts_capacity * 2 : 16;
+                    server->scripts = (ServerScript*)asc_realloc(server->scripts, sizeof(ServerScript) * server->scripts_capacity, MEM_RUNTIME);
+                    if (!server->scripts) {
+                        fprintf(stderr, "Memory allocation failed\n");
+                        exit(1);
+                    }
+                }
+
+                memset(&server->scripts[server->scripts_length++], 0, sizeof(ServerScript));
+            }
+
+            if (server->scripts[id].program) {
+                if (server->retired_length >= server->retired_capacity) {
+                    server->retired_capacity = server->retired_capacity ? server->retired_capacity * 2 : 16;
+                    server->retired = (AscProgram**)asc_realloc(server->retired, sizeof(AscProgram*) * server->retired_capacity, MEM_RUNTIME);
+                    if (!server->retired) {
+                        fprintf(stderr, "Memory allocation failed\n");
+                        exit(1);
+                    }
+                }
+
+                server->retired[server->retired_length++] = server->scripts[id].program;
+            }
+
+            server->scripts[id].program = *program;
+            server->scripts[id].stamp = stamp;
+            mutex_unlock(&server->lock);
         }
     }
 
-    eat(parser, TOKEN_RPAREN);
-    node->data.function_declaration.body = parse_statement(parser);
-
-    return node;
+    asc_free(key);
+    asc_free(full_path);
+    return status;
 }
 
-ASTNode* parse_function_call(Parser* parser, char* name) {
-    eat(parser, TOKEN_LPAREN);
+static void handle_request(Server* server, AscInterpreter* interpreter, int connection) {
+    uint32_t length;
+    int descriptors[2];
 
-    ASTNode* node = (ASTNode*)malloc(sizeof(ASTNode));
-    if (!node) {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(1);
+    if (!receive_request_header(connection, &length, descriptors)) {
+        return;
     }
 
-    node->type = NODE_CALL_EXPRESSION;
-    node->data.call_expression.name = strdup(name);
+    uint64_t start = monotonic_ns();
+    char* request = NULL;
+    FILE* output = NULL;
+    unsigned char exit_status = 1;
 
-    // Allocate initial capacity for arguments
-    int capacity = 20;
-    node->data.call_expression.arguments = (ASTNode**)malloc(sizeof(ASTNode*) * capacity);
-    if (!node->data.call_expression.arguments) {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(1);
+    if (length > 0 && length <= SERVER_MAX_REQUEST) {
+        request = (char*)asc_malloc(length + 1, MEM_RUNTIME);
+        if (!request) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+
+        if (!read_fully(connection, request, length)) {
+            asc_free(request);
+            request = NULL;
+        }
     }
 
-    node->data.call_expression.arguments_length = 0;
+    if (request) {
+        // Directory, script and arguments, each NUL-terminated
+        request[length] = '\0';
+        const char* fields[64];
+        int fields_length = 0;
 
-    if (parser->current_token.type != TOKEN_RPAREN) {
-        node->data.call_expression.arguments[node->data.call_expression.arguments_length++] = parse_expression(parser);
+        for (uint32_t i = 0; i < length && fields_length < 64; i += (uint32_t)strlen(request + i) + 1) {
+            fields[fields_length++] = request + i;
+        }
 
-        while (parser->current_token.type == TOKEN_COMMA) {
-            eat(parser, TOKEN_COMMA);
+        output = fdopen(descriptors[0], "w");
+        AscProgram* program = NULL;
+        AscStatus status = fields_length >= 2 && output
+            ? get_server_script(server, fields[0], fields[1], &program)
+            : ASC_ERROR_IO;
 
-            if (node->data.call_expression.arguments_length >= capacity) {
-                capacity *= 2;
-                node->data.call_expression.arguments = (ASTNode**)realloc(node->data.call_expression.arguments,
-                    sizeof(ASTNode*) * capacity);
-                if (!node->data.call_expression.arguments) {
-                    fprintf(stderr, "Memory allocation failed\n");
-                    exit(1);
-                }
+        for (int i = 2; status == ASC_OK && i < fields_length; i++) {
+            char* separator = strchr(fields[i], '=');
+            if (separator == NULL || separator == fields[i]) {
+                continue;
             }
 
-            node->data.call_expression.arguments[node->data.call_expression.arguments_length++] = parse_expression(parser);
+            *separator = '\0';
+            asc_set_global(interpreter, fields[i], parse_batch_argument(separator + 1));
+        }
+
+        if (status == ASC_OK) {
+            asc_set_output(interpreter, output);
+            status = asc_run(interpreter, program, NULL);
+            asc_set_output(interpreter, NULL);
+            asc_reset(interpreter);
         }
+
+        if (output) {
+            fflush(output);
+        }
+
+        if (status != ASC_OK && fields_length >= 2) {
+            const char* message = asc_error_message();
+            ssize_t written = write(descriptors[1], message, strlen(message));
+            (void)written;
+        }
+
+        exit_status = status == ASC_OK ? 0 : 1;
+        asc_free(request);
     }
 
-    eat(parser, TOKEN_RPAREN);
+    if (output) {
+        fclose(output);
+    }
+    else {
+        close(descriptors[0]);
+    }
+    close(descriptors[1]);
 
-    return node;
+    uint64_t elapsed = monotonic_ns() - start;
+    send(connection, &exit_status, 1, 0);
+
+    if (tracer.enabled) {
+        trace_event("request", "server", start);
+    }
+
+    mutex_lock(&server->lock);
+    server->requests++;
+    server->failures += exit_status != 0;
+    server->busy_ns += elapsed;
+    mutex_unlock(&server->lock);
 }
 
-ASTNode* parse_return_statement(Parser* parser) {
-    eat(parser, TOKEN_RETURN);
-    ASTNode* argument = parse_expression(parser);
-    eat(parser, TOKEN_SEMICOLON);
+static THREAD_RESULT server_worker(void* arg) {
+    Server* server = (Server*)arg;
+    AscInterpreter* interpreter = asc_interpreter_create();
+    share_module_programs(interpreter, &server->store);
 
-    ASTNode* node = (ASTNode*)malloc(sizeof(ASTNode));
-    if (!node) {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(1);
-    }
+    for (;;) {
+        int connection = accept(server->listener, NULL, NULL);
+        if (connection < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break; // The listener was shut down
+        }
 
-    node->type = NODE_RETURN_STATEMENT;
-    node->data.return_statement.argument = argument;
+        // A client that connects and then sends nothing must not hold a worker forever
+        struct timeval timeout = { 5, 0 };
+        setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
 
-    return node;
+        handle_request(server, interpreter, connection);
+        close(connection);
+    }
+
+    asc_interpreter_free(interpreter);
+    return 0;
 }
 
-ASTNode* parse_print_statement(Parser* parser) {
-    eat(parser, TOKEN_PRINT);
-    eat(parser, TOKEN_LPAREN);
-    ASTNode* argument = parse_expression(parser);
-    eat(parser, TOKEN_RPAREN);
-    eat(parser, TOKEN_SEMICOLON);
+// Serves requests on a Unix socket until SIGINT or SIGTERM. Returns the exit
+// status.
+int run_server(const char* socket_path, int workers) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
 
-    ASTNode* node = (ASTNode*)malloc(sizeof(ASTNode));
-    if (!node) {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(1);
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Error: Socket path '%s' is too long\n", socket_path);
+        return 1;
     }
 
-    node->type = NODE_PRINT_STATEMENT;
-    node->data.print_statement.argument = argument;
+    strcpy(address.sun_path, socket_path);
 
-    return node;
-}
+    Server server;
+    memset(&server, 0, sizeof(Server));
+    server.listener = socket(AF_UNIX, SOCK_STREAM, 0);
 
-ASTNode* parse_import_statement(Parser* parser) {
-    eat(parser, TOKEN_IMPORT);
-    eat(parser, TOKEN_LPAREN);
-    Token path = eat(parser, TOKEN_STRING);
-    eat(parser, TOKEN_RPAREN);
-    eat(parser, TOKEN_SEMICOLON);
+    // Replace a socket left behind by a server that did not shut down cleanly
+    struct stat info;
+    if (stat(socket_path, &info) == 0 && S_ISSOCK(info.st_mode)) {
+        unlink(socket_path);
+    }
 
-    ASTNode* node = (ASTNode*)malloc(sizeof(ASTNode));
-    if (!node) {
+    if (server.listener < 0 || bind(server.listener, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(server.listener, 128) != 0) {
+        fprintf(stderr, "Error: Could not listen on '%s': %s\n", socket_path, strerror(errno));
+        return 1;
+    }
+
+    // Workers write into client pipes that may close at any time. Shutdown
+    // signals are taken by the main thread only.
+    signal(SIGPIPE, SIG_IGN);
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGPROF);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    enable_threads();
+    mutex_init(&server.lock);
+    init_program_store(&server.store);
+
+    AscThread* threads = (AscThread*)asc_malloc(sizeof(AscThread) * workers, MEM_RUNTIME);
+    if (!threads) {
         fprintf(stderr, "Memory allocation failed\n");
         exit(1);
     }
 
-    node->type = NODE_IMPORT_STATEMENT;
-    node->data.import_statement.path = strdup(path.value.string_value);
+    int threads_length = 0;
+    for (int i = 0; i < workers; i++) {
+        if (thread_start(&threads[threads_length], server_worker, &server)) {
+            threads_length++;
+        }
+    }
 
-    return node;
-}
+    fprintf(stderr, "Serving on %s with %d interpreters\n", socket_path, threads_length);
 
-ASTNode* parse_expression(Parser* parser) {
-    return parse_logical_or(parser);
-}
+    int signal_number;
+    sigdelset(&signals, SIGPROF);
+    sigwait(&signals, &signal_number);
 
-ASTNode* parse_logical_or(Parser* parser) {
-    ASTNode* left = parse_logical_and(parser);
+    // Wakes the workers blocked in accept
+    shutdown(server.listener, SHUT_RDWR);
+    close(server.listener);
 
-    while (parser->current_token.type == TOKEN_OR) {
-        eat(parser, TOKEN_OR);
-        ASTNode* right = parse_logical_and(parser);
+    for (int i = 0; i < threads_length; i++) {
+        thread_join(threads[i]);
+    }
 
-        ASTNode* node = (ASTNode*)malloc(sizeof(ASTNode));
-        if (!node) {
-            fprintf(stderr, "Memory allocation failed\n");
-            exit(1);
-        }
+    unlink(socket_path);
 
-        node->type = NODE_LOGICAL_EXPRESSION;
-        node->data.logical_expression.operator = strdup("||");
-        node->data.logical_expression.left = left;
-        node->data.logical_expression.right = right;
+    fprintf(stderr, "Served %llu requests (%llu failed), mean %.3f ms\n",
+        (unsigned long long)server.requests, (unsigned long long)server.failures,
+        server.requests ? server.busy_ns / 1e6 / server.requests : 0.0);
 
-        left = node;
+    for (int i = 0; i < server.scripts_length; i++) {
+        asc_program_free(server.scripts[i].program);
     }
 
-    return left;
+    for (int i = 0; i < server.retired_length; i++) {
+        asc_program_free(server.retired[i]);
+    }
+
+    free_program_store(&server.store);
+    free_name_table(&server.script_keys);
+    mutex_destroy(&server.lock);
+    asc_free(server.scripts);
+    asc_free(server.retired);
+    asc_free(threads);
+
+    return 0;
 }
 
-ASTNode* parse_logical_and(Parser* parser) {
-    ASTNode* left = parse_equality(parser);
+// Sends a script to a server and waits for its exit status. Output arrives
+// on this process's stdout and stderr directly.
+int run_client(const char* socket_path, int argc, char* argv[]) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
 
-    while (parser->current_token.type == TOKEN_AND) {
-        eat(parser, TOKEN_AND);
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Error: Socket path '%s' is too long\n", socket_path);
+        return 1;
+    }
+
+    strcpy(address.sun_path, socket_path);
+
+    char directory[4096];
+    if (getcwd(directory, sizeof(directory)) == NULL) {
+        fprintf(stderr, "Error: Could not get the working directory\n");
+        return 1;
+    }
+
+    // Working directory, script and arguments as NUL-terminated strings
+    size_t length = strlen(directory) + 1;
+    for (int i = 0; i < argc; i++) {
+        length += strlen(argv[i]) + 1;
+    }
+
+    if (length > SERVER_MAX_REQUEST) {
+        fprintf(stderr, "Error: Request is too large\n");
+        return 1;
+    }
+
+    char* request = (char*)asc_malloc(sizeof(uint32_t) + length, MEM_RUNTIME);
+    if (!request) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    uint32_t request_length = (uint32_t)length;
+    memcpy(request, &request_length, sizeof(uint32_t));
+
+    char* cursor = request + sizeof(uint32_t);
+    strcpy(cursor, directory);
+    cursor += strlen(directory) + 1;
+
+    for (int i = 0; i < argc; i++) {
+        strcpy(cursor, argv[i]);
+        cursor += strlen(argv[i]) + 1;
+    }
+
+    int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connection < 0 || connect(connection, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        fprintf(stderr, "Error: Could not connect to '%s': %s\n", socket_path, strerror(errno));
+        asc_free(request);
+        return 1;
+    }
+
+    printf("Running %s...\n\n", argv[0]);
+    fflush(stdout);
+
+    // The length goes with the descriptors, the rest follows as plain data
+    int descriptors[2] = { STDOUT_FILENO, STDERR_FILENO };
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int) * 2)];
+    } control;
+    struct iovec vector = { request, sizeof(uint32_t) };
+    struct msghdr message;
+
+    memset(&message, 0, sizeof(message));
+    memset(&control, 0, sizeof(control));
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int) * 2);
+    memcpy(CMSG_DATA(header), descriptors, sizeof(descriptors));
+
+    unsigned char exit_status = 1;
+    bool sent = sendmsg(connection, &message, 0) == (ssize_t)sizeof(uint32_t) &&
+        send(connection, request + sizeof(uint32_t), length, 0) == (ssize_t)length;
+
+    if (!sent || recv(connection, &exit_status, 1, 0) != 1) {
+        fprintf(stderr, "Error: Lost connection to '%s'\n", socket_path);
+        exit_status = 1;
+    }
+
+    close(connection);
+    asc_free(request);
+    return exit_status;
+}
+#endif
+#endif // ASC_LIBRARY
+
+// Threading implementation
+void mutex_init(AscMutex* mutex) {
+#ifdef _WIN32
+    InitializeCriticalSection(mutex);
+#else
+    pthread_mutex_init(mutex, NULL);
+#endif
+}
+
+void mutex_lock(AscMutex* mutex) {
+#ifdef _WIN32
+    EnterCriticalSection(mutex);
+#else
+    pthread_mutex_lock(mutex);
+#endif
+}
+
+void mutex_unlock(AscMutex* mutex) {
+#ifdef _WIN32
+    LeaveCriticalSection(mutex);
+#else
+    pthread_mutex_unlock(mutex);
+#endif
+}
+
+void mutex_destroy(AscMutex* mutex) {
+#ifdef _WIN32
+    DeleteCriticalSection(mutex);
+#else
+    pthread_mutex_destroy(mutex);
+#endif
+}
+
+void cond_init(AscCond* cond) {
+#ifdef _WIN32
+    InitializeConditionVariable(cond);
+#else
+    pthread_cond_init(cond, NULL);
+#endif
+}
+
+void cond_wait(AscCond* cond, AscMutex* mutex) {
+#ifdef _WIN32
+    SleepConditionVariableCS(cond, mutex, INFINITE);
+#else
+    pthread_cond_wait(cond, mutex);
+#endif
+}
+
+void cond_broadcast(AscCond* cond) {
+#ifdef _WIN32
+    WakeAllConditionVariable(cond);
+#else
+    pthread_cond_broadcast(cond);
+#endif
+}
+
+void cond_destroy(AscCond* cond) {
+#ifdef _WIN32
+    (void)cond;
+#else
+    pthread_cond_destroy(cond);
+#endif
+}
+
+bool thread_start(AscThread* thread, ThreadFunction function, void* arg) {
+#ifdef _WIN32
+    *thread = CreateThread(NULL, 0, function, arg, 0, NULL);
+    return *thread != NULL;
+#else
+    return pthread_create(thread, NULL, function, arg) == 0;
+#endif
+}
+
+void thread_join(AscThread thread) {
+#ifdef _WIN32
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+}
+
+int cpu_count(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+#endif
+}
+
+// Called on the main thread before the first worker thread starts
+#ifdef _WIN32
+static BOOL CALLBACK init_thread_locks(PINIT_ONCE once, PVOID parameter, PVOID* context) {
+    (void)once;
+    (void)parameter;
+    (void)context;
+#else
+static void init_thread_locks(void) {
+#endif
+    mutex_init(&mem_lock);
+    mutex_init(&tooling_lock);
+    mutex_init(&lazy_lock);
+    threads_enabled = true;
+#ifdef _WIN32
+    return TRUE;
+#endif
+}
+
+// Safe to call from several threads at once
+void enable_threads(void) {
+#ifdef _WIN32
+    static INIT_ONCE once = INIT_ONCE_STATIC_INIT;
+    InitOnceExecuteOnce(&once, init_thread_locks, NULL, NULL);
+#else
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, init_thread_locks);
+#endif
+}
+
+void shared_lock(AscMutex* mutex) {
+    if (threads_enabled) {
+        mutex_lock(mutex);
+    }
+}
+
+void shared_unlock(AscMutex* mutex) {
+    if (threads_enabled) {
+        mutex_unlock(mutex);
+    }
+}
+
+// Tagged allocation wrappers
+// The shared heap is locked once threads are enabled; an interpreter heap is
+// only touched by the thread running that interpreter
+static void mem_stats_add(MemStats* mem_stats, MemTag tag, int64_t bytes) {
+    MemTagStats* stats = &mem_stats->tags[tag];
+
+    stats->live_bytes += bytes;
+    if (stats->live_bytes > stats->peak_live_bytes) {
+        stats->peak_live_bytes = stats->live_bytes;
+    }
+
+    mem_stats->live_bytes += bytes;
+    if (mem_stats->live_bytes > mem_stats->peak_live_bytes) {
+        mem_stats->peak_live_bytes = mem_stats->live_bytes;
+    }
+}
+
+static Heap* heap_for_tag(MemTag tag) {
+    if (current_heap == NULL) {
+        return &shared_heap;
+    }
+
+    switch (tag) {
+    case MEM_SCOPE:
+    case MEM_CLOSURE:
+    case MEM_STRING:
+    case MEM_ARRAY:
+    case MEM_MAP:
+    case MEM_CALL:
+    case MEM_RUNTIME:
+        return current_heap;
+    default:
+        return &shared_heap;
+    }
+}
+
+static void heap_lock(Heap* heap) {
+    if (heap->shared) {
+        shared_lock(&mem_lock);
+    }
+}
+
+static void heap_unlock(Heap* heap) {
+    if (heap->shared) {
+        shared_unlock(&mem_lock);
+    }
+}
+
+static void link_block(Heap* heap, MemHeader* header) {
+    header->info.prev = NULL;
+    header->info.next = heap->shared ? NULL : heap->blocks;
+
+    if (header->info.next) {
+        header->info.next->info.prev = header;
+    }
+
+    if (!heap->shared) {
+        heap->blocks = header;
+    }
+}
+
+static void unlink_block(Heap* heap, MemHeader* header) {
+    if (heap->shared) {
+        return;
+    }
+
+    if (header->info.prev) {
+        header->info.prev->info.next = header->info.next;
+    }
+    else {
+        heap->blocks = header->info.next;
+    }
+
+    if (header->info.next) {
+        header->info.next->info.prev = header->info.prev;
+    }
+}
+
+void* asc_malloc(size_t size, MemTag tag) {
+    MemHeader* header = (MemHeader*)malloc(sizeof(MemHeader) + size);
+    if (!header) {
+        return NULL;
+    }
+
+    Heap* heap = heap_for_tag(tag);
+    header->info.size = size;
+    header->info.tag = tag;
+    header->info.heap = heap;
+
+    heap_lock(heap);
+    link_block(heap, header);
+    heap->stats.tags[tag].allocations++;
+    heap->stats.tags[tag].bytes_allocated += size;
+    mem_stats_add(&heap->stats, tag, (int64_t)size);
+    heap_unlock(heap);
+
+    return header + 1;
+}
+
+void* asc_calloc(size_t count, size_t size, MemTag tag) {
+    void* ptr = asc_malloc(count * size, tag);
+    if (ptr) {
+        memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+// A block keeps the heap and tag it was first allocated with
+void* asc_realloc(void* ptr, size_t size, MemTag tag) {
+    if (ptr == NULL) {
+        return asc_malloc(size, tag);
+    }
+
+    MemHeader* header = (MemHeader*)ptr - 1;
+    size_t old_size = header->info.size;
+    Heap* heap = header->info.heap;
+    tag = header->info.tag;
+
+    // The neighbours in the block list point at the header, which may move
+    heap_lock(heap);
+    unlink_block(heap, header);
+
+    MemHeader* moved = (MemHeader*)realloc(header, sizeof(MemHeader) + size);
+    if (!moved) {
+        link_block(heap, header);
+        heap_unlock(heap);
+        return NULL;
+    }
+
+    moved->info.size = size;
+    link_block(heap, moved);
+
+    heap->stats.tags[tag].reallocations++;
+    if (size > old_size) {
+        heap->stats.tags[tag].bytes_allocated += size - old_size;
+    }
+    mem_stats_add(&heap->stats, tag, (int64_t)size - (int64_t)old_size);
+    heap_unlock(heap);
+
+    return moved + 1;
+}
+
+// String duplication (strdup is not available in all C standard libraries)
+char* asc_strdup(const char* str, MemTag tag) {
+    size_t len = strlen(str) + 1;
+    char* new_str = (char*)asc_malloc(len, tag);
+    if (new_str) {
+        memcpy(new_str, str, len);
+    }
+    return new_str;
+}
+
+void asc_free(void* ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+
+    MemHeader* header = (MemHeader*)ptr - 1;
+    Heap* heap = header->info.heap;
+
+    heap_lock(heap);
+    unlink_block(heap, header);
+    heap->stats.tags[header->info.tag].frees++;
+    mem_stats_add(&heap->stats, header->info.tag, -(int64_t)header->info.size);
+    heap_unlock(heap);
+
+    free(header);
+}
+
+// Makes heap the one new interpreter allocations on this thread are charged
+// to, and returns the previous one. NULL charges everything to the shared heap.
+Heap* use_heap(Heap* heap) {
+    Heap* previous = current_heap;
+    current_heap = heap;
+    return previous;
+}
+
+// Frees every block still on an interpreter heap and adds its totals to
+// released_heap_stats
+void release_heap(Heap* heap) {
+    uint64_t blocks = 0;
+
+    while (heap->blocks) {
+        MemHeader* header = heap->blocks;
+        heap->blocks = header->info.next;
+        mem_stats_add(&heap->stats, header->info.tag, -(int64_t)header->info.size);
+        free(header);
+        blocks++;
+    }
+
+    shared_lock(&mem_lock);
+    for (int i = 0; i < MEM_TAG_COUNT; i++) {
+        MemTagStats* from = &heap->stats.tags[i];
+        MemTagStats* to = &released_heap_stats.tags[i];
+
+        to->allocations += from->allocations;
+        to->reallocations += from->reallocations;
+        to->frees += from->frees;
+        to->bytes_allocated += from->bytes_allocated;
+        if (from->peak_live_bytes > to->peak_live_bytes) {
+            to->peak_live_bytes = from->peak_live_bytes;
+        }
+    }
+
+    if (heap->stats.peak_live_bytes > released_heap_stats.peak_live_bytes) {
+        released_heap_stats.peak_live_bytes = heap->stats.peak_live_bytes;
+    }
+    reclaimed_blocks += blocks;
+    shared_unlock(&mem_lock);
+
+    memset(&heap->stats, 0, sizeof(heap->stats));
+}
+
+static void print_mem_table(const MemStats* mem_stats) {
+    static const char* tag_names[MEM_TAG_COUNT] = {
+        "tokens", "ast", "scopes", "closures", "strings", "arrays",
+        "maps", "calls", "imports", "source", "runtime", "tooling"
+    };
+
+    MemTagStats total = { 0 };
+
+    fprintf(stderr, "%-10s %12s %10s %12s %14s %12s %12s\n",
+        "category", "allocs", "reallocs", "frees", "bytes", "live", "peak live");
+
+    for (int i = 0; i < MEM_TAG_COUNT; i++) {
+        const MemTagStats* stats = &mem_stats->tags[i];
+
+        fprintf(stderr, "%-10s %12llu %10llu %12llu %14llu %12lld %12lld\n",
+            tag_names[i],
+            (unsigned long long)stats->allocations,
+            (unsigned long long)stats->reallocations,
+            (unsigned long long)stats->frees,
+            (unsigned long long)stats->bytes_allocated,
+            (long long)stats->live_bytes,
+            (long long)stats->peak_live_bytes);
+
+        total.allocations += stats->allocations;
+        total.reallocations += stats->reallocations;
+        total.frees += stats->frees;
+        total.bytes_allocated += stats->bytes_allocated;
+    }
+
+    fprintf(stderr, "%-10s %12llu %10llu %12llu %14llu %12lld %12lld\n",
+        "total",
+        (unsigned long long)total.allocations,
+        (unsigned long long)total.reallocations,
+        (unsigned long long)total.frees,
+        (unsigned long long)total.bytes_allocated,
+        (long long)mem_stats->live_bytes,
+        (long long)mem_stats->peak_live_bytes);
+}
+
+void print_mem_stats(void) {
+    fprintf(stderr, "\nShared memory (peak live %.1f KiB, live at exit %.1f KiB)\n",
+        shared_heap.stats.peak_live_bytes / 1024.0, shared_heap.stats.live_bytes / 1024.0);
+    print_mem_table(&shared_heap.stats);
+
+    // Blocks left on an interpreter heap are not counted as frees
+    fprintf(stderr, "\nInterpreter memory (peak live %.1f KiB, %llu blocks reclaimed with the heap)\n",
+        released_heap_stats.peak_live_bytes / 1024.0, (unsigned long long)reclaimed_blocks);
+    print_mem_table(&released_heap_stats);
+}
+
+// Unwinds to error_trap with the message in error_message, or prints it and exits
+static ASC_NORETURN void raise_error(int kind) {
+    if (error_trap != NULL) {
+        longjmp(*error_trap, kind);
+    }
+
+    fputs(error_message, stderr);
+    exit(1);
+}
+
+// Reports a lexer or parser error
+ASC_NORETURN void syntax_error(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(error_message, sizeof(error_message), format, args);
+    va_end(args);
+    raise_error(ERROR_SYNTAX);
+}
+
+// Reports an evaluation error
+ASC_NORETURN void runtime_error(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(error_message, sizeof(error_message), format, args);
+    va_end(args);
+    raise_error(ERROR_RUNTIME);
+}
+
+// Output buffer implementation
+void init_output(OutputBuffer* output) {
+    output->data = (char*)asc_malloc(OUTPUT_BUFFER_SIZE, MEM_RUNTIME);
+    if (!output->data) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    output->length = 0;
+    output->stream = NULL;
+}
+
+#ifndef _WIN32
+// Writes every vector, continuing after partial writes. Output that cannot
+// be written, for example to a closed pipe, is dropped.
+static void write_vectors(int fd, struct iovec* vectors, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, vectors, count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+
+        while (count > 0 && (size_t)written >= vectors->iov_len) {
+            written -= (ssize_t)vectors->iov_len;
+            vectors++;
+            count--;
+        }
+
+        if (count > 0) {
+            vectors->iov_base = (char*)vectors->iov_base + written;
+            vectors->iov_len -= (size_t)written;
+        }
+    }
+}
+#endif
+
+// Writes the buffer followed by extra, with one system call where possible
+static void send_output(OutputBuffer* output, const char* extra, size_t extra_length) {
+    FILE* stream = output->stream ? output->stream : stdout;
+
+    // Anything written to the stream through stdio goes first
+    fflush(stream);
+
+#ifndef _WIN32
+    int fd = fileno(stream);
+    if (fd >= 0) {
+        struct iovec vectors[2];
+        vectors[0].iov_base = output->data;
+        vectors[0].iov_len = output->length;
+        vectors[1].iov_base = (void*)extra;
+        vectors[1].iov_len = extra_length;
+
+        write_vectors(fd, vectors, 2);
+        output->length = 0;
+        return;
+    }
+#endif
+
+    fwrite(output->data, 1, output->length, stream);
+    fwrite(extra, 1, extra_length, stream);
+    fflush(stream);
+    output->length = 0;
+}
+
+void output_write(OutputBuffer* output, const char* data, size_t length) {
+    if (output->length + length > OUTPUT_BUFFER_SIZE) {
+        // A write that would not fit goes out together with the buffer
+        if (length >= OUTPUT_BUFFER_SIZE / 2) {
+            send_output(output, data, length);
+            return;
+        }
+
+        send_output(output, NULL, 0);
+    }
+
+    memcpy(output->data + output->length, data, length);
+    output->length += length;
+}
+
+void output_flush(OutputBuffer* output) {
+    if (output->length > 0) {
+        send_output(output, NULL, 0);
+    }
+}
+
+void free_output(OutputBuffer* output) {
+    output_flush(output);
+    asc_free(output->data);
+    output->data = NULL;
+}
+
+// Number formatting implementation
+// Numbers are printed with the fewest digits that read back as the same
+// double, using the Ryu algorithm (Ulf Adams, PLDI 2018). The tables hold
+// 5^i and 2^k / 5^i rounded to 125 significant bits, low word first.
+#define DOUBLE_MANTISSA_BITS 52
+#define DOUBLE_EXPONENT_BITS 11
+#define DOUBLE_BIAS 1023
+#define DOUBLE_POW5_INV_BITCOUNT 125
+#define DOUBLE_POW5_BITCOUNT 125
+#define DOUBLE_POW5_INV_TABLE_SIZE 342
+#define DOUBLE_POW5_TABLE_SIZE 326
+
+static const uint64_t DOUBLE_POW5_INV_SPLIT[DOUBLE_POW5_INV_TABLE_SIZE][2] = {
+    { 1u, 2305843009213693952u }, { 11068046444225730970u, 1844674407370955161u },
+    { 5165088340638674453u, 1475739525896764129u }, { 7821419487252849886u, 1180591620717411303u },
+    { 8824922364862649494u, 1888946593147858085u }, { 7059937891890119595u, 1511157274518286468u },
+    { 13026647942995916322u, 1208925819614629174u }, { 9774590264567735146u, 1934281311383406679u },
+    { 11509021026396098440u, 1547425049106725343u }, { 16585914450600699399u, 1237940039285380274u },
+    { 15469416676735388068u, 1980704062856608439u }, { 16064882156130220778u, 1584563250285286751u },
+    { 9162556910162266299u, 1267650600228229401u }, { 7281393426775805432u, 2028240960365167042u },
+    { 16893161185646375315u, 1622592768292133633u }, { 2446482504291369283u, 1298074214633706907u },
+    { 7603720821608101175u, 2076918743413931051u }, { 2393627842544570617u, 1661534994731144841u },
+    { 16672297533003297786u, 1329227995784915872u }, { 11918280793837635165u, 2126764793255865396u },
+    { 5845275820328197809u, 1701411834604692317u }, { 15744267100488289217u, 1361129467683753853u },
+    { 3054734472329800808u, 2177807148294006166u }, { 17201182836831481939u, 1742245718635204932u },
+    { 6382248639981364905u, 1393796574908163946u }, { 2832900194486363201u, 2230074519853062314u },
+    { 5955668970331000884u, 1784059615882449851u }, { 1075186361522890384u, 1427247692705959881u },
+    { 12788344622662355584u, 2283596308329535809u }, { 13920024512871794791u, 1826877046663628647u },
+    { 3757321980813615186u, 1461501637330902918u }, { 10384555214134712795u, 1169201309864722334u },
+    { 5547241898389809503u, 1870722095783555735u }, { 4437793518711847602u, 1496577676626844588u },
+    { 10928932444453298728u, 1197262141301475670u }, { 17486291911125277965u, 1915619426082361072u },
+    { 6610335899416401726u, 1532495540865888858u }, { 12666966349016942027u, 1225996432692711086u },
+    { 12888448528943286597u, 1961594292308337738u }, { 17689456452638449924u, 1569275433846670190u },
+    { 14151565162110759939u, 1255420347077336152u }, { 7885109000409574610u, 2008672555323737844u },
+    { 9997436015069570011u, 1606938044258990275u }, { 7997948812055656009u, 1285550435407192220u },
+    { 12796718099289049614u, 2056880696651507552u }, { 2858676849947419045u, 1645504557321206042u },
+    { 13354987924183666206u, 1316403645856964833u }, { 17678631863951955605u, 2106245833371143733u },
+    { 3074859046935833515u, 1684996666696914987u }, { 13527933681774397782u, 1347997333357531989u },
+    { 10576647446613305481u, 2156795733372051183u }, { 15840015586774465031u, 1725436586697640946u },
+    { 8982663654677661702u, 1380349269358112757u }, { 18061610662226169046u, 2208558830972980411u },
+    { 10759939715039024913u, 1766847064778384329u }, { 12297300586773130254u, 1413477651822707463u },
+    { 15986332124095098083u, 2261564242916331941u }, { 9099716884534168143u, 1809251394333065553u },
+    { 14658471137111155161u, 1447401115466452442u }, { 4348079280205103483u, 1157920892373161954u },
+    { 14335624477811986218u, 1852673427797059126u }, { 7779150767507678651u, 1482138742237647301u },
+    { 2533971799264232598u, 1185710993790117841u }, { 15122401323048503126u, 1897137590064188545u },
+    { 12097921058438802501u, 1517710072051350836u }, { 5988988032009131678u, 1214168057641080669u },
+    { 16961078480698431330u, 1942668892225729070u }, { 13568862784558745064u, 1554135113780583256u },
+    { 7165741412905085728u, 1243308091024466605u }, { 11465186260648137165u, 1989292945639146568u },
+    { 16550846638002330379u, 1591434356511317254u }, { 16930026125143774626u, 1273147485209053803u },
+    { 4951948911778577463u, 2037035976334486086u }, { 272210314680951647u, 1629628781067588869u },
+    { 3907117066486671641u, 1303703024854071095u }, { 6251387306378674625u, 2085924839766513752u },
+    { 16069156289328670670u, 1668739871813211001u }, { 9165976216721026213u, 1334991897450568801u },
+    { 7286864317269821294u, 2135987035920910082u }, { 16897537898041588005u, 1708789628736728065u },
+    { 13518030318433270404u, 1367031702989382452u }, { 6871453250525591353u, 2187250724783011924u },
+    { 9186511415162383406u, 1749800579826409539u }, { 11038557946871817048u, 1399840463861127631u },
+    { 10282995085511086630u, 2239744742177804210u }, { 8226396068408869304u, 1791795793742243368u },
+    { 13959814484210916090u, 1433436634993794694u }, { 11267656730511734774u, 2293498615990071511u },
+    { 5324776569667477496u, 1834798892792057209u }, { 7949170070475892320u, 1467839114233645767u },
+    { 17427382500606444826u, 1174271291386916613u }, { 5747719112518849781u, 1878834066219066582u },
+    { 15666221734240810795u, 1503067252975253265u }, { 12532977387392648636u, 1202453802380202612u },
+    { 5295368560860596524u, 1923926083808324180u }, { 4236294848688477220u, 1539140867046659344u },
+    { 7078384693692692099u, 1231312693637327475u }, { 11325415509908307358u, 1970100309819723960u },
+    { 9060332407926645887u, 1576080247855779168u }, { 14626963555825137356u, 1260864198284623334u },
+    { 12335095245094488799u, 2017382717255397335u }, { 9868076196075591040u, 1613906173804317868u },
+    { 15273158586344293478u, 1291124939043454294u }, { 13369007293925138595u, 2065799902469526871u },
+    { 7005857020398200553u, 1652639921975621497u }, { 16672732060544291412u, 1322111937580497197u },
+    { 11918976037903224966u, 2115379100128795516u }, { 5845832015580669650u, 1692303280103036413u },
+    { 12055363241948356366u, 1353842624082429130u }, { 841837113407818570u, 2166148198531886609u },
+    { 4362818505468165179u, 1732918558825509287u }, { 14558301248600263113u, 1386334847060407429u },
+    { 12225235553534690011u, 2218135755296651887u }, { 2401490813343931363u, 1774508604237321510u },
+    { 1921192650675145090u, 1419606883389857208u }, { 17831303500047873437u, 2271371013423771532u },
+    { 6886345170554478103u, 1817096810739017226u }, { 1819727321701672159u, 1453677448591213781u },
+    { 16213177116328979020u, 1162941958872971024u }, { 14873036941900635463u, 1860707134196753639u },
+    { 15587778368262418694u, 1488565707357402911u }, { 8780873879868024632u, 1190852565885922329u },
+    { 2981351763563108441u, 1905364105417475727u }, { 13453127855076217722u, 1524291284333980581u },
+    { 7073153469319063855u, 1219433027467184465u }, { 11317045550910502167u, 1951092843947495144u },
+    { 12742985255470312057u, 1560874275157996115u }, { 10194388204376249646u, 1248699420126396892u },
+    { 1553625868034358140u, 1997919072202235028u }, { 8621598323911307159u, 1598335257761788022u },
+    { 17965325103354776697u, 1278668206209430417u }, { 13987124906400001422u, 2045869129935088668u },
+    { 121653480894270168u, 1636695303948070935u }, { 97322784715416134u, 1309356243158456748u },
+    { 14913111714512307107u, 2094969989053530796u }, { 8241140556867935363u, 1675975991242824637u },
+    { 17660958889720079260u, 1340780792994259709u }, { 17189487779326395846u, 2145249268790815535u },
+    { 13751590223461116677u, 1716199415032652428u }, { 18379969808252713988u, 1372959532026121942u },
+    { 14650556434236701088u, 2196735251241795108u }, { 652398703163629901u, 1757388200993436087u },
+    { 11589965406756634890u, 1405910560794748869u }, { 7475898206584884855u, 2249456897271598191u },
+    { 2291369750525997561u, 1799565517817278553u }, { 9211793429904618695u, 1439652414253822842u },
+    { 18428218302589300235u, 2303443862806116547u }, { 7363877012587619542u, 1842755090244893238u },
+    { 13269799239553916280u, 1474204072195914590u }, { 10615839391643133024u, 1179363257756731672u },
+    { 2227947767661371545u, 1886981212410770676u }, { 16539753473096738529u, 1509584969928616540u },
+    { 13231802778477390823u, 1207667975942893232u }, { 6413489186596184024u, 1932268761508629172u },
+    { 16198837793502678189u, 1545815009206903337u }, { 5580372605318321905u, 1236652007365522670u },
+    { 8928596168509315048u, 1978643211784836272u }, { 18210923379033183008u, 1582914569427869017u },
+    { 7190041073742725760u, 1266331655542295214u }, { 436019273762630246u, 2026130648867672343u },
+    { 7727513048493924843u, 1620904519094137874u }, { 9871359253537050198u, 1296723615275310299u },
+    { 4726128361433549347u, 2074757784440496479u }, { 7470251503888749801u, 1659806227552397183u },
+    { 13354898832594820487u, 1327844982041917746u }, { 13989140502667892133u, 2124551971267068394u },
+    { 14880661216876224029u, 1699641577013654715u }, { 11904528973500979224u, 1359713261610923772u },
+    { 4289851098633925465u, 2175541218577478036u }, { 18189276137874781665u, 1740432974861982428u },
+    { 3483374466074094362u, 1392346379889585943u }, { 1884050330976640656u, 2227754207823337509u },
+    { 5196589079523222848u, 1782203366258670007u }, { 15225317707844309248u, 1425762693006936005u },
+    { 5913764258841343181u, 2281220308811097609u }, { 8420360221814984868u, 1824976247048878087u },
+    { 17804334621677718864u, 1459980997639102469u }, { 17932816512084085415u, 1167984798111281975u },
+    { 10245762345624985047u, 1868775676978051161u }, { 4507261061758077715u, 1495020541582440929u },
+    { 7295157664148372495u, 1196016433265952743u }, { 7982903447895485668u, 1913626293225524389u },
+    { 10075671573058298858u, 1530901034580419511u }, { 4371188443704728763u, 1224720827664335609u },
+    { 14372599139411386667u, 1959553324262936974u }, { 15187428126271019657u, 1567642659410349579u },
+    { 15839291315758726049u, 1254114127528279663u }, { 3206773216762499739u, 2006582604045247462u },
+    { 13633465017635730761u, 1605266083236197969u }, { 14596120828850494932u, 1284212866588958375u },
+    { 4907049252451240275u, 2054740586542333401u }, { 236290587219081897u, 1643792469233866721u },
+    { 14946427728742906810u, 1315033975387093376u }, { 16535586736504830250u, 2104054360619349402u },
+    { 5849771759720043554u, 1683243488495479522u }, { 15747863852001765813u, 1346594790796383617u },
+    { 10439186904235184007u, 2154551665274213788u }, { 15730047152871967852u, 1723641332219371030u },
+    { 12584037722297574282u, 1378913065775496824u }, { 9066413911450387881u, 2206260905240794919u },
+    { 10942479943902220628u, 1765008724192635935u }, { 8753983955121776503u, 1412006979354108748u },
+    { 10317025513452932081u, 2259211166966573997u }, { 874922781278525018u, 1807368933573259198u },
+    { 8078635854506640661u, 1445895146858607358u }, { 13841606313089133175u, 1156716117486885886u },
+    { 14767872471458792434u, 1850745787979017418u }, { 746251532941302978u, 1480596630383213935u },
+    { 597001226353042382u, 1184477304306571148u }, { 15712597221132509104u, 1895163686890513836u },
+    { 8880728962164096960u, 1516130949512411069u }, { 10793931984473187891u, 1212904759609928855u },
+    { 17270291175157100626u, 1940647615375886168u }, { 2748186495899949531u, 1552518092300708935u },
+    { 2198549196719959625u, 1242014473840567148u }, { 18275073973719576693u, 1987223158144907436u },
+    { 10930710364233751031u, 1589778526515925949u }, { 12433917106128911148u, 1271822821212740759u },
+    { 8826220925580526867u, 2034916513940385215u }, { 7060976740464421494u, 1627933211152308172u },
+    { 16716827836597268165u, 1302346568921846537u }, { 11989529279587987770u, 2083754510274954460u },
+    { 9591623423670390216u, 1667003608219963568u }, { 15051996368420132820u, 1333602886575970854u },
+    { 13015147745246481542u, 2133764618521553367u }, { 3033420566713364587u, 1707011694817242694u },
+    { 6116085268112601993u, 1365609355853794155u }, { 9785736428980163188u, 2184974969366070648u },
+    { 15207286772667951197u, 1747979975492856518u }, { 1097782973908629988u, 1398383980394285215u },
+    { 1756452758253807981u, 2237414368630856344u }, { 5094511021344956708u, 1789931494904685075u },
+    { 4075608817075965366u, 1431945195923748060u }, { 6520974107321544586u, 2291112313477996896u },
+    { 1527430471115325346u, 1832889850782397517u }, { 12289990821117991246u, 1466311880625918013u },
+    { 17210690286378213644u, 1173049504500734410u }, { 9090360384495590213u, 1876879207201175057u },
+    { 18340334751822203140u, 1501503365760940045u }, { 14672267801457762512u, 1201202692608752036u },
+    { 16096930852848599373u, 1921924308174003258u }, { 1809498238053148529u, 1537539446539202607u },
+    { 12515645034668249793u, 1230031557231362085u }, { 1578287981759648052u, 1968050491570179337u },
+    { 12330676829633449412u, 1574440393256143469u }, { 13553890278448669853u, 1259552314604914775u },
+    { 3239480371808320148u, 2015283703367863641u }, { 17348979556414297411u, 1612226962694290912u },
+    { 6500486015647617283u, 1289781570155432730u }, { 10400777625036187652u, 2063650512248692368u },
+    { 15699319729512770768u, 1650920409798953894u }, { 16248804598352126938u, 1320736327839163115u },
+    { 7551343283653851484u, 2113178124542660985u }, { 6041074626923081187u, 1690542499634128788u },
+    { 12211557331022285596u, 1352433999707303030u }, { 1091747655926105338u, 2163894399531684849u },
+    { 4562746939482794594u, 1731115519625347879u }, { 7339546366328145998u, 1384892415700278303u },
+    { 8053925371383123274u, 2215827865120445285u }, { 6443140297106498619u, 1772662292096356228u },
+    { 12533209867169019542u, 1418129833677084982u }, { 5295740528502789974u, 2269007733883335972u },
+    { 15304638867027962949u, 1815206187106668777u }, { 4865013464138549713u, 1452164949685335022u },
+    { 14960057215536570740u, 1161731959748268017u }, { 9178696285890871890u, 1858771135597228828u },
+    { 14721654658196518159u, 1487016908477783062u }, { 4398626097073393881u, 1189613526782226450u },
+    { 7037801755317430209u, 1903381642851562320u }, { 5630241404253944167u, 1522705314281249856u },
+    { 814844308661245011u, 1218164251424999885u }, { 1303750893857992017u, 1949062802279999816u },
+    { 15800395974054034906u, 1559250241823999852u }, { 5261619149759407279u, 1247400193459199882u },
+    { 12107939454356961969u, 1995840309534719811u }, { 5997002748743659252u, 1596672247627775849u },
+    { 8486951013736837725u, 1277337798102220679u }, { 2511075177753209390u, 2043740476963553087u },
+    { 13076906586428298482u, 1634992381570842469u }, { 14150874083884549109u, 1307993905256673975u },
+    { 4194654460505726958u, 2092790248410678361u }, { 18113118827372222859u, 1674232198728542688u },
+    { 3422448617672047318u, 1339385758982834151u }, { 16543964232501006678u, 2143017214372534641u },
+    { 9545822571258895019u, 1714413771498027713u }, { 15015355686490936662u, 1371531017198422170u },
+    { 5577825024675947042u, 2194449627517475473u }, { 11840957649224578280u, 1755559702013980378u },
+    { 16851463748863483271u, 1404447761611184302u }, { 12204946739213931940u, 2247116418577894884u },
+    { 13453306206113055875u, 1797693134862315907u }, { 3383947335406624054u, 1438154507889852726u },
+    { 16482362180876329456u, 2301047212623764361u }, { 9496540929959153242u, 1840837770099011489u },
+    { 11286581558709232917u, 1472670216079209191u }, { 5339916432225476010u, 1178136172863367353u },
+    { 4854517476818851293u, 1885017876581387765u }, { 3883613981455081034u, 1508014301265110212u },
+    { 14174937629389795797u, 1206411441012088169u }, { 11611853762797942306u, 1930258305619341071u },
+    { 5600134195496443521u, 1544206644495472857u }, { 15548153800622885787u, 1235365315596378285u },
+    { 6430302007287065643u, 1976584504954205257u }, { 16212288050055383484u, 1581267603963364205u },
+    { 12969830440044306787u, 1265014083170691364u }, { 9683682259845159889u, 2024022533073106183u },
+    { 15125643437359948558u, 1619218026458484946u }, { 8411165935146048523u, 1295374421166787957u },
+    { 17147214310975587960u, 2072599073866860731u }, { 10028422634038560045u, 1658079259093488585u },
+    { 8022738107230848036u, 1326463407274790868u }, { 9147032156827446534u, 2122341451639665389u },
+    { 11006974540203867551u, 1697873161311732311u }, { 5116230817421183718u, 1358298529049385849u },
+    { 15564666937357714594u, 2173277646479017358u }, { 1383687105660440706u, 1738622117183213887u },
+    { 12174996128754083534u, 1390897693746571109u }, { 8411947361780802685u, 2225436309994513775u },
+    { 6729557889424642148u, 1780349047995611020u }, { 5383646311539713719u, 1424279238396488816u },
+    { 1235136468979721303u, 2278846781434382106u }, { 15745504434151418335u, 1823077425147505684u },
+    { 16285752362063044992u, 1458461940118004547u }, { 5649904260166615347u, 1166769552094403638u },
+    { 5350498001524674232u, 1866831283351045821u }, { 591049586477829062u, 1493465026680836657u },
+    { 11540886113407994219u, 1194772021344669325u }, { 18673707743239135u, 1911635234151470921u },
+    { 14772334225162232601u, 1529308187321176736u }, { 8128518565387875758u, 1223446549856941389u },
+    { 1937583260394870242u, 1957514479771106223u }, { 8928764237799716840u, 1566011583816884978u },
+    { 14521709019723594119u, 1252809267053507982u }, { 8477339172590109297u, 2004494827285612772u },
+    { 17849917782297818407u, 1603595861828490217u }, { 6901236596354434079u, 1282876689462792174u },
+    { 18420676183650915173u, 2052602703140467478u }, { 3668494502695001169u, 1642082162512373983u },
+    { 10313493231639821582u, 1313665730009899186u }, { 9122891541139893884u, 2101865168015838698u },
+    { 14677010862395735754u, 1681492134412670958u }, { 673562245690857633u, 1345193707530136767u }
+};
+
+static const uint64_t DOUBLE_POW5_SPLIT[DOUBLE_POW5_TABLE_SIZE][2] = {
+    { 0u, 1152921504606846976u }, { 0u, 1441151880758558720u },
+    { 0u, 1801439850948198400u }, { 0u, 2251799813685248000u },
+    { 0u, 1407374883553280000u }, { 0u, 1759218604441600000u },
+    { 0u, 2199023255552000000u }, { 0u, 1374389534720000000u },
+    { 0u, 1717986918400000000u }, { 0u, 2147483648000000000u },
+    { 0u, 1342177280000000000u }, { 0u, 1677721600000000000u },
+    { 0u, 2097152000000000000u }, { 0u, 1310720000000000000u },
+    { 0u, 1638400000000000000u }, { 0u, 2048000000000000000u },
+    { 0u, 1280000000000000000u }, { 0u, 1600000000000000000u },
+    { 0u, 2000000000000000000u }, { 0u, 1250000000000000000u },
+    { 0u, 1562500000000000000u }, { 0u, 1953125000000000000u },
+    { 0u, 1220703125000000000u }, { 0u, 1525878906250000000u },
+    { 0u, 1907348632812500000u }, { 0u, 1192092895507812500u },
+    { 0u, 1490116119384765625u }, { 4611686018427387904u, 1862645149230957031u },
+    { 9799832789158199296u, 1164153218269348144u }, { 12249790986447749120u, 1455191522836685180u },
+    { 15312238733059686400u, 1818989403545856475u }, { 14528612397897220096u, 2273736754432320594u },
+    { 13692068767113150464u, 1421085471520200371u }, { 12503399940464050176u, 1776356839400250464u },
+    { 15629249925580062720u, 2220446049250313080u }, { 9768281203487539200u, 1387778780781445675u },
+    { 7598665485932036096u, 1734723475976807094u }, { 274959820560269312u, 2168404344971008868u },
+    { 9395221924704944128u, 1355252715606880542u }, { 2520655369026404352u, 1694065894508600678u },
+    { 12374191248137781248u, 2117582368135750847u }, { 14651398557727195136u, 1323488980084844279u },
+    { 13702562178731606016u, 1654361225106055349u }, { 3293144668132343808u, 2067951531382569187u },
+    { 18199116482078572544u, 1292469707114105741u }, { 8913837547316051968u, 1615587133892632177u },
+    { 15753982952572452864u, 2019483917365790221u }, { 12152082354571476992u, 1262177448353618888u },
+    { 15190102943214346240u, 1577721810442023610u }, { 9764256642163156992u, 1972152263052529513u },
+    { 17631875447420442880u, 1232595164407830945u }, { 8204786253993389888u, 1540743955509788682u },
+    { 1032610780636961552u, 1925929944387235853u }, { 2951224747111794922u, 1203706215242022408u },
+    { 3689030933889743652u, 1504632769052528010u }, { 13834660704216955373u, 1880790961315660012u },
+    { 17870034976990372916u, 1175494350822287507u }, { 17725857702810578241u, 1469367938527859384u },
+    { 3710578054803671186u, 1836709923159824231u }, { 26536550077201078u, 2295887403949780289u },
+    { 11545800389866720434u, 1434929627468612680u }, { 14432250487333400542u, 1793662034335765850u },
+    { 8816941072311974870u, 2242077542919707313u }, { 17039803216263454053u, 1401298464324817070u },
+    { 12076381983474541759u, 1751623080406021338u }, { 5872105442488401391u, 2189528850507526673u },
+    { 15199280947623720629u, 1368455531567204170u }, { 9775729147674874978u, 1710569414459005213u },
+    { 16831347453020981627u, 2138211768073756516u }, { 1296220121283337709u, 1336382355046097823u },
+    { 15455333206886335848u, 1670477943807622278u }, { 10095794471753144002u, 2088097429759527848u },
+    { 6309871544845715001u, 1305060893599704905u }, { 12499025449484531656u, 1631326116999631131u },
+    { 11012095793428276666u, 2039157646249538914u }, { 11494245889320060820u, 1274473528905961821u },
+    { 532749306367912313u, 1593091911132452277u }, { 5277622651387278295u, 1991364888915565346u },
+    { 7910200175544436838u, 1244603055572228341u }, { 14499436237857933952u, 1555753819465285426u },
+    { 8900923260467641632u, 1944692274331606783u }, { 12480606065433357876u, 1215432671457254239u },
+    { 10989071563364309441u, 1519290839321567799u }, { 9124653435777998898u, 1899113549151959749u },
+    { 8008751406574943263u, 1186945968219974843u }, { 5399253239791291175u, 1483682460274968554u },
+    { 15972438586593889776u, 1854603075343710692u }, { 759402079766405302u, 1159126922089819183u },
+    { 14784310654990170340u, 1448908652612273978u }, { 9257016281882937117u, 1811135815765342473u },
+    { 16182956370781059300u, 2263919769706678091u }, { 7808504722524468110u, 1414949856066673807u },
+    { 5148944884728197234u, 1768687320083342259u }, { 1824495087482858639u, 2210859150104177824u },
+    { 1140309429676786649u, 1381786968815111140u }, { 1425386787095983311u, 1727233711018888925u },
+    { 6393419502297367043u, 2159042138773611156u }, { 13219259225790630210u, 1349401336733506972u },
+    { 16524074032238287762u, 1686751670916883715u }, { 16043406521870471799u, 2108439588646104644u },
+    { 803757039314269066u, 1317774742903815403u }, { 14839754354425000045u, 1647218428629769253u },
+    { 4714634887749086344u, 2059023035787211567u }, { 9864175832484260821u, 1286889397367007229u },
+    { 16941905809032713930u, 1608611746708759036u }, { 2730638187581340797u, 2010764683385948796u },
+    { 10930020904093113806u, 1256727927116217997u }, { 18274212148543780162u, 1570909908895272496u },
+    { 4396021111970173586u, 1963637386119090621u }, { 5053356204195052443u, 1227273366324431638u },
+    { 15540067292098591362u, 1534091707905539547u }, { 14813398096695851299u, 1917614634881924434u },
+    { 13870059828862294966u, 1198509146801202771u }, { 12725888767650480803u, 1498136433501503464u },
+    { 15907360959563101004u, 1872670541876879330u }, { 14553786618154326031u, 1170419088673049581u },
+    { 4357175217410743827u, 1463023860841311977u }, { 10058155040190817688u, 1828779826051639971u },
+    { 7961007781811134206u, 2285974782564549964u }, { 14199001900486734687u, 1428734239102843727u },
+    { 13137066357181030455u, 1785917798878554659u }, { 11809646928048900164u, 2232397248598193324u },
+    { 16604401366885338411u, 1395248280373870827u }, { 16143815690179285109u, 1744060350467338534u },
+    { 10956397575869330579u, 2180075438084173168u }, { 6847748484918331612u, 1362547148802608230u },
+    { 17783057643002690323u, 1703183936003260287u }, { 17617136035325974999u, 2128979920004075359u },
+    { 17928239049719816230u, 1330612450002547099u }, { 17798612793722382384u, 1663265562503183874u },
+    { 13024893955298202172u, 2079081953128979843u }, { 5834715712847682405u, 1299426220705612402u },
+    { 16516766677914378815u, 1624282775882015502u }, { 11422586310538197711u, 2030353469852519378u },
+    { 11750802462513761473u, 1268970918657824611u }, { 10076817059714813937u, 1586213648322280764u },
+    { 12596021324643517422u, 1982767060402850955u }, { 5566670318688504437u, 1239229412751781847u },
+    { 2346651879933242642u, 1549036765939727309u }, { 7545000868343941206u, 1936295957424659136u },
+    { 4715625542714963254u, 1210184973390411960u }, { 5894531928393704067u, 1512731216738014950u },
+    { 16591536947346905892u, 1890914020922518687u }, { 17287239619732898039u, 1181821263076574179u },
+    { 16997363506238734644u, 1477276578845717724u }, { 2799960309088866689u, 1846595723557147156u },
+    { 10973347230035317489u, 1154122327223216972u }, { 13716684037544146861u, 1442652909029021215u },
+    { 12534169028502795672u, 1803316136286276519u }, { 11056025267201106687u, 2254145170357845649u },
+    { 18439230838069161439u, 1408840731473653530u }, { 13825666510731675991u, 1761050914342066913u },
+    { 3447025083132431277u, 2201313642927583642u }, { 6766076695385157452u, 1375821026829739776u },
+    { 8457595869231446815u, 1719776283537174720u }, { 10571994836539308519u, 2149720354421468400u },
+    { 6607496772837067824u, 1343575221513417750u }, { 17482743002901110588u, 1679469026891772187u },
+    { 17241742735199000331u, 2099336283614715234u }, { 15387775227926763111u, 1312085177259197021u },
+    { 5399660979626290177u, 1640106471573996277u }, { 11361262242960250625u, 2050133089467495346u },
+    { 11712474920277544544u, 1281333180917184591u }, { 10028907631919542777u, 1601666476146480739u },
+    { 7924448521472040567u, 2002083095183100924u }, { 14176152362774801162u, 1251301934489438077u },
+    { 3885132398186337741u, 1564127418111797597u }, { 9468101516160310080u, 1955159272639746996u },
+    { 15140935484454969608u, 1221974545399841872u }, { 479425281859160394u, 1527468181749802341u },
+    { 5210967620751338397u, 1909335227187252926u }, { 17091912818251750210u, 1193334516992033078u },
+    { 12141518985959911954u, 1491668146240041348u }, { 15176898732449889943u, 1864585182800051685u },
+    { 11791404716994875166u, 1165365739250032303u }, { 10127569877816206054u, 1456707174062540379u },
+    { 8047776328842869663u, 1820883967578175474u }, { 836348374198811271u, 2276104959472719343u },
+    { 7440246761515338900u, 1422565599670449589u }, { 13911994470321561530u, 1778206999588061986u },
+    { 8166621051047176104u, 2222758749485077483u }, { 2798295147690791113u, 1389224218428173427u },
+    { 17332926989895652603u, 1736530273035216783u }, { 17054472718942177850u, 2170662841294020979u },
+    { 8353202440125167204u, 1356664275808763112u }, { 10441503050156459005u, 1695830344760953890u },
+    { 3828506775840797949u, 2119787930951192363u }, { 86973725686804766u, 1324867456844495227u },
+    { 13943775212390669669u, 1656084321055619033u }, { 3594660960206173375u, 2070105401319523792u },
+    { 2246663100128858359u, 1293815875824702370u }, { 12031700912015848757u, 1617269844780877962u },
+    { 5816254103165035138u, 2021587305976097453u }, { 5941001823691840913u, 1263492066235060908u },
+    { 7426252279614801142u, 1579365082793826135u }, { 4671129331091113523u, 1974206353492282669u },
+    { 5225298841145639904u, 1233878970932676668u }, { 6531623551432049880u, 1542348713665845835u },
+    { 3552843420862674446u, 1927935892082307294u }, { 16055585193321335241u, 1204959932551442058u },
+    { 10846109454796893243u, 1506199915689302573u }, { 18169322836923504458u, 1882749894611628216u },
+    { 11355826773077190286u, 1176718684132267635u }, { 9583097447919099954u, 1470898355165334544u },
+    { 11978871809898874942u, 1838622943956668180u }, { 14973589762373593678u, 2298278679945835225u },
+    { 2440964573842414192u, 1436424174966147016u }, { 3051205717303017741u, 1795530218707683770u },
+    { 13037379183483547984u, 2244412773384604712u }, { 8148361989677217490u, 1402757983365377945u },
+    { 14797138505523909766u, 1753447479206722431u }, { 13884737113477499304u, 2191809349008403039u },
+    { 15595489723564518921u, 1369880843130251899u }, { 14882676136028260747u, 1712351053912814874u },
+    { 9379973133180550126u, 2140438817391018593u }, { 17391698254306313589u, 1337774260869386620u },
+    { 3292878744173340370u, 1672217826086733276u }, { 4116098430216675462u, 2090272282608416595u },
+    { 266718509671728212u, 1306420176630260372u }, { 333398137089660265u, 1633025220787825465u },
+    { 5028433689789463235u, 2041281525984781831u }, { 10060300083759496378u, 1275800953740488644u },
+    { 12575375104699370472u, 1594751192175610805u }, { 1884160825592049379u, 1993438990219513507u },
+    { 17318501580490888525u, 1245899368887195941u }, { 7813068920331446945u, 1557374211108994927u },
+    { 5154650131986920777u, 1946717763886243659u }, { 915813323278131534u, 1216698602428902287u },
+    { 14979824709379828129u, 1520873253036127858u }, { 9501408849870009354u, 1901091566295159823u },
+    { 12855909558809837702u, 1188182228934474889u }, { 2234828893230133415u, 1485227786168093612u },
+    { 2793536116537666769u, 1856534732710117015u }, { 8663489100477123587u, 1160334207943823134u },
+    { 1605989338741628675u, 1450417759929778918u }, { 11230858710281811652u, 1813022199912223647u },
+    { 9426887369424876662u, 2266277749890279559u }, { 12809333633531629769u, 1416423593681424724u },
+    { 16011667041914537212u, 1770529492101780905u }, { 6179525747111007803u, 2213161865127226132u },
+    { 13085575628799155685u, 1383226165704516332u }, { 16356969535998944606u, 1729032707130645415u },
+    { 15834525901571292854u, 2161290883913306769u }, { 2979049660840976177u, 1350806802445816731u },
+    { 17558870131333383934u, 1688508503057270913u }, { 8113529608884566205u, 2110635628821588642u },
+    { 9682642023980241782u, 1319147268013492901u }, { 16714988548402690132u, 1648934085016866126u },
+    { 11670363648648586857u, 2061167606271082658u }, { 11905663298832754689u, 1288229753919426661u },
+    { 1047021068258779650u, 1610287192399283327u }, { 15143834390605638274u, 2012858990499104158u },
+    { 4853210475701136017u, 1258036869061940099u }, { 1454827076199032118u, 1572546086327425124u },
+    { 1818533845248790147u, 1965682607909281405u }, { 3442426662494187794u, 1228551629943300878u },
+    { 13526405364972510550u, 1535689537429126097u }, { 3072948650933474476u, 1919611921786407622u },
+    { 15755650962115585259u, 1199757451116504763u }, { 15082877684217093670u, 1499696813895630954u },
+    { 9630225068416591280u, 1874621017369538693u }, { 8324733676974063502u, 1171638135855961683u },
+    { 5794231077790191473u, 1464547669819952104u }, { 7242788847237739342u, 1830684587274940130u },
+    { 18276858095901949986u, 2288355734093675162u }, { 16034722328366106645u, 1430222333808546976u },
+    { 1596658836748081690u, 1787777917260683721u }, { 6607509564362490017u, 2234722396575854651u },
+    { 1823850468512862308u, 1396701497859909157u }, { 6891499104068465790u, 1745876872324886446u },
+    { 17837745916940358045u, 2182346090406108057u }, { 4231062170446641922u, 1363966306503817536u },
+    { 5288827713058302403u, 1704957883129771920u }, { 6611034641322878003u, 2131197353912214900u },
+    { 13355268687681574560u, 1331998346195134312u }, { 16694085859601968200u, 1664997932743917890u },
+    { 11644235287647684442u, 2081247415929897363u }, { 4971804045566108824u, 1300779634956185852u },
+    { 6214755056957636030u, 1625974543695232315u }, { 3156757802769657134u, 2032468179619040394u },
+    { 6584659645158423613u, 1270292612261900246u }, { 17454196593302805324u, 1587865765327375307u },
+    { 17206059723201118751u, 1984832206659219134u }, { 6142101308573311315u, 1240520129162011959u },
+    { 3065940617289251240u, 1550650161452514949u }, { 8444111790038951954u, 1938312701815643686u },
+    { 665883850346957067u, 1211445438634777304u }, { 832354812933696334u, 1514306798293471630u },
+    { 10263815553021896226u, 1892883497866839537u }, { 17944099766707154901u, 1183052186166774710u },
+    { 13206752671529167818u, 1478815232708468388u }, { 16508440839411459773u, 1848519040885585485u },
+    { 12623618533845856310u, 1155324400553490928u }, { 15779523167307320387u, 1444155500691863660u },
+    { 1277659885424598868u, 1805194375864829576u }, { 1597074856780748586u, 2256492969831036970u },
+    { 5609857803915355770u, 1410308106144398106u }, { 16235694291748970521u, 1762885132680497632u },
+    { 1847873790976661535u, 2203606415850622041u }, { 12684136165428883219u, 1377254009906638775u },
+    { 11243484188358716120u, 1721567512383298469u }, { 219297180166231438u, 2151959390479123087u },
+    { 7054589765244976505u, 1344974619049451929u }, { 13429923224983608535u, 1681218273811814911u },
+    { 12175718012802122765u, 2101522842264768639u }, { 14527352785642408584u, 1313451776415480399u },
+    { 13547504963625622826u, 1641814720519350499u }, { 12322695186104640628u, 2052268400649188124u },
+    { 16925056528170176201u, 1282667750405742577u }, { 7321262604930556539u, 1603334688007178222u },
+    { 18374950293017971482u, 2004168360008972777u }, { 4566814905495150320u, 1252605225005607986u },
+    { 14931890668723713708u, 1565756531257009982u }, { 9441491299049866327u, 1957195664071262478u },
+    { 1289246043478778550u, 1223247290044539049u }, { 6223243572775861092u, 1529059112555673811u },
+    { 3167368447542438461u, 1911323890694592264u }, { 1979605279714024038u, 1194577431684120165u },
+    { 7086192618069917952u, 1493221789605150206u }, { 18081112809442173248u, 1866527237006437757u },
+    { 13606538515115052232u, 1166579523129023598u }, { 7784801107039039482u, 1458224403911279498u },
+    { 507629346944023544u, 1822780504889099373u }, { 5246222702107417334u, 2278475631111374216u },
+    { 3278889188817135834u, 1424047269444608885u }, { 8710297504448807696u, 1780059086805761106u }
+};
+
+// floor(log10(2^e)) for 0 <= e <= 1650
+static uint32_t log10_pow2(int32_t e) {
+    return ((uint32_t)e * 78913) >> 18;
+}
+
+// floor(log10(5^e)) for 0 <= e <= 2620
+static uint32_t log10_pow5(int32_t e) {
+    return ((uint32_t)e * 732923) >> 20;
+}
+
+// Bits in 5^e, or 1 for e == 0
+static int32_t pow5_bits(int32_t e) {
+    return (int32_t)(((uint32_t)e * 1217359) >> 19) + 1;
+}
+
+static bool multiple_of_pow5(uint64_t value, uint32_t p) {
+    uint32_t count = 0;
+    while (value % 5 == 0) {
+        value /= 5;
+        count++;
+    }
+    return count >= p;
+}
+
+static bool multiple_of_pow2(uint64_t value, uint32_t p) {
+    return (value & ((1ull << p) - 1)) == 0;
+}
+
+static uint64_t umul128(uint64_t a, uint64_t b, uint64_t* high) {
+#ifdef __SIZEOF_INT128__
+    __extension__ typedef unsigned __int128 uint128;
+    uint128 product = (uint128)a * b;
+    *high = (uint64_t)(product >> 64);
+    return (uint64_t)product;
+#else
+    uint64_t a_low = (uint32_t)a, a_high = a >> 32;
+    uint64_t b_low = (uint32_t)b, b_high = b >> 32;
+    uint64_t low_low = a_low * b_low;
+    uint64_t low_high = a_low * b_high;
+    uint64_t high_low = a_high * b_low;
+    uint64_t middle = high_low + (low_low >> 32) + (uint32_t)low_high;
+
+    *high = a_high * b_high + (middle >> 32) + (low_high >> 32);
+    return (middle << 32) | (uint32_t)low_low;
+#endif
+}
+
+// (m * mul) >> j, for 64 < j < 128
+static uint64_t mul_shift64(uint64_t m, const uint64_t* mul, int32_t j) {
+    uint64_t high1;
+    uint64_t low1 = umul128(m, mul[1], &high1);
+    uint64_t high0;
+    umul128(m, mul[0], &high0);
+
+    uint64_t sum = high0 + low1;
+    if (sum < high0) {
+        high1++;
+    }
+
+    int32_t shift = j - 64;
+    return (high1 << (64 - shift)) | (sum >> shift);
+}
+
+// The shortest decimal digits and exponent that round to the double with
+// this mantissa and biased exponent
+static uint64_t shortest_decimal(uint64_t ieee_mantissa, uint32_t ieee_exponent, int32_t* exponent) {
+    int32_t e2;
+    uint64_t m2;
+
+    if (ieee_exponent == 0) {
+        e2 = 1 - DOUBLE_BIAS - DOUBLE_MANTISSA_BITS - 2;
+        m2 = ieee_mantissa;
+    }
+    else {
+        e2 = (int32_t)ieee_exponent - DOUBLE_BIAS - DOUBLE_MANTISSA_BITS - 2;
+        m2 = (1ull << DOUBLE_MANTISSA_BITS) | ieee_mantissa;
+    }
+
+    // Halfway cases round to even, so an even mantissa owns its bounds
+    bool accept_bounds = (m2 & 1) == 0;
+
+    // The interval of decimals that round to this double is (mm, mp) around
+    // mv, all scaled by 4. The gap below is halved at a power of two.
+    uint64_t mv = 4 * m2;
+    uint32_t mm_shift = ieee_mantissa != 0 || ieee_exponent <= 1;
+
+    uint64_t vr, vp, vm;
+    int32_t e10;
+    bool vm_trailing_zeros = false;
+    bool vr_trailing_zeros = false;
+
+    if (e2 >= 0) {
+        uint32_t q = log10_pow2(e2) - (e2 > 3);
+        int32_t k = DOUBLE_POW5_INV_BITCOUNT + pow5_bits((int32_t)q) - 1;
+        int32_t i = -e2 + (int32_t)q + k;
+
+        e10 = (int32_t)q;
+        vr = mul_shift64(4 * m2, DOUBLE_POW5_INV_SPLIT[q], i);
+        vp = mul_shift64(4 * m2 + 2, DOUBLE_POW5_INV_SPLIT[q], i);
+        vm = mul_shift64(4 * m2 - 1 - mm_shift, DOUBLE_POW5_INV_SPLIT[q], i);
+
+        if (q <= 21) {
+            // Only one of mv, mp and mm can be a multiple of 5
+            if (mv % 5 == 0) {
+                vr_trailing_zeros = multiple_of_pow5(mv, q);
+            }
+            else if (accept_bounds) {
+                vm_trailing_zeros = multiple_of_pow5(mv - 1 - mm_shift, q);
+            }
+            else {
+                vp -= multiple_of_pow5(mv + 2, q);
+            }
+        }
+    }
+    else {
+        uint32_t q = log10_pow5(-e2) - (-e2 > 1);
+        int32_t i = -e2 - (int32_t)q;
+        int32_t k = pow5_bits(i) - DOUBLE_POW5_BITCOUNT;
+        int32_t j = (int32_t)q - k;
+
+        e10 = (int32_t)q + e2;
+        vr = mul_shift64(4 * m2, DOUBLE_POW5_SPLIT[i], j);
+        vp = mul_shift64(4 * m2 + 2, DOUBLE_POW5_SPLIT[i], j);
+        vm = mul_shift64(4 * m2 - 1 - mm_shift, DOUBLE_POW5_SPLIT[i], j);
+
+        if (q <= 1) {
+            // mv has at least q trailing zero bits, and mp = mv + 2 and
+            // mm = mv - 1 - mm_shift have them only when q is 0 or 1
+            vr_trailing_zeros = true;
+            if (accept_bounds) {
+                vm_trailing_zeros = mm_shift == 1;
+            }
+            else {
+                vp--;
+            }
+        }
+        else if (q < 63) {
+            vr_trailing_zeros = multiple_of_pow2(mv, q);
+        }
+    }
+
+    // Drop digits while the interval still holds a shorter number
+    int32_t removed = 0;
+    uint32_t last_removed_digit = 0;
+    uint64_t output;
+
+    if (vm_trailing_zeros || vr_trailing_zeros) {
+        while (vp / 10 > vm / 10) {
+            vm_trailing_zeros &= vm % 10 == 0;
+            vr_trailing_zeros &= last_removed_digit == 0;
+            last_removed_digit = (uint32_t)(vr % 10);
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            removed++;
+        }
+
+        if (vm_trailing_zeros) {
+            while (vm % 10 == 0) {
+                vr_trailing_zeros &= last_removed_digit == 0;
+                last_removed_digit = (uint32_t)(vr % 10);
+                vr /= 10;
+                vp /= 10;
+                vm /= 10;
+                removed++;
+            }
+        }
+
+        // Exactly halfway: round to even
+        if (vr_trailing_zeros && last_removed_digit == 5 && vr % 2 == 0) {
+            last_removed_digit = 4;
+        }
+
+        output = vr + ((vr == vm && (!accept_bounds || !vm_trailing_zeros)) || last_removed_digit >= 5);
+    }
+    else {
+        // The common case, where no bound is exact
+        bool round_up = false;
+
+        if (vp / 100 > vm / 100) {
+            round_up = vr % 100 >= 50;
+            vr /= 100;
+            vp /= 100;
+            vm /= 100;
+            removed += 2;
+        }
+
+        while (vp / 10 > vm / 10) {
+            round_up = vr % 10 >= 5;
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            removed++;
+        }
+
+        output = vr + (vr == vm || round_up);
+    }
+
+    *exponent = e10 + removed;
+    return output;
+}
+
+// Writes the shortest text that reads back as value, in decimal notation for
+// magnitudes from 1e-7 up to 1e21 and in exponent notation otherwise, and
+// returns its length. buffer needs NUMBER_BUFFER_SIZE bytes.
+int format_number(double value, char* buffer) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    bool negative = (bits >> 63) != 0;
+    uint64_t ieee_mantissa = bits & ((1ull << DOUBLE_MANTISSA_BITS) - 1);
+    uint32_t ieee_exponent = (uint32_t)((bits >> DOUBLE_MANTISSA_BITS) & ((1u << DOUBLE_EXPONENT_BITS) - 1));
+    int length = 0;
+
+    if (ieee_exponent == (1u << DOUBLE_EXPONENT_BITS) - 1) {
+        if (ieee_mantissa != 0) {
+            memcpy(buffer, "nan", 4);
+            return 3;
+        }
+
+        length = negative ? 4 : 3;
+        memcpy(buffer, negative ? "-inf" : "inf", (size_t)length + 1);
+        return length;
+    }
+
+    if (negative) {
+        buffer[length++] = '-';
+    }
+
+    if (ieee_exponent == 0 && ieee_mantissa == 0) {
+        buffer[length++] = '0';
+        buffer[length] = '\0';
+        return length;
+    }
+
+    int32_t exponent;
+    uint64_t output = shortest_decimal(ieee_mantissa, ieee_exponent, &exponent);
+
+    char digits[20];
+    int digits_length = 0;
+    while (output > 0) {
+        digits[digits_length++] = (char)('0' + output % 10);
+        output /= 10;
+    }
+
+    // Exponent of the first digit
+    int32_t scientific = exponent + digits_length - 1;
+
+    if (scientific >= -7 && scientific < 21) {
+        if (scientific < 0) {
+            buffer[length++] = '0';
+            buffer[length++] = '.';
+            for (int32_t i = -1; i > scientific; i--) {
+                buffer[length++] = '0';
+            }
+        }
+
+        for (int i = digits_length - 1; i >= 0; i--) {
+            buffer[length++] = digits[i];
+            if (i > 0 && digits_length - 1 - i == scientific) {
+                buffer[length++] = '.';
+            }
+        }
+
+        for (int32_t i = 0; i < exponent; i++) {
+            buffer[length++] = '0';
+        }
+    }
+    else {
+        buffer[length++] = digits[digits_length - 1];
+        if (digits_length > 1) {
+            buffer[length++] = '.';
+            for (int i = digits_length - 2; i >= 0; i--) {
+                buffer[length++] = digits[i];
+            }
+        }
+
+        int32_t magnitude = scientific < 0 ? -scientific : scientific;
+        buffer[length++] = 'e';
+        buffer[length++] = scientific < 0 ? '-' : '+';
+        if (magnitude >= 100) {
+            buffer[length++] = (char)('0' + magnitude / 100);
+        }
+        if (magnitude >= 10) {
+            buffer[length++] = (char)('0' + magnitude / 10 % 10);
+        }
+        buffer[length++] = (char)('0' + magnitude % 10);
+    }
+
+    buffer[length] = '\0';
+    return length;
+}
+
+// Lexer implementation
+Lexer* create_lexer(const char* input) {
+    Lexer* lexer = (Lexer*)asc_malloc(sizeof(Lexer), MEM_RUNTIME);
+    if (!lexer) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    lexer->input = input;
+    lexer->position = 0;
+    lexer->input_length = strlen(input);
+    lexer->current_char = (lexer->input_length > 0) ? input[0] : '\0';
+    lexer->line = 1;
+    lexer->tokens = NULL;
+    lexer->token_count = 0;
+    return lexer;
+}
+
+void advance_lexer(Lexer* lexer) {
+    if (lexer->current_char == '\n') {
+        lexer->line++;
+    }
+
+    lexer->position++;
+    if (lexer->position < lexer->input_length) {
+        lexer->current_char = lexer->input[lexer->position];
+    }
+    else {
+        lexer->current_char = '\0';
+    }
+}
+
+void skip_whitespace(Lexer* lexer) {
+    while (lexer->current_char && isspace(lexer->current_char)) {
+        advance_lexer(lexer);
+    }
+}
+
+Token get_number_token(Lexer* lexer) {
+    Token token;
+    token.type = TOKEN_NUMBER;
+
+    char* number_str = (char*)asc_malloc(64, MEM_TOKEN);
+    if (!number_str) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    int i = 0;
+
+    // Get integer part
+    while (lexer->current_char && isdigit(lexer->current_char)) {
+        number_str[i++] = lexer->current_char;
+        advance_lexer(lexer);
+    }
+
+    // Get decimal part if exists
+    if (lexer->current_char == '.') {
+        number_str[i++] = lexer->current_char;
+        advance_lexer(lexer);
+
+        while (lexer->current_char && isdigit(lexer->current_char)) {
+            number_str[i++] = lexer->current_char;
+            advance_lexer(lexer);
+        }
+    }
+
+    number_str[i] = '\0';
+    token.value.number_value = atof(number_str);
+    asc_free(number_str);
+
+    return token;
+}
+
+Token get_identifier_token(Lexer* lexer) {
+    Token token;
+
+    char* identifier = (char*)asc_malloc(256, MEM_TOKEN);
+    if (!identifier) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    int i = 0;
+
+    while (lexer->current_char && (isalnum(lexer->current_char) || lexer->current_char == '_')) {
+        identifier[i++] = lexer->current_char;
+        advance_lexer(lexer);
+    }
+
+    identifier[i] = '\0';
+
+    // Check if it's a keyword
+    if (strcmp(identifier, "let") == 0) token.type = TOKEN_LET;
+    else if (strcmp(identifier, "if") == 0) token.type = TOKEN_IF;
+    else if (strcmp(identifier, "else") == 0) token.type = TOKEN_ELSE;
+    else if (strcmp(identifier, "while") == 0) token.type = TOKEN_WHILE;
+    else if (strcmp(identifier, "function") == 0) token.type = TOKEN_FUNCTION;
+    else if (strcmp(identifier, "return") == 0) token.type = TOKEN_RETURN;
+    else if (strcmp(identifier, "true") == 0) token.type = TOKEN_TRUE;
+    else if (strcmp(identifier, "false") == 0) token.type = TOKEN_FALSE;
+    else if (strcmp(identifier, "print") == 0) token.type = TOKEN_PRINT;
+    else if (strcmp(identifier, "import") == 0) token.type = TOKEN_IMPORT;
+    else {
+        token.type = TOKEN_IDENTIFIER;
+        token.value.string_value = asc_strdup(identifier, MEM_TOKEN);
+    }
+
+    asc_free(identifier);
+    return token;
+}
+
+Token get_string_token(Lexer* lexer) {
+    Token token;
+    token.type = TOKEN_STRING;
+
+    advance_lexer(lexer); // Skip opening quote
+
+    char* string = (char*)asc_malloc(1024, MEM_TOKEN);
+    if (!string) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    int i = 0;
+
+    while (lexer->current_char && lexer->current_char != '"') {
+        string[i++] = lexer->current_char;
+        advance_lexer(lexer);
+    }
+
+    string[i] = '\0';
+    token.value.string_value = asc_strdup(string, MEM_TOKEN);
+
+    advance_lexer(lexer); // Skip closing quote
+    asc_free(string);
+
+    return token;
+}
+
+Token get_next_token(Lexer* lexer) {
+    Token token;
+
+    while (lexer->current_char) {
+        if (isspace(lexer->current_char)) {
+            skip_whitespace(lexer);
+            continue;
+        }
+
+        if (isdigit(lexer->current_char)) {
+            return get_number_token(lexer);
+        }
+
+        if (isalpha(lexer->current_char) || lexer->current_char == '_') {
+            return get_identifier_token(lexer);
+        }
+
+        if (lexer->current_char == '"') {
+            return get_string_token(lexer);
+        }
+
+        if (lexer->current_char == '+') {
+            token.type = TOKEN_PLUS;
+            advance_lexer(lexer);
+            return token;
+        }
+
+        if (lexer->current_char == '-') {
+            token.type = TOKEN_MINUS;
+            advance_lexer(lexer);
+            return token;
+        }
+
+        if (lexer->current_char == '*') {
+            token.type = TOKEN_MULTIPLY;
+            advance_lexer(lexer);
+            return token;
+        }
+
+        if (lexer->current_char == '/') {
+            advance_lexer(lexer);
+
+            // Check for comments
+            if (lexer->current_char == '/') {
+                // Skip single-line comment
+                while (lexer->current_char && lexer->current_char != '\n') {
+                    advance_lexer(lexer);
+                }
+                continue;
+            }
+
+            token.type = TOKEN_DIVIDE;
+            return token;
+        }
+
+        if (lexer->current_char == '=') {
+            advance_lexer(lexer);
+
+            if (lexer->current_char == '=') {
+                advance_lexer(lexer);
+                token.type = TOKEN_EQUALS;
+            }
+            else {
+                token.type = TOKEN_ASSIGN;
+            }
+
+            return token;
+        }
+
+        if (lexer->current_char == '>') {
+            advance_lexer(lexer);
+
+            if (lexer->current_char == '=') {
+                advance_lexer(lexer);
+                token.type = TOKEN_GTE;
+            }
+            else {
+                token.type = TOKEN_GT;
+            }
+
+            return token;
+        }
+
+        if (lexer->current_char == '<') {
+            advance_lexer(lexer);
+
+            if (lexer->current_char == '=') {
+                advance_lexer(lexer);
+                token.type = TOKEN_LTE;
+            }
+            else {
+                token.type = TOKEN_LT;
+            }
+
+            return token;
+        }
+
+        if (lexer->current_char == '!') {
+            advance_lexer(lexer);
+
+            if (lexer->current_char == '=') {
+                advance_lexer(lexer);
+                token.type = TOKEN_NOT_EQUALS;
+                return token;
+            }
+
+            syntax_error("Unexpected character after '!'\n");
+        }
+
+        if (lexer->current_char == '&' && lexer->position + 1 < lexer->input_length &&
+            lexer->input[lexer->position + 1] == '&') {
+            advance_lexer(lexer);
+            advance_lexer(lexer);
+            token.type = TOKEN_AND;
+            return token;
+        }
+
+        if (lexer->current_char == '|' && lexer->position + 1 < lexer->input_length &&
+            lexer->input[lexer->position + 1] == '|') {
+            advance_lexer(lexer);
+            advance_lexer(lexer);
+            token.type = TOKEN_OR;
+            return token;
+        }
+
+        if (lexer->current_char == '(') {
+            token.type = TOKEN_LPAREN;
+            advance_lexer(lexer);
+            return token;
+        }
+
+        if (lexer->current_char == ')') {
+            token.type = TOKEN_RPAREN;
+            advance_lexer(lexer);
+            return token;
+        }
+
+        if (lexer->current_char == '{') {
+            token.type = TOKEN_LBRACE;
+            advance_lexer(lexer);
+            return token;
+        }
+
+        if (lexer->current_char == '}') {
+            token.type = TOKEN_RBRACE;
+            advance_lexer(lexer);
+            return token;
+        }
+
+        if (lexer->current_char == ';') {
+            token.type = TOKEN_SEMICOLON;
+            advance_lexer(lexer);
+            return token;
+        }
+
+        if (lexer->current_char == ',') {
+            token.type = TOKEN_COMMA;
+            advance_lexer(lexer);
+            return token;
+        }
+
+        if (lexer->current_char == '[') {
+            token.type = TOKEN_LBRACKET;
+            advance_lexer(lexer);
+            return token;
+        }
+
+        if (lexer->current_char == ']') {
+            token.type = TOKEN_RBRACKET;
+            advance_lexer(lexer);
+            return token;
+        }
+
+        if (lexer->current_char == '.') {
+            token.type = TOKEN_DOT;
+            advance_lexer(lexer);
+            return token;
+        }
+
+        if (lexer->current_char == ':') {
+            token.type = TOKEN_COLON;
+            advance_lexer(lexer);
+            return token;
+        }
+
+        if (lexer->current_char == '%') {
+            token.type = TOKEN_MODULO;
+            advance_lexer(lexer);
+            return token;
+        }
+
+        // If we get here, we have an invalid character
+        syntax_error("Invalid character: %c\n", lexer->current_char);
+    }
+
+    token.type = TOKEN_EOF;
+    return token;
+}
+
+// The tokens are kept in the lexer as they are read, so that the ones before a
+// syntax error can still be released
+Token* tokenize(Lexer* lexer, int* token_count) {
+    int capacity = 1024;
+    lexer->tokens = (Token*)asc_malloc(sizeof(Token) * capacity, MEM_TOKEN);
+    if (!lexer->tokens) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    lexer->token_count = 0;
+
+    Token token = get_next_token(lexer);
+    token.line = lexer->line;
+    token.end = lexer->position;
+    while (token.type != TOKEN_EOF) {
+        if (lexer->token_count >= capacity) {
+            capacity *= 2;
+            lexer->tokens = (Token*)asc_realloc(lexer->tokens, sizeof(Token) * capacity, MEM_TOKEN);
+            if (!lexer->tokens) {
+                fprintf(stderr, "Memory allocation failed\n");
+                exit(1);
+            }
+        }
+
+        lexer->tokens[lexer->token_count++] = token;
+        token = get_next_token(lexer);
+        token.line = lexer->line;
+        token.end = lexer->position;
+    }
+
+    lexer->tokens[lexer->token_count++] = token; // Add EOF token
+    *token_count = lexer->token_count;
+
+    return lexer->tokens;
+}
+
+// Tokens belong to the parser once it is created, so this leaves them alone
+void free_lexer(Lexer* lexer) {
+    asc_free(lexer);
+}
+
+void free_tokens(Token* tokens, int count) {
+    for (int i = 0; i < count; i++) {
+        if (tokens[i].type == TOKEN_IDENTIFIER || tokens[i].type == TOKEN_STRING) {
+            asc_free(tokens[i].value.string_value);
+        }
+    }
+
+    asc_free(tokens);
+}
+
+// Program image implementation
+static uint32_t image_alloc(ImageBuilder* builder, size_t size, size_t alignment) {
+    size_t offset = (builder->size + alignment - 1) & ~(alignment - 1);
+
+    if (offset + size > builder->capacity) {
+        fprintf(stderr, "Internal error: program image overflow\n");
+        exit(1);
+    }
+
+    builder->size = (uint32_t)(offset + size);
+    return (uint32_t)offset;
+}
+
+// Reserves an upper bound for everything the parser can emit, so the buffer
+// never moves while nodes are being linked together. Every node, list entry
+// and operator string is produced by at least one token, and skipped function
+// bodies are copied from disjoint parts of the source.
+void init_image_builder(ImageBuilder* builder, Token* tokens, int tokens_length, size_t source_length) {
+    size_t count = (size_t)tokens_length + 1;
+    size_t capacity = sizeof(ImageHeader);
+
+    capacity += count * (sizeof(ASTNode) + IMAGE_ALIGNMENT); // Nodes and their padding
+    capacity += count * 4 * sizeof(RelPtr);                   // Lists and their padding
+    capacity += count * (sizeof(ImageSymbol) + sizeof(RelPtr)); // Symbols
+    capacity += count * 3;                                    // Operators
+    capacity += source_length + 1;                            // Skipped function bodies
+
+    for (int i = 0; i < tokens_length; i++) {
+        if (tokens[i].type == TOKEN_IDENTIFIER || tokens[i].type == TOKEN_STRING) {
+            capacity += strlen(tokens[i].value.string_value) + 1;
+        }
+    }
+
+    if (capacity > INT32_MAX) {
+        syntax_error("Program is too large\n");
+    }
+
+    reserve_image_builder(builder, capacity, count);
+}
+
+// Allocates a fixed buffer of capacity bytes, with a constant pool sized for
+// up to strings distinct strings
+void reserve_image_builder(ImageBuilder* builder, size_t capacity, size_t strings) {
+    builder->data = (char*)asc_calloc(capacity, 1, MEM_AST);
+    builder->strings_capacity = 64;
+    while ((size_t)builder->strings_capacity < strings * 2) {
+        builder->strings_capacity *= 2;
+    }
+    builder->strings = (uint32_t*)asc_calloc(builder->strings_capacity, sizeof(uint32_t), MEM_AST);
+    if (!builder->data || !builder->strings) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    builder->capacity = (uint32_t)capacity;
+    builder->size = sizeof(ImageHeader);
+}
+
+void free_image_builder(ImageBuilder* builder) {
+    asc_free(builder->data);
+    asc_free(builder->strings);
+    builder->data = NULL;
+    builder->strings = NULL;
+}
+
+ASTNode* create_node(Parser* parser, NodeType type) {
+    ImageBuilder* builder = &parser->image;
+    ASTNode* node = (ASTNode*)(builder->data + image_alloc(builder, sizeof(ASTNode), IMAGE_ALIGNMENT));
+    node->type = type;
+    return node;
+}
+
+// Constant pool: equal strings are stored once per image
+const char* image_string(ImageBuilder* builder, const char* str) {
+    int mask = builder->strings_capacity - 1;
+    int slot = (int)(hash_string(str) & mask);
+
+    while (builder->strings[slot] != 0) {
+        const char* existing = builder->data + builder->strings[slot];
+        if (strcmp(existing, str) == 0) {
+            return existing;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    size_t length = strlen(str) + 1;
+    uint32_t offset = image_alloc(builder, length, 1);
+    memcpy(builder->data + offset, str, length);
+    builder->strings[slot] = offset;
+
+    return builder->data + offset;
+}
+
+void node_list_push(NodeList* list, void* item) {
+    if (list->length >= list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 10;
+        list->items = (void**)asc_realloc(list->items, sizeof(void*) * list->capacity, MEM_AST);
+        if (!list->items) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+    }
+
+    list->items[list->length++] = item;
+}
+
+static RelPtr* image_list_entries(ImageBuilder* builder, const NodeList* list) {
+    RelPtr* entries = NULL;
+
+    if (list->length > 0) {
+        entries = (RelPtr*)(builder->data + image_alloc(builder, sizeof(RelPtr) * list->length, sizeof(RelPtr)));
+        for (int i = 0; i < list->length; i++) {
+            rel_set(&entries[i], list->items[i]);
+        }
+    }
+
+    return entries;
+}
+
+// Copies a temporary list into the image and releases it
+RelPtr* image_node_list(ImageBuilder* builder, NodeList* list) {
+    RelPtr* entries = image_list_entries(builder, list);
+
+    asc_free(list->items);
+    list->items = NULL;
+    list->capacity = 0;
+    return entries;
+}
+
+void fill_image_header(ImageHeader* header, const char* code) {
+    size_t length = strlen(code);
+
+    memset(header, 0, sizeof(ImageHeader));
+    header->magic = IMAGE_MAGIC;
+    header->format = IMAGE_FORMAT;
+    header->version_hash = build_hash();
+    header->source_hash = hash_bytes(code, length, 0);
+    header->source_length = length;
+    header->layout = (uint32_t)(sizeof(ASTNode) << 8 | sizeof(RelPtr));
+}
+
+// Adds the header and symbol table, then shrinks the buffer to fit. The image
+// can move freely afterwards since it holds no absolute pointers.
+Program* finish_image(ImageBuilder* builder, ASTNode* root, const char* code) {
+    RelPtr* body = AST_LIST(root->data.program.body);
+    int symbols_length = 0;
+
+    for (int i = 0; i < root->data.program.body_length; i++) {
+        NodeType type = AST_NODE(body[i])->type;
+        if (type == NODE_FUNCTION_DECLARATION || type == NODE_VARIABLE_DECLARATION) {
+            symbols_length++;
+        }
+    }
+
+    ImageSymbol* symbols = NULL;
+    if (symbols_length > 0) {
+        symbols = (ImageSymbol*)(builder->data + image_alloc(builder, sizeof(ImageSymbol) * symbols_length, sizeof(RelPtr)));
+    }
+
+    for (int i = 0, j = 0; i < root->data.program.body_length; i++) {
+        ASTNode* statement = AST_NODE(body[i]);
+
+        if (statement->type == NODE_FUNCTION_DECLARATION) {
+            AST_SET(symbols[j].name, AST_STRING(statement->data.function_declaration.name));
+            AST_SET(symbols[j++].node, statement);
+        }
+        else if (statement->type == NODE_VARIABLE_DECLARATION) {
+            AST_SET(symbols[j].name, AST_STRING(statement->data.variable_declaration.name));
+            AST_SET(symbols[j++].node, statement);
+        }
+    }
+
+    ImageHeader* header = (ImageHeader*)builder->data;
+    uint32_t size = (builder->size + IMAGE_ALIGNMENT - 1) & ~(uint32_t)(IMAGE_ALIGNMENT - 1);
+
+    fill_image_header(header, code);
+    header->size = size;
+    AST_SET(header->root, root);
+    AST_SET(header->symbols, symbols);
+    header->symbols_length = symbols_length;
+
+    Program* program = (Program*)asc_malloc(sizeof(Program), MEM_AST);
+    if (!program) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    program->image = (ImageHeader*)asc_realloc(builder->data, size, MEM_AST);
+    if (!program->image) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    memset((char*)program->image + builder->size, 0, size - builder->size);
+    program->size = size;
+    program->mapped = false;
+
+    builder->data = NULL;
+    asc_free(builder->strings);
+    builder->strings = NULL;
+
+    return program;
+}
+
+ASTNode* program_root(Program* program) {
+    return AST_NODE(program->image->root);
+}
+
+// Looks up a top-level declaration by name
+ASTNode* program_find_symbol(Program* program, const char* name) {
+    ImageSymbol* symbols = (ImageSymbol*)rel_get(&program->image->symbols);
+
+    for (int i = 0; i < program->image->symbols_length; i++) {
+        if (strcmp(AST_STRING(symbols[i].name), name) == 0) {
+            return AST_NODE(symbols[i].node);
+        }
+    }
+
+    return NULL;
+}
+
+// Checks that an image was written by this build and is not truncated. When
+// expected is given, the source hash must match as well.
+static bool check_image(const ImageHeader* header, size_t size, const ImageHeader* expected) {
+    ImageHeader current;
+    fill_image_header(&current, "");
+
+    if (size < sizeof(ImageHeader) ||
+        header->magic != IMAGE_MAGIC ||
+        header->format != IMAGE_FORMAT ||
+        header->version_hash != current.version_hash ||
+        header->layout != current.layout ||
+        header->size != size ||
+        header->root <= 0 ||
+        (uint64_t)offsetof(ImageHeader, root) + header->root + sizeof(ASTNode) > size) {
+        return false;
+    }
+
+    if (expected && (header->source_hash != expected->source_hash || header->source_length != expected->source_length)) {
+        return false;
+    }
+
+    return AST_NODE(header->root)->type == NODE_PROGRAM;
+}
+
+// Maps an image read-only, so every process running it shares the same pages.
+// Returns NULL if the file is missing or not a valid image.
+Program* load_program_image(const char* path, const ImageHeader* expected) {
+    ImageHeader* image = NULL;
+    size_t size = 0;
+    bool mapped = false;
+
+#ifdef _WIN32
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long file_size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    if (file_size > 0) {
+        image = (ImageHeader*)asc_malloc(file_size, MEM_AST);
+        size = image ? fread(image, 1, file_size, file) : 0;
+    }
+    fclose(file);
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        void* data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            image = (ImageHeader*)data;
+            size = (size_t)info.st_size;
+            mapped = true;
+        }
+    }
+    close(fd);
+#endif
+
+    Program program = { image, size, mapped };
+    if (!image || !check_image(image, size, expected)) {
+        if (image) {
+            free_program_image(&program);
+        }
+        return NULL;
+    }
+
+    Program* result = (Program*)asc_malloc(sizeof(Program), MEM_AST);
+    if (!result) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    *result = program;
+    return result;
+}
+
+// Writes to a temporary file and renames it into place, so concurrent runs
+// never see a partially written image
+bool write_program_image(Program* program, const char* path) {
+#ifdef _WIN32
+    int pid = _getpid();
+#else
+    int pid = (int)getpid();
+#endif
+
+    char* temp_path = (char*)asc_malloc(strlen(path) + 32, MEM_TOOLING);
+    if (!temp_path) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    sprintf(temp_path, "%s.%d.tmp", path, pid);
+
+    bool ok = false;
+    FILE* file = fopen(temp_path, "wb");
+    if (file != NULL) {
+        ok = fwrite(program->image, 1, program->size, file) == program->size;
+        if (fclose(file) == 0 && ok) {
+#ifdef _WIN32
+            remove(path);
+#endif
+            ok = rename(temp_path, path) == 0;
+        }
+
+        if (!ok) {
+            remove(temp_path);
+        }
+    }
+
+    asc_free(temp_path);
+    return ok;
+}
+
+void free_program_image(Program* program) {
+#ifndef _WIN32
+    if (program->mapped) {
+        munmap(program->image, program->size);
+        return;
+    }
+#endif
+    asc_free(program->image);
+}
+
+void free_program(Program* program) {
+    if (program) {
+        free_lazy_bodies(program);
+        free_program_image(program);
+        asc_free(program);
+    }
+}
+
+// Lazy function body implementation
+static LazyBody** lazy_body_bucket(const ASTNode* node) {
+    return &lazy_bodies.buckets[((uintptr_t)node / IMAGE_ALIGNMENT) & (uintptr_t)(lazy_bodies.buckets_length - 1)];
+}
+
+static void grow_lazy_bodies(void) {
+    LazyBody** old_buckets = lazy_bodies.buckets;
+    int old_length = lazy_bodies.buckets_length;
+
+    lazy_bodies.buckets_length = old_length ? old_length * 2 : 64;
+    lazy_bodies.buckets = (LazyBody**)asc_calloc(lazy_bodies.buckets_length, sizeof(LazyBody*), MEM_AST);
+    if (!lazy_bodies.buckets) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < old_length; i++) {
+        while (old_buckets[i]) {
+            LazyBody* entry = old_buckets[i];
+            old_buckets[i] = entry->next;
+
+            LazyBody** bucket = lazy_body_bucket(entry->node);
+            entry->next = *bucket;
+            *bucket = entry;
+        }
+    }
+
+    asc_free(old_buckets);
+}
+
+static ASTNode* find_parsed_body(const ASTNode* node) {
+    if (lazy_bodies.buckets_length == 0) {
+        return NULL;
+    }
+
+    for (LazyBody* entry = *lazy_body_bucket(node); entry; entry = entry->next) {
+        if (entry->node == node) {
+            return entry->body;
+        }
+    }
+
+    return NULL;
+}
+
+// Parses a skipped body on first use. Returns NULL on a syntax error and
+// leaves the message in error_message.
+ASTNode* try_lazy_function_body(const ASTNode* node) {
+    shared_lock(&lazy_lock);
+    ASTNode* body = find_parsed_body(node);
+    shared_unlock(&lazy_lock);
+
+    if (body) {
+        return body;
+    }
+
+    // Parsed without the lock, since a syntax error jumps out of it
+    jmp_buf trap;
+    jmp_buf* previous_trap = error_trap;
+    Program* volatile program = NULL;
+    Lexer* volatile lexer = NULL;
+    Parser* volatile parser = NULL;
+
+    if (setjmp(trap) == 0) {
+        error_trap = &trap;
+
+        const char* source = AST_STRING(node->data.lazy_body.source);
+        lexer = create_lexer(source);
+        lexer->line = node->data.lazy_body.line;
+
+        int token_count;
+        Token* tokens = tokenize(lexer, &token_count);
+        parser = create_parser(tokens, token_count, NULL);
+        program = finish_image(&parser->image, parse(parser), source);
+
+        free_parser(parser);
+        free_lexer(lexer);
+    }
+    else {
+        free_failed_compile(lexer, parser);
+    }
+
+    error_trap = previous_trap;
+    if (program == NULL) {
+        return NULL;
+    }
+
+    shared_lock(&lazy_lock);
+
+    body = find_parsed_body(node);
+    if (body == NULL) {
+        if (lazy_bodies.length >= lazy_bodies.buckets_length) {
+            grow_lazy_bodies();
+        }
+
+        LazyBody* entry = (LazyBody*)asc_malloc(sizeof(LazyBody), MEM_AST);
+        if (!entry) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+
+        // The source is one block statement
+        ASTNode* root = program_root(program);
+        entry->node = node;
+        entry->program = program;
+        entry->body = AST_NODE(AST_LIST(root->data.program.body)[0]);
+
+        LazyBody** bucket = lazy_body_bucket(node);
+        entry->next = *bucket;
+        *bucket = entry;
+        lazy_bodies.length++;
+
+        body = entry->body;
+        program = NULL;
+    }
+
+    shared_unlock(&lazy_lock);
+
+    // Another thread parsed it first
+    free_program(program);
+    return body;
+}
+
+ASTNode* lazy_function_body(const ASTNode* node) {
+    ASTNode* body = try_lazy_function_body(node);
+    if (body == NULL) {
+        raise_error(ERROR_SYNTAX);
+    }
+
+    return body;
+}
+
+// Finds the skipped body whose parsed program contains body, for tools that
+// need to refer to it by position
+bool find_lazy_body(const ASTNode* body, const ASTNode** node, const Program** program) {
+    bool found = false;
+    shared_lock(&lazy_lock);
+
+    for (int i = 0; i < lazy_bodies.buckets_length && !found; i++) {
+        for (LazyBody* entry = lazy_bodies.buckets[i]; entry && !found; entry = entry->next) {
+            const char* image = (const char*)entry->program->image;
+            if ((const char*)body >= image && (const char*)body < image + entry->program->size) {
+                *node = entry->node;
+                *program = entry->program;
+                found = true;
+            }
+        }
+    }
+
+    shared_unlock(&lazy_lock);
+    return found;
+}
+
+// Drops the parsed bodies of a program's functions along with the program
+void free_lazy_bodies(const Program* program) {
+    LazyBody* removed = NULL;
+    const char* image = (const char*)program->image;
+
+    shared_lock(&lazy_lock);
+
+    for (int i = 0; i < lazy_bodies.buckets_length && lazy_bodies.length > 0; i++) {
+        LazyBody** link = &lazy_bodies.buckets[i];
+
+        while (*link) {
+            LazyBody* entry = *link;
+            if ((const char*)entry->node >= image && (const char*)entry->node < image + program->size) {
+                *link = entry->next;
+                entry->next = removed;
+                removed = entry;
+                lazy_bodies.length--;
+            }
+            else {
+                link = &entry->next;
+            }
+        }
+    }
+
+    shared_unlock(&lazy_lock);
+
+    while (removed) {
+        LazyBody* next = removed->next;
+        free_program(removed->program);
+        asc_free(removed);
+        removed = next;
+    }
+}
+
+// Parser implementation
+// With source, function bodies in braces are skipped and left for their first
+// call to parse
+Parser* create_parser(Token* tokens, int tokens_length, const char* source) {
+    // Reserved first, since a program that is too large is a syntax error
+    ImageBuilder image;
+    init_image_builder(&image, tokens, tokens_length, source ? strlen(source) : 0);
+
+    Parser* parser = (Parser*)asc_malloc(sizeof(Parser), MEM_RUNTIME);
+    if (!parser) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    parser->tokens = tokens;
+    parser->tokens_length = tokens_length;
+    parser->position = 0;
+    parser->current_token = tokens[0];
+    parser->source = source;
+    parser->image = image;
+    parser->lists = NULL;
+    parser->lists_capacity = 0;
+    parser->open_lists = 0;
+    return parser;
+}
+
+// Temporary lists belong to the parser, so the ones still open when a syntax
+// error jumps out of it are released along with it. They nest like the nodes
+// being parsed, and their buffers are reused by the nodes that follow.
+NodeList* open_list(Parser* parser) {
+    if (parser->open_lists == parser->lists_capacity) {
+        int capacity = parser->lists_capacity ? parser->lists_capacity * 2 : 16;
+        parser->lists = (NodeList**)asc_realloc(parser->lists, sizeof(NodeList*) * capacity, MEM_AST);
+        if (!parser->lists) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+
+        for (int i = parser->lists_capacity; i < capacity; i++) {
+            parser->lists[i] = (NodeList*)asc_calloc(1, sizeof(NodeList), MEM_AST);
+            if (!parser->lists[i]) {
+                fprintf(stderr, "Memory allocation failed\n");
+                exit(1);
+            }
+        }
+
+        parser->lists_capacity = capacity;
+    }
+
+    NodeList* list = parser->lists[parser->open_lists++];
+    list->length = 0;
+    return list;
+}
+
+// Copies the innermost open list into the image and closes it. Its length
+// stays readable until the next list is opened.
+RelPtr* close_list(Parser* parser, NodeList* list) {
+    parser->open_lists--;
+    return image_list_entries(&parser->image, list);
+}
+
+void advance_parser(Parser* parser) {
+    parser->position++;
+    if (parser->position < parser->tokens_length) {
+        parser->current_token = parser->tokens[parser->position];
+    }
+    else {
+        parser->current_token.type = TOKEN_EOF;
+    }
+}
+
+Token eat(Parser* parser, TokenType type) {
+    if (parser->current_token.type == type) {
+        Token token = parser->current_token;
+        advance_parser(parser);
+        return token;
+    }
+    else {
+        syntax_error("Expected token type %d but got %d\n", type, parser->current_token.type);
+    }
+}
+
+ASTNode* parse_program(Parser* parser) {
+    ASTNode* node = create_node(parser, NODE_PROGRAM);
+    NodeList* body = open_list(parser);
+
+    while (parser->current_token.type != TOKEN_EOF) {
+        node_list_push(body, parse_statement(parser));
+    }
+
+    AST_SET(node->data.program.body, close_list(parser, body));
+    node->data.program.body_length = body->length;
+
+    return node;
+}
+
+ASTNode* parse_statement(Parser* parser) {
+    switch (parser->current_token.type) {
+    case TOKEN_LET:
+        return parse_variable_declaration(parser);
+    case TOKEN_IF:
+        return parse_if_statement(parser);
+    case TOKEN_WHILE:
+        return parse_while_statement(parser);
+    case TOKEN_FUNCTION:
+        return parse_function_declaration(parser);
+    case TOKEN_RETURN:
+        return parse_return_statement(parser);
+    case TOKEN_PRINT:
+        return parse_print_statement(parser);
+    case TOKEN_IMPORT:
+        return parse_import_statement(parser);
+    case TOKEN_IDENTIFIER: {
+        Token identifier = eat(parser, TOKEN_IDENTIFIER);
+
+        if (parser->current_token.type == TOKEN_ASSIGN) {
+            eat(parser, TOKEN_ASSIGN);
+            ASTNode* value = parse_expression(parser);
+            eat(parser, TOKEN_SEMICOLON);
+
+            ASTNode* node = create_node(parser, NODE_ASSIGNMENT_EXPRESSION);
+            AST_SET(node->data.assignment_expression.name, image_string(&parser->image, identifier.value.string_value));
+            AST_SET(node->data.assignment_expression.value, value);
+
+            return node;
+        }
+        else if (parser->current_token.type == TOKEN_LPAREN) {
+            ASTNode* call = parse_function_call(parser, identifier.value.string_value);
+
+            if (parser->current_token.type == TOKEN_LBRACKET || parser->current_token.type == TOKEN_DOT) {
+                return parse_postfix_statement(parser, parse_postfix(parser, call));
+            }
+
+            eat(parser, TOKEN_SEMICOLON);
+            return call;
+        }
+        else if (parser->current_token.type == TOKEN_LBRACKET || parser->current_token.type == TOKEN_DOT) {
+            ASTNode* target = create_node(parser, NODE_IDENTIFIER);
+            AST_SET(target->data.identifier.name, image_string(&parser->image, identifier.value.string_value));
+            return parse_postfix_statement(parser, parse_postfix(parser, target));
+        }
+
+        break;
+    }
+    case TOKEN_LBRACE:
+        return parse_block_statement(parser);
+    default:
+        break;
+    }
+
+    syntax_error("Unexpected token type: %d\n", parser->current_token.type);
+    return NULL; // To avoid compiler warning
+}
+
+ASTNode* parse_block_statement(Parser* parser) {
+    eat(parser, TOKEN_LBRACE);
+
+    ASTNode* node = create_node(parser, NODE_BLOCK_STATEMENT);
+    NodeList* body = open_list(parser);
+
+    while (parser->current_token.type != TOKEN_RBRACE) {
+        node_list_push(body, parse_statement(parser));
+    }
+
+    AST_SET(node->data.block_statement.body, close_list(parser, body));
+    node->data.block_statement.body_length = body->length;
+
+    eat(parser, TOKEN_RBRACE);
+    return node;
+}
+
+ASTNode* parse_variable_declaration(Parser* parser) {
+    eat(parser, TOKEN_LET);
+    Token name = eat(parser, TOKEN_IDENTIFIER);
+    eat(parser, TOKEN_ASSIGN);
+    ASTNode* value = parse_expression(parser);
+    eat(parser, TOKEN_SEMICOLON);
+
+    ASTNode* node = create_node(parser, NODE_VARIABLE_DECLARATION);
+    AST_SET(node->data.variable_declaration.name, image_string(&parser->image, name.value.string_value));
+    AST_SET(node->data.variable_declaration.value, value);
+
+    return node;
+}
+
+ASTNode* parse_if_statement(Parser* parser) {
+    eat(parser, TOKEN_IF);
+    eat(parser, TOKEN_LPAREN);
+    ASTNode* test = parse_expression(parser);
+    eat(parser, TOKEN_RPAREN);
+    ASTNode* consequent = parse_statement(parser);
+
+    ASTNode* node = create_node(parser, NODE_IF_STATEMENT);
+    AST_SET(node->data.if_statement.test, test);
+    AST_SET(node->data.if_statement.consequent, consequent);
+
+    if (parser->current_token.type == TOKEN_ELSE) {
+        eat(parser, TOKEN_ELSE);
+        AST_SET(node->data.if_statement.alternate, parse_statement(parser));
+    }
+
+    return node;
+}
+
+ASTNode* parse_while_statement(Parser* parser) {
+    eat(parser, TOKEN_WHILE);
+    eat(parser, TOKEN_LPAREN);
+    ASTNode* test = parse_expression(parser);
+    eat(parser, TOKEN_RPAREN);
+    ASTNode* body = parse_statement(parser);
+
+    ASTNode* node = create_node(parser, NODE_WHILE_STATEMENT);
+    AST_SET(node->data.while_statement.test, test);
+    AST_SET(node->data.while_statement.body, body);
+
+    return node;
+}
+
+ASTNode* parse_function_declaration(Parser* parser) {
+    int line = parser->current_token.line;
+    eat(parser, TOKEN_FUNCTION);
+    Token name = eat(parser, TOKEN_IDENTIFIER);
+    eat(parser, TOKEN_LPAREN);
+
+    ASTNode* node = create_node(parser, NODE_FUNCTION_DECLARATION);
+    AST_SET(node->data.function_declaration.name, image_string(&parser->image, name.value.string_value));
+    node->data.function_declaration.line = line;
+
+    // Parameters are stored as a list of names
+    NodeList* params = open_list(parser);
+
+    if (parser->current_token.type != TOKEN_RPAREN) {
+        Token param = eat(parser, TOKEN_IDENTIFIER);
+        node_list_push(params, (void*)image_string(&parser->image, param.value.string_value));
+
+        while (parser->current_token.type == TOKEN_COMMA) {
+            eat(parser, TOKEN_COMMA);
+            param = eat(parser, TOKEN_IDENTIFIER);
+            node_list_push(params, (void*)image_string(&parser->image, param.value.string_value));
+        }
+    }
+
+    AST_SET(node->data.function_declaration.params, close_list(parser, params));
+    node->data.function_declaration.params_length = params->length;
+
+    eat(parser, TOKEN_RPAREN);
+
+    if (parser->source && parser->current_token.type == TOKEN_LBRACE) {
+        AST_SET(node->data.function_declaration.body, skip_function_body(parser));
+    }
+    else {
+        AST_SET(node->data.function_declaration.body, parse_statement(parser));
+    }
+
+    return node;
+}
+
+// Finds the brace that closes the body and keeps its source text in the
+// image. Nothing inside is parsed, so syntax errors in it are only reported
+// when the function is first called.
+ASTNode* skip_function_body(Parser* parser) {
+    int start = parser->current_token.end - 1;
+    int line = parser->current_token.line;
+    int end = start;
+    int depth = 0;
+
+    do {
+        if (parser->current_token.type == TOKEN_LBRACE) {
+            depth++;
+        }
+        else if (parser->current_token.type == TOKEN_RBRACE) {
+            depth--;
+        }
+        else if (parser->current_token.type == TOKEN_EOF) {
+            eat(parser, TOKEN_RBRACE);
+        }
+
+        end = parser->current_token.end;
+        advance_parser(parser);
+    } while (depth > 0);
+
+    char* source = (char*)asc_malloc((size_t)(end - start) + 1, MEM_AST);
+    if (!source) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    memcpy(source, parser->source + start, (size_t)(end - start));
+    source[end - start] = '\0';
+
+    ASTNode* node = create_node(parser, NODE_LAZY_BODY);
+    AST_SET(node->data.lazy_body.source, image_string(&parser->image, source));
+    node->data.lazy_body.line = line;
+
+    asc_free(source);
+    return node;
+}
+
+ASTNode* parse_function_call(Parser* parser, const char* name) {
+    int line = parser->current_token.line;
+    eat(parser, TOKEN_LPAREN);
+
+    ASTNode* node = create_node(parser, NODE_CALL_EXPRESSION);
+    AST_SET(node->data.call_expression.name, image_string(&parser->image, name));
+    node->data.call_expression.line = line;
+    node->data.call_expression.builtin = find_builtin(name);
+
+    NodeList* arguments = open_list(parser);
+
+    if (parser->current_token.type != TOKEN_RPAREN) {
+        node_list_push(arguments, parse_expression(parser));
+
+        while (parser->current_token.type == TOKEN_COMMA) {
+            eat(parser, TOKEN_COMMA);
+            node_list_push(arguments, parse_expression(parser));
+        }
+    }
+
+    AST_SET(node->data.call_expression.arguments, close_list(parser, arguments));
+    node->data.call_expression.arguments_length = arguments->length;
+
+    eat(parser, TOKEN_RPAREN);
+
+    return node;
+}
+
+ASTNode* parse_return_statement(Parser* parser) {
+    eat(parser, TOKEN_RETURN);
+    ASTNode* argument = parse_expression(parser);
+    eat(parser, TOKEN_SEMICOLON);
+
+    ASTNode* node = create_node(parser, NODE_RETURN_STATEMENT);
+    AST_SET(node->data.return_statement.argument, argument);
+
+    return node;
+}
+
+// print(a, b, ...) writes its arguments back to back, then a newline. When
+// the first of several arguments is a string literal containing "{}", it is a
+// template: each "{}" is replaced by the next argument, "{{" and "}}" stand for
+// literal braces and arguments left over are written after it
+ASTNode* parse_print_statement(Parser* parser) {
+    eat(parser, TOKEN_PRINT);
+    eat(parser, TOKEN_LPAREN);
+
+    NodeList* arguments = open_list(parser);
+    node_list_push(arguments, parse_expression(parser));
+
+    while (parser->current_token.type == TOKEN_COMMA) {
+        eat(parser, TOKEN_COMMA);
+        node_list_push(arguments, parse_expression(parser));
+    }
+
+    eat(parser, TOKEN_RPAREN);
+    eat(parser, TOKEN_SEMICOLON);
+
+    if (arguments->length > 1) {
+        expand_print_template(parser, arguments);
+    }
+
+    ASTNode* node = create_node(parser, NODE_PRINT_STATEMENT);
+    node->data.print_statement.arguments_length = arguments->length;
+    AST_SET(node->data.print_statement.arguments, close_list(parser, arguments));
+
+    return node;
+}
+
+// Adds the template text collected so far as a string literal piece
+static void push_template_text(Parser* parser, NodeList* pieces, char* text, size_t* length) {
+    if (*length == 0) {
+        return;
+    }
+
+    text[*length] = '\0';
+    *length = 0;
+
+    ASTNode* node = create_node(parser, NODE_LITERAL);
+    AST_SET(node->data.literal.value.string, image_string(&parser->image, text));
+    node->data.literal.value_type = 's';
+    node_list_push(pieces, node);
+}
+
+// Splits a template into literal pieces and the arguments between them, so
+// that evaluating print never has to look at the template again
+void expand_print_template(Parser* parser, NodeList* arguments) {
+    ASTNode* first = (ASTNode*)arguments->items[0];
+
+    if (first->type != NODE_LITERAL || first->data.literal.value_type != 's') {
+        return;
+    }
+
+    const char* template_text = AST_STRING(first->data.literal.value.string);
+
+    if (strstr(template_text, "{}") == NULL) {
+        return;
+    }
+
+    char* text = (char*)asc_malloc(strlen(template_text) + 1, MEM_AST);
+    if (!text) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    NodeList* pieces = open_list(parser);
+    size_t length = 0;
+    int next = 1;
+    bool too_few = false;
+
+    for (const char* c = template_text; *c; c++) {
+        if ((c[0] == '{' && c[1] == '{') || (c[0] == '}' && c[1] == '}')) {
+            text[length++] = *c++;
+        }
+        else if (c[0] == '{' && c[1] == '}') {
+            if (next >= arguments->length) {
+                too_few = true;
+                break;
+            }
+
+            push_template_text(parser, pieces, text, &length);
+            node_list_push(pieces, arguments->items[next++]);
+            c++;
+        }
+        else {
+            text[length++] = *c;
+        }
+    }
+
+    if (too_few) {
+        asc_free(text);
+        syntax_error("Too few arguments for print template \"%s\"\n", template_text);
+    }
+
+    push_template_text(parser, pieces, text, &length);
+
+    while (next < arguments->length) {
+        node_list_push(pieces, arguments->items[next++]);
+    }
+
+    asc_free(text);
+
+    // The arguments take over the pieces, and the list closed in their place
+    // keeps the old buffer for reuse
+    NodeList swap = *arguments;
+    *arguments = *pieces;
+    *pieces = swap;
+    parser->open_lists--;
+}
+
+ASTNode* parse_import_statement(Parser* parser) {
+    eat(parser, TOKEN_IMPORT);
+    eat(parser, TOKEN_LPAREN);
+    Token path = eat(parser, TOKEN_STRING);
+    eat(parser, TOKEN_RPAREN);
+    eat(parser, TOKEN_SEMICOLON);
+
+    ASTNode* node = create_node(parser, NODE_IMPORT_STATEMENT);
+    AST_SET(node->data.import_statement.path, image_string(&parser->image, path.value.string_value));
+
+    return node;
+}
+
+ASTNode* parse_expression(Parser* parser) {
+    return parse_logical_or(parser);
+}
+
+ASTNode* parse_logical_or(Parser* parser) {
+    ASTNode* left = parse_logical_and(parser);
+
+    while (parser->current_token.type == TOKEN_OR) {
+        eat(parser, TOKEN_OR);
+        ASTNode* right = parse_logical_and(parser);
+
+        ASTNode* node = create_node(parser, NODE_LOGICAL_EXPRESSION);
+        AST_SET(node->data.logical_expression.operator, image_string(&parser->image, "||"));
+        AST_SET(node->data.logical_expression.left, left);
+        AST_SET(node->data.logical_expression.right, right);
+
+        left = node;
+    }
+
+    return left;
+}
+
+ASTNode* parse_logical_and(Parser* parser) {
+    ASTNode* left = parse_equality(parser);
+
+    while (parser->current_token.type == TOKEN_AND) {
+        eat(parser, TOKEN_AND);
         ASTNode* right = parse_equality(parser);
 
-        ASTNode* node = (ASTNode*)malloc(sizeof(ASTNode));
-        if (!node) {
+        ASTNode* node = create_node(parser, NODE_LOGICAL_EXPRESSION);
+        AST_SET(node->data.logical_expression.operator, image_string(&parser->image, "&&"));
+        AST_SET(node->data.logical_expression.left, left);
+        AST_SET(node->data.logical_expression.right, right);
+
+        left = node;
+    }
+
+    return left;
+}
+
+ASTNode* parse_equality(Parser* parser) {
+    ASTNode* left = parse_comparison(parser);
+
+    while (parser->current_token.type == TOKEN_EQUALS ||
+        parser->current_token.type == TOKEN_NOT_EQUALS) {
+
+        const char* operator;
+        if (parser->current_token.type == TOKEN_EQUALS) {
+            operator = "==";
+            eat(parser, TOKEN_EQUALS);
+        }
+        else {
+            operator = "!=";
+            eat(parser, TOKEN_NOT_EQUALS);
+        }
+
+        ASTNode* right = parse_comparison(parser);
+
+        ASTNode* node = create_node(parser, NODE_BINARY_EXPRESSION);
+        AST_SET(node->data.binary_expression.operator, image_string(&parser->image, operator));
+        AST_SET(node->data.binary_expression.left, left);
+        AST_SET(node->data.binary_expression.right, right);
+
+        left = node;
+    }
+
+    return left;
+}
+
+ASTNode* parse_comparison(Parser* parser) {
+    ASTNode* left = parse_addition(parser);
+
+    while (parser->current_token.type == TOKEN_GT ||
+        parser->current_token.type == TOKEN_GTE ||
+        parser->current_token.type == TOKEN_LT ||
+        parser->current_token.type == TOKEN_LTE) {
+
+        const char* operator;
+        if (parser->current_token.type == TOKEN_GT) {
+            operator = ">";
+            eat(parser, TOKEN_GT);
+        }
+        else if (parser->current_token.type == TOKEN_GTE) {
+            operator = ">=";
+            eat(parser, TOKEN_GTE);
+        }
+        else if (parser->current_token.type == TOKEN_LT) {
+            operator = "<";
+            eat(parser, TOKEN_LT);
+        }
+        else {
+            operator = "<=";
+            eat(parser, TOKEN_LTE);
+        }
+
+        ASTNode* right = parse_addition(parser);
+
+        ASTNode* node = create_node(parser, NODE_BINARY_EXPRESSION);
+        AST_SET(node->data.binary_expression.operator, image_string(&parser->image, operator));
+        AST_SET(node->data.binary_expression.left, left);
+        AST_SET(node->data.binary_expression.right, right);
+
+        left = node;
+    }
+
+    return left;
+}
+
+ASTNode* parse_addition(Parser* parser) {
+    ASTNode* left = parse_multiplication(parser);
+
+    while (parser->current_token.type == TOKEN_PLUS ||
+        parser->current_token.type == TOKEN_MINUS) {
+
+        const char* operator;
+        if (parser->current_token.type == TOKEN_PLUS) {
+            operator = "+";
+            eat(parser, TOKEN_PLUS);
+        }
+        else {
+            operator = "-";
+            eat(parser, TOKEN_MINUS);
+        }
+
+        ASTNode* right = parse_multiplication(parser);
+
+        ASTNode* node = create_node(parser, NODE_BINARY_EXPRESSION);
+        AST_SET(node->data.binary_expression.operator, image_string(&parser->image, operator));
+        AST_SET(node->data.binary_expression.left, left);
+        AST_SET(node->data.binary_expression.right, right);
+
+        left = node;
+    }
+
+    return left;
+}
+
+ASTNode* parse_multiplication(Parser* parser) {
+    ASTNode* left = parse_primary(parser);
+
+    while (parser->current_token.type == TOKEN_MULTIPLY ||
+        parser->current_token.type == TOKEN_DIVIDE ||
+        parser->current_token.type == TOKEN_MODULO) {
+
+        const char* operator;
+        if (parser->current_token.type == TOKEN_MULTIPLY) {
+            operator = "*";
+            eat(parser, TOKEN_MULTIPLY);
+        }
+        else if (parser->current_token.type == TOKEN_DIVIDE) {
+            operator = "/";
+            eat(parser, TOKEN_DIVIDE);
+        }
+        else {
+            operator = "%";
+            eat(parser, TOKEN_MODULO);
+        }
+
+        ASTNode* right = parse_primary(parser);
+
+        ASTNode* node = create_node(parser, NODE_BINARY_EXPRESSION);
+        AST_SET(node->data.binary_expression.operator, image_string(&parser->image, operator));
+        AST_SET(node->data.binary_expression.left, left);
+        AST_SET(node->data.binary_expression.right, right);
+
+        left = node;
+    }
+
+    return left;
+}
+
+ASTNode* parse_primary(Parser* parser) {
+    ASTNode* node;
+
+    switch (parser->current_token.type) {
+    case TOKEN_NUMBER: {
+        node = create_node(parser, NODE_LITERAL);
+        node->data.literal.value.number = parser->current_token.value.number_value;
+        node->data.literal.value_type = 'n';
+        eat(parser, TOKEN_NUMBER);
+        break;
+    }
+    case TOKEN_STRING: {
+        node = create_node(parser, NODE_LITERAL);
+        AST_SET(node->data.literal.value.string, image_string(&parser->image, parser->current_token.value.string_value));
+        node->data.literal.value_type = 's';
+        eat(parser, TOKEN_STRING);
+        break;
+    }
+    case TOKEN_TRUE: {
+        node = create_node(parser, NODE_LITERAL);
+        node->data.literal.value.boolean = true;
+        node->data.literal.value_type = 'b';
+        eat(parser, TOKEN_TRUE);
+        break;
+    }
+    case TOKEN_FALSE: {
+        node = create_node(parser, NODE_LITERAL);
+        node->data.literal.value.boolean = false;
+        node->data.literal.value_type = 'b';
+        eat(parser, TOKEN_FALSE);
+        break;
+    }
+    case TOKEN_IDENTIFIER: {
+        Token identifier = eat(parser, TOKEN_IDENTIFIER);
+
+        if (parser->current_token.type == TOKEN_LPAREN) {
+            node = parse_function_call(parser, identifier.value.string_value);
+            break;
+        }
+
+        node = create_node(parser, NODE_IDENTIFIER);
+        AST_SET(node->data.identifier.name, image_string(&parser->image, identifier.value.string_value));
+        break;
+    }
+    case TOKEN_LPAREN: {
+        eat(parser, TOKEN_LPAREN);
+        node = parse_expression(parser);
+        eat(parser, TOKEN_RPAREN);
+        break;
+    }
+    case TOKEN_LBRACKET:
+        node = parse_array_literal(parser);
+        break;
+    case TOKEN_LBRACE:
+        node = parse_map_literal(parser);
+        break;
+    default:
+        syntax_error("Unexpected token in primary expression: %d\n", parser->current_token.type);
+    }
+
+    return parse_postfix(parser, node);
+}
+
+ASTNode* parse_array_literal(Parser* parser) {
+    eat(parser, TOKEN_LBRACKET);
+
+    ASTNode* node = create_node(parser, NODE_ARRAY_LITERAL);
+    NodeList* elements = open_list(parser);
+
+    if (parser->current_token.type != TOKEN_RBRACKET) {
+        node_list_push(elements, parse_expression(parser));
+
+        while (parser->current_token.type == TOKEN_COMMA) {
+            eat(parser, TOKEN_COMMA);
+            node_list_push(elements, parse_expression(parser));
+        }
+    }
+
+    AST_SET(node->data.array_literal.elements, close_list(parser, elements));
+    node->data.array_literal.elements_length = elements->length;
+
+    eat(parser, TOKEN_RBRACKET);
+
+    return node;
+}
+
+// { key: value, ... } where each key is an expression giving a string or a
+// number
+ASTNode* parse_map_literal(Parser* parser) {
+    eat(parser, TOKEN_LBRACE);
+
+    ASTNode* node = create_node(parser, NODE_MAP_LITERAL);
+    NodeList* entries = open_list(parser);
+
+    while (parser->current_token.type != TOKEN_RBRACE) {
+        if (entries->length > 0) {
+            eat(parser, TOKEN_COMMA);
+        }
+
+        node_list_push(entries, parse_expression(parser));
+        eat(parser, TOKEN_COLON);
+        node_list_push(entries, parse_expression(parser));
+    }
+
+    node->data.map_literal.entries_length = entries->length / 2;
+    AST_SET(node->data.map_literal.entries, close_list(parser, entries));
+
+    eat(parser, TOKEN_RBRACE);
+
+    return node;
+}
+
+// Indexing and members following a primary expression: a[i], m[key],
+// a.length and a.push(x)
+ASTNode* parse_postfix(Parser* parser, ASTNode* node) {
+    while (true) {
+        if (parser->current_token.type == TOKEN_LBRACKET) {
+            eat(parser, TOKEN_LBRACKET);
+            ASTNode* index = parse_expression(parser);
+            eat(parser, TOKEN_RBRACKET);
+
+            ASTNode* access = create_node(parser, NODE_INDEX_EXPRESSION);
+            AST_SET(access->data.index_expression.object, node);
+            AST_SET(access->data.index_expression.index, index);
+            node = access;
+        }
+        else if (parser->current_token.type == TOKEN_DOT) {
+            eat(parser, TOKEN_DOT);
+            Token name = eat(parser, TOKEN_IDENTIFIER);
+
+            ASTNode* member = create_node(parser, NODE_MEMBER_EXPRESSION);
+            AST_SET(member->data.member_expression.object, node);
+            AST_SET(member->data.member_expression.name, image_string(&parser->image, name.value.string_value));
+
+            if (parser->current_token.type == TOKEN_LPAREN) {
+                eat(parser, TOKEN_LPAREN);
+                NodeList* arguments = open_list(parser);
+
+                if (parser->current_token.type != TOKEN_RPAREN) {
+                    node_list_push(arguments, parse_expression(parser));
+
+                    while (parser->current_token.type == TOKEN_COMMA) {
+                        eat(parser, TOKEN_COMMA);
+                        node_list_push(arguments, parse_expression(parser));
+                    }
+                }
+
+                eat(parser, TOKEN_RPAREN);
+
+                AST_SET(member->data.member_expression.arguments, close_list(parser, arguments));
+                member->data.member_expression.arguments_length = arguments->length;
+                member->data.member_expression.call = true;
+            }
+
+            node = member;
+        }
+        else {
+            return node;
+        }
+    }
+}
+
+// A statement starting with indexing or a member: a[i] = value; or a call
+// such as a.push(value);
+ASTNode* parse_postfix_statement(Parser* parser, ASTNode* target) {
+    if (target->type == NODE_INDEX_EXPRESSION && parser->current_token.type == TOKEN_ASSIGN) {
+        eat(parser, TOKEN_ASSIGN);
+        ASTNode* value = parse_expression(parser);
+        eat(parser, TOKEN_SEMICOLON);
+
+        ASTNode* node = create_node(parser, NODE_INDEX_ASSIGNMENT);
+        AST_SET(node->data.index_assignment.object, AST_NODE(target->data.index_expression.object));
+        AST_SET(node->data.index_assignment.index, AST_NODE(target->data.index_expression.index));
+        AST_SET(node->data.index_assignment.value, value);
+
+        return node;
+    }
+
+    if (target->type != NODE_CALL_EXPRESSION && (target->type != NODE_MEMBER_EXPRESSION || !target->data.member_expression.call)) {
+        syntax_error("Expected an assignment or a call\n");
+    }
+
+    eat(parser, TOKEN_SEMICOLON);
+    return target;
+}
+
+ASTNode* parse(Parser* parser) {
+    return parse_program(parser);
+}
+
+void free_parser(Parser* parser) {
+    free_tokens(parser->tokens, parser->tokens_length);
+
+    for (int i = 0; i < parser->lists_capacity; i++) {
+        asc_free(parser->lists[i]->items);
+        asc_free(parser->lists[i]);
+    }
+
+    asc_free(parser->lists);
+    free_image_builder(&parser->image);
+    asc_free(parser);
+}
+
+// Releases what a compile had allocated when a syntax error jumped out of it.
+// Either may be NULL; until the parser exists the tokens are the lexer's.
+void free_failed_compile(Lexer* lexer, Parser* parser) {
+    if (parser) {
+        free_parser(parser);
+    }
+    else if (lexer && lexer->tokens) {
+        free_tokens(lexer->tokens, lexer->token_count);
+    }
+
+    free_lexer(lexer);
+}
+
+// Interpreter implementation
+Interpreter* create_interpreter(void) {
+    Interpreter* interpreter = (Interpreter*)asc_malloc(sizeof(Interpreter), MEM_RUNTIME);
+    if (!interpreter) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    interpreter->scope_stack = (Scope**)asc_malloc(sizeof(Scope*) * 10, MEM_RUNTIME);
+    if (!interpreter->scope_stack) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    interpreter->scope_stack_length = 0;
+    interpreter->scope_stack_capacity = 10;
+    interpreter->has_return = false;
+    interpreter->base_dir = asc_strdup(".", MEM_RUNTIME);
+    interpreter->modules = create_module_registry();
+    interpreter->output = NULL;
+    interpreter->stack = NULL;
+    interpreter->stack_length = 0;
+    interpreter->stack_capacity = 0;
+    interpreter->kernels = select_numeric_kernels();
+    interpreter->frames = NULL;
+    interpreter->frames_length = 0;
+    interpreter->frames_capacity = 0;
+    interpreter->saved_scopes = NULL;
+    interpreter->saved_scopes_length = 0;
+    interpreter->saved_scopes_capacity = 0;
+
+    // Create global scope
+    Scope* global_scope = create_scope();
+    push_scope(interpreter, global_scope);
+
+    return interpreter;
+}
+
+Scope* create_scope(void) {
+    Scope* scope = (Scope*)asc_malloc(sizeof(Scope), MEM_SCOPE);
+    if (!scope) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    scope->names = (char**)asc_malloc(sizeof(char*) * 10, MEM_SCOPE);
+    if (!scope->names) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    scope->values = (Value*)asc_malloc(sizeof(Value) * 10, MEM_SCOPE);
+    if (!scope->values) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    scope->length = 0;
+    scope->capacity = 10;
+    STATS(runtime_stats.scopes_created++);
+    return scope;
+}
+
+void push_scope(Interpreter* interpreter, Scope* scope) {
+    if (interpreter->scope_stack_length >= interpreter->scope_stack_capacity) {
+        interpreter->scope_stack_capacity *= 2;
+        interpreter->scope_stack = (Scope**)asc_realloc(interpreter->scope_stack,
+            sizeof(Scope*) * interpreter->scope_stack_capacity, MEM_RUNTIME);
+        if (!interpreter->scope_stack) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+    }
+
+    interpreter->scope_stack[interpreter->scope_stack_length++] = scope;
+}
+
+Scope* pop_scope(Interpreter* interpreter) {
+    if (interpreter->scope_stack_length == 0) {
+        return NULL;
+    }
+
+    return interpreter->scope_stack[--interpreter->scope_stack_length];
+}
+
+Scope* get_current_scope(Interpreter* interpreter) {
+    if (interpreter->scope_stack_length == 0) {
+        return NULL;
+    }
+
+    return interpreter->scope_stack[interpreter->scope_stack_length - 1];
+}
+
+void define_variable(Scope* scope, const char* name, Value value) {
+    if (scope->length >= scope->capacity) {
+        scope->capacity *= 2;
+        scope->names = (char**)asc_realloc(scope->names, sizeof(char*) * scope->capacity, MEM_SCOPE);
+        if (!scope->names) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+
+        scope->values = (Value*)asc_realloc(scope->values, sizeof(Value) * scope->capacity, MEM_SCOPE);
+        if (!scope->values) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+    }
+
+    scope->names[scope->length] = asc_strdup(name, MEM_SCOPE);
+    scope->values[scope->length] = value;
+    scope->length++;
+}
+
+// The innermost definition of name, or NULL
+Value* find_variable(Interpreter* interpreter, const char* name) {
+    for (int i = interpreter->scope_stack_length - 1; i >= 0; i--) {
+        Scope* scope = interpreter->scope_stack[i];
+
+        for (int j = 0; j < scope->length; j++) {
+            if (strcmp(scope->names[j], name) == 0) {
+                STATS(record_lookup(interpreter, i, j));
+                if (scope->values[j].type == VALUE_IMPORT) {
+                    resolve_import(interpreter, &scope->values[j], name);
+                }
+                return &scope->values[j];
+            }
+        }
+    }
+
+    return NULL;
+}
+
+Value* lookup_variable(Interpreter* interpreter, const char* name) {
+    Value* value = find_variable(interpreter, name);
+
+    if (value == NULL) {
+        runtime_error("Variable '%s' is not defined\n", name);
+    }
+
+    return value;
+}
+
+Value evaluate(Interpreter* interpreter, ASTNode* node) {
+    STATS(runtime_stats.evaluations[node->type]++);
+
+    switch (node->type) {
+    case NODE_PROGRAM:
+        return evaluate_program(interpreter, node);
+    case NODE_BLOCK_STATEMENT:
+        return evaluate_block_statement(interpreter, node);
+    case NODE_VARIABLE_DECLARATION:
+        return evaluate_variable_declaration(interpreter, node);
+    case NODE_ASSIGNMENT_EXPRESSION:
+        return evaluate_assignment_expression(interpreter, node);
+    case NODE_BINARY_EXPRESSION:
+        return evaluate_binary_expression(interpreter, node);
+    case NODE_LOGICAL_EXPRESSION:
+        return evaluate_logical_expression(interpreter, node);
+    case NODE_LITERAL:
+        return evaluate_literal(interpreter, node);
+    case NODE_IDENTIFIER:
+        return evaluate_identifier(interpreter, node);
+    case NODE_IF_STATEMENT:
+        return evaluate_if_statement(interpreter, node);
+    case NODE_WHILE_STATEMENT:
+        return evaluate_while_statement(interpreter, node);
+    case NODE_FUNCTION_DECLARATION:
+        return evaluate_function_declaration(interpreter, node);
+    case NODE_CALL_EXPRESSION:
+        return evaluate_call_expression(interpreter, node);
+    case NODE_RETURN_STATEMENT:
+        return evaluate_return_statement(interpreter, node);
+    case NODE_PRINT_STATEMENT:
+        return evaluate_print_statement(interpreter, node);
+    case NODE_IMPORT_STATEMENT:
+        return evaluate_import_statement(interpreter, node);
+    case NODE_ARRAY_LITERAL:
+        return evaluate_array_literal(interpreter, node);
+    case NODE_MAP_LITERAL:
+        return evaluate_map_literal(interpreter, node);
+    case NODE_INDEX_EXPRESSION:
+        return evaluate_index_expression(interpreter, node);
+    case NODE_INDEX_ASSIGNMENT:
+        return evaluate_index_assignment(interpreter, node);
+    case NODE_MEMBER_EXPRESSION:
+        return evaluate_member_expression(interpreter, node);
+    case NODE_LAZY_BODY:
+        return evaluate(interpreter, lazy_function_body(node));
+    default:
+        runtime_error("Unknown node type: %d\n", node->type);
+    }
+
+    // To avoid compiler warning
+    Value null_value;
+    null_value.type = VALUE_NULL;
+    return null_value;
+}
+
+Value evaluate_program(Interpreter* interpreter, ASTNode* node) {
+    return evaluate_program_range(interpreter, node, 0, node->data.program.body_length);
+}
+
+// Evaluates top-level statements from up to, not including, to
+Value evaluate_program_range(Interpreter* interpreter, ASTNode* node, int from, int to) {
+    Value result;
+    result.type = VALUE_NULL;
+
+    for (int i = from; i < to; i++) {
+        result = evaluate(interpreter, AST_NODE(AST_LIST(node->data.program.body)[i]));
+
+        if (interpreter->has_return) {
+            return interpreter->return_value;
+        }
+    }
+
+    return result;
+}
+
+Value evaluate_block_statement(Interpreter* interpreter, ASTNode* node) {
+    Value result;
+    result.type = VALUE_NULL;
+
+    Scope* scope = create_scope();
+    push_scope(interpreter, scope);
+
+    for (int i = 0; i < node->data.block_statement.body_length; i++) {
+        result = evaluate(interpreter, AST_NODE(AST_LIST(node->data.block_statement.body)[i]));
+
+        if (interpreter->has_return) {
+            break;
+        }
+    }
+
+    pop_scope(interpreter);
+    return result;
+}
+
+Value evaluate_variable_declaration(Interpreter* interpreter, ASTNode* node) {
+    Value value = evaluate(interpreter, AST_NODE(node->data.variable_declaration.value));
+    define_variable(get_current_scope(interpreter), AST_STRING(node->data.variable_declaration.name), value);
+    return value;
+}
+
+Value evaluate_assignment_expression(Interpreter* interpreter, ASTNode* node) {
+    return assign_variable(interpreter, node, evaluate(interpreter, AST_NODE(node->data.assignment_expression.value)));
+}
+
+// Stores the evaluated value of an assignment in the innermost variable of
+// its name
+Value assign_variable(Interpreter* interpreter, ASTNode* node, Value value) {
+    for (int i = interpreter->scope_stack_length - 1; i >= 0; i--) {
+        Scope* scope = interpreter->scope_stack[i];
+
+        for (int j = 0; j < scope->length; j++) {
+            if (strcmp(scope->names[j], AST_STRING(node->data.assignment_expression.name)) == 0) {
+                STATS(record_lookup(interpreter, i, j));
+                scope->values[j] = value;
+                return value;
+            }
+        }
+    }
+
+    runtime_error("Variable '%s' is not defined\n", AST_STRING(node->data.assignment_expression.name));
+
+    // To avoid compiler warning
+    Value null_value;
+    null_value.type = VALUE_NULL;
+    return null_value;
+}
+
+Value evaluate_binary_expression(Interpreter* interpreter, ASTNode* node) {
+    Value left = evaluate(interpreter, AST_NODE(node->data.binary_expression.left));
+    Value right = evaluate(interpreter, AST_NODE(node->data.binary_expression.right));
+    return binary_operation(node, left, right);
+}
+
+// Applies a binary expression's operator to its evaluated operands
+Value binary_operation(ASTNode* node, Value left, Value right) {
+    ASTNode* left_node = AST_NODE(node->data.binary_expression.left);
+    ASTNode* right_node = AST_NODE(node->data.binary_expression.right);
+    Value result;
+
+    // Handle numeric operations
+    if (left.type == VALUE_NUMBER && right.type == VALUE_NUMBER) {
+        result.type = VALUE_NUMBER;
+
+        if (strcmp(AST_STRING(node->data.binary_expression.operator), "+") == 0) {
+            result.data.number = left.data.number + right.data.number;
+        }
+        else if (strcmp(AST_STRING(node->data.binary_expression.operator), "-") == 0) {
+            result.data.number = left.data.number - right.data.number;
+        }
+        else if (strcmp(AST_STRING(node->data.binary_expression.operator), "*") == 0) {
+            result.data.number = left.data.number * right.data.number;
+        }
+        else if (strcmp(AST_STRING(node->data.binary_expression.operator), "/") == 0) {
+            result.data.number = left.data.number / right.data.number;
+        }
+        else if (strcmp(AST_STRING(node->data.binary_expression.operator), "%") == 0) {
+            result.data.number = (int)left.data.number % (int)right.data.number;
+        }
+        else if (strcmp(AST_STRING(node->data.binary_expression.operator), "==") == 0) {
+            result.type = VALUE_BOOLEAN;
+            result.data.boolean = left.data.number == right.data.number;
+        }
+        else if (strcmp(AST_STRING(node->data.binary_expression.operator), "!=") == 0) {
+            result.type = VALUE_BOOLEAN;
+            result.data.boolean = left.data.number != right.data.number;
+        }
+        else if (strcmp(AST_STRING(node->data.binary_expression.operator), ">") == 0) {
+            result.type = VALUE_BOOLEAN;
+            result.data.boolean = left.data.number > right.data.number;
+        }
+        else if (strcmp(AST_STRING(node->data.binary_expression.operator), ">=") == 0) {
+            result.type = VALUE_BOOLEAN;
+            result.data.boolean = left.data.number >= right.data.number;
+        }
+        else if (strcmp(AST_STRING(node->data.binary_expression.operator), "<") == 0) {
+            result.type = VALUE_BOOLEAN;
+            result.data.boolean = left.data.number < right.data.number;
+        }
+        else if (strcmp(AST_STRING(node->data.binary_expression.operator), "<=") == 0) {
+            result.type = VALUE_BOOLEAN;
+            result.data.boolean = left.data.number <= right.data.number;
+        }
+    }
+    // Handle string operations
+    else if (left.type == VALUE_STRING && right.type == VALUE_STRING) {
+        if (strcmp(AST_STRING(node->data.binary_expression.operator), "+") == 0) {
+            result.type = VALUE_STRING;
+            result.data.string = (char*)asc_malloc(strlen(left.data.string) + strlen(right.data.string) + 1, MEM_STRING);
+            if (!result.data.string) {
+                fprintf(stderr, "Memory allocation failed\n");
+                exit(1);
+            }
+
+            strcpy(result.data.string, left.data.string);
+            strcat(result.data.string, right.data.string);
+
+            STATS(runtime_stats.string_concatenations++);
+            STATS(runtime_stats.string_bytes_copied += strlen(result.data.string) + 1);
+        }
+        else if (strcmp(AST_STRING(node->data.binary_expression.operator), "==") == 0) {
+            result.type = VALUE_BOOLEAN;
+            result.data.boolean = strcmp(left.data.string, right.data.string) == 0;
+        }
+        else if (strcmp(AST_STRING(node->data.binary_expression.operator), "!=") == 0) {
+            result.type = VALUE_BOOLEAN;
+            result.data.boolean = strcmp(left.data.string, right.data.string) != 0;
+        }
+        else {
+            runtime_error("Invalid operator '%s' for strings\n", AST_STRING(node->data.binary_expression.operator));
+        }
+    }
+    // Handle boolean operations
+    else if (left.type == VALUE_BOOLEAN && right.type == VALUE_BOOLEAN) {
+        result.type = VALUE_BOOLEAN;
+
+        if (strcmp(AST_STRING(node->data.binary_expression.operator), "==") == 0) {
+            result.data.boolean = left.data.boolean == right.data.boolean;
+        }
+        else if (strcmp(AST_STRING(node->data.binary_expression.operator), "!=") == 0) {
+            result.data.boolean = left.data.boolean != right.data.boolean;
+        }
+        else {
+            runtime_error("Invalid operator '%s' for booleans\n", AST_STRING(node->data.binary_expression.operator));
+        }
+    }
+    // Arrays and maps only compare, by identity
+    else if (left.type == VALUE_ARRAY || right.type == VALUE_ARRAY || left.type == VALUE_MAP || right.type == VALUE_MAP) {
+        bool same = left.type == right.type &&
+            (left.type == VALUE_ARRAY ? left.data.array == right.data.array : left.data.map == right.data.map);
+        result.type = VALUE_BOOLEAN;
+
+        if (strcmp(AST_STRING(node->data.binary_expression.operator), "==") == 0) {
+            result.data.boolean = same;
+        }
+        else if (strcmp(AST_STRING(node->data.binary_expression.operator), "!=") == 0) {
+            result.data.boolean = !same;
+        }
+        else {
+            runtime_error("Invalid operator '%s' for %s\n", AST_STRING(node->data.binary_expression.operator),
+                left.type == VALUE_MAP || right.type == VALUE_MAP ? "maps" : "arrays");
+        }
+    }
+    // Handle mixed types with type coercion for + operator
+    else if (strcmp(AST_STRING(node->data.binary_expression.operator), "+") == 0) {
+        // Convert to string and concatenate
+        char left_number[NUMBER_BUFFER_SIZE];
+        char right_number[NUMBER_BUFFER_SIZE];
+        const char* left_text = value_text(left, left_number);
+        const char* right_text = value_text(right, right_number);
+        size_t left_length = strlen(left_text);
+        size_t right_length = strlen(right_text);
+
+        result.type = VALUE_STRING;
+        result.data.string = (char*)asc_malloc(left_length + right_length + 1, MEM_STRING);
+        if (!result.data.string) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+
+        memcpy(result.data.string, left_text, left_length);
+        memcpy(result.data.string + left_length, right_text, right_length + 1);
+
+        STATS(runtime_stats.string_concatenations++);
+        STATS(runtime_stats.string_bytes_copied += left_length + right_length + 1);
+    }
+    // Handle other mixed types
+    else if (strcmp(AST_STRING(node->data.binary_expression.operator), "==") == 0) {
+        result.type = VALUE_BOOLEAN;
+        result.data.boolean = false; // Different types are never equal
+    }
+    else if (strcmp(AST_STRING(node->data.binary_expression.operator), "!=") == 0) {
+        result.type = VALUE_BOOLEAN;
+        result.data.boolean = true; // Different types are always not equal
+    }
+    else {
+        runtime_error("Invalid operator '%s' for mixed types\n", AST_STRING(node->data.binary_expression.operator));
+    }
+
+    // Intermediate strings of a chain like "x=" + x + " y=" + y
+    if (is_temporary_string(left_node, left)) {
+        free_value(left);
+    }
+
+    if (is_temporary_string(right_node, right)) {
+        free_value(right);
+    }
+
+    return result;
+}
+
+Value evaluate_logical_expression(Interpreter* interpreter, ASTNode* node) {
+    Value left = evaluate(interpreter, AST_NODE(node->data.logical_expression.left));
+    Value result;
+
+    if (strcmp(AST_STRING(node->data.logical_expression.operator), "&&") == 0) {
+        if (left.type == VALUE_BOOLEAN && !left.data.boolean) {
+            result.type = VALUE_BOOLEAN;
+            result.data.boolean = false;
+            return result;
+        }
+
+        Value right = evaluate(interpreter, AST_NODE(node->data.logical_expression.right));
+        result.type = VALUE_BOOLEAN;
+        result.data.boolean = (right.type == VALUE_BOOLEAN) ? right.data.boolean : false;
+    }
+    else if (strcmp(AST_STRING(node->data.logical_expression.operator), "||") == 0) {
+        if (left.type == VALUE_BOOLEAN && left.data.boolean) {
+            result.type = VALUE_BOOLEAN;
+            result.data.boolean = true;
+            return result;
+        }
+
+        Value right = evaluate(interpreter, AST_NODE(node->data.logical_expression.right));
+        result.type = VALUE_BOOLEAN;
+        result.data.boolean = (right.type == VALUE_BOOLEAN) ? right.data.boolean : false;
+    }
+
+    return result;
+}
+
+Value evaluate_literal(Interpreter* interpreter, ASTNode* node) {
+    Value result;
+
+    switch (node->data.literal.value_type) {
+    case 'n':
+        result.type = VALUE_NUMBER;
+        result.data.number = node->data.literal.value.number;
+        break;
+    case 's':
+        result.type = VALUE_STRING;
+        result.data.string = asc_strdup(AST_STRING(node->data.literal.value.string), MEM_STRING);
+        STATS(runtime_stats.string_bytes_copied += strlen(result.data.string) + 1);
+        break;
+    case 'b':
+        result.type = VALUE_BOOLEAN;
+        result.data.boolean = node->data.literal.value.boolean;
+        break;
+    default:
+        runtime_error("Unknown literal type: %c\n", node->data.literal.value_type);
+    }
+
+    return result;
+}
+
+Value evaluate_identifier(Interpreter* interpreter, ASTNode* node) {
+    const char* name = AST_STRING(node->data.identifier.name);
+    Value* value = find_variable(interpreter, name);
+
+    if (value != NULL) {
+        return *value;
+    }
+
+    int builtin = find_builtin(name);
+    if (builtin < 0) {
+        runtime_error("Variable '%s' is not defined\n", name);
+    }
+
+    Value result;
+    result.type = VALUE_NATIVE;
+    result.data.native = &builtins[builtin];
+    return result;
+}
+
+Value evaluate_if_statement(Interpreter* interpreter, ASTNode* node) {
+    Value test = evaluate(interpreter, AST_NODE(node->data.if_statement.test));
+    Value result;
+    result.type = VALUE_NULL;
+
+    if (test.type == VALUE_BOOLEAN && test.data.boolean) {
+        result = evaluate(interpreter, AST_NODE(node->data.if_statement.consequent));
+    }
+    else if (AST_NODE(node->data.if_statement.alternate) != NULL) {
+        result = evaluate(interpreter, AST_NODE(node->data.if_statement.alternate));
+    }
+
+    return result;
+}
+
+Value evaluate_while_statement(Interpreter* interpreter, ASTNode* node) {
+    Value result;
+    result.type = VALUE_NULL;
+
+    while (true) {
+        Value test = evaluate(interpreter, AST_NODE(node->data.while_statement.test));
+
+        if (test.type != VALUE_BOOLEAN || !test.data.boolean) {
+            break;
+        }
+
+        result = evaluate(interpreter, AST_NODE(node->data.while_statement.body));
+
+        if (interpreter->has_return) {
+            break;
+        }
+    }
+
+    return result;
+}
+
+Value evaluate_function_declaration(Interpreter* interpreter, ASTNode* node) {
+    Value result;
+    result.type = VALUE_FUNCTION;
+    result.data.function.name = asc_strdup(AST_STRING(node->data.function_declaration.name), MEM_CLOSURE);
+
+    // Copy parameters
+    result.data.function.params = (char**)asc_malloc(sizeof(char*) * node->data.function_declaration.params_length, MEM_CLOSURE);
+    if (!result.data.function.params) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    result.data.function.params_length = node->data.function_declaration.params_length;
+
+    for (int i = 0; i < node->data.function_declaration.params_length; i++) {
+        result.data.function.params[i] = asc_strdup(AST_STRING(AST_LIST(node->data.function_declaration.params)[i]), MEM_CLOSURE);
+    }
+
+    result.data.function.body = AST_NODE(node->data.function_declaration.body);
+
+    // Capture current scope (closure)
+    result.data.function.closure = (Scope**)asc_malloc(sizeof(Scope*) * interpreter->scope_stack_length, MEM_CLOSURE);
+    if (!result.data.function.closure) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    result.data.function.closure_length = interpreter->scope_stack_length;
+
+    for (int i = 0; i < interpreter->scope_stack_length; i++) {
+        result.data.function.closure[i] = interpreter->scope_stack[i];
+    }
+
+    define_variable(get_current_scope(interpreter), AST_STRING(node->data.function_declaration.name), result);
+
+    return result;
+}
+
+Value evaluate_call_expression(Interpreter* interpreter, ASTNode* node) {
+    Value* func_value = find_variable(interpreter, AST_STRING(node->data.call_expression.name));
+
+    if (func_value == NULL) {
+        if (node->data.call_expression.builtin < 0) {
+            runtime_error("Variable '%s' is not defined\n", AST_STRING(node->data.call_expression.name));
+        }
+
+        return call_native(interpreter, &builtins[node->data.call_expression.builtin], node);
+    }
+
+    if (func_value->type == VALUE_NATIVE) {
+        return call_native(interpreter, func_value->data.native, node);
+    }
+
+    if (func_value->type != VALUE_FUNCTION) {
+        runtime_error("'%s' is not a function\n", AST_STRING(node->data.call_expression.name));
+    }
+
+    // Later calls through this variable go straight to the parsed body
+    if (func_value->data.function.body->type == NODE_LAZY_BODY) {
+        func_value->data.function.body = lazy_function_body(func_value->data.function.body);
+    }
+
+    // Evaluate arguments
+    Value* args = (Value*)asc_malloc(sizeof(Value) * node->data.call_expression.arguments_length, MEM_CALL);
+    if (!args) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < node->data.call_expression.arguments_length; i++) {
+        args[i] = evaluate(interpreter, AST_NODE(AST_LIST(node->data.call_expression.arguments)[i]));
+    }
+
+    Value result = call_function(interpreter, *func_value, args, node->data.call_expression.arguments_length, node->data.call_expression.line);
+    asc_free(args);
+
+    return result;
+}
+
+// Calls a script function with evaluated arguments. line is the call site,
+// 0 when called from the host.
+Value call_function(Interpreter* interpreter, Value function, Value* args, int args_length, int line) {
+    // Save current scope
+    Scope** previous_scope = (Scope**)asc_malloc(sizeof(Scope*) * interpreter->scope_stack_length, MEM_CALL);
+    if (!previous_scope) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    int previous_scope_length = interpreter->scope_stack_length;
+    uint64_t call_start = enter_function(interpreter, &function, args, args_length, line, previous_scope);
+
+    // Execute function body
+    Value result = explicit_stack ? run_machine(interpreter, function.data.function.body, 0, -1) :
+        evaluate(interpreter, function.data.function.body);
+
+    result = leave_function(interpreter, &function, result, previous_scope, previous_scope_length, call_start);
+    asc_free(previous_scope);
+
+    return result;
+}
+
+// Starts a call: records it for the tooling, saves the caller's scope stack
+// to previous_scope and binds the arguments in a new scope under the
+// function's closure. Returns the start time for --trace-calls.
+uint64_t enter_function(Interpreter* interpreter, const Value* func_value, Value* args, int args_length, int line,
+                        Scope** previous_scope) {
+    STATS(runtime_stats.function_calls++);
+
+    if (profiler.enabled) {
+        profiler_enter(func_value->data.function.name);
+    }
+
+    if (sampler.enabled) {
+        sampler_push(func_value->data.function.name, line);
+    }
+
+    uint64_t call_start = tracer.trace_calls ? monotonic_ns() : 0;
+
+    for (int i = 0; i < interpreter->scope_stack_length; i++) {
+        previous_scope[i] = interpreter->scope_stack[i];
+    }
+
+    // Set up function scope
+    interpreter->scope_stack_length = 0;
+
+    for (int i = 0; i < func_value->data.function.closure_length; i++) {
+        push_scope(interpreter, func_value->data.function.closure[i]);
+    }
+
+    Scope* local_scope = create_scope();
+    push_scope(interpreter, local_scope);
+
+    // Bind parameters to arguments
+    for (int i = 0; i < func_value->data.function.params_length; i++) {
+        if (i < args_length) {
+            define_variable(local_scope, func_value->data.function.params[i], args[i]);
+        }
+        else {
+            // Default to null if not enough arguments
+            Value null_value;
+            null_value.type = VALUE_NULL;
+            define_variable(local_scope, func_value->data.function.params[i], null_value);
+        }
+    }
+
+    return call_start;
+}
+
+// Ends a call started by enter_function once the body has given result, and
+// returns the call's value
+Value leave_function(Interpreter* interpreter, const Value* func_value, Value result, Scope** previous_scope,
+                     int previous_scope_length, uint64_t call_start) {
+    // Restore previous scope
+    interpreter->scope_stack_length = 0;
+
+    for (int i = 0; i < previous_scope_length; i++) {
+        push_scope(interpreter, previous_scope[i]);
+    }
+
+    // Handle return value
+    if (interpreter->has_return) {
+        result = interpreter->return_value;
+        interpreter->has_return = false;
+    }
+
+    if (tracer.trace_calls && monotonic_ns() - call_start >= tracer.call_threshold_ns) {
+        trace_event(func_value->data.function.name, "call", call_start);
+    }
+
+    if (sampler.enabled) {
+        sampler_pop();
+    }
+
+    if (profiler.enabled) {
+        profiler_exit();
+    }
+
+    return result;
+}
+
+Value evaluate_return_statement(Interpreter* interpreter, ASTNode* node) {
+    interpreter->return_value = evaluate(interpreter, AST_NODE(node->data.return_statement.argument));
+    interpreter->has_return = true;
+    return interpreter->return_value;
+}
+
+Value evaluate_print_statement(Interpreter* interpreter, ASTNode* node) {
+    OutputBuffer* output = interpreter->output;
+    RelPtr* arguments = AST_LIST(node->data.print_statement.arguments);
+
+    for (int i = 0; i < node->data.print_statement.arguments_length; i++) {
+        ASTNode* argument = AST_NODE(arguments[i]);
+
+        if (!print_literal(output, argument)) {
+            print_argument(output, argument, evaluate(interpreter, argument));
+        }
+    }
+
+    return end_print_line(output);
+}
+
+// Literal text goes straight from the program image, without evaluating the
+// argument
+bool print_literal(OutputBuffer* output, const ASTNode* argument) {
+    if (argument->type != NODE_LITERAL || argument->data.literal.value_type != 's') {
+        return false;
+    }
+
+    const char* text = AST_STRING(argument->data.literal.value.string);
+    output_write(output, text, strlen(text));
+    return true;
+}
+
+void print_argument(OutputBuffer* output, const ASTNode* argument, Value value) {
+    write_value(output, value);
+
+    if (is_temporary_string(argument, value)) {
+        free_value(value);
+    }
+}
+
+Value end_print_line(OutputBuffer* output) {
+    output_write(output, "\n", 1);
+
+    if (unbuffered_output) {
+        output_flush(output);
+    }
+
+    Value result;
+    result.type = VALUE_NULL;
+    return result;
+}
+
+// Writes the text print shows for value
+void write_value(OutputBuffer* output, Value value) {
+    char number[NUMBER_BUFFER_SIZE];
+
+    switch (value.type) {
+    case VALUE_NUMBER:
+        output_write(output, number, (size_t)format_number(value.data.number, number));
+        break;
+    case VALUE_STRING:
+        output_write(output, value.data.string, strlen(value.data.string));
+        break;
+    case VALUE_BOOLEAN:
+        output_write(output, value.data.boolean ? "true" : "false", value.data.boolean ? 4 : 5);
+        break;
+    case VALUE_FUNCTION:
+        output_write(output, "[Function: ", 11);
+        output_write(output, value.data.function.name, strlen(value.data.function.name));
+        output_write(output, "]", 1);
+        break;
+    case VALUE_NULL:
+        output_write(output, "null", 4);
+        break;
+    case VALUE_IMPORT:
+        // lookup_variable resolves stubs before an expression sees them
+        break;
+    case VALUE_ARRAY:
+        write_array(output, value.data.array, 0);
+        break;
+    case VALUE_MAP:
+        write_map(output, value.data.map, 0);
+        break;
+    case VALUE_NATIVE:
+        output_write(output, "[Function: ", 11);
+        output_write(output, value.data.native->name, strlen(value.data.native->name));
+        output_write(output, "]", 1);
+        break;
+    }
+}
+
+// An element of an array or map: strings are quoted, and nesting deeper than
+// PRINT_DEPTH_LIMIT prints as [...] or {...}, so a value that holds itself
+// still prints
+static void write_element(OutputBuffer* output, Value value, int depth) {
+    if (value.type == VALUE_STRING) {
+        output_write(output, "\"", 1);
+        output_write(output, value.data.string, strlen(value.data.string));
+        output_write(output, "\"", 1);
+    }
+    else if (value.type == VALUE_ARRAY) {
+        if (depth + 1 >= PRINT_DEPTH_LIMIT) {
+            output_write(output, "[...]", 5);
+        }
+        else {
+            write_array(output, value.data.array, depth + 1);
+        }
+    }
+    else if (value.type == VALUE_MAP) {
+        if (depth + 1 >= PRINT_DEPTH_LIMIT) {
+            output_write(output, "{...}", 5);
+        }
+        else {
+            write_map(output, value.data.map, depth + 1);
+        }
+    }
+    else {
+        write_value(output, value);
+    }
+}
+
+// Arrays print as [1, "two", [3]]
+void write_array(OutputBuffer* output, const Array* array, int depth) {
+    char number[NUMBER_BUFFER_SIZE];
+
+    output_write(output, "[", 1);
+
+    for (int i = 0; i < array->length; i++) {
+        if (i > 0) {
+            output_write(output, ", ", 2);
+        }
+
+        if (array->packed) {
+            output_write(output, number, (size_t)format_number(array->items.numbers[i], number));
+        }
+        else {
+            write_element(output, array->items.values[i], depth);
+        }
+    }
+
+    output_write(output, "]", 1);
+}
+
+// Maps print as {"a": 1, 2: "b"} in insertion order
+void write_map(OutputBuffer* output, const Map* map, int depth) {
+    bool first = true;
+
+    output_write(output, "{", 1);
+
+    for (int i = 0; i < map->entries_length; i++) {
+        const MapEntry* entry = &map->entries[i];
+
+        if (entry->key.type == VALUE_NULL) {
+            continue;
+        }
+
+        if (!first) {
+            output_write(output, ", ", 2);
+        }
+
+        first = false;
+        write_element(output, entry->key, depth);
+        output_write(output, ": ", 2);
+        write_element(output, entry->value, depth);
+    }
+
+    output_write(output, "}", 1);
+}
+
+// The text a value turns into when '+' joins it to a string. number must hold
+// NUMBER_BUFFER_SIZE bytes, numbers are formatted into it.
+const char* value_text(Value value, char* number) {
+    switch (value.type) {
+    case VALUE_NUMBER:
+        format_number(value.data.number, number);
+        return number;
+    case VALUE_STRING:
+        return value.data.string;
+    case VALUE_BOOLEAN:
+        return value.data.boolean ? "true" : "false";
+    default:
+        return "null";
+    }
+}
+
+// A string made by '+' or by a string literal is only referenced by the
+// expression that evaluated node, which may free it once it is used
+bool is_temporary_string(const ASTNode* node, Value value) {
+    return value.type == VALUE_STRING && (node->type == NODE_BINARY_EXPRESSION || node->type == NODE_LITERAL);
+}
+
+Value evaluate_import_statement(Interpreter* interpreter, ASTNode* node) {
+    Value result;
+    result.type = VALUE_NULL;
+
+    const char* file_path = AST_STRING(node->data.import_statement.path);
+    char* path = resolve_import_path(interpreter->modules, interpreter->base_dir, file_path);
+
+    if (path == NULL) {
+        runtime_error("Error importing file '%s'\n", file_path);
+    }
+
+    if (lazy_imports) {
+        bind_import_stubs(interpreter, path, file_path, get_current_scope(interpreter));
+    }
+    else {
+        result = import_module(interpreter, path, file_path, get_current_scope(interpreter));
+    }
+
+    asc_free(path);
+    return result;
+}
+
+// Makes sure a module's program is parsed. Normally the loader threads or
+// another interpreter have parsed it already.
+static void load_module_program(Interpreter* interpreter, Module* module, const char* path, const char* file_path, const char* directory) {
+    ProgramStore* store = interpreter->modules->store;
+    const Bundle* bundle = interpreter->modules->bundle;
+    uint64_t read_start = tracer.enabled ? monotonic_ns() : 0;
+    Program* program = module->program;
+    bool parsed = false;
+
+    if (program == NULL && bundle) {
+        int alias = find_name(&bundle->aliases, path);
+        if (alias < 0) {
+            runtime_error("Error importing file '%s'\n", file_path);
+        }
+        program = bundle->programs[bundle->alias_modules[alias]];
+    }
+    else if (program == NULL && store) {
+        program = find_shared_program(store, path);
+    }
+
+    if (program == NULL) {
+        char* code = read_file(path);
+
+        if (tracer.enabled) {
+            trace_event("read_file", "io", read_start);
+        }
+
+        if (code == NULL) {
+            runtime_error("Error importing file '%s'\n", file_path);
+        }
+
+        program = compile_source(code);
+        asc_free(code);
+
+        if (store) {
+            program = share_program(store, path, program);
+        }
+
+        parsed = true;
+    }
+
+    // The loader threads skip modules that have a program
+    registry_lock(interpreter->modules);
+    module->program = program;
+    registry_unlock(interpreter->modules);
+
+    if (parsed) {
+        prefetch_imports(interpreter->modules, program_root(program), directory);
+    }
+}
+
+// Runs the module at a canonical path in scope on its first import. Later
+// imports bind what it defined into their own scope.
+Value import_module(Interpreter* interpreter, const char* path, const char* file_path, Scope* scope) {
+    Value result;
+    result.type = VALUE_NULL;
+
+    bool first;
+    Module* module = begin_import(interpreter->modules, path, &first);
+
+    if (!first) {
+        // Already loaded, or still loading in an import cycle
+        if (module->loaded && module->exports != scope) {
+            bind_module_exports(module, scope);
+        }
+
+        return result;
+    }
+
+    uint64_t import_start = tracer.enabled ? monotonic_ns() : 0;
+    char* directory = path_directory(path);
+
+    load_module_program(interpreter, module, path, file_path, directory);
+
+    module->exports = scope;
+    result = process_import(interpreter, module, directory);
+    module->loaded = true;
+
+    if (tracer.enabled) {
+        trace_event(file_path, "import", import_start);
+    }
+
+    asc_free(directory);
+    return result;
+}
+
+// Defines a stub for each name an import of the module at path binds, in
+// the order running it would: its top-level declarations, and the names its
+// top-level imports bind. Each stub names the module that declares it, so
+// using a name only runs that module.
+static void define_import_stubs(Interpreter* interpreter, const char* path, const char* file_path, Scope* scope, NodeList* visited) {
+    Module* module = wait_for_module(interpreter->modules, path);
+
+    for (int i = 0; i < visited->length; i++) {
+        if (visited->items[i] == module) {
+            return;
+        }
+    }
+
+    node_list_push(visited, module);
+
+    char* directory = path_directory(path);
+    load_module_program(interpreter, module, path, file_path, directory);
+
+    ASTNode* root = program_root(module->program);
+
+    for (int i = 0; i < root->data.program.body_length; i++) {
+        ASTNode* statement = AST_NODE(AST_LIST(root->data.program.body)[i]);
+        const char* name = NULL;
+
+        if (statement->type == NODE_FUNCTION_DECLARATION) {
+            name = AST_STRING(statement->data.function_declaration.name);
+        }
+        else if (statement->type == NODE_VARIABLE_DECLARATION) {
+            name = AST_STRING(statement->data.variable_declaration.name);
+        }
+        else if (statement->type == NODE_IMPORT_STATEMENT) {
+            const char* import_path = AST_STRING(statement->data.import_statement.path);
+            char* nested_path = resolve_import_path(interpreter->modules, directory, import_path);
+
+            // A missing file is reported when the module runs
+            if (nested_path) {
+                define_import_stubs(interpreter, nested_path, import_path, scope, visited);
+                asc_free(nested_path);
+            }
+        }
+
+        if (name) {
+            Value stub;
+            stub.type = VALUE_IMPORT;
+            stub.data.import = asc_strdup(path, MEM_STRING);
+            define_variable(scope, name, stub);
+        }
+    }
+
+    asc_free(directory);
+}
+
+// Binds the names an import of the module at path would, as stubs that run
+// the module on first use. A module that has already run is bound as usual.
+void bind_import_stubs(Interpreter* interpreter, const char* path, const char* file_path, Scope* scope) {
+    Module* module = wait_for_module(interpreter->modules, path);
+
+    if (module->loaded) {
+        if (module->exports != scope) {
+            bind_module_exports(module, scope);
+        }
+        return;
+    }
+
+    NodeList visited = { 0 };
+    define_import_stubs(interpreter, path, file_path, scope, &visited);
+    asc_free(visited.items);
+}
+
+// Replaces a stub with the value its module gives the name, running the
+// module in a scope of its own the first time. The value found may itself be
+// a stub, which is followed in turn.
+void resolve_import(Interpreter* interpreter, Value* value, const char* name) {
+    for (int hops = 0; hops <= interpreter->modules->length; hops++) {
+        char* path = value->data.import;
+        Module* module = wait_for_module(interpreter->modules, path);
+
+        if (!module->running) {
+            import_module(interpreter, path, path, create_scope());
+        }
+
+        // Still running when it reads its own names through an import cycle
+        Scope* exports = module->exports;
+        Value* found = NULL;
+
+        for (int j = exports ? exports->length - 1 : -1; j >= 0 && found == NULL; j--) {
+            if (strcmp(exports->names[j], name) == 0) {
+                found = &exports->values[j];
+            }
+        }
+
+        if (found == NULL || found == value || (found->type == VALUE_IMPORT && strcmp(found->data.import, path) == 0)) {
+            break;
+        }
+
+        *value = copy_value(*found);
+        asc_free(path);
+
+        if (value->type != VALUE_IMPORT) {
+            return;
+        }
+    }
+
+    runtime_error("Variable '%s' is not defined\n", name);
+}
+
+void free_interpreter(Interpreter* interpreter) {
+    // Free scopes
+    for (int i = 0; i < interpreter->scope_stack_length; i++) {
+        free_scope(interpreter->scope_stack[i]);
+    }
+
+    asc_free(interpreter->scope_stack);
+    asc_free(interpreter->base_dir);
+    asc_free(interpreter->stack);
+    asc_free(interpreter->frames);
+    asc_free(interpreter->saved_scopes);
+    free_module_registry(interpreter->modules);
+    asc_free(interpreter);
+}
+
+void free_scope(Scope* scope) {
+    for (int i = 0; i < scope->length; i++) {
+        asc_free(scope->names[i]);
+        free_value(scope->values[i]);
+    }
+
+    asc_free(scope->names);
+    asc_free(scope->values);
+    asc_free(scope);
+}
+
+// Deep copy, so the copy can be freed independently
+Value copy_value(Value value) {
+    Value copy = value;
+
+    if (value.type == VALUE_STRING) {
+        copy.data.string = asc_strdup(value.data.string, MEM_STRING);
+    }
+    else if (value.type == VALUE_IMPORT) {
+        copy.data.import = asc_strdup(value.data.import, MEM_STRING);
+    }
+    else if (value.type == VALUE_FUNCTION) {
+        copy.data.function.name = asc_strdup(value.data.function.name, MEM_CLOSURE);
+        copy.data.function.params = (char**)asc_malloc(sizeof(char*) * (value.data.function.params_length + 1), MEM_CLOSURE);
+        copy.data.function.closure = (Scope**)asc_malloc(sizeof(Scope*) * (value.data.function.closure_length + 1), MEM_CLOSURE);
+        if (!copy.data.function.params || !copy.data.function.closure) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+
+        for (int i = 0; i < value.data.function.params_length; i++) {
+            copy.data.function.params[i] = asc_strdup(value.data.function.params[i], MEM_CLOSURE);
+        }
+
+        for (int i = 0; i < value.data.function.closure_length; i++) {
+            copy.data.function.closure[i] = value.data.function.closure[i];
+        }
+    }
+
+    return copy;
+}
+
+// Arrays and maps are shared, so they are left to the interpreter heap
+void free_value(Value value) {
+    if (value.type == VALUE_STRING) {
+        asc_free(value.data.string);
+    }
+    else if (value.type == VALUE_IMPORT) {
+        asc_free(value.data.import);
+    }
+    else if (value.type == VALUE_FUNCTION) {
+        asc_free(value.data.function.name);
+
+        for (int i = 0; i < value.data.function.params_length; i++) {
+            asc_free(value.data.function.params[i]);
+        }
+
+        asc_free(value.data.function.params);
+        asc_free(value.data.function.closure);
+    }
+}
+
+Value evaluate_array_literal(Interpreter* interpreter, ASTNode* node) {
+    RelPtr* elements = AST_LIST(node->data.array_literal.elements);
+    Array* array = create_array(node->data.array_literal.elements_length);
+
+    for (int i = 0; i < node->data.array_literal.elements_length; i++) {
+        array_push(array, evaluate(interpreter, AST_NODE(elements[i])));
+    }
+
+    Value result;
+    result.type = VALUE_ARRAY;
+    result.data.array = array;
+    return result;
+}
+
+// Checks that index is a whole number below limit and returns it
+static int array_index(Value index, int limit) {
+    if (index.type != VALUE_NUMBER) {
+        runtime_error("Array index must be a number\n");
+    }
+
+    double number = index.data.number;
+
+    if (!(number >= 0 && number < limit) || number != (double)(int)number) {
+        char text[NUMBER_BUFFER_SIZE];
+        format_number(number, text);
+        runtime_error("Array index %s out of range for length %d\n", text, limit);
+    }
+
+    return (int)number;
+}
+
+Value evaluate_map_literal(Interpreter* interpreter, ASTNode* node) {
+    RelPtr* entries = AST_LIST(node->data.map_literal.entries);
+    Map* map = create_map(node->data.map_literal.entries_length);
+
+    for (int i = 0; i < node->data.map_literal.entries_length; i++) {
+        Value key = evaluate(interpreter, AST_NODE(entries[2 * i]));
+        map_set(map, key, evaluate(interpreter, AST_NODE(entries[2 * i + 1])));
+    }
+
+    Value result;
+    result.type = VALUE_MAP;
+    result.data.map = map;
+    return result;
+}
+
+// Reading a missing key gives null
+static Value map_get(Map* map, Value key) {
+    Value* found = map_find(map, key);
+
+    if (found == NULL) {
+        Value null_value;
+        null_value.type = VALUE_NULL;
+        return null_value;
+    }
+
+    return *found;
+}
+
+Value evaluate_index_expression(Interpreter* interpreter, ASTNode* node) {
+    Value object = evaluate(interpreter, AST_NODE(node->data.index_expression.object));
+    Value index = evaluate(interpreter, AST_NODE(node->data.index_expression.index));
+    return get_index(object, index);
+}
+
+Value get_index(Value object, Value index) {
+    if (object.type == VALUE_MAP) {
+        return map_get(object.data.map, index);
+    }
+
+    if (object.type != VALUE_ARRAY) {
+        runtime_error("Only arrays and maps can be indexed\n");
+    }
+
+    return array_get(object.data.array, array_index(index, object.data.array->length));
+}
+
+Value evaluate_index_assignment(Interpreter* interpreter, ASTNode* node) {
+    Value object = evaluate(interpreter, AST_NODE(node->data.index_assignment.object));
+    Value index = evaluate(interpreter, AST_NODE(node->data.index_assignment.index));
+    Value value = evaluate(interpreter, AST_NODE(node->data.index_assignment.value));
+    set_index(object, index, value);
+    return value;
+}
+
+void set_index(Value object, Value index, Value value) {
+    if (object.type == VALUE_MAP) {
+        map_set(object.data.map, index, value);
+    }
+    else if (object.type == VALUE_ARRAY) {
+        array_set(object.data.array, array_index(index, object.data.array->length), value);
+    }
+    else {
+        runtime_error("Only arrays and maps can be indexed\n");
+    }
+}
+
+// Copies the keys or the values of a map, in insertion order, into an array
+static Value map_items(const Map* map, bool keys) {
+    Array* array = create_array(map->length);
+
+    for (int i = 0; i < map->entries_length; i++) {
+        if (map->entries[i].key.type != VALUE_NULL) {
+            array_push(array, keys ? map->entries[i].key : map->entries[i].value);
+        }
+    }
+
+    Value result;
+    result.type = VALUE_ARRAY;
+    result.data.array = array;
+    return result;
+}
+
+// The members of maps: length, get(key), set(key, value), has(key),
+// delete(key), keys() and values()
+static Value map_member(Interpreter* interpreter, ASTNode* node, Map* map) {
+    RelPtr* arguments = AST_LIST(node->data.member_expression.arguments);
+    int arguments_length = check_map_member(node);
+    Value args[2];
+
+    for (int i = 0; i < arguments_length; i++) {
+        args[i] = evaluate(interpreter, AST_NODE(arguments[i]));
+    }
+
+    return apply_map_member(node, map, args);
+}
+
+// Checks that a map member exists and is given the arguments it takes, and
+// returns how many that is
+int check_map_member(ASTNode* node) {
+    const char* name = AST_STRING(node->data.member_expression.name);
+    int arguments_length = node->data.member_expression.arguments_length;
+
+    if (!node->data.member_expression.call) {
+        if (strcmp(name, "length") != 0) {
+            runtime_error("Maps have no property '%s'\n", name);
+        }
+
+        return 0;
+    }
+
+    int expected = strcmp(name, "set") == 0 ? 2 :
+        strcmp(name, "keys") == 0 || strcmp(name, "values") == 0 ? 0 : 1;
+
+    if (expected == 1 && strcmp(name, "get") != 0 && strcmp(name, "has") != 0 && strcmp(name, "delete") != 0) {
+        runtime_error("Maps have no method '%s'\n", name);
+    }
+
+    if (arguments_length != expected) {
+        runtime_error("Map method '%s' expects %d argument%s\n", name, expected, expected == 1 ? "" : "s");
+    }
+
+    return expected;
+}
+
+// Reads a map member checked by check_map_member, with its evaluated
+// arguments
+Value apply_map_member(ASTNode* node, Map* map, Value* args) {
+    const char* name = AST_STRING(node->data.member_expression.name);
+    Value result;
+
+    if (!node->data.member_expression.call) {
+        result.type = VALUE_NUMBER;
+        result.data.number = map->length;
+    }
+    else if (strcmp(name, "get") == 0) {
+        return map_get(map, args[0]);
+    }
+    else if (strcmp(name, "set") == 0) {
+        result = args[1];
+        map_set(map, args[0], result);
+    }
+    else if (strcmp(name, "has") == 0) {
+        result.type = VALUE_BOOLEAN;
+        result.data.boolean = map_find(map, args[0]) != NULL;
+    }
+    else if (strcmp(name, "delete") == 0) {
+        result.type = VALUE_BOOLEAN;
+        result.data.boolean = map_delete(map, args[0]);
+    }
+    else {
+        result = map_items(map, strcmp(name, "keys") == 0);
+    }
+
+    return result;
+}
+
+// The members of arrays: length, and push(values...), which returns the new
+// length. Maps are handled by map_member.
+Value evaluate_member_expression(Interpreter* interpreter, ASTNode* node) {
+    Value object = evaluate(interpreter, AST_NODE(node->data.member_expression.object));
+    const char* name = AST_STRING(node->data.member_expression.name);
+    Value result;
+
+    if (object.type == VALUE_MAP) {
+        return map_member(interpreter, node, object.data.map);
+    }
+
+    if (object.type != VALUE_ARRAY) {
+        runtime_error("Cannot read '%s' of a value that is not an array or a map\n", name);
+    }
+
+    Array* array = object.data.array;
+
+    if (strcmp(name, "length") == 0 && !node->data.member_expression.call) {
+        result.type = VALUE_NUMBER;
+        result.data.number = array->length;
+    }
+    else if (strcmp(name, "push") == 0 && node->data.member_expression.call) {
+        RelPtr* arguments = AST_LIST(node->data.member_expression.arguments);
+
+        for (int i = 0; i < node->data.member_expression.arguments_length; i++) {
+            array_push(array, evaluate(interpreter, AST_NODE(arguments[i])));
+        }
+
+        result.type = VALUE_NUMBER;
+        result.data.number = array->length;
+    }
+    else {
+        runtime_error("Arrays have no %s '%s'\n", node->data.member_expression.call ? "method" : "property", name);
+    }
+
+    return result;
+}
+
+// Array implementation
+Array* create_array(int capacity) {
+    Array* array = (Array*)asc_malloc(sizeof(Array), MEM_ARRAY);
+    if (!array) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    array->length = 0;
+    array->capacity = capacity;
+    array->packed = true;
+    array->items.numbers = NULL;
+
+    if (capacity > 0) {
+        array->items.numbers = (double*)asc_malloc(sizeof(double) * capacity, MEM_ARRAY);
+        if (!array->items.numbers) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+    }
+
+    return array;
+}
+
+// Turns the unboxed numbers into values, the first time something else is
+// stored
+static void box_array(Array* array) {
+    Value* values = (Value*)asc_malloc(sizeof(Value) * (array->capacity + 1), MEM_ARRAY);
+    if (!values) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < array->length; i++) {
+        values[i].type = VALUE_NUMBER;
+        values[i].data.number = array->items.numbers[i];
+    }
+
+    asc_free(array->items.numbers);
+    array->items.values = values;
+    array->packed = false;
+}
+
+void array_push(Array* array, Value value) {
+    if (array->packed && value.type != VALUE_NUMBER) {
+        box_array(array);
+    }
+
+    if (array->length >= array->capacity) {
+        array->capacity = array->capacity ? array->capacity * 2 : 8;
+        size_t size = array->packed ? sizeof(double) : sizeof(Value);
+        array->items.numbers = (double*)asc_realloc(array->items.numbers, size * array->capacity, MEM_ARRAY);
+        if (!array->items.numbers) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+    }
+
+    if (array->packed) {
+        array->items.numbers[array->length++] = value.data.number;
+    }
+    else {
+        array->items.values[array->length++] = value;
+    }
+}
+
+Value array_get(const Array* array, int index) {
+    if (!array->packed) {
+        return array->items.values[index];
+    }
+
+    Value value;
+    value.type = VALUE_NUMBER;
+    value.data.number = array->items.numbers[index];
+    return value;
+}
+
+void array_set(Array* array, int index, Value value) {
+    if (array->packed && value.type != VALUE_NUMBER) {
+        box_array(array);
+    }
+
+    if (array->packed) {
+        array->items.numbers[index] = value.data.number;
+    }
+    else {
+        array->items.values[index] = value;
+    }
+}
+
+// Map implementation
+// Only strings and numbers are keys. 0 and -0 are the same key, nan is not a
+// key at all since it equals nothing.
+static uint64_t map_hash(Value key) {
+    if (key.type == VALUE_STRING) {
+        return hash_string(key.data.string);
+    }
+
+    if (key.type != VALUE_NUMBER) {
+        runtime_error("Map keys must be strings or numbers\n");
+    }
+
+    // NaN is not equal to itself, so it could never be found again
+    if (key.data.number != key.data.number) {
+        runtime_error("Map keys cannot be NaN\n");
+    }
+
+    double number = key.data.number == 0 ? 0 : key.data.number;
+    return hash_bytes(&number, sizeof(double), 0);
+}
+
+static bool map_keys_equal(Value a, Value b) {
+    if (a.type != b.type) {
+        return false;
+    }
+
+    return a.type == VALUE_STRING ? strcmp(a.data.string, b.data.string) == 0 : a.data.number == b.data.number;
+}
+
+// The slot holding key, or the empty slot where it would go
+static int map_probe(const Map* map, Value key, uint64_t hash) {
+    int mask = map->slots_capacity - 1;
+    int slot = (int)(hash & (uint64_t)mask);
+
+    while (map->slots[slot] != MAP_EMPTY_SLOT) {
+        const MapEntry* entry = &map->entries[map->slots[slot]];
+
+        if (entry->hash == hash && map_keys_equal(entry->key, key)) {
+            break;
+        }
+
+        slot = (slot + 1) & mask;
+    }
+
+    return slot;
+}
+
+// Drops deleted entries and rebuilds the slots so that they are at most half
+// full when the map holds expected entries
+static void rebuild_map(Map* map, int expected) {
+    int length = 0;
+
+    for (int i = 0; i < map->entries_length; i++) {
+        if (map->entries[i].key.type != VALUE_NULL) {
+            map->entries[length++] = map->entries[i];
+        }
+    }
+
+    map->entries_length = length;
+
+    int capacity = 8;
+    while ((expected > length ? expected : length) * 2 > capacity) {
+        capacity *= 2;
+    }
+
+    if (map->slots == NULL || capacity != map->slots_capacity) {
+        asc_free(map->slots);
+        map->slots = (int32_t*)asc_malloc(sizeof(int32_t) * capacity, MEM_MAP);
+        if (!map->slots) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+
+        map->slots_capacity = capacity;
+    }
+
+    for (int i = 0; i < capacity; i++) {
+        map->slots[i] = MAP_EMPTY_SLOT;
+    }
+
+    for (int i = 0; i < length; i++) {
+        map->slots[map_probe(map, map->entries[i].key, map->entries[i].hash)] = i;
+    }
+}
+
+Map* create_map(int capacity) {
+    Map* map = (Map*)asc_malloc(sizeof(Map), MEM_MAP);
+    if (!map) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    map->entries_capacity = capacity > 0 ? capacity : 4;
+    map->entries = (MapEntry*)asc_malloc(sizeof(MapEntry) * map->entries_capacity, MEM_MAP);
+    if (!map->entries) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    map->entries_length = 0;
+    map->length = 0;
+    map->slots = NULL;
+    map->slots_capacity = 0;
+
+    rebuild_map(map, capacity);
+    return map;
+}
+
+Value* map_find(Map* map, Value key) {
+    int32_t index = map->slots[map_probe(map, key, map_hash(key))];
+    return index == MAP_EMPTY_SLOT ? NULL : &map->entries[index].value;
+}
+
+void map_set(Map* map, Value key, Value value) {
+    uint64_t hash = map_hash(key);
+    int slot = map_probe(map, key, hash);
+
+    if (map->slots[slot] != MAP_EMPTY_SLOT) {
+        map->entries[map->slots[slot]].value = value;
+        return;
+    }
+
+    // Deleted entries still hold their slots, so they count towards the load
+    if ((map->entries_length + 1) * 4 > map->slots_capacity * 3) {
+        rebuild_map(map, map->length + 1);
+        slot = map_probe(map, key, hash);
+    }
+
+    if (map->entries_length >= map->entries_capacity) {
+        map->entries_capacity *= 2;
+        map->entries = (MapEntry*)asc_realloc(map->entries, sizeof(MapEntry) * map->entries_capacity, MEM_MAP);
+        if (!map->entries) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+    }
+
+    MapEntry* entry = &map->entries[map->entries_length];
+    entry->key = key;
+    entry->value = value;
+    entry->hash = hash;
+
+    map->slots[slot] = map->entries_length++;
+    map->length++;
+}
+
+bool map_delete(Map* map, Value key) {
+    int32_t index = map->slots[map_probe(map, key, map_hash(key))];
+
+    if (index == MAP_EMPTY_SLOT) {
+        return false;
+    }
+
+    map->entries[index].key.type = VALUE_NULL;
+    map->entries[index].value.type = VALUE_NULL;
+    map->length--;
+    return true;
+}
+
+// Numeric kernel implementation
+// The bulk builtins (sum, dot, scale, add, and min and max of an array) run
+// these loops over the unboxed numbers of packed arrays. x86 builds also
+// have SSE2 and AVX versions, and each interpreter takes the widest one the
+// CPU supports when it is created. Sums and dot products keep several
+// partial sums, so they add in a different order than a loop in a script
+// and their last digits can differ; the other kernels give exactly the
+// scalar results, NaN and the sign of zero included.
+static double sum_scalar(const double* values, size_t length) {
+    double total = 0;
+    for (size_t i = 0; i < length; i++) {
+        total += values[i];
+    }
+    return total;
+}
+
+static double dot_scalar(const double* a, const double* b, size_t length) {
+    double total = 0;
+    for (size_t i = 0; i < length; i++) {
+        total += a[i] * b[i];
+    }
+    return total;
+}
+
+static double min_scalar(const double* values, size_t length) {
+    double result = values[0];
+    for (size_t i = 1; i < length; i++) {
+        result = values[i] < result ? values[i] : result;
+    }
+    return result;
+}
+
+static double max_scalar(const double* values, size_t length) {
+    double result = values[0];
+    for (size_t i = 1; i < length; i++) {
+        result = values[i] > result ? values[i] : result;
+    }
+    return result;
+}
+
+static void scale_scalar(double* out, const double* values, double factor, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        out[i] = values[i] * factor;
+    }
+}
+
+static void add_scalar(double* out, const double* a, const double* b, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        out[i] = a[i] + b[i];
+    }
+}
+
+static const NumericKernels scalar_kernels = {
+    "scalar", sum_scalar, dot_scalar, min_scalar, max_scalar, scale_scalar, add_scalar
+};
+
+#ifdef ASC_X86_KERNELS
+// MINPD and MAXPD return their second operand unless the comparison holds,
+// which is the scalar x < result ? x : result with the running result
+// second. Every lane starts at the first number, so a lane only holds NaN
+// when the scalar loop would have. The scalar loop keeps the first of equal
+// numbers, and the lanes lose which came first; equal doubles only differ
+// for 0 and -0, so a zero result is replaced by the first zero.
+static double first_zero(const double* values) {
+    size_t i = 0;
+    while (values[i] != 0) {
+        i++;
+    }
+    return values[i];
+}
+
+static double sum_sse2(const double* values, size_t length) {
+    __m128d total0 = _mm_setzero_pd();
+    __m128d total1 = _mm_setzero_pd();
+    size_t i = 0;
+
+    for (; i + 4 <= length; i += 4) {
+        total0 = _mm_add_pd(total0, _mm_loadu_pd(values + i));
+        total1 = _mm_add_pd(total1, _mm_loadu_pd(values + i + 2));
+    }
+
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_add_pd(total0, total1));
+    double total = lanes[0] + lanes[1];
+
+    for (; i < length; i++) {
+        total += values[i];
+    }
+    return total;
+}
+
+static double dot_sse2(const double* a, const double* b, size_t length) {
+    __m128d total0 = _mm_setzero_pd();
+    __m128d total1 = _mm_setzero_pd();
+    size_t i = 0;
+
+    for (; i + 4 <= length; i += 4) {
+        total0 = _mm_add_pd(total0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        total1 = _mm_add_pd(total1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+    }
+
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_add_pd(total0, total1));
+    double total = lanes[0] + lanes[1];
+
+    for (; i < length; i++) {
+        total += a[i] * b[i];
+    }
+    return total;
+}
+
+static double min_sse2(const double* values, size_t length) {
+    __m128d result = _mm_set1_pd(values[0]);
+    size_t i = 0;
+
+    for (; i + 2 <= length; i += 2) {
+        result = _mm_min_pd(_mm_loadu_pd(values + i), result);
+    }
+
+    double lanes[2];
+    _mm_storeu_pd(lanes, result);
+    double minimum = lanes[1] < lanes[0] ? lanes[1] : lanes[0];
+
+    for (; i < length; i++) {
+        minimum = values[i] < minimum ? values[i] : minimum;
+    }
+    return minimum == 0 ? first_zero(values) : minimum;
+}
+
+static double max_sse2(const double* values, size_t length) {
+    __m128d result = _mm_set1_pd(values[0]);
+    size_t i = 0;
+
+    for (; i + 2 <= length; i += 2) {
+        result = _mm_max_pd(_mm_loadu_pd(values + i), result);
+    }
+
+    double lanes[2];
+    _mm_storeu_pd(lanes, result);
+    double maximum = lanes[1] > lanes[0] ? lanes[1] : lanes[0];
+
+    for (; i < length; i++) {
+        maximum = values[i] > maximum ? values[i] : maximum;
+    }
+    return maximum == 0 ? first_zero(values) : maximum;
+}
+
+static void scale_sse2(double* out, const double* values, double factor, size_t length) {
+    __m128d factors = _mm_set1_pd(factor);
+    size_t i = 0;
+
+    for (; i + 2 <= length; i += 2) {
+        _mm_storeu_pd(out + i, _mm_mul_pd(_mm_loadu_pd(values + i), factors));
+    }
+    for (; i < length; i++) {
+        out[i] = values[i] * factor;
+    }
+}
+
+static void add_sse2(double* out, const double* a, const double* b, size_t length) {
+    size_t i = 0;
+
+    for (; i + 2 <= length; i += 2) {
+        _mm_storeu_pd(out + i, _mm_add_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    }
+    for (; i < length; i++) {
+        out[i] = a[i] + b[i];
+    }
+}
+
+static const NumericKernels sse2_kernels = {
+    "sse2", sum_sse2, dot_sse2, min_sse2, max_sse2, scale_sse2, add_sse2
+};
+
+// GCC and Clang compile these for AVX without it being enabled for the rest
+// of the file; MSVC accepts the intrinsics in any function
+#if defined(__GNUC__) || defined(__clang__)
+#define AVX_TARGET __attribute__((target("avx")))
+#else
+#define AVX_TARGET
+#endif
+
+// The two 128-bit halves folded together and then the two lanes
+AVX_TARGET static double sum_lanes_avx(__m256d total) {
+    __m128d half = _mm_add_pd(_mm256_castpd256_pd128(total), _mm256_extractf128_pd(total, 1));
+    double lanes[2];
+    _mm_storeu_pd(lanes, half);
+    return lanes[0] + lanes[1];
+}
+
+AVX_TARGET static double sum_avx(const double* values, size_t length) {
+    __m256d total0 = _mm256_setzero_pd();
+    __m256d total1 = _mm256_setzero_pd();
+    size_t i = 0;
+
+    for (; i + 8 <= length; i += 8) {
+        total0 = _mm256_add_pd(total0, _mm256_loadu_pd(values + i));
+        total1 = _mm256_add_pd(total1, _mm256_loadu_pd(values + i + 4));
+    }
+
+    double total = sum_lanes_avx(_mm256_add_pd(total0, total1));
+
+    for (; i < length; i++) {
+        total += values[i];
+    }
+    return total;
+}
+
+AVX_TARGET static double dot_avx(const double* a, const double* b, size_t length) {
+    __m256d total0 = _mm256_setzero_pd();
+    __m256d total1 = _mm256_setzero_pd();
+    size_t i = 0;
+
+    for (; i + 8 <= length; i += 8) {
+        total0 = _mm256_add_pd(total0, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+        total1 = _mm256_add_pd(total1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+    }
+
+    double total = sum_lanes_avx(_mm256_add_pd(total0, total1));
+
+    for (; i < length; i++) {
+        total += a[i] * b[i];
+    }
+    return total;
+}
+
+AVX_TARGET static double min_avx(const double* values, size_t length) {
+    __m256d result = _mm256_set1_pd(values[0]);
+    size_t i = 0;
+
+    for (; i + 4 <= length; i += 4) {
+        result = _mm256_min_pd(_mm256_loadu_pd(values + i), result);
+    }
+
+    __m128d half = _mm_min_pd(_mm256_extractf128_pd(result, 1), _mm256_castpd256_pd128(result));
+    double lanes[2];
+    _mm_storeu_pd(lanes, half);
+    double minimum = lanes[1] < lanes[0] ? lanes[1] : lanes[0];
+
+    for (; i < length; i++) {
+        minimum = values[i] < minimum ? values[i] : minimum;
+    }
+    return minimum == 0 ? first_zero(values) : minimum;
+}
+
+AVX_TARGET static double max_avx(const double* values, size_t length) {
+    __m256d result = _mm256_set1_pd(values[0]);
+    size_t i = 0;
+
+    for (; i + 4 <= length; i += 4) {
+        result = _mm256_max_pd(_mm256_loadu_pd(values + i), result);
+    }
+
+    __m128d half = _mm_max_pd(_mm256_extractf128_pd(result, 1), _mm256_castpd256_pd128(result));
+    double lanes[2];
+    _mm_storeu_pd(lanes, half);
+    double maximum = lanes[1] > lanes[0] ? lanes[1] : lanes[0];
+
+    for (; i < length; i++) {
+        maximum = values[i] > maximum ? values[i] : maximum;
+    }
+    return maximum == 0 ? first_zero(values) : maximum;
+}
+
+AVX_TARGET static void scale_avx(double* out, const double* values, double factor, size_t length) {
+    __m256d factors = _mm256_set1_pd(factor);
+    size_t i = 0;
+
+    for (; i + 4 <= length; i += 4) {
+        _mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_loadu_pd(values + i), factors));
+    }
+    for (; i < length; i++) {
+        out[i] = values[i] * factor;
+    }
+}
+
+AVX_TARGET static void add_avx(double* out, const double* a, const double* b, size_t length) {
+    size_t i = 0;
+
+    for (; i + 4 <= length; i += 4) {
+        _mm256_storeu_pd(out + i, _mm256_add_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    }
+    for (; i < length; i++) {
+        out[i] = a[i] + b[i];
+    }
+}
+
+static const NumericKernels avx_kernels = {
+    "avx", sum_avx, dot_avx, min_avx, max_avx, scale_avx, add_avx
+};
+
+// AVX needs the CPU to have it and the OS to save the YMM registers
+static bool cpu_supports_avx(void) {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    return osxsave && avx && (_xgetbv(0) & 6) == 6;
+#else
+    return __builtin_cpu_supports("avx");
+#endif
+}
+#endif
+
+// The widest kernels the CPU runs. ASC_KERNELS=scalar or sse2 caps the
+// choice, to compare the kernels or rule them out.
+const NumericKernels* select_numeric_kernels(void) {
+    const char* limit = getenv("ASC_KERNELS");
+    if (limit && strcmp(limit, "scalar") == 0) {
+        return &scalar_kernels;
+    }
+
+#ifdef ASC_X86_KERNELS
+    if (limit && strcmp(limit, "sse2") == 0) {
+        return &sse2_kernels;
+    }
+    return cpu_supports_avx() ? &avx_kernels : &sse2_kernels;
+#else
+    return &scalar_kernels;
+#endif
+}
+
+// Builtin library implementation
+// Builtins sit outside the global scope: a name a script defines shadows
+// them, and a call reaches one only when no scope defines its name. The
+// parser records which builtin a call names, so a call never searches the
+// table, and call_native evaluates the arguments straight onto the
+// interpreter's value stack instead of into a new scope.
+// Grows one of the interpreter's evaluation stacks (the value stack, and the
+// frames and saved scopes of the explicit-stack evaluator) to fit needed more
+// items. Past stack_limit bytes between them the script fails with a stack
+// overflow.
+static void* grow_stack(Interpreter* interpreter, void* items, int length, int* capacity, size_t item_size, int needed) {
+    int new_capacity = *capacity ? *capacity : 64;
+    while (new_capacity < length + needed) {
+        new_capacity *= 2;
+    }
+
+    size_t bytes = sizeof(Value) * interpreter->stack_capacity +
+        sizeof(MachineFrame) * interpreter->frames_capacity +
+        sizeof(Scope*) * interpreter->saved_scopes_capacity;
+
+    if (bytes + item_size * (new_capacity - *capacity) > stack_limit) {
+        runtime_error("Stack overflow: the script needs more than %d MB of stack\n", (int)(stack_limit >> 20));
+    }
+
+    items = asc_realloc(items, item_size * new_capacity, MEM_CALL);
+    if (!items) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    *capacity = new_capacity;
+    return items;
+}
+
+static void stack_push(Interpreter* interpreter, Value value) {
+    if (interpreter->stack_length >= interpreter->stack_capacity) {
+        interpreter->stack = (Value*)grow_stack(interpreter, interpreter->stack, interpreter->stack_length,
+            &interpreter->stack_capacity, sizeof(Value), 1);
+    }
+
+    interpreter->stack[interpreter->stack_length++] = value;
+}
+
+Value call_native(Interpreter* interpreter, const Builtin* builtin, ASTNode* node) {
+    RelPtr* arguments = AST_LIST(node->data.call_expression.arguments);
+    int args_length = node->data.call_expression.arguments_length;
+    check_native_arity(builtin, args_length);
+
+    int base = interpreter->stack_length;
+
+    for (int i = 0; i < args_length; i++) {
+        stack_push(interpreter, evaluate(interpreter, AST_NODE(arguments[i])));
+    }
+
+    return invoke_native(interpreter, builtin, base, args_length);
+}
+
+void check_native_arity(const Builtin* builtin, int args_length) {
+    if (args_length < builtin->min_args || (builtin->max_args >= 0 && args_length > builtin->max_args)) {
+        if (builtin->max_args < 0) {
+            runtime_error("%s expects at least %d argument%s\n", builtin->name, builtin->min_args, builtin->min_args == 1 ? "" : "s");
+        }
+        else if (builtin->min_args == builtin->max_args) {
+            runtime_error("%s expects %d argument%s\n", builtin->name, builtin->min_args, builtin->min_args == 1 ? "" : "s");
+        }
+
+        runtime_error("%s expects %d to %d arguments\n", builtin->name, builtin->min_args, builtin->max_args);
+    }
+}
+
+// Runs a native on the arguments from base to the top of the value stack and
+// pops them
+Value invoke_native(Interpreter* interpreter, const Builtin* builtin, int base, int args_length) {
+    STATS(runtime_stats.native_calls++);
+
+    // The stack may have moved while the arguments were evaluated
+    Value result = builtin->function(interpreter, interpreter->stack + base, args_length);
+    interpreter->stack_length = base;
+
+    return result;
+}
+
+static Value number_result(double number) {
+    Value result;
+    result.type = VALUE_NUMBER;
+    result.data.number = number;
+    return result;
+}
+
+static Value string_result(char* string) {
+    Value result;
+    result.type = VALUE_STRING;
+    result.data.string = string;
+    return result;
+}
+
+static Value null_result(void) {
+    Value result;
+    result.type = VALUE_NULL;
+    return result;
+}
+
+// A new string of length bytes plus the terminator
+static char* new_string(size_t length) {
+    char* string = (char*)asc_malloc(length + 1, MEM_STRING);
+    if (!string) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    string[length] = '\0';
+    return string;
+}
+
+static double number_argument(const char* name, const Value* args, int index) {
+    if (args[index].type != VALUE_NUMBER) {
+        runtime_error("%s expects a number as argument %d\n", name, index + 1);
+    }
+
+    return args[index].data.number;
+}
+
+// A number that is converted to an integer, so NaN and the infinities are
+// rejected first
+static double finite_argument(const char* name, const Value* args, int index) {
+    double number = number_argument(name, args, index);
+    if (!isfinite(number)) {
+        runtime_error("%s expects a finite number as argument %d\n", name, index + 1);
+    }
+
+    return number;
+}
+
+static const char* string_argument(const char* name, const Value* args, int index) {
+    if (args[index].type != VALUE_STRING) {
+        runtime_error("%s expects a string as argument %d\n", name, index + 1);
+    }
+
+    return args[index].data.string;
+}
+
+#define NATIVE_MATH(name, function) \
+    static Value native_##name(Interpreter* interpreter, Value* args, int args_length) { \
+        (void)interpreter; \
+        (void)args_length; \
+        return number_result(function(number_argument(#name, args, 0))); \
+    }
+
+NATIVE_MATH(abs, fabs)
+NATIVE_MATH(floor, floor)
+NATIVE_MATH(ceil, ceil)
+NATIVE_MATH(round, round)
+NATIVE_MATH(trunc, trunc)
+NATIVE_MATH(sqrt, sqrt)
+NATIVE_MATH(exp, exp)
+NATIVE_MATH(log, log)
+NATIVE_MATH(sin, sin)
+NATIVE_MATH(cos, cos)
+NATIVE_MATH(tan, tan)
+
+static Value native_pow(Interpreter* interpreter, Value* args, int args_length) {
+    (void)interpreter;
+    (void)args_length;
+    return number_result(pow(number_argument("pow", args, 0), number_argument("pow", args, 1)));
+}
+
+static Value native_atan2(Interpreter* interpreter, Value* args, int args_length) {
+    (void)interpreter;
+    (void)args_length;
+    return number_result(atan2(number_argument("atan2", args, 0), number_argument("atan2", args, 1)));
+}
+
+static void check_numbers(const char* name, const Value* args, int index) {
+    if (args[index].type != VALUE_ARRAY) {
+        runtime_error("%s expects an array as argument %d\n", name, index + 1);
+    }
+
+    Array* array = args[index].data.array;
+    if (array->packed) {
+        return;
+    }
+
+    for (int i = 0; i < array->length; i++) {
+        if (array->items.values[i].type != VALUE_NUMBER) {
+            runtime_error("%s expects an array of numbers as argument %d\n", name, index + 1);
+        }
+    }
+}
+
+// The numbers of an array argument: the unboxed storage of a packed array,
+// or for one that has been boxed a copy the caller frees with asc_free. The
+// arguments are checked before anything is copied, so an error leaks
+// nothing.
+static const double* numbers_argument(const char* name, const Value* args, int index, double** copy) {
+    *copy = NULL;
+    check_numbers(name, args, index);
+
+    Array* array = args[index].data.array;
+    if (array->packed) {
+        return array->items.numbers;
+    }
+
+    if (array->length == 0) {
+        return NULL;
+    }
+
+    *copy = (double*)asc_malloc(sizeof(double) * array->length, MEM_CALL);
+    if (!*copy) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < array->length; i++) {
+        (*copy)[i] = array->items.values[i].data.number;
+    }
+
+    return *copy;
+}
+
+// min and max of a single array reduce its elements
+static Value reduce_array(Interpreter* interpreter, const char* name, Value* args,
+                          double (*kernel)(const double* values, size_t length)) {
+    (void)interpreter;
+    double* copy;
+    const double* numbers = numbers_argument(name, args, 0, &copy);
+    int length = args[0].data.array->length;
+
+    if (length == 0) {
+        runtime_error("%s of an empty array\n", name);
+    }
+
+    double result = kernel(numbers, (size_t)length);
+    asc_free(copy);
+    return number_result(result);
+}
+
+static Value native_min(Interpreter* interpreter, Value* args, int args_length) {
+    if (args_length == 1 && args[0].type == VALUE_ARRAY) {
+        return reduce_array(interpreter, "min", args, interpreter->kernels->min);
+    }
+
+    double result = number_argument("min", args, 0);
+
+    for (int i = 1; i < args_length; i++) {
+        double number = number_argument("min", args, i);
+        result = number < result ? number : result;
+    }
+
+    return number_result(result);
+}
+
+static Value native_max(Interpreter* interpreter, Value* args, int args_length) {
+    if (args_length == 1 && args[0].type == VALUE_ARRAY) {
+        return reduce_array(interpreter, "max", args, interpreter->kernels->max);
+    }
+
+    double result = number_argument("max", args, 0);
+
+    for (int i = 1; i < args_length; i++) {
+        double number = number_argument("max", args, i);
+        result = number > result ? number : result;
+    }
+
+    return number_result(result);
+}
+
+static Value native_sum(Interpreter* interpreter, Value* args, int args_length) {
+    (void)args_length;
+    double* copy;
+    const double* numbers = numbers_argument("sum", args, 0, &copy);
+    int length = args[0].data.array->length;
+
+    double result = length > 0 ? interpreter->kernels->sum(numbers, (size_t)length) : 0;
+    asc_free(copy);
+    return number_result(result);
+}
+
+// The length two arrays of numbers share
+static int paired_length(const char* name, const Value* args) {
+    check_numbers(name, args, 0);
+    check_numbers(name, args, 1);
+
+    int length = args[0].data.array->length;
+    if (args[1].data.array->length != length) {
+        runtime_error("%s expects arrays of the same length, got %d and %d\n", name, length,
+                      args[1].data.array->length);
+    }
+
+    return length;
+}
+
+static Value native_dot(Interpreter* interpreter, Value* args, int args_length) {
+    (void)args_length;
+    int length = paired_length("dot", args);
+    double* copy_a;
+    double* copy_b;
+    const double* a = numbers_argument("dot", args, 0, &copy_a);
+    const double* b = numbers_argument("dot", args, 1, &copy_b);
+
+    double result = length > 0 ? interpreter->kernels->dot(a, b, (size_t)length) : 0;
+    asc_free(copy_a);
+    asc_free(copy_b);
+    return number_result(result);
+}
+
+// A packed array of length numbers for a kernel to fill
+static Value numbers_result(int length) {
+    Array* array = create_array(length);
+    array->length = length;
+
+    Value result;
+    result.type = VALUE_ARRAY;
+    result.data.array = array;
+    return result;
+}
+
+// A new array of the elements times the factor
+static Value native_scale(Interpreter* interpreter, Value* args, int args_length) {
+    (void)args_length;
+    check_numbers("scale", args, 0);
+    double factor = number_argument("scale", args, 1);
+    double* copy;
+    const double* numbers = numbers_argument("scale", args, 0, &copy);
+    int length = args[0].data.array->length;
+
+    Value result = numbers_result(length);
+    interpreter->kernels->scale(result.data.array->items.numbers, numbers, factor, (size_t)length);
+    asc_free(copy);
+    return result;
+}
+
+// A new array of the sums of the elements at each index
+static Value native_add(Interpreter* interpreter, Value* args, int args_length) {
+    (void)args_length;
+    int length = paired_length("add", args);
+    double* copy_a;
+    double* copy_b;
+    const double* a = numbers_argument("add", args, 0, &copy_a);
+    const double* b = numbers_argument("add", args, 1, &copy_b);
+
+    Value result = numbers_result(length);
+    interpreter->kernels->add(result.data.array->items.numbers, a, b, (size_t)length);
+    asc_free(copy_a);
+    asc_free(copy_b);
+    return result;
+}
+
+// The length of a string in bytes, or the number of elements of an array or
+// a map
+static Value native_len(Interpreter* interpreter, Value* args, int args_length) {
+    (void)interpreter;
+    (void)args_length;
+
+    switch (args[0].type) {
+    case VALUE_STRING:
+        return number_result((double)strlen(args[0].data.string));
+    case VALUE_ARRAY:
+        return number_result(args[0].data.array->length);
+    case VALUE_MAP:
+        return number_result(args[0].data.map->length);
+    default:
+        runtime_error("len expects a string, an array or a map\n");
+    }
+}
+
+// substring(s, start, end) with end defaulting to the length of s. Both are
+// clamped to the string, and an empty string comes back when end <= start.
+static Value native_substring(Interpreter* interpreter, Value* args, int args_length) {
+    (void)interpreter;
+    const char* string = string_argument("substring", args, 0);
+    double length = (double)strlen(string);
+    double start = finite_argument("substring", args, 1);
+    double end = args_length > 2 ? finite_argument("substring", args, 2) : length;
+
+    start = start < 0 ? 0 : start > length ? length : start;
+    end = end < start ? start : end > length ? length : end;
+
+    size_t from = (size_t)start;
+    size_t to = (size_t)end;
+    char* result = new_string(to - from);
+    memcpy(result, string + from, to - from);
+    return string_result(result);
+}
+
+static Value native_index_of(Interpreter* interpreter, Value* args, int args_length) {
+    (void)interpreter;
+    (void)args_length;
+    const char* string = string_argument("index_of", args, 0);
+    const char* found = strstr(string, string_argument("index_of", args, 1));
+    return number_result(found ? (double)(found - string) : -1);
+}
+
+static Value change_case(const char* name, const Value* args, bool upper) {
+    const char* string = string_argument(name, args, 0);
+    size_t length = strlen(string);
+    char* result = new_string(length);
+
+    for (size_t i = 0; i < length; i++) {
+        result[i] = (char)(upper ? toupper((unsigned char)string[i]) : tolower((unsigned char)string[i]));
+    }
+
+    return string_result(result);
+}
+
+static Value native_upper(Interpreter* interpreter, Value* args, int args_length) {
+    (void)interpreter;
+    (void)args_length;
+    return change_case("upper", args, true);
+}
+
+static Value native_lower(Interpreter* interpreter, Value* args, int args_length) {
+    (void)interpreter;
+    (void)args_length;
+    return change_case("lower", args, false);
+}
+
+static Value native_trim(Interpreter* interpreter, Value* args, int args_length) {
+    (void)interpreter;
+    (void)args_length;
+    const char* start = string_argument("trim", args, 0);
+    const char* end = start + strlen(start);
+
+    while (start < end && isspace((unsigned char)*start)) {
+        start++;
+    }
+
+    while (end > start && isspace((unsigned char)end[-1])) {
+        end--;
+    }
+
+    char* result = new_string((size_t)(end - start));
+    memcpy(result, start, (size_t)(end - start));
+    return string_result(result);
+}
+
+// split(s, separator) returns an array of the pieces between separators, or
+// of single characters for an empty separator
+static Value native_split(Interpreter* interpreter, Value* args, int args_length) {
+    (void)interpreter;
+    (void)args_length;
+    const char* string = string_argument("split", args, 0);
+    const char* separator = string_argument("split", args, 1);
+    size_t separator_length = strlen(separator);
+    Array* array = create_array(0);
+
+    if (separator_length == 0) {
+        for (const char* c = string; *c; c++) {
+            char* piece = new_string(1);
+            piece[0] = *c;
+            array_push(array, string_result(piece));
+        }
+    }
+    else {
+        const char* start = string;
+        const char* found;
+
+        while ((found = strstr(start, separator)) != NULL) {
+            char* piece = new_string((size_t)(found - start));
+            memcpy(piece, start, (size_t)(found - start));
+            array_push(array, string_result(piece));
+            start = found + separator_length;
+        }
+
+        char* piece = new_string(strlen(start));
+        memcpy(piece, start, strlen(start));
+        array_push(array, string_result(piece));
+    }
+
+    Value result;
+    result.type = VALUE_ARRAY;
+    result.data.array = array;
+    return result;
+}
+
+static bool is_scalar(Value value) {
+    return value.type == VALUE_NUMBER || value.type == VALUE_STRING || value.type == VALUE_BOOLEAN || value.type == VALUE_NULL;
+}
+
+// join(array, separator) with separator defaulting to ""; elements are
+// turned into text as '+' does
+static Value native_join(Interpreter* interpreter, Value* args, int args_length) {
+    (void)interpreter;
+    if (args[0].type != VALUE_ARRAY) {
+        runtime_error("join expects an array as argument 1\n");
+    }
+
+    const Array* array = args[0].data.array;
+    const char* separator = args_length > 1 ? string_argument("join", args, 1) : "";
+    size_t separator_length = strlen(separator);
+    char number[NUMBER_BUFFER_SIZE];
+    size_t length = 0;
+
+    for (int i = 0; i < array->length; i++) {
+        Value element = array_get(array, i);
+        if (!is_scalar(element)) {
+            runtime_error("join can only join numbers, strings, booleans and null\n");
+        }
+
+        length += strlen(value_text(element, number)) + (i > 0 ? separator_length : 0);
+    }
+
+    char* result = new_string(length);
+    char* end = result;
+
+    for (int i = 0; i < array->length; i++) {
+        if (i > 0) {
+            memcpy(end, separator, separator_length);
+            end += separator_length;
+        }
+
+        const char* text = value_text(array_get(array, i), number);
+        size_t text_length = strlen(text);
+        memcpy(end, text, text_length);
+        end += text_length;
+    }
+
+    return string_result(result);
+}
+
+// replace(s, from, to) replaces every occurrence of from
+static Value native_replace(Interpreter* interpreter, Value* args, int args_length) {
+    (void)interpreter;
+    (void)args_length;
+    const char* string = string_argument("replace", args, 0);
+    const char* from = string_argument("replace", args, 1);
+    const char* to = string_argument("replace", args, 2);
+    size_t from_length = strlen(from);
+    size_t to_length = strlen(to);
+
+    if (from_length == 0) {
+        runtime_error("replace expects a non-empty string to replace\n");
+    }
+
+    size_t count = 0;
+    for (const char* found = strstr(string, from); found; found = strstr(found + from_length, from)) {
+        count++;
+    }
+
+    char* result = new_string(strlen(string) - count * from_length + count * to_length);
+    char* end = result;
+    const char* start = string;
+    const char* found;
+
+    while ((found = strstr(start, from)) != NULL) {
+        memcpy(end, start, (size_t)(found - start));
+        end += found - start;
+        memcpy(end, to, to_length);
+        end += to_length;
+        start = found + from_length;
+    }
+
+    memcpy(end, start, strlen(start));
+    return string_result(result);
+}
+
+// The text '+' would turn a value into
+static Value native_str(Interpreter* interpreter, Value* args, int args_length) {
+    (void)interpreter;
+    (void)args_length;
+    char number[NUMBER_BUFFER_SIZE];
+
+    if (!is_scalar(args[0])) {
+        runtime_error("str expects a number, a string, a boolean or null\n");
+    }
+
+    return string_result(asc_strdup(value_text(args[0], number), MEM_STRING));
+}
+
+// A number from its text, or null if the whole string is not one
+static Value native_number(Interpreter* interpreter, Value* args, int args_length) {
+    (void)interpreter;
+    (void)args_length;
+
+    if (args[0].type == VALUE_NUMBER) {
+        return args[0];
+    }
+
+    const char* string = string_argument("number", args, 0);
+    char* end;
+    double number = strtod(string, &end);
+
+    if (end == string || *end != '\0') {
+        return null_result();
+    }
+
+    return number_result(number);
+}
+
+// Calls in program images store their builtin's index in this table, so new
+// builtins go at the end
+const Builtin builtins[] = {
+    { "abs", native_abs, 1, 1 },
+    { "floor", native_floor, 1, 1 },
+    { "ceil", native_ceil, 1, 1 },
+    { "round", native_round, 1, 1 },
+    { "trunc", native_trunc, 1, 1 },
+    { "sqrt", native_sqrt, 1, 1 },
+    { "exp", native_exp, 1, 1 },
+    { "log", native_log, 1, 1 },
+    { "sin", native_sin, 1, 1 },
+    { "cos", native_cos, 1, 1 },
+    { "tan", native_tan, 1, 1 },
+    { "pow", native_pow, 2, 2 },
+    { "atan2", native_atan2, 2, 2 },
+    { "min", native_min, 1, -1 },
+    { "max", native_max, 1, -1 },
+    { "len", native_len, 1, 1 },
+    { "substring", native_substring, 2, 3 },
+    { "index_of", native_index_of, 2, 2 },
+    { "upper", native_upper, 1, 1 },
+    { "lower", native_lower, 1, 1 },
+    { "trim", native_trim, 1, 1 },
+    { "split", native_split, 2, 2 },
+    { "join", native_join, 1, 2 },
+    { "replace", native_replace, 3, 3 },
+    { "str", native_str, 1, 1 },
+    { "number", native_number, 1, 1 },
+    { "sum", native_sum, 1, 1 },
+    { "dot", native_dot, 2, 2 },
+    { "scale", native_scale, 2, 2 },
+    { "add", native_add, 2, 2 }
+};
+
+#define BUILTIN_COUNT ((int)(sizeof(builtins) / sizeof(builtins[0])))
+
+int find_builtin(const char* name) {
+    for (int i = 0; i < BUILTIN_COUNT; i++) {
+        if (strcmp(builtins[i].name, name) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Identifies what images depend on besides their format and layout: the
+// version, and the builtins in table order, whose indexes calls store. The
+// executable and the library of one build agree on it, so they can share
+// the module cache.
+uint64_t build_hash(void) {
+    uint64_t hash = hash_string(ASC_VERSION);
+
+    for (int i = 0; i < BUILTIN_COUNT; i++) {
+        hash = hash_bytes(builtins[i].name, strlen(builtins[i].name) + 1, hash);
+    }
+
+    return hash;
+}
+
+// Explicit-stack evaluator implementation
+// With --explicit-stack, scripts run as a loop over a stack of frames on the
+// heap instead of through evaluate calling itself, so their recursion depth
+// is bounded by --stack-limit rather than by the C stack. Each frame counts
+// the children of its node that have been started. A child that finishes
+// leaves its value on the value stack, where a frame keeps the values it
+// still needs from its base up. A call saves the caller's scope stack on
+// saved_scopes instead of in a block of its own. Every node behaves exactly
+// as it does in evaluate, through the same helpers; literals, identifiers,
+// function declarations and imports still go through evaluate's functions,
+// as they have no children to wait for.
+static Value boolean_result(bool boolean) {
+    Value result;
+    result.type = VALUE_BOOLEAN;
+    result.data.boolean = boolean;
+    return result;
+}
+
+// Starts evaluating node, pushing its value straight away if it has no
+// children
+static void machine_push(Interpreter* interpreter, ASTNode* node) {
+    STATS(runtime_stats.evaluations[node->type]++);
+
+    switch (node->type) {
+    case NODE_LITERAL:
+        stack_push(interpreter, evaluate_literal(interpreter, node));
+        return;
+    case NODE_IDENTIFIER:
+        stack_push(interpreter, evaluate_identifier(interpreter, node));
+        return;
+    case NODE_FUNCTION_DECLARATION:
+        stack_push(interpreter, evaluate_function_declaration(interpreter, node));
+        return;
+    case NODE_IMPORT_STATEMENT:
+        stack_push(interpreter, evaluate_import_statement(interpreter, node));
+        return;
+    case NODE_LAZY_BODY:
+        machine_push(interpreter, lazy_function_body(node));
+        return;
+    default:
+        break;
+    }
+
+    if (interpreter->frames_length >= interpreter->frames_capacity) {
+        interpreter->frames = (MachineFrame*)grow_stack(interpreter, interpreter->frames, interpreter->frames_length,
+            &interpreter->frames_capacity, sizeof(MachineFrame), 1);
+    }
+
+    MachineFrame* frame = &interpreter->frames[interpreter->frames_length++];
+    frame->node = node;
+    frame->step = 0;
+    frame->base = interpreter->stack_length;
+}
+
+// Pops the top frame, leaving value in place of its children's values
+static void machine_finish(Interpreter* interpreter, Value value) {
+    MachineFrame* frame = &interpreter->frames[--interpreter->frames_length];
+    interpreter->stack_length = frame->base;
+    stack_push(interpreter, value);
+}
+
+// Starts a script function's body once the callee and the arguments are on
+// the value stack
+static void machine_call(Interpreter* interpreter, MachineFrame* frame, int args_length) {
+    Value* values = interpreter->stack + frame->base;
+    int saved_length = interpreter->scope_stack_length;
+
+    if (interpreter->saved_scopes_length + saved_length > interpreter->saved_scopes_capacity) {
+        interpreter->saved_scopes = (Scope**)grow_stack(interpreter, interpreter->saved_scopes,
+            interpreter->saved_scopes_length, &interpreter->saved_scopes_capacity, sizeof(Scope*), saved_length);
+    }
+
+    frame->saved_scopes = interpreter->saved_scopes_length;
+    frame->saved_length = saved_length;
+    interpreter->saved_scopes_length += saved_length;
+    frame->call_start = enter_function(interpreter, &values[0], values + 1, args_length,
+        frame->node->data.call_expression.line, interpreter->saved_scopes + frame->saved_scopes);
+    frame->step++;
+
+    machine_push(interpreter, values[0].data.function.body);
+}
+
+// Advances the top frame: starts its next child, or finishes it
+static void machine_step(Interpreter* interpreter) {
+    MachineFrame* frame = &interpreter->frames[interpreter->frames_length - 1];
+    ASTNode* node = frame->node;
+    Value* values = interpreter->stack + frame->base;
+    int done = interpreter->stack_length - frame->base;
+
+    switch (node->type) {
+    case NODE_PROGRAM:
+        if (done > 0) {
+            if (interpreter->has_return) {
+                machine_finish(interpreter, interpreter->return_value);
+                return;
+            }
+
+            if (frame->step >= frame->end) {
+                machine_finish(interpreter, values[0]);
+                return;
+            }
+
+            interpreter->stack_length = frame->base;
+        }
+        else if (frame->step >= frame->end) {
+            machine_finish(interpreter, null_result());
+            return;
+        }
+
+        machine_push(interpreter, AST_NODE(AST_LIST(node->data.program.body)[frame->step++]));
+        return;
+
+    case NODE_BLOCK_STATEMENT:
+        if (done > 0) {
+            if (interpreter->has_return || frame->step == node->data.block_statement.body_length) {
+                pop_scope(interpreter);
+                machine_finish(interpreter, values[0]);
+                return;
+            }
+
+            interpreter->stack_length = frame->base;
+        }
+        else {
+            push_scope(interpreter, create_scope());
+
+            if (node->data.block_statement.body_length == 0) {
+                pop_scope(interpreter);
+                machine_finish(interpreter, null_result());
+                return;
+            }
+        }
+
+        machine_push(interpreter, AST_NODE(AST_LIST(node->data.block_statement.body)[frame->step++]));
+        return;
+
+    case NODE_VARIABLE_DECLARATION:
+        if (done == 0) {
+            machine_push(interpreter, AST_NODE(node->data.variable_declaration.value));
+            return;
+        }
+
+        define_variable(get_current_scope(interpreter), AST_STRING(node->data.variable_declaration.name), values[0]);
+        machine_finish(interpreter, values[0]);
+        return;
+
+    case NODE_ASSIGNMENT_EXPRESSION:
+        if (done == 0) {
+            machine_push(interpreter, AST_NODE(node->data.assignment_expression.value));
+            return;
+        }
+
+        machine_finish(interpreter, assign_variable(interpreter, node, values[0]));
+        return;
+
+    case NODE_BINARY_EXPRESSION:
+        if (done < 2) {
+            machine_push(interpreter, done == 0 ? AST_NODE(node->data.binary_expression.left) :
+                AST_NODE(node->data.binary_expression.right));
+            return;
+        }
+
+        machine_finish(interpreter, binary_operation(node, values[0], values[1]));
+        return;
+
+    case NODE_LOGICAL_EXPRESSION: {
+        // && stops at false and || at true; otherwise the right side decides
+        bool stop = strcmp(AST_STRING(node->data.logical_expression.operator), "||") == 0;
+
+        if (frame->step == 0) {
+            frame->step = 1;
+            machine_push(interpreter, AST_NODE(node->data.logical_expression.left));
+            return;
+        }
+
+        if (frame->step == 1) {
+            if (values[0].type == VALUE_BOOLEAN && values[0].data.boolean == stop) {
+                machine_finish(interpreter, boolean_result(stop));
+                return;
+            }
+
+            interpreter->stack_length = frame->base;
+            frame->step = 2;
+            machine_push(interpreter, AST_NODE(node->data.logical_expression.right));
+            return;
+        }
+
+        machine_finish(interpreter, boolean_result(values[0].type == VALUE_BOOLEAN && values[0].data.boolean));
+        return;
+    }
+
+    case NODE_IF_STATEMENT:
+        if (frame->step == 0) {
+            frame->step = 1;
+            machine_push(interpreter, AST_NODE(node->data.if_statement.test));
+            return;
+        }
+
+        if (frame->step == 1) {
+            bool test = values[0].type == VALUE_BOOLEAN && values[0].data.boolean;
+            ASTNode* branch = test ? AST_NODE(node->data.if_statement.consequent) : AST_NODE(node->data.if_statement.alternate);
+
+            if (branch == NULL) {
+                machine_finish(interpreter, null_result());
+                return;
+            }
+
+            interpreter->stack_length = frame->base;
+            frame->step = 2;
+            machine_push(interpreter, branch);
+            return;
+        }
+
+        machine_finish(interpreter, values[0]);
+        return;
+
+    case NODE_WHILE_STATEMENT:
+        // values[0] is the last value of the body, values[1] the test or the
+        // body just evaluated
+        if (frame->step == 0) {
+            stack_push(interpreter, null_result());
+            frame->step = 1;
+            return;
+        }
+
+        if (done == 2) {
+            Value value = values[1];
+            interpreter->stack_length = frame->base + 1;
+
+            if (frame->step == 1) {
+                if (value.type != VALUE_BOOLEAN || !value.data.boolean) {
+                    machine_finish(interpreter, values[0]);
+                    return;
+                }
+
+                frame->step = 2;
+                machine_push(interpreter, AST_NODE(node->data.while_statement.body));
+                return;
+            }
+
+            values[0] = value;
+
+            if (interpreter->has_return) {
+                machine_finish(interpreter, values[0]);
+                return;
+            }
+        }
+
+        frame->step = 1;
+        machine_push(interpreter, AST_NODE(node->data.while_statement.test));
+        return;
+
+    case NODE_CALL_EXPRESSION: {
+        // values[0] is the callee and the arguments follow it
+        int args_length = node->data.call_expression.arguments_length;
+
+        if (frame->step == 0) {
+            const char* name = AST_STRING(node->data.call_expression.name);
+            Value* func_value = find_variable(interpreter, name);
+            Value callee;
+
+            if (func_value == NULL) {
+                if (node->data.call_expression.builtin < 0) {
+                    runtime_error("Variable '%s' is not defined\n", name);
+                }
+
+                callee.type = VALUE_NATIVE;
+                callee.data.native = &builtins[node->data.call_expression.builtin];
+            }
+            else if (func_value->type == VALUE_NATIVE) {
+                callee = *func_value;
+            }
+            else if (func_value->type == VALUE_FUNCTION) {
+                // Later calls through this variable go straight to the parsed body
+                if (func_value->data.function.body->type == NODE_LAZY_BODY) {
+                    func_value->data.function.body = lazy_function_body(func_value->data.function.body);
+                }
+
+                callee = *func_value;
+            }
+            else {
+                runtime_error("'%s' is not a function\n", name);
+            }
+
+            if (callee.type == VALUE_NATIVE) {
+                check_native_arity(callee.data.native, args_length);
+            }
+
+            frame->step = 1;
+            stack_push(interpreter, callee);
+            return;
+        }
+
+        if (frame->step <= args_length) {
+            ASTNode* argument = AST_NODE(AST_LIST(node->data.call_expression.arguments)[frame->step - 1]);
+            frame->step++;
+            machine_push(interpreter, argument);
+            return;
+        }
+
+        if (values[0].type == VALUE_NATIVE) {
+            machine_finish(interpreter, invoke_native(interpreter, values[0].data.native, frame->base + 1, args_length));
+            return;
+        }
+
+        if (frame->step == args_length + 1) {
+            machine_call(interpreter, frame, args_length);
+            return;
+        }
+
+        Value result = leave_function(interpreter, &values[0], values[args_length + 1],
+            interpreter->saved_scopes + frame->saved_scopes, frame->saved_length, frame->call_start);
+        interpreter->saved_scopes_length = frame->saved_scopes;
+        machine_finish(interpreter, result);
+        return;
+    }
+
+    case NODE_RETURN_STATEMENT:
+        if (done == 0) {
+            machine_push(interpreter, AST_NODE(node->data.return_statement.argument));
+            return;
+        }
+
+        interpreter->return_value = values[0];
+        interpreter->has_return = true;
+        machine_finish(interpreter, values[0]);
+        return;
+
+    case NODE_PRINT_STATEMENT: {
+        RelPtr* arguments = AST_LIST(node->data.print_statement.arguments);
+
+        if (done > 0) {
+            print_argument(interpreter->output, AST_NODE(arguments[frame->step - 1]), values[0]);
+            interpreter->stack_length = frame->base;
+        }
+
+        while (frame->step < node->data.print_statement.arguments_length) {
+            ASTNode* argument = AST_NODE(arguments[frame->step++]);
+
+            if (!print_literal(interpreter->output, argument)) {
+                machine_push(interpreter, argument);
+                return;
+            }
+        }
+
+        machine_finish(interpreter, end_print_line(interpreter->output));
+        return;
+    }
+
+    case NODE_ARRAY_LITERAL:
+        // values[0] is the array, and values[1] the element just evaluated
+        if (done == 0) {
+            Value array;
+            array.type = VALUE_ARRAY;
+            array.data.array = create_array(node->data.array_literal.elements_length);
+            stack_push(interpreter, array);
+            return;
+        }
+
+        if (done == 2) {
+            array_push(values[0].data.array, values[1]);
+            interpreter->stack_length = frame->base + 1;
+        }
+
+        if (frame->step < node->data.array_literal.elements_length) {
+            machine_push(interpreter, AST_NODE(AST_LIST(node->data.array_literal.elements)[frame->step++]));
+            return;
+        }
+
+        machine_finish(interpreter, values[0]);
+        return;
+
+    case NODE_MAP_LITERAL:
+        // values[0] is the map, and values[1] and values[2] the entry being
+        // evaluated
+        if (done == 0) {
+            Value map;
+            map.type = VALUE_MAP;
+            map.data.map = create_map(node->data.map_literal.entries_length);
+            stack_push(interpreter, map);
+            return;
+        }
+
+        if (done == 3) {
+            map_set(values[0].data.map, values[1], values[2]);
+            interpreter->stack_length = frame->base + 1;
+        }
+
+        if (frame->step < 2 * node->data.map_literal.entries_length) {
+            machine_push(interpreter, AST_NODE(AST_LIST(node->data.map_literal.entries)[frame->step++]));
+            return;
+        }
+
+        machine_finish(interpreter, values[0]);
+        return;
+
+    case NODE_INDEX_EXPRESSION:
+        if (done < 2) {
+            machine_push(interpreter, done == 0 ? AST_NODE(node->data.index_expression.object) :
+                AST_NODE(node->data.index_expression.index));
+            return;
+        }
+
+        machine_finish(interpreter, get_index(values[0], values[1]));
+        return;
+
+    case NODE_INDEX_ASSIGNMENT:
+        if (done < 3) {
+            ASTNode* child = done == 0 ? AST_NODE(node->data.index_assignment.object) :
+                done == 1 ? AST_NODE(node->data.index_assignment.index) : AST_NODE(node->data.index_assignment.value);
+            machine_push(interpreter, child);
+            return;
+        }
+
+        set_index(values[0], values[1], values[2]);
+        machine_finish(interpreter, values[2]);
+        return;
+
+    case NODE_MEMBER_EXPRESSION: {
+        // values[0] is the object and the arguments follow it
+        RelPtr* arguments = AST_LIST(node->data.member_expression.arguments);
+        const char* name = AST_STRING(node->data.member_expression.name);
+        bool call = node->data.member_expression.call;
+
+        if (done == 0) {
+            machine_push(interpreter, AST_NODE(node->data.member_expression.object));
+            return;
+        }
+
+        if (values[0].type == VALUE_MAP) {
+            if (frame->step == 0) {
+                frame->end = check_map_member(node);
+                frame->step = 1;
+            }
+
+            if (done - 1 < frame->end) {
+                machine_push(interpreter, AST_NODE(arguments[done - 1]));
+                return;
+            }
+
+            machine_finish(interpreter, apply_map_member(node, values[0].data.map, values + 1));
+            return;
+        }
+
+        if (values[0].type != VALUE_ARRAY) {
+            runtime_error("Cannot read '%s' of a value that is not an array or a map\n", name);
+        }
+
+        Array* array = values[0].data.array;
+
+        if (strcmp(name, "length") == 0 && !call) {
+            machine_finish(interpreter, number_result(array->length));
+            return;
+        }
+
+        if (strcmp(name, "push") != 0 || !call) {
+            runtime_error("Arrays have no %s '%s'\n", call ? "method" : "property", name);
+        }
+
+        // Each value is pushed as soon as it is evaluated
+        if (done == 2) {
+            array_push(array, values[1]);
+            interpreter->stack_length = frame->base + 1;
+        }
+
+        if (frame->step < node->data.member_expression.arguments_length) {
+            machine_push(interpreter, AST_NODE(arguments[frame->step++]));
+            return;
+        }
+
+        machine_finish(interpreter, number_result(array->length));
+        return;
+    }
+
+    default:
+        runtime_error("Unknown node type: %d\n", node->type);
+    }
+}
+
+// Evaluates node without recursing in C. For a program, only the top-level
+// statements from up to, not including, to run, or all of them when to is
+// -1.
+Value run_machine(Interpreter* interpreter, ASTNode* node, int from, int to) {
+    int floor = interpreter->frames_length;
+    int base = interpreter->stack_length;
+
+    machine_push(interpreter, node);
+
+    if (node->type == NODE_PROGRAM) {
+        MachineFrame* frame = &interpreter->frames[interpreter->frames_length - 1];
+        frame->step = from;
+        frame->end = to < 0 ? node->data.program.body_length : to;
+    }
+
+    while (interpreter->frames_length > floor) {
+        machine_step(interpreter);
+    }
+
+    Value result = interpreter->stack[base];
+    interpreter->stack_length = base;
+    return result;
+}
+
+// Does the work of compile_source, publishing the lexer and parser through
+// lexer_out and parser_out while they are alive, for try_compile_source to
+// release after a syntax error
+static Program* compile_source_tracked(const char* code, Lexer* volatile* lexer_out, Parser* volatile* parser_out) {
+    uint64_t phase_start = tracer.enabled ? monotonic_ns() : 0;
+    Program* program = NULL;
+
+    if (module_cache.enabled) {
+        program = load_cached_program(code);
+
+        if (tracer.enabled) {
+            trace_event(program ? "cache_hit" : "cache_miss", "cache", phase_start);
+            phase_start = monotonic_ns();
+        }
+
+        if (program) {
+            return program;
+        }
+    }
+
+    Lexer* lexer = create_lexer(code);
+    *lexer_out = lexer;
+    int token_count;
+    Token* tokens = tokenize(lexer, &token_count);
+
+    if (tracer.enabled) {
+        trace_event("tokenize", "phase", phase_start);
+        phase_start = monotonic_ns();
+    }
+
+    Parser* parser = create_parser(tokens, token_count, code);
+    *parser_out = parser;
+    ASTNode* ast = parse(parser);
+    program = finish_image(&parser->image, ast, code);
+
+    if (tracer.enabled) {
+        trace_event("parse", "phase", phase_start);
+        phase_start = monotonic_ns();
+    }
+
+    free_parser(parser);
+    free_lexer(lexer);
+    *parser_out = NULL;
+    *lexer_out = NULL;
+
+    if (module_cache.enabled) {
+        store_cached_program(program);
+
+        if (tracer.enabled) {
+            trace_event("cache_store", "cache", phase_start);
+        }
+    }
+
+    return program;
+}
+
+// Lexes and parses code, going through the module cache when it is enabled
+Program* compile_source(const char* code) {
+    Lexer* volatile lexer = NULL;
+    Parser* volatile parser = NULL;
+    return compile_source_tracked(code, &lexer, &parser);
+}
+
+// Like compile_source, but returns NULL on a syntax error and leaves the
+// message in error_message
+Program* try_compile_source(const char* code) {
+    jmp_buf trap;
+    jmp_buf* previous_trap = error_trap;
+    Program* volatile program = NULL;
+    Lexer* volatile lexer = NULL;
+    Parser* volatile parser = NULL;
+
+    if (setjmp(trap) == 0) {
+        error_trap = &trap;
+        program = compile_source_tracked(code, &lexer, &parser);
+    }
+    else {
+        free_failed_compile(lexer, parser);
+    }
+
+    error_trap = previous_trap;
+    return program;
+}
+
+// Runs an imported module's top level in its exports scope
+Value process_import(Interpreter* parent, Module* module, const char* base_dir) {
+    uint64_t phase_start = tracer.enabled ? monotonic_ns() : 0;
+
+    Interpreter* interpreter = create_interpreter();
+    asc_free(interpreter->base_dir);
+    interpreter->base_dir = asc_strdup(base_dir, MEM_RUNTIME);
+
+    // Use the importer's scope and module registry
+    free_scope(interpreter->scope_stack[0]);
+    interpreter->scope_stack[0] = module->exports;
+    free_module_registry(interpreter->modules);
+    interpreter->modules = parent->modules;
+    interpreter->output = parent->output;
+
+    Value result = explicit_stack ? run_machine(interpreter, program_root(module->program), 0, -1) :
+        evaluate(interpreter, program_root(module->program));
+
+    if (tracer.enabled) {
+        trace_event("evaluate", "phase", phase_start);
+    }
+
+    // Don't free the scope and registry as they're shared
+    interpreter->scope_stack_length = 0;
+    interpreter->modules = NULL;
+    free_interpreter(interpreter);
+
+    return result;
+}
+
+// Utility functions
+bool is_keyword(char* identifier) {
+    const char* keywords[] = {
+        "let", "if", "else", "while", "function",
+        "return", "true", "false", "print", "import"
+    };
+
+    for (int i = 0; i < 10; i++) {
+        if (strcmp(identifier, keywords[i]) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+char* read_file(const char* filename) {
+    FILE* file = fopen(filename, "r");
+
+    if (file == NULL) {
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long file_size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    char* buffer = (char*)asc_malloc(file_size + 1, MEM_SOURCE);
+    if (!buffer) {
+        fprintf(stderr, "Memory allocation failed\n");
+        fclose(file);
+        exit(1);
+    }
+
+    size_t bytes_read = fread(buffer, 1, file_size, file);
+    buffer[bytes_read] = '\0';
+
+    fclose(file);
+    return buffer;
+}
+
+// Resolves . and .. components and symbolic links. Returns NULL if the file
+// does not exist.
+char* canonical_path(const char* path) {
+#ifdef _WIN32
+    char* resolved = _fullpath(NULL, path, 0);
+    if (resolved != NULL && _access(resolved, 0) != 0) {
+        free(resolved);
+        resolved = NULL;
+    }
+#else
+    char* resolved = realpath(path, NULL);
+#endif
+
+    if (resolved == NULL) {
+        return NULL;
+    }
+
+    char* result = asc_strdup(resolved, MEM_IMPORT);
+    free(resolved);
+    return result;
+}
+
+static bool is_path_separator(char c) {
+#ifdef _WIN32
+    return c == '/' || c == '\\';
+#else
+    return c == '/';
+#endif
+}
+
+// Removes "." and empty components and folds ".." into the component before
+// it, from the text alone. Separators become '/'.
+char* normalize_path(const char* path) {
+    char* result = (char*)asc_malloc(strlen(path) + 2, MEM_IMPORT);
+    if (!result) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    size_t root = is_path_separator(path[0]) ? 1 : 0;
+    size_t size = 0;
+    int depth = 0; // Components a ".." can remove
+
+    if (root) {
+        result[size++] = '/';
+    }
+
+    const char* p = path;
+    while (*p) {
+        while (is_path_separator(*p)) {
+            p++;
+        }
+
+        const char* start = p;
+        while (*p && !is_path_separator(*p)) {
+            p++;
+        }
+
+        size_t length = (size_t)(p - start);
+        if (length == 0 || (length == 1 && start[0] == '.')) {
+            continue;
+        }
+
+        if (length == 2 && start[0] == '.' && start[1] == '.') {
+            if (depth > 0) {
+                while (size > root && result[size - 1] != '/') {
+                    size--;
+                }
+                if (size > root) {
+                    size--;
+                }
+                depth--;
+                continue;
+            }
+
+            // Nothing is above the root
+            if (root) {
+                continue;
+            }
+        }
+        else {
+            depth++;
+        }
+
+        if (size > root) {
+            result[size++] = '/';
+        }
+
+        memcpy(result + size, start, length);
+        size += length;
+    }
+
+    if (size == 0) {
+        result[size++] = '.';
+    }
+
+    result[size] = '\0';
+    return result;
+}
+
+bool get_file_stamp(const char* path, FileStamp* stamp) {
+#ifdef _WIN32
+    struct _stat64 info;
+    if (_stat64(path, &info) != 0) {
+        return false;
+    }
+#else
+    struct stat info;
+    if (stat(path, &info) != 0) {
+        return false;
+    }
+#endif
+
+    stamp->modified = (int64_t)info.st_mtime;
+    stamp->size = (int64_t)info.st_size;
+    stamp->inode = (uint64_t)info.st_ino;
+    return true;
+}
+
+bool same_file_stamp(const FileStamp* a, const FileStamp* b) {
+    return a->modified == b->modified && a->size == b->size && a->inode == b->inode;
+}
+
+uint64_t hash_string(const char* str) {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+
+    while (*str) {
+        hash ^= (unsigned char)*str++;
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+uint64_t hash_bytes(const void* data, size_t length, uint64_t seed) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    uint64_t hash = 14695981039346656037ULL ^ seed;
+
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+uint64_t monotonic_ns(void) {
+#ifdef _WIN32
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+// Name table implementation
+static int* create_slots(int capacity) {
+    int* slots = (int*)asc_malloc(sizeof(int) * capacity, MEM_TOOLING);
+    if (!slots) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < capacity; i++) {
+        slots[i] = -1;
+    }
+
+    return slots;
+}
+
+static void grow_name_table_slots(NameTable* table) {
+    int capacity = table->slots_capacity ? table->slots_capacity * 2 : 64;
+    int* slots = create_slots(capacity);
+
+    for (int i = 0; i < table->length; i++) {
+        size_t slot = hash_string(table->names[i]) & (capacity - 1);
+        while (slots[slot] != -1) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        slots[slot] = i;
+    }
+
+    asc_free(table->slots);
+    table->slots = slots;
+    table->slots_capacity = capacity;
+}
+
+int intern_name(NameTable* table, const char* name) {
+    if (table->length * 2 >= table->slots_capacity) {
+        grow_name_table_slots(table);
+    }
+
+    int mask = table->slots_capacity - 1;
+    size_t slot = hash_string(name) & mask;
+
+    while (table->slots[slot] != -1) {
+        int id = table->slots[slot];
+        if (strcmp(table->names[id], name) == 0) {
+            return id;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    if (table->length >= table->capacity) {
+        table->capacity = table->capacity ? table->capacity * 2 : 32;
+        table->names = (char**)asc_realloc(table->names, sizeof(char*) * table->capacity, MEM_TOOLING);
+        if (!table->names) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+    }
+
+    int id = table->length++;
+    table->names[id] = asc_strdup(name, MEM_TOOLING);
+    table->slots[slot] = id;
+
+    return id;
+}
+
+// Returns the id of a name without adding it, or -1 if it is not interned
+int find_name(const NameTable* table, const char* name) {
+    if (table->slots_capacity == 0) {
+        return -1;
+    }
+
+    int mask = table->slots_capacity - 1;
+    size_t slot = hash_string(name) & mask;
+
+    while (table->slots[slot] != -1) {
+        int id = table->slots[slot];
+        if (strcmp(table->names[id], name) == 0) {
+            return id;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    return -1;
+}
+
+void free_name_table(NameTable* table) {
+    for (int i = 0; i < table->length; i++) {
+        asc_free(table->names[i]);
+    }
+
+    asc_free(table->names);
+    asc_free(table->slots);
+    memset(table, 0, sizeof(NameTable));
+}
+
+// Module registry implementation
+ModuleRegistry* create_module_registry(void) {
+    ModuleRegistry* registry = (ModuleRegistry*)asc_calloc(1, sizeof(ModuleRegistry), MEM_IMPORT);
+    if (!registry) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    return registry;
+}
+
+// Returns the module for a canonical path, adding an empty one on first use
+Module* get_module(ModuleRegistry* registry, const char* path) {
+    int id = intern_name(&registry->paths, path);
+
+    if (id < registry->length) {
+        return registry->modules[id];
+    }
+
+    if (registry->length >= registry->capacity) {
+        registry->capacity = registry->capacity ? registry->capacity * 2 : 16;
+        registry->modules = (Module**)asc_realloc(registry->modules, sizeof(Module*) * registry->capacity, MEM_IMPORT);
+        if (!registry->modules) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+    }
+
+    Module* module = (Module*)asc_calloc(1, sizeof(Module), MEM_IMPORT);
+    if (!module) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    registry->modules[registry->length++] = module;
+    return module;
+}
+
+// Defines a loaded module's top-level declarations in another scope, for a
+// repeated import from somewhere other than where it first ran
+void bind_module_exports(Module* module, Scope* scope) {
+    ImageSymbol* symbols = (ImageSymbol*)rel_get(&module->program->image->symbols);
+
+    for (int i = 0; i < module->program->image->symbols_length; i++) {
+        const char* name = AST_STRING(symbols[i].name);
+
+        for (int j = module->exports->length - 1; j >= 0; j--) {
+            if (strcmp(module->exports->names[j], name) == 0) {
+                define_variable(scope, name, copy_value(module->exports->values[j]));
+                break;
+            }
+        }
+    }
+}
+
+// Resolves an import of file_path from directory to the path its module is
+// registered under: the canonical path, or for a bundle the normalized path it
+// was bundled under. Returns NULL if there is no such module.
+char* resolve_import_path(ModuleRegistry* registry, const char* directory, const char* file_path) {
+    char* full_path = (char*)asc_malloc(strlen(directory) + strlen(file_path) + 2, MEM_IMPORT);
+    if (!full_path) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    sprintf(full_path, "%s/%s", directory, file_path);
+    char* path = NULL;
+
+    if (registry->bundle) {
+        char* key = normalize_path(full_path);
+        int alias = find_name(&registry->bundle->aliases, key);
+        if (alias >= 0) {
+            path = asc_strdup(registry->bundle->paths[registry->bundle->alias_modules[alias]], MEM_IMPORT);
+        }
+        asc_free(key);
+    }
+    else {
+        path = canonical_path(full_path);
+    }
+
+    asc_free(full_path);
+    return path;
+}
+
+// Forgets which modules have run, keeping their parsed programs
+void reset_module_registry(ModuleRegistry* registry) {
+    registry_lock(registry);
+
+    for (int i = 0; i < registry->length; i++) {
+        registry->modules[i]->exports = NULL;
+        registry->modules[i]->running = false;
+        registry->modules[i]->loaded = false;
+
+        // Looked up again on the next import, in case the file changed
+        if (registry->store) {
+            registry->modules[i]->program = NULL;
+        }
+    }
+
+    registry_unlock(registry);
+}
+
+// Forgets modules whose top level was cut short by an error, so they run
+// again when next imported
+void abort_module_loads(ModuleRegistry* registry) {
+    registry_lock(registry);
+
+    for (int i = 0; i < registry->length; i++) {
+        if (registry->modules[i]->running && !registry->modules[i]->loaded) {
+            registry->modules[i]->exports = NULL;
+            registry->modules[i]->running = false;
+        }
+    }
+
+    registry_unlock(registry);
+}
+
+void free_module_registry(ModuleRegistry* registry) {
+    if (registry == NULL) {
+        return;
+    }
+
+    if (registry->loader) {
+        stop_import_loader(registry->loader);
+    }
+
+    for (int i = 0; i < registry->length; i++) {
+        if (registry->store == NULL && registry->bundle == NULL) {
+            free_program(registry->modules[i]->program);
+        }
+
+        asc_free(registry->modules[i]);
+    }
+
+    free_name_table(&registry->paths);
+    asc_free(registry->modules);
+    asc_free(registry);
+}
+
+void init_program_store(ProgramStore* store) {
+    memset(store, 0, sizeof(ProgramStore));
+    mutex_init(&store->lock);
+}
+
+// Returns the program shared under path, or NULL if there is none or its
+// file has changed since it was parsed
+Program* find_shared_program(ProgramStore* store, const char* path) {
+    Program* program = NULL;
+    FileStamp stamp;
+
+    if (!get_file_stamp(path, &stamp)) {
+        return NULL;
+    }
+
+    mutex_lock(&store->lock);
+
+    int id = intern_name(&store->paths, path);
+    if (id < store->length && store->programs[id] && same_file_stamp(&store->stamps[id], &stamp)) {
+        program = store->programs[id];
+    }
+
+    mutex_unlock(&store->lock);
+    return program;
+}
+
+// Adds a program parsed from path and returns the one to use, which is the
+// program already stored if another interpreter got there first
+Program* share_program(ProgramStore* store, const char* path, Program* program) {
+    FileStamp stamp = { 0 };
+    get_file_stamp(path, &stamp);
+
+    mutex_lock(&store->lock);
+
+    int id = intern_name(&store->paths, path);
+
+    while (store->length <= id) {
+        if (store->length >= store->capacity) {
+            store->capacity = store->capacity ? store->capacity * 2 : 16;
+            store->programs = (Program**)asc_realloc(store->programs, sizeof(Program*) * store->capacity, MEM_IMPORT);
+            store->stamps = (FileStamp*)asc_realloc(store->stamps, sizeof(FileStamp) * store->capacity, MEM_IMPORT);
+            if (!store->programs || !store->stamps) {
+                fprintf(stderr, "Memory allocation failed\n");
+                exit(1);
+            }
+        }
+
+        store->programs[store->length++] = NULL;
+    }
+
+    Program* stored = store->programs[id];
+
+    if (stored && same_file_stamp(&store->stamps[id], &stamp)) {
+        free_program(program);
+        program = stored;
+    }
+    else {
+        if (stored) {
+            if (store->retired_length >= store->retired_capacity) {
+                store->retired_capacity = store->retired_capacity ? store->retired_capacity * 2 : 16;
+                store->retired = (Program**)asc_realloc(store->retired, sizeof(Program*) * store->retired_capacity, MEM_IMPORT);
+                if (!store->retired) {
+                    fprintf(stderr, "Memory allocation failed\n");
+                    exit(1);
+                }
+            }
+
+            store->retired[store->retired_length++] = stored;
+        }
+
+        store->programs[id] = program;
+        store->stamps[id] = stamp;
+    }
+
+    mutex_unlock(&store->lock);
+    return program;
+}
+
+void free_program_store(ProgramStore* store) {
+    for (int i = 0; i < store->length; i++) {
+        free_program(store->programs[i]);
+    }
+
+    for (int i = 0; i < store->retired_length; i++) {
+        free_program(store->retired[i]);
+    }
+
+    free_name_table(&store->paths);
+    asc_free(store->programs);
+    asc_free(store->stamps);
+    asc_free(store->retired);
+    mutex_destroy(&store->lock);
+}
+
+// Import loader implementation
+// Directory that imports inside a file resolve against
+char* path_directory(const char* path) {
+    const char* last_slash = strrchr(path, '/');
+#ifdef _WIN32
+    const char* last_backslash = strrchr(path, '\\');
+    if (last_backslash != NULL && (last_slash == NULL || last_backslash > last_slash)) {
+        last_slash = last_backslash;
+    }
+#endif
+
+    if (last_slash == NULL) {
+        return asc_strdup(".", MEM_IMPORT);
+    }
+
+    size_t length = last_slash == path ? 1 : (size_t)(last_slash - path);
+    char* directory = (char*)asc_malloc(length + 1, MEM_IMPORT);
+    if (!directory) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    memcpy(directory, path, length);
+    directory[length] = '\0';
+    return directory;
+}
+
+void registry_lock(ModuleRegistry* registry) {
+    if (registry->loader) {
+        mutex_lock(&registry->loader->lock);
+    }
+}
+
+void registry_unlock(ModuleRegistry* registry) {
+    if (registry->loader) {
+        mutex_unlock(&registry->loader->lock);
+    }
+}
+
+// Created by the main thread, before any worker exists
+static ImportLoader* get_import_loader(ModuleRegistry* registry) {
+    if (registry->loader) {
+        return registry->loader;
+    }
+
+    enable_threads();
+
+    ImportLoader* loader = (ImportLoader*)asc_calloc(1, sizeof(ImportLoader), MEM_IMPORT);
+    if (!loader) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    loader->threads_capacity = import_threads;
+    if (loader->threads_capacity < 0) {
+        int cpus = cpu_count();
+        loader->threads_capacity = cpus < 8 ? cpus : 8;
+    }
+
+    loader->threads = (AscThread*)asc_malloc(sizeof(AscThread) * loader->threads_capacity, MEM_IMPORT);
+    if (!loader->threads) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    mutex_init(&loader->lock);
+    cond_init(&loader->changed);
+    registry->loader = loader;
+    return loader;
+}
+
+// Reads and parses a file. Returns NULL on any error; the import reports it
+// itself if execution ever reaches it.
+static Program* prefetch_program(ModuleRegistry* registry, const char* path) {
+    Program* program = registry->store ? find_shared_program(registry->store, path) : NULL;
+    if (program) {
+        return program;
+    }
+
+    char* code = read_file(path);
+    if (code == NULL) {
+        return NULL;
+    }
+
+    program = try_compile_source(code);
+    asc_free(code);
+
+    if (program && registry->store) {
+        program = share_program(registry->store, path, program);
+    }
+
+    return program;
+}
+
+static THREAD_RESULT import_worker(void* arg) {
+    ModuleRegistry* registry = (ModuleRegistry*)arg;
+    ImportLoader* loader = registry->loader;
+
+#ifndef _WIN32
+    // Profiling signals belong to the main thread, whose stack they sample
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGPROF);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+#endif
+
+    mutex_lock(&loader->lock);
+    thread_index = ++loader->workers_started;
+
+    for (;;) {
+        while (loader->jobs_head == loader->jobs_length && !loader->stopping) {
+            cond_wait(&loader->changed, &loader->lock);
+        }
+
+        if (loader->stopping) {
+            break;
+        }
+
+        LoadJob job = loader->jobs[loader->jobs_head++];
+        if (loader->jobs_head == loader->jobs_length) {
+            loader->jobs_head = 0;
+            loader->jobs_length = 0;
+        }
+
+        mutex_unlock(&loader->lock);
+
+        uint64_t start = tracer.enabled ? monotonic_ns() : 0;
+        Program* program = prefetch_program(registry, job.path);
+
+        if (program) {
+            char* directory = path_directory(job.path);
+            prefetch_imports(registry, program_root(program), directory);
+            asc_free(directory);
+        }
+
+        if (tracer.enabled) {
+            trace_event(job.path, "prefetch", start);
+        }
+
+        asc_free(job.path);
+
+        mutex_lock(&loader->lock);
+        job.module->program = program;
+        job.module->prefetching = false;
+        loader->pending--;
+        cond_broadcast(&loader->changed);
+    }
+
+    mutex_unlock(&loader->lock);
+    return 0;
+}
+
+static void queue_import(ModuleRegistry* registry, const char* directory, const char* file_path) {
+    char* path = resolve_import_path(registry, directory, file_path);
+
+    if (path == NULL) {
+        return;
+    }
+
+    ImportLoader* loader = get_import_loader(registry);
+    mutex_lock(&loader->lock);
+
+    Module* module = get_module(registry, path);
+
+    if (!module->queued && !module->running && module->program == NULL && !loader->stopping) {
+        // Start another worker while there are more jobs than workers
+        if (loader->threads_length < loader->threads_capacity && loader->threads_length <= loader->pending) {
+            if (thread_start(&loader->threads[loader->threads_length], import_worker, registry)) {
+                loader->threads_length++;
+            }
+        }
+
+        if (loader->threads_length > 0) {
+            if (loader->jobs_length >= loader->jobs_capacity) {
+                loader->jobs_capacity = loader->jobs_capacity ? loader->jobs_capacity * 2 : 16;
+                loader->jobs = (LoadJob*)asc_realloc(loader->jobs, sizeof(LoadJob) * loader->jobs_capacity, MEM_IMPORT);
+                if (!loader->jobs) {
+                    fprintf(stderr, "Memory allocation failed\n");
+                    exit(1);
+                }
+            }
+
+            loader->jobs[loader->jobs_length].module = module;
+            loader->jobs[loader->jobs_length].path = path;
+            loader->jobs_length++;
+            loader->pending++;
+            path = NULL;
+
+            module->queued = true;
+            module->prefetching = true;
+            cond_broadcast(&loader->changed);
+        }
+    }
+
+    mutex_unlock(&loader->lock);
+    asc_free(path);
+}
+
+// Queues every file a program imports, at any depth, for reading and parsing
+// on the loader threads. Files that do not exist are left for the import
+// statement to report. A bundle has nothing to read.
+void prefetch_imports(ModuleRegistry* registry, ASTNode* node, const char* directory) {
+    if (node == NULL || import_threads == 0 || registry->bundle) {
+        return;
+    }
+
+    switch (node->type) {
+    case NODE_PROGRAM:
+        for (int i = 0; i < node->data.program.body_length; i++) {
+            prefetch_imports(registry, AST_NODE(AST_LIST(node->data.program.body)[i]), directory);
+        }
+        break;
+    case NODE_BLOCK_STATEMENT:
+        for (int i = 0; i < node->data.block_statement.body_length; i++) {
+            prefetch_imports(registry, AST_NODE(AST_LIST(node->data.block_statement.body)[i]), directory);
+        }
+        break;
+    case NODE_IF_STATEMENT:
+        prefetch_imports(registry, AST_NODE(node->data.if_statement.consequent), directory);
+        prefetch_imports(registry, AST_NODE(node->data.if_statement.alternate), directory);
+        break;
+    case NODE_WHILE_STATEMENT:
+        prefetch_imports(registry, AST_NODE(node->data.while_statement.body), directory);
+        break;
+    case NODE_FUNCTION_DECLARATION:
+        prefetch_imports(registry, AST_NODE(node->data.function_declaration.body), directory);
+        break;
+    case NODE_LAZY_BODY:
+        // Only bodies that may import something are worth parsing early
+        if (strstr(AST_STRING(node->data.lazy_body.source), "import") != NULL) {
+            prefetch_imports(registry, try_lazy_function_body(node), directory);
+        }
+        break;
+    case NODE_IMPORT_STATEMENT:
+        queue_import(registry, directory, AST_STRING(node->data.import_statement.path));
+        break;
+    default:
+        // Imports are statements, so expressions never contain one
+        break;
+    }
+}
+
+// Marks a module as imported and waits for its prefetch, if one is running.
+// Sets first when this is the module's first import.
+Module* begin_import(ModuleRegistry* registry, const char* path, bool* first) {
+    registry_lock(registry);
+
+    Module* module = get_module(registry, path);
+    *first = !module->running;
+    module->running = true;
+
+    while (module->prefetching) {
+        cond_wait(&registry->loader->changed, &registry->loader->lock);
+    }
+
+    registry_unlock(registry);
+    return module;
+}
+
+// Like begin_import, without marking the module as imported
+Module* wait_for_module(ModuleRegistry* registry, const char* path) {
+    registry_lock(registry);
+
+    Module* module = get_module(registry, path);
+    while (module->prefetching) {
+        cond_wait(&registry->loader->changed, &registry->loader->lock);
+    }
+
+    registry_unlock(registry);
+    return module;
+}
+
+void stop_import_loader(ImportLoader* loader) {
+    mutex_lock(&loader->lock);
+    loader->stopping = true;
+    cond_broadcast(&loader->changed);
+    mutex_unlock(&loader->lock);
+
+    for (int i = 0; i < loader->threads_length; i++) {
+        thread_join(loader->threads[i]);
+    }
+
+    for (int i = loader->jobs_head; i < loader->jobs_length; i++) {
+        asc_free(loader->jobs[i].path);
+    }
+
+    mutex_destroy(&loader->lock);
+    cond_destroy(&loader->changed);
+    asc_free(loader->jobs);
+    asc_free(loader->threads);
+    asc_free(loader);
+}
+
+// Profiler implementation
+static int profiler_function_index(const char* name) {
+    int index = intern_name(&profiler.names, name);
+
+    if (index >= profiler.functions_capacity) {
+        int capacity = profiler.functions_capacity ? profiler.functions_capacity * 2 : 32;
+        profiler.functions = (ProfileFunction*)asc_realloc(profiler.functions,
+            sizeof(ProfileFunction) * capacity, MEM_TOOLING);
+        if (!profiler.functions) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+
+        memset(profiler.functions + profiler.functions_capacity, 0,
+            sizeof(ProfileFunction) * (capacity - profiler.functions_capacity));
+        profiler.functions_capacity = capacity;
+    }
+
+    return index;
+}
+
+static size_t hash_profile_edge(int caller, int callee) {
+    return (size_t)(((uint64_t)(uint32_t)caller << 32 | (uint32_t)callee) * 0x9E3779B97F4A7C15ULL >> 16);
+}
+
+static void grow_profile_edge_slots(void) {
+    int capacity = profiler.edge_slots_capacity ? profiler.edge_slots_capacity * 2 : 64;
+    int* slots = create_slots(capacity);
+
+    for (int i = 0; i < profiler.edges_length; i++) {
+        size_t slot = hash_profile_edge(profiler.edges[i].caller, profiler.edges[i].callee) & (capacity - 1);
+        while (slots[slot] != -1) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        slots[slot] = i;
+    }
+
+    asc_free(profiler.edge_slots);
+    profiler.edge_slots = slots;
+    profiler.edge_slots_capacity = capacity;
+}
+
+static ProfileEdge* profiler_edge(int caller, int callee) {
+    if (profiler.edges_length * 2 >= profiler.edge_slots_capacity) {
+        grow_profile_edge_slots();
+    }
+
+    int mask = profiler.edge_slots_capacity - 1;
+    size_t slot = hash_profile_edge(caller, callee) & mask;
+
+    while (profiler.edge_slots[slot] != -1) {
+        ProfileEdge* edge = &profiler.edges[profiler.edge_slots[slot]];
+        if (edge->caller == caller && edge->callee == callee) {
+            return edge;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    if (profiler.edges_length >= profiler.edges_capacity) {
+        profiler.edges_capacity = profiler.edges_capacity ? profiler.edges_capacity * 2 : 64;
+        profiler.edges = (ProfileEdge*)asc_realloc(profiler.edges,
+            sizeof(ProfileEdge) * profiler.edges_capacity, MEM_TOOLING);
+        if (!profiler.edges) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+    }
+
+    ProfileEdge* edge = &profiler.edges[profiler.edges_length];
+    edge->caller = caller;
+    edge->callee = callee;
+    edge->calls = 0;
+    edge->inclusive_ns = 0;
+    profiler.edge_slots[slot] = profiler.edges_length++;
+
+    return edge;
+}
+
+void profiler_start(const char* script_name) {
+    profiler.script_name = script_name;
+    profiler_enter("<main>");
+}
+
+void profiler_enter(const char* name) {
+    if (profiler.frames_length >= profiler.frames_capacity) {
+        profiler.frames_capacity = profiler.frames_capacity ? profiler.frames_capacity * 2 : 64;
+        profiler.frames = (ProfileFrame*)asc_realloc(profiler.frames,
+            sizeof(ProfileFrame) * profiler.frames_capacity, MEM_TOOLING);
+        if (!profiler.frames) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+    }
+
+    int index = profiler_function_index(name);
+    profiler.functions[index].calls++;
+    profiler.functions[index].active++;
+
+    ProfileFrame* frame = &profiler.frames[profiler.frames_length++];
+    frame->function = index;
+    frame->child_ns = 0;
+    // Read the clock last so the bookkeeping above is charged to the caller
+    frame->start_ns = monotonic_ns();
+}
+
+void profiler_exit(void) {
+    uint64_t end_ns = monotonic_ns();
+
+    if (profiler.frames_length == 0) {
+        return;
+    }
+
+    ProfileFrame* frame = &profiler.frames[--profiler.frames_length];
+    ProfileFunction* function = &profiler.functions[frame->function];
+    uint64_t elapsed = end_ns - frame->start_ns;
+
+    function->exclusive_ns += elapsed - frame->child_ns;
+    if (--function->active == 0) {
+        function->inclusive_ns += elapsed;
+    }
+
+    if (profiler.frames_length > 0) {
+        ProfileFrame* parent = &profiler.frames[profiler.frames_length - 1];
+        parent->child_ns += elapsed;
+
+        ProfileEdge* edge = profiler_edge(parent->function, frame->function);
+        edge->calls++;
+        edge->inclusive_ns += elapsed;
+    }
+}
+
+void profiler_stop(void) {
+    // Unwind anything left open (e.g. the <main> frame)
+    while (profiler.frames_length > 0) {
+        profiler_exit();
+    }
+}
+
+static int compare_profile_functions(const void* a, const void* b) {
+    int left_index = *(const int*)a;
+    int right_index = *(const int*)b;
+    const ProfileFunction* left = &profiler.functions[left_index];
+    const ProfileFunction* right = &profiler.functions[right_index];
+
+    if (left->exclusive_ns != right->exclusive_ns) {
+        return left->exclusive_ns < right->exclusive_ns ? 1 : -1;
+    }
+
+    return strcmp(profiler.names.names[left_index], profiler.names.names[right_index]);
+}
+
+void profiler_report(void) {
+    if (profiler.names.length == 0) {
+        return;
+    }
+
+    int* order = (int*)asc_malloc(sizeof(int) * profiler.names.length, MEM_TOOLING);
+    if (!order) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < profiler.names.length; i++) {
+        order[i] = i;
+    }
+
+    qsort(order, profiler.names.length, sizeof(int), compare_profile_functions);
+
+    // The <main> pseudo-function covers the whole run
+    double total_ms = profiler.functions[0].inclusive_ns / 1e6;
+
+    fprintf(stderr, "\nProfile (%.3f ms total, sorted by self time)\n", total_ms);
+    fprintf(stderr, "%12s %12s %12s %8s  %s\n", "calls", "incl ms", "self ms", "self %", "function");
+
+    for (int i = 0; i < profiler.names.length; i++) {
+        ProfileFunction* function = &profiler.functions[order[i]];
+        double self_ms = function->exclusive_ns / 1e6;
+
+        fprintf(stderr, "%12llu %12.3f %12.3f %7.2f%%  %s\n",
+            (unsigned long long)function->calls,
+            function->inclusive_ns / 1e6,
+            self_ms,
+            total_ms > 0 ? self_ms * 100.0 / total_ms : 0.0,
+            profiler.names.names[order[i]]);
+    }
+
+    asc_free(order);
+
+    const char* path = profiler.output_path ? profiler.output_path : "callgrind.out";
+    if (profiler_write_callgrind(path)) {
+        fprintf(stderr, "Call graph written to %s\n", path);
+    }
+    else {
+        fprintf(stderr, "Error: Could not write call graph to '%s'\n", path);
+    }
+}
+
+// Writes the call graph in callgrind format, loadable by kcachegrind/qcachegrind and gprof2dot
+bool profiler_write_callgrind(const char* path) {
+    FILE* file = fopen(path, "w");
+
+    if (file == NULL) {
+        return false;
+    }
+
+    fprintf(file, "# callgrind format\n");
+    fprintf(file, "version: 1\n");
+    fprintf(file, "creator: AbstractScriptC\n");
+    fprintf(file, "cmd: %s\n", profiler.script_name ? profiler.script_name : "");
+    fprintf(file, "positions: line\n");
+    fprintf(file, "events: ns\n");
+    fprintf(file, "summary: %llu\n\n", (unsigned long long)profiler.functions[0].inclusive_ns);
+
+    for (int i = 0; i < profiler.names.length; i++) {
+        ProfileFunction* function = &profiler.functions[i];
+
+        fprintf(file, "fl=%s\n", profiler.script_name ? profiler.script_name : "???");
+        fprintf(file, "fn=%s\n", profiler.names.names[i]);
+        fprintf(file, "0 %llu\n", (unsigned long long)function->exclusive_ns);
+
+        for (int j = 0; j < profiler.edges_length; j++) {
+            ProfileEdge* edge = &profiler.edges[j];
+
+            if (edge->caller != i) {
+                continue;
+            }
+
+            fprintf(file, "cfn=%s\n", profiler.names.names[edge->callee]);
+            fprintf(file, "calls=%llu 0\n", (unsigned long long)edge->calls);
+            fprintf(file, "0 %llu\n", (unsigned long long)edge->inclusive_ns);
+        }
+
+        fprintf(file, "\n");
+    }
+
+    bool ok = ferror(file) == 0;
+    return fclose(file) == 0 && ok;
+}
+
+void free_profiler(void) {
+    free_name_table(&profiler.names);
+    asc_free(profiler.functions);
+    asc_free(profiler.edges);
+    asc_free(profiler.edge_slots);
+    asc_free(profiler.frames);
+    memset(&profiler, 0, sizeof(Profiler));
+}
+
+// Sampling profiler implementation
+void sampler_push(const char* name, int line) {
+    int depth = shadow_stack_depth;
+
+    if (depth < SHADOW_STACK_CAPACITY) {
+        shadow_stack[depth].function = intern_name(&sampler.names, name);
+        shadow_stack[depth].line = line;
+    }
+
+    // Publish the frame only once it is complete
+    shadow_stack_depth = depth + 1;
+}
+
+void sampler_pop(void) {
+    if (shadow_stack_depth > 0) {
+        shadow_stack_depth = shadow_stack_depth - 1;
+    }
+}
+
+#ifndef _WIN32
+static bool sample_stack_matches(SampleStack* stack, uint64_t hash, int depth, bool truncated) {
+    if (stack->hash != hash || stack->depth != depth || stack->truncated != truncated) {
+        return false;
+    }
+
+    ShadowFrame* frames = &sampler.frames[stack->frames_offset];
+    for (int i = 0; i < depth; i++) {
+        if (frames[i].function != shadow_stack[i].function || frames[i].line != shadow_stack[i].line) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Runs in signal context: only touches memory preallocated by sampler_start
+static void sampler_handle_signal(int signal_number) {
+    (void)signal_number;
+
+    int depth = shadow_stack_depth;
+    bool truncated = depth > SHADOW_STACK_CAPACITY;
+    if (truncated) {
+        depth = SHADOW_STACK_CAPACITY;
+    }
+
+    uint64_t hash = 14695981039346656037ULL ^ (uint64_t)truncated;
+    for (int i = 0; i < depth; i++) {
+        hash = (hash ^ (uint32_t)shadow_stack[i].function) * 1099511628211ULL;
+        hash = (hash ^ (uint32_t)shadow_stack[i].line) * 1099511628211ULL;
+    }
+
+    sampler.samples++;
+
+    size_t mask = SAMPLE_STACKS_CAPACITY - 1;
+    size_t slot = hash & mask;
+
+    for (int probe = 0; probe < SAMPLE_STACKS_CAPACITY; probe++) {
+        SampleStack* stack = &sampler.stacks[slot];
+
+        if (stack->count == 0) {
+            if (sampler.frames_length + depth > SAMPLE_FRAMES_CAPACITY) {
+                break;
+            }
+
+            for (int i = 0; i < depth; i++) {
+                sampler.frames[sampler.frames_length + i].function = shadow_stack[i].function;
+                sampler.frames[sampler.frames_length + i].line = shadow_stack[i].line;
+            }
+
+            stack->hash = hash;
+            stack->frames_offset = sampler.frames_length;
+            stack->depth = depth;
+            stack->truncated = truncated;
+            stack->count = 1;
+            sampler.frames_length += depth;
+            return;
+        }
+
+        if (sample_stack_matches(stack, hash, depth, truncated)) {
+            stack->count++;
+            return;
+        }
+
+        slot = (slot + 1) & mask;
+    }
+
+    sampler.dropped++;
+}
+#endif
+
+bool sampler_start(const char* script_name) {
+#ifdef _WIN32
+    (void)script_name;
+    fprintf(stderr, "Error: --sample requires SIGPROF and is not supported on this platform\n");
+    return false;
+#else
+    sampler.stacks = (SampleStack*)asc_calloc(SAMPLE_STACKS_CAPACITY, sizeof(SampleStack), MEM_TOOLING);
+    sampler.frames = (ShadowFrame*)asc_malloc(sizeof(ShadowFrame) * SAMPLE_FRAMES_CAPACITY, MEM_TOOLING);
+    if (!sampler.stacks || !sampler.frames) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    if (sampler.frequency <= 0) {
+        sampler.frequency = 997; // Prime, so sampling does not lock step with periodic work
+    }
+
+    // The script itself is the root frame of every stack
+    shadow_stack_depth = 0;
+    sampler_push(script_name, 0);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = sampler_handle_signal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+
+    if (sigaction(SIGPROF, &action, NULL) != 0) {
+        fprintf(stderr, "Error: Could not install SIGPROF handler\n");
+        return false;
+    }
+
+    struct itimerval timer;
+    // tv_usec must stay below a second, so 1 Hz is a whole second
+    timer.it_interval.tv_sec = 1 / sampler.frequency;
+    timer.it_interval.tv_usec = (1000000 / sampler.frequency) % 1000000;
+    if (timer.it_interval.tv_sec == 0 && timer.it_interval.tv_usec == 0) {
+        timer.it_interval.tv_usec = 1;
+    }
+    timer.it_value = timer.it_interval;
+
+    if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+        fprintf(stderr, "Error: Could not start profiling timer\n");
+        return false;
+    }
+
+    sampler.running = true;
+    return true;
+#endif
+}
+
+void sampler_stop(void) {
+#ifndef _WIN32
+    if (!sampler.running) {
+        return;
+    }
+
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+    signal(SIGPROF, SIG_IGN);
+
+    sampler.running = false;
+    shadow_stack_depth = 0;
+#endif
+}
+
+// Writes one "root;caller:line;callee:line count" line per distinct stack, the
+// folded format read by flamegraph.pl, inferno and speedscope
+bool sampler_write_folded(const char* path) {
+    FILE* file = fopen(path, "w");
+
+    if (file == NULL) {
+        return false;
+    }
+
+    for (int i = 0; sampler.stacks && i < SAMPLE_STACKS_CAPACITY; i++) {
+        SampleStack* stack = &sampler.stacks[i];
+
+        if (stack->count == 0) {
+            continue;
+        }
+
+        for (int j = 0; j < stack->depth; j++) {
+            ShadowFrame* frame = &sampler.frames[stack->frames_offset + j];
+
+            if (j > 0) {
+                fputc(';', file);
+            }
+
+            if (frame->line > 0) {
+                fprintf(file, "%s:%d", sampler.names.names[frame->function], frame->line);
+            }
+            else {
+                fputs(sampler.names.names[frame->function], file);
+            }
+        }
+
+        if (stack->truncated) {
+            fputs(";[truncated]", file);
+        }
+
+        fprintf(file, " %llu\n", (unsigned long long)stack->count);
+    }
+
+    if (sampler.dropped > 0) {
+        fprintf(stderr, "Warning: %llu samples dropped, sample table full\n", (unsigned long long)sampler.dropped);
+    }
+
+    bool ok = ferror(file) == 0;
+    return fclose(file) == 0 && ok;
+}
+
+void free_sampler(void) {
+    free_name_table(&sampler.names);
+    asc_free(sampler.stacks);
+    asc_free(sampler.frames);
+    memset(&sampler, 0, sizeof(Sampler));
+}
+
+// Tracer implementation
+void tracer_start(void) {
+    tracer.origin_ns = monotonic_ns();
+}
+
+// Records a span that started at start_ns and ends now
+void trace_event(const char* name, const char* category, uint64_t start_ns) {
+    uint64_t end_ns = monotonic_ns();
+
+    shared_lock(&tooling_lock);
+
+    if (tracer.events_length >= tracer.events_capacity) {
+        tracer.events_capacity = tracer.events_capacity ? tracer.events_capacity * 2 : 256;
+        tracer.events = (TraceEvent*)asc_realloc(tracer.events,
+            sizeof(TraceEvent) * tracer.events_capacity, MEM_TOOLING);
+        if (!tracer.events) {
             fprintf(stderr, "Memory allocation failed\n");
             exit(1);
         }
+    }
+
+    TraceEvent* event = &tracer.events[tracer.events_length++];
+    event->name = asc_strdup(name, MEM_TOOLING);
+    event->category = category;
+    event->start_ns = start_ns;
+    event->duration_ns = end_ns - start_ns;
+    event->thread = thread_index;
+
+    shared_unlock(&tooling_lock);
+}
+
+static void write_json_string(FILE* file, const char* str) {
+    fputc('"', file);
+
+    for (; *str; str++) {
+        unsigned char c = (unsigned char)*str;
+
+        if (c == '"' || c == '\\') {
+            fputc('\\', file);
+            fputc(c, file);
+        }
+        else if (c < 0x20) {
+            fprintf(file, "\\u%04x", c);
+        }
+        else {
+            fputc(c, file);
+        }
+    }
+
+    fputc('"', file);
+}
+
+bool tracer_write_json(const char* path) {
+    FILE* file = fopen(path, "w");
+
+    if (file == NULL) {
+        return false;
+    }
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"AbstractScriptC\"}}");
+
+    for (int i = 0; i < tracer.events_length; i++) {
+        TraceEvent* event = &tracer.events[i];
+
+        fprintf(file, ",\n{\"name\":");
+        write_json_string(file, event->name);
+        fprintf(file, ",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+            event->category,
+            event->thread + 1,
+            (event->start_ns - tracer.origin_ns) / 1e3,
+            event->duration_ns / 1e3);
+    }
+
+    fprintf(file, "\n]}\n");
+
+    bool ok = ferror(file) == 0;
+    return fclose(file) == 0 && ok;
+}
+
+void free_tracer(void) {
+    for (int i = 0; i < tracer.events_length; i++) {
+        asc_free(tracer.events[i].name);
+    }
+
+    asc_free(tracer.events);
+    memset(&tracer, 0, sizeof(Tracer));
+}
+
+// Runtime stats implementation
+static int stats_log2_bucket(uint64_t value) {
+    int bucket = 0;
+
+    while (value > 1 && bucket < STATS_HISTOGRAM_BUCKETS - 1) {
+        value >>= 1;
+        bucket++;
+    }
+
+    return bucket;
+}
+
+// Called when a name was found in scope_stack[scope_index] at name_index; the
+// search walked every scope above it in full
+void record_lookup(Interpreter* interpreter, int scope_index, int name_index) {
+    int scopes = interpreter->scope_stack_length - scope_index;
+    int names = name_index + 1;
+
+    for (int i = scope_index + 1; i < interpreter->scope_stack_length; i++) {
+        names += interpreter->scope_stack[i]->length;
+    }
+
+    runtime_stats.lookups++;
+    runtime_stats.lookup_scopes_total += scopes;
+    runtime_stats.lookup_names_total += names;
+    runtime_stats.lookup_scopes[scopes < STATS_HISTOGRAM_BUCKETS ? scopes - 1 : STATS_HISTOGRAM_BUCKETS - 1]++;
+    runtime_stats.lookup_names[stats_log2_bucket(names)]++;
+}
+
+void print_runtime_stats(void) {
+#ifdef ASC_STATS
+    static const char* node_type_names[NODE_TYPE_COUNT] = {
+        "program", "block_statement", "variable_declaration", "assignment_expression",
+        "binary_expression", "logical_expression", "literal", "identifier",
+        "if_statement", "while_statement", "function_declaration", "call_expression",
+        "return_statement", "print_statement", "import_statement", "array_literal",
+        "map_literal", "index_expression", "index_assignment", "member_expression", "lazy_body"
+    };
+
+    uint64_t evaluations = 0;
+    for (int i = 0; i < NODE_TYPE_COUNT; i++) {
+        evaluations += runtime_stats.evaluations[i];
+    }
+
+    fprintf(stderr, "\nRuntime stats\n");
+    fprintf(stderr, "%-24s %14llu\n", "evaluate dispatches", (unsigned long long)evaluations);
+
+    for (int i = 0; i < NODE_TYPE_COUNT; i++) {
+        if (runtime_stats.evaluations[i] > 0) {
+            fprintf(stderr, "  %-22s %14llu\n", node_type_names[i], (unsigned long long)runtime_stats.evaluations[i]);
+        }
+    }
+
+    fprintf(stderr, "%-24s %14llu\n", "function calls", (unsigned long long)runtime_stats.function_calls);
+    fprintf(stderr, "%-24s %14llu\n", "native calls", (unsigned long long)runtime_stats.native_calls);
+    fprintf(stderr, "%-24s %14llu\n", "scopes created", (unsigned long long)runtime_stats.scopes_created);
+    fprintf(stderr, "%-24s %14llu\n", "string concatenations", (unsigned long long)runtime_stats.string_concatenations);
+    fprintf(stderr, "%-24s %14llu\n", "string bytes copied", (unsigned long long)runtime_stats.string_bytes_copied);
+    fprintf(stderr, "%-24s %14llu\n", "variable lookups", (unsigned long long)runtime_stats.lookups);
+
+    if (runtime_stats.lookups == 0) {
+        return;
+    }
+
+    fprintf(stderr, "  avg scopes searched %.2f, avg names compared %.2f\n",
+        (double)runtime_stats.lookup_scopes_total / runtime_stats.lookups,
+        (double)runtime_stats.lookup_names_total / runtime_stats.lookups);
+
+    fprintf(stderr, "  scopes searched:\n");
+    for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+        if (runtime_stats.lookup_scopes[i] == 0) {
+            continue;
+        }
+
+        fprintf(stderr, "    %5d%s %14llu  %6.2f%%\n",
+            i + 1, i == STATS_HISTOGRAM_BUCKETS - 1 ? "+" : " ",
+            (unsigned long long)runtime_stats.lookup_scopes[i],
+            runtime_stats.lookup_scopes[i] * 100.0 / runtime_stats.lookups);
+    }
+
+    fprintf(stderr, "  names compared:\n");
+    for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+        if (runtime_stats.lookup_names[i] == 0) {
+            continue;
+        }
+
+        char range[32];
+        if (i == 0) {
+            snprintf(range, sizeof(range), "1");
+        }
+        else if (i == STATS_HISTOGRAM_BUCKETS - 1) {
+            snprintf(range, sizeof(range), "%llu+", 1ULL << i);
+        }
+        else {
+            snprintf(range, sizeof(range), "%llu-%llu", 1ULL << i, (1ULL << (i + 1)) - 1);
+        }
+
+        fprintf(stderr, "    %11s %14llu  %6.2f%%\n", range,
+            (unsigned long long)runtime_stats.lookup_names[i],
+            runtime_stats.lookup_names[i] * 100.0 / runtime_stats.lookups);
+    }
+#else
+    fprintf(stderr, "Runtime stats are not compiled into this build (configure with -DASC_ENABLE_STATS=ON)\n");
+#endif
+}
+
+// Module cache implementation
+static void make_directory(const char* path) {
+#ifdef _WIN32
+    _mkdir(path);
+#else
+    mkdir(path, 0755);
+#endif
+}
+
+// $ASC_CACHE_DIR, else $XDG_CACHE_HOME/abstractscript or ~/.cache/abstractscript
+// (%LOCALAPPDATA%/abstractscript on Windows)
+static const char* get_cache_directory(void) {
+    if (module_cache.directory) {
+        return module_cache.directory;
+    }
+
+    const char* override = getenv("ASC_CACHE_DIR");
+    if (override && *override) {
+        module_cache.directory = asc_strdup(override, MEM_IMPORT);
+        return module_cache.directory;
+    }
+
+#ifdef _WIN32
+    const char* root = getenv("LOCALAPPDATA");
+    const char* parent = "";
+#else
+    const char* root = getenv("XDG_CACHE_HOME");
+    const char* parent = "";
+
+    if (!root || !*root) {
+        root = getenv("HOME");
+        parent = "/.cache";
+    }
+#endif
+
+    if (!root || !*root) {
+        return NULL;
+    }
+
+    char* directory = (char*)asc_malloc(strlen(root) + strlen(parent) + strlen("/abstractscript") + 1, MEM_IMPORT);
+    if (!directory) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    sprintf(directory, "%s%s", root, parent);
+    make_directory(directory);
+    strcat(directory, "/abstractscript");
+
+    module_cache.directory = directory;
+    return directory;
+}
+
+static char* get_cache_path(uint64_t key) {
+    shared_lock(&tooling_lock);
+    const char* directory = get_cache_directory();
+    shared_unlock(&tooling_lock);
+
+    if (!directory) {
+        return NULL;
+    }
+
+    char* path = (char*)asc_malloc(strlen(directory) + 32, MEM_IMPORT);
+    if (!path) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    sprintf(path, "%s/%016llx.asi", directory, (unsigned long long)key);
+    return path;
+}
+
+static uint64_t get_cache_key(ImageHeader* header) {
+    // Seeded differently from source_hash, so a file name collision is still
+    // caught by the header check
+    return hash_bytes(header, offsetof(ImageHeader, size), 0x9E3779B97F4A7C15ULL);
+}
+
+Program* load_cached_program(const char* code) {
+    ImageHeader expected;
+    fill_image_header(&expected, code);
+
+    char* path = get_cache_path(get_cache_key(&expected));
+    if (!path) {
+        return NULL;
+    }
+
+    Program* program = load_program_image(path, &expected);
+    asc_free(path);
+
+    shared_lock(&tooling_lock);
+    if (program) {
+        module_cache.hits++;
+    }
+    else {
+        module_cache.misses++;
+    }
+    shared_unlock(&tooling_lock);
+
+    return program;
+}
+
+void store_cached_program(Program* program) {
+    char* path = get_cache_path(get_cache_key(program->image));
+    if (!path) {
+        return;
+    }
+
+    make_directory(module_cache.directory);
+    write_program_image(program, path);
+    asc_free(path);
+}
+
+void free_module_cache(void) {
+    asc_free(module_cache.directory);
+    module_cache.directory = NULL;
+}
+
+// Embedding API implementation (AbstractScriptC.h)
+struct AscProgram {
+    Program* program;
+    char* base_dir;
+    Bundle* bundle; // Modules it imports, when loaded from a bundle
+};
+
+// An isolated instance: its scopes and values live on its own heap, and it
+// has its own module registry. Only process-wide tooling (profilers, tracer,
+// module cache) is shared with other interpreters.
+struct AscInterpreter {
+    Heap heap;
+    Interpreter* interpreter;
+    OutputBuffer output; // Allocated outside heap, so it outlives asc_reset
+    char* result_string; // Backs the string in the last returned AscValue
+};
 
-        node->type = NODE_LOGICAL_EXPRESSION;
-        node->data.logical_expression.operator = strdup("&&");
-        node->data.logical_expression.left = left;
-        node->data.logical_expression.right = right;
+// A host may use the library from any number of threads, so the shared heap
+// is locked from the first call on. The command-line front end stays
+// unlocked until it starts import threads.
+static void init_library(void) {
+#ifdef ASC_LIBRARY
+    enable_threads();
+#endif
+}
 
-        left = node;
+static void set_error_message(const char* format, const char* name) {
+    snprintf(error_message, sizeof(error_message), format, name);
+}
+
+AscProgram* create_asc_program(Program* program, const char* base_dir) {
+    AscProgram* result = (AscProgram*)asc_malloc(sizeof(AscProgram), MEM_RUNTIME);
+    if (!result) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
     }
 
-    return left;
+    result->program = program;
+    result->base_dir = asc_strdup(base_dir ? base_dir : ".", MEM_RUNTIME);
+    result->bundle = NULL;
+    return result;
 }
 
-ASTNode* parse_equality(Parser* parser) {
-    ASTNode* left = parse_comparison(parser);
+static Value to_value(const AscValue* value) {
+    Value result;
 
-    while (parser->current_token.type == TOKEN_EQUALS ||
-        parser->current_token.type == TOKEN_NOT_EQUALS) {
+    switch (value->type) {
+    case ASC_VALUE_NUMBER:
+        result.type = VALUE_NUMBER;
+        result.data.number = value->as.number;
+        break;
+    case ASC_VALUE_STRING:
+        result.type = VALUE_STRING;
+        result.data.string = asc_strdup(value->as.string ? value->as.string : "", MEM_STRING);
+        break;
+    case ASC_VALUE_BOOLEAN:
+        result.type = VALUE_BOOLEAN;
+        result.data.boolean = value->as.boolean;
+        break;
+    default:
+        // Functions, arrays and maps cannot be passed in from the host
+        result.type = VALUE_NULL;
+        break;
+    }
 
-        char* operator;
-        if (parser->current_token.type == TOKEN_EQUALS) {
-            operator = strdup("==");
-            eat(parser, TOKEN_EQUALS);
-        }
-        else {
-            operator = strdup("!=");
-            eat(parser, TOKEN_NOT_EQUALS);
-        }
+    return result;
+}
 
-        ASTNode* right = parse_comparison(parser);
+static void to_asc_value(AscInterpreter* handle, Value value, AscValue* result) {
+    if (result == NULL) {
+        return;
+    }
 
-        ASTNode* node = (ASTNode*)malloc(sizeof(ASTNode));
-        if (!node) {
-            fprintf(stderr, "Memory allocation failed\n");
-            exit(1);
-        }
+    switch (value.type) {
+    case VALUE_NUMBER:
+        *result = asc_number(value.data.number);
+        break;
+    case VALUE_BOOLEAN:
+        *result = asc_boolean(value.data.boolean);
+        break;
+    case VALUE_STRING:
+    case VALUE_FUNCTION:
+    case VALUE_NATIVE:
+        asc_free(handle->result_string);
+        handle->result_string = asc_strdup(value.type == VALUE_STRING ? value.data.string :
+            value.type == VALUE_FUNCTION ? value.data.function.name : value.data.native->name, MEM_RUNTIME);
+        *result = asc_string(handle->result_string);
+        result->type = value.type == VALUE_STRING ? ASC_VALUE_STRING : ASC_VALUE_FUNCTION;
+        break;
+    case VALUE_ARRAY:
+        result->type = ASC_VALUE_ARRAY;
+        result->as.length = value.data.array->length;
+        break;
+    case VALUE_MAP:
+        result->type = ASC_VALUE_MAP;
+        result->as.length = value.data.map->length;
+        break;
+    default:
+        *result = asc_null();
+        break;
+    }
+}
 
-        node->type = NODE_BINARY_EXPRESSION;
-        node->data.binary_expression.operator = operator;
-        node->data.binary_expression.left = left;
-        node->data.binary_expression.right = right;
+AscStatus asc_compile(const char* source, const char* base_dir, AscProgram** program) {
+    init_library();
 
-        left = node;
+    *program = NULL;
+
+    Program* compiled = try_compile_source(source);
+    if (compiled == NULL) {
+        return ASC_ERROR_SYNTAX;
     }
 
-    return left;
+    *program = create_asc_program(compiled, base_dir);
+    return ASC_OK;
 }
 
-ASTNode* parse_comparison(Parser* parser) {
-    ASTNode* left = parse_addition(parser);
+AscStatus asc_compile_file(const char* path, AscProgram** program) {
+    init_library();
 
-    while (parser->current_token.type == TOKEN_GT ||
-        parser->current_token.type == TOKEN_GTE ||
-        parser->current_token.type == TOKEN_LT ||
-        parser->current_token.type == TOKEN_LTE) {
+    *program = NULL;
 
-        char* operator;
-        if (parser->current_token.type == TOKEN_GT) {
-            operator = strdup(">");
-            eat(parser, TOKEN_GT);
-        }
-        else if (parser->current_token.type == TOKEN_GTE) {
-            operator = strdup(">=");
-            eat(parser, TOKEN_GTE);
-        }
-        else if (parser->current_token.type == TOKEN_LT) {
-            operator = strdup("<");
-            eat(parser, TOKEN_LT);
-        }
-        else {
-            operator = strdup("<=");
-            eat(parser, TOKEN_LTE);
-        }
+    char* code = read_file(path);
+    if (code == NULL) {
+        set_error_message("Could not read file '%s'\n", path);
+        return ASC_ERROR_IO;
+    }
 
-        ASTNode* right = parse_addition(parser);
+    Program* compiled = NULL;
+    uint32_t magic = 0;
+    memcpy(&magic, code, strlen(code) >= sizeof(magic) ? sizeof(magic) : 0);
 
-        ASTNode* node = (ASTNode*)malloc(sizeof(ASTNode));
-        if (!node) {
-            fprintf(stderr, "Memory allocation failed\n");
-            exit(1);
+    if (magic == BUNDLE_MAGIC) {
+        asc_free(code);
+        *program = load_bundle(path);
+        if (*program == NULL) {
+            set_error_message("'%s' is not a bundle for this version\n", path);
+            return ASC_ERROR_IO;
         }
+        return ASC_OK;
+    }
 
-        node->type = NODE_BINARY_EXPRESSION;
-        node->data.binary_expression.operator = operator;
-        node->data.binary_expression.left = left;
-        node->data.binary_expression.right = right;
-
-        left = node;
+    if (magic == IMAGE_MAGIC) {
+        compiled = load_program_image(path, NULL);
+        if (compiled == NULL) {
+            set_error_message("'%s' is not a program image for this version\n", path);
+        }
+    }
+    else {
+        compiled = try_compile_source(code);
     }
 
-    return left;
-}
+    asc_free(code);
 
-ASTNode* parse_addition(Parser* parser) {
-    ASTNode* left = parse_multiplication(parser);
+    if (compiled == NULL) {
+        return magic == IMAGE_MAGIC ? ASC_ERROR_IO : ASC_ERROR_SYNTAX;
+    }
 
-    while (parser->current_token.type == TOKEN_PLUS ||
-        parser->current_token.type == TOKEN_MINUS) {
+    char* directory = path_directory(path);
+    *program = create_asc_program(compiled, directory);
+    asc_free(directory);
 
-        char* operator;
-        if (parser->current_token.type == TOKEN_PLUS) {
-            operator = strdup("+");
-            eat(parser, TOKEN_PLUS);
+    return ASC_OK;
+}
+
+void asc_program_free(AscProgram* program) {
+    if (program) {
+        // A bundle owns its entry program along with its modules
+        if (program->bundle) {
+            free_bundle(program->bundle);
         }
         else {
-            operator = strdup("-");
-            eat(parser, TOKEN_MINUS);
+            free_program(program->program);
         }
+        asc_free(program->base_dir);
+        asc_free(program);
+    }
+}
 
-        ASTNode* right = parse_multiplication(parser);
+// Puts an interpreter back in its global scope after an error unwound out of
+// the middle of an evaluation
+static void recover_interpreter(Interpreter* interpreter, Scope* globals) {
+    interpreter->scope_stack_length = 0;
+    interpreter->stack_length = 0;
+    interpreter->frames_length = 0;
+    interpreter->saved_scopes_length = 0;
+    interpreter->has_return = false;
+    push_scope(interpreter, globals);
+    abort_module_loads(interpreter->modules);
+}
 
-        ASTNode* node = (ASTNode*)malloc(sizeof(ASTNode));
-        if (!node) {
-            fprintf(stderr, "Memory allocation failed\n");
-            exit(1);
-        }
+static AscStatus error_status(int error) {
+    return error == ERROR_SYNTAX ? ASC_ERROR_SYNTAX : ASC_ERROR_RUNTIME;
+}
 
-        node->type = NODE_BINARY_EXPRESSION;
-        node->data.binary_expression.operator = operator;
-        node->data.binary_expression.left = left;
-        node->data.binary_expression.right = right;
+AscInterpreter* asc_interpreter_create(void) {
+    init_library();
 
-        left = node;
+    AscInterpreter* handle = (AscInterpreter*)asc_calloc(1, sizeof(AscInterpreter), MEM_RUNTIME);
+    if (!handle) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
     }
 
-    return left;
-}
+    init_output(&handle->output);
 
-ASTNode* parse_multiplication(Parser* parser) {
-    ASTNode* left = parse_primary(parser);
+    Heap* previous_heap = use_heap(&handle->heap);
+    handle->interpreter = create_interpreter();
+    handle->interpreter->output = &handle->output;
+    use_heap(previous_heap);
 
-    while (parser->current_token.type == TOKEN_MULTIPLY ||
-        parser->current_token.type == TOKEN_DIVIDE ||
-        parser->current_token.type == TOKEN_MODULO) {
+    return handle;
+}
 
-        char* operator;
-        if (parser->current_token.type == TOKEN_MULTIPLY) {
-            operator = strdup("*");
-            eat(parser, TOKEN_MULTIPLY);
+AscStatus asc_run(AscInterpreter* handle, AscProgram* program, AscValue* result) {
+    return run_program_statements(handle, program, 0, -1, result);
+}
+
+// Runs top-level statements from up to, not including, to, or the whole
+// program when to is -1
+AscStatus run_program_statements(AscInterpreter* handle, AscProgram* program, int from, int to, AscValue* result) {
+    uint64_t phase_start = tracer.enabled ? monotonic_ns() : 0;
+    Interpreter* interpreter = handle->interpreter;
+    Scope* globals = interpreter->scope_stack[0];
+    ASTNode* root = program_root(program->program);
+    char* previous_base_dir = interpreter->base_dir;
+    Heap* previous_heap = use_heap(&handle->heap);
+
+    jmp_buf trap;
+    jmp_buf* previous_trap = error_trap;
+    AscStatus status;
+    Value value;
+
+    int error = setjmp(trap);
+    if (error == 0) {
+        error_trap = &trap;
+        interpreter->base_dir = program->base_dir;
+        if (program->bundle) {
+            interpreter->modules->bundle = program->bundle;
         }
-        else if (parser->current_token.type == TOKEN_DIVIDE) {
-            operator = strdup("/");
-            eat(parser, TOKEN_DIVIDE);
+
+        prefetch_imports(interpreter->modules, root, interpreter->base_dir);
+        if (explicit_stack) {
+            value = run_machine(interpreter, root, from, to);
         }
         else {
-            operator = strdup("%");
-            eat(parser, TOKEN_MODULO);
+            value = to < 0 ? evaluate(interpreter, root) : evaluate_program_range(interpreter, root, from, to);
         }
+        interpreter->has_return = false;
+        status = ASC_OK;
+    }
+    else {
+        recover_interpreter(interpreter, globals);
+        status = error_status(error);
+    }
 
-        ASTNode* right = parse_primary(parser);
+    error_trap = previous_trap;
+    interpreter->base_dir = previous_base_dir;
+    use_heap(previous_heap);
 
-        ASTNode* node = (ASTNode*)malloc(sizeof(ASTNode));
-        if (!node) {
-            fprintf(stderr, "Memory allocation failed\n");
-            exit(1);
-        }
+    // Everything printed is out by the time a run returns, also after an error
+    output_flush(&handle->output);
 
-        node->type = NODE_BINARY_EXPRESSION;
-        node->data.binary_expression.operator = operator;
-        node->data.binary_expression.left = left;
-        node->data.binary_expression.right = right;
+    if (tracer.enabled) {
+        trace_event("evaluate", "phase", phase_start);
+    }
 
-        left = node;
+    if (status == ASC_OK) {
+        to_asc_value(handle, value, result);
+    }
+    else if (result) {
+        *result = asc_null();
     }
 
-    return left;
+    return status;
 }
 
-ASTNode* parse_primary(Parser* parser) {
-    ASTNode* node = (ASTNode*)malloc(sizeof(ASTNode));
-    if (!node) {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(1);
+AscStatus asc_call(AscInterpreter* handle, const char* name, const AscValue* args, int args_length, AscValue* result) {
+    Interpreter* interpreter = handle->interpreter;
+    Scope* globals = interpreter->scope_stack[0];
+    Value* function = NULL;
+
+    for (int i = globals->length - 1; i >= 0; i--) {
+        if (strcmp(globals->names[i], name) == 0) {
+            function = &globals->values[i];
+            break;
+        }
     }
 
-    switch (parser->current_token.type) {
-    case TOKEN_NUMBER: {
-        node->type = NODE_LITERAL;
-        node->data.literal.value.number = parser->current_token.value.number_value;
-        node->data.literal.value_type = 'n';
-        eat(parser, TOKEN_NUMBER);
-        break;
+    if (function == NULL) {
+        set_error_message("Function '%s' is not defined\n", name);
+        return ASC_ERROR_NOT_FOUND;
     }
-    case TOKEN_STRING: {
-        node->type = NODE_LITERAL;
-        node->data.literal.value.string = strdup(parser->current_token.value.string_value);
-        node->data.literal.value_type = 's';
-        eat(parser, TOKEN_STRING);
-        break;
+
+    if (function->type != VALUE_FUNCTION && function->type != VALUE_NATIVE && function->type != VALUE_IMPORT) {
+        set_error_message("'%s' is not a function\n", name);
+        return ASC_ERROR_TYPE;
     }
-    case TOKEN_TRUE: {
-        node->type = NODE_LITERAL;
-        node->data.literal.value.boolean = true;
-        node->data.literal.value_type = 'b';
-        eat(parser, TOKEN_TRUE);
-        break;
+
+    Heap* previous_heap = use_heap(&handle->heap);
+    Value* values = (Value*)asc_malloc(sizeof(Value) * (args_length + 1), MEM_CALL);
+    if (!values) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
     }
-    case TOKEN_FALSE: {
-        node->type = NODE_LITERAL;
-        node->data.literal.value.boolean = false;
-        node->data.literal.value_type = 'b';
-        eat(parser, TOKEN_FALSE);
-        break;
+
+    for (int i = 0; i < args_length; i++) {
+        values[i] = to_value(&args[i]);
     }
-    case TOKEN_IDENTIFIER: {
-        Token identifier = eat(parser, TOKEN_IDENTIFIER);
 
-        if (parser->current_token.type == TOKEN_LPAREN) {
-            free(node);
-            return parse_function_call(parser, identifier.value.string_value);
+    jmp_buf trap;
+    jmp_buf* previous_trap = error_trap;
+    AscStatus status;
+    Value value;
+
+    // After an error the arguments are left to the interpreter heap
+    int error = setjmp(trap);
+    if (error == 0) {
+        error_trap = &trap;
+
+        if (function->type == VALUE_IMPORT) {
+            resolve_import(interpreter, function, name);
+            if (function->type != VALUE_FUNCTION && function->type != VALUE_NATIVE) {
+                runtime_error("'%s' is not a function\n", name);
+            }
         }
 
-        node->type = NODE_IDENTIFIER;
-        node->data.identifier.name = strdup(identifier.value.string_value);
-        break;
-    }
-    case TOKEN_LPAREN: {
-        eat(parser, TOKEN_LPAREN);
-        free(node);
-        node = parse_expression(parser);
-        eat(parser, TOKEN_RPAREN);
-        break;
+        // A global bound to a builtin, as after let g = sqrt;
+        if (function->type == VALUE_NATIVE) {
+            const Builtin* builtin = function->data.native;
+            check_native_arity(builtin, args_length);
+
+            int base = interpreter->stack_length;
+            for (int i = 0; i < args_length; i++) {
+                stack_push(interpreter, values[i]);
+            }
+
+            value = invoke_native(interpreter, builtin, base, args_length);
+        }
+        else {
+            value = call_function(interpreter, *function, values, args_length, 0);
+        }
+
+        asc_free(values);
+        status = ASC_OK;
     }
-    default:
-        fprintf(stderr, "Unexpected token in primary expression: %d\n", parser->current_token.type);
-        exit(1);
+    else {
+        recover_interpreter(interpreter, globals);
+        status = error_status(error);
     }
 
-    return node;
-}
+    error_trap = previous_trap;
+    use_heap(previous_heap);
+    output_flush(&handle->output);
 
-ASTNode* parse(Parser* parser) {
-    return parse_program(parser);
+    if (status == ASC_OK) {
+        to_asc_value(handle, value, result);
+    }
+    else if (result) {
+        *result = asc_null();
+    }
+
+    return status;
 }
 
-void free_parser(Parser* parser) {
-    // Free tokens
-    for (int i = 0; i < parser->tokens_length; i++) {
-        if (parser->tokens[i].type == TOKEN_IDENTIFIER || parser->tokens[i].type == TOKEN_STRING) {
-            free(parser->tokens[i].value.string_value);
+AscStatus asc_set_global(AscInterpreter* handle, const char* name, AscValue value) {
+    Interpreter* interpreter = handle->interpreter;
+    Scope* globals = interpreter->scope_stack[0];
+    Heap* previous_heap = use_heap(&handle->heap);
+    Value converted = to_value(&value);
+
+    for (int i = globals->length - 1; i >= 0; i--) {
+        if (strcmp(globals->names[i], name) == 0) {
+            free_value(globals->values[i]);
+            globals->values[i] = converted;
+            use_heap(previous_heap);
+            return ASC_OK;
         }
     }
 
-    free(parser->tokens);
-    free(parser);
+    define_variable(globals, name, converted);
+    use_heap(previous_heap);
+    return ASC_OK;
 }
 
-void free_ast_node(ASTNode* node) {
-    if (!node) return;
+void asc_set_output(AscInterpreter* handle, FILE* output) {
+    output_flush(&handle->output);
+    handle->output.stream = output;
+}
 
-    switch (node->type) {
-    case NODE_PROGRAM:
-        for (int i = 0; i < node->data.program.body_length; i++) {
-            free_ast_node(node->data.program.body[i]);
-        }
-        free(node->data.program.body);
-        break;
-    case NODE_BLOCK_STATEMENT:
-        for (int i = 0; i < node->data.block_statement.body_length; i++) {
-            free_ast_node(node->data.block_statement.body[i]);
-        }
-        free(node->data.block_statement.body);
-        break;
-    case NODE_VARIABLE_DECLARATION:
-        free(node->data.variable_declaration.name);
-        free_ast_node(node->data.variable_declaration.value);
-        break;
-    case NODE_ASSIGNMENT_EXPRESSION:
-        free(node->data.assignment_expression.name);
-        free_ast_node(node->data.assignment_expression.value);
-        break;
-    case NODE_BINARY_EXPRESSION:
-        free(node->data.binary_expression.operator);
-        free_ast_node(node->data.binary_expression.left);
-        free_ast_node(node->data.binary_expression.right);
-        break;
-    case NODE_LOGICAL_EXPRESSION:
-        free(node->data.logical_expression.operator);
-        free_ast_node(node->data.logical_expression.left);
-        free_ast_node(node->data.logical_expression.right);
-        break;
-    case NODE_LITERAL:
-        if (node->data.literal.value_type == 's') {
-            free(node->data.literal.value.string);
-        }
-        break;
-    case NODE_IDENTIFIER:
-        free(node->data.identifier.name);
-        break;
-    case NODE_IF_STATEMENT:
-        free_ast_node(node->data.if_statement.test);
-        free_ast_node(node->data.if_statement.consequent);
-        if (node->data.if_statement.alternate) {
-            free_ast_node(node->data.if_statement.alternate);
-        }
-        break;
-    case NODE_WHILE_STATEMENT:
-        free_ast_node(node->data.while_statement.test);
-        free_ast_node(node->data.while_statement.body);
-        break;
-    case NODE_FUNCTION_DECLARATION:
-        free(node->data.function_declaration.name);
-        for (int i = 0; i < node->data.function_declaration.params_length; i++) {
-            free(node->data.function_declaration.params[i]);
-        }
-        free(node->data.function_declaration.params);
-        free_ast_node(node->data.function_declaration.body);
-        break;
-    case NODE_CALL_EXPRESSION:
-        free(node->data.call_expression.name);
-        for (int i = 0; i < node->data.call_expression.arguments_length; i++) {
-            free_ast_node(node->data.call_expression.arguments[i]);
-        }
-        free(node->data.call_expression.arguments);
-        break;
-    case NODE_RETURN_STATEMENT:
-        free_ast_node(node->data.return_statement.argument);
-        break;
-    case NODE_PRINT_STATEMENT:
-        free_ast_node(node->data.print_statement.argument);
-        break;
-    case NODE_IMPORT_STATEMENT:
-        free(node->data.import_statement.path);
-        break;
+// For the command-line front end, whose own messages go through the same
+// buffer as the script's output
+void write_output(AscInterpreter* handle, const char* text) {
+    output_write(&handle->output, text, strlen(text));
+}
+
+void flush_output(AscInterpreter* handle) {
+    output_flush(&handle->output);
+}
+
+// Lets the interpreter take imported programs from store, and parse new ones
+// into it, instead of keeping its own. For hosts that run many interpreters
+// over the same modules.
+void share_module_programs(AscInterpreter* handle, ProgramStore* store) {
+    handle->interpreter->modules->store = store;
+}
+
+void asc_reset(AscInterpreter* handle) {
+    // The registry is on the shared heap and keeps its parsed programs;
+    // everything else starts over on an empty interpreter heap
+    ModuleRegistry* modules = handle->interpreter->modules;
+    reset_module_registry(modules);
+    release_heap(&handle->heap);
+
+    Heap* previous_heap = use_heap(&handle->heap);
+    handle->interpreter = create_interpreter();
+    use_heap(previous_heap);
+
+    free_module_registry(handle->interpreter->modules);
+    handle->interpreter->modules = modules;
+    handle->interpreter->output = &handle->output;
+}
+
+void asc_interpreter_free(AscInterpreter* handle) {
+    if (handle) {
+        free_module_registry(handle->interpreter->modules);
+        release_heap(&handle->heap);
+        free_output(&handle->output);
+        asc_free(handle->result_string);
+        asc_free(handle);
     }
+}
+
+const char* asc_error_message(void) {
+    return error_message;
+}
+
+// Heap snapshot implementation
+// A snapshot holds the state after a script's initialisation phase: the
+// program images of the script and every module it imported, the scopes
+// reachable from the global scope with their values, and the module
+// registry. Function bodies are stored as offsets into the images, and
+// closures as scope numbers. It is only valid while every file in it is
+// unchanged, and only for the build that wrote it.
+#define SNAPSHOT_MAGIC 0x53435341u // "ASCS"
+#define SNAPSHOT_FORMAT 3
 
-    free(node);
-}
+typedef struct {
+    FILE* file;
+    bool ok;
+} SnapshotWriter;
 
-// Interpreter implementation
-Interpreter* create_interpreter(void) {
-    Interpreter* interpreter = (Interpreter*)malloc(sizeof(Interpreter));
-    if (!interpreter) {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(1);
-    }
+typedef struct {
+    const char* data;
+    size_t size;
+    size_t position;
+    bool ok;
+} SnapshotReader;
+
+// Arrays or maps, numbered in the order they are first reached. Their
+// contents are written there, and later references only carry the number.
+typedef struct {
+    void** items;
+    int length;
+    int capacity;
+} SnapshotObjects;
 
-    interpreter->scope_stack = (Scope**)malloc(sizeof(Scope*) * 10);
-    if (!interpreter->scope_stack) {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(1);
+typedef struct {
+    Program** programs;
+    int programs_length;
+    Scope** scopes;
+    int scopes_length;
+    int scopes_capacity;
+    SnapshotObjects arrays;
+    SnapshotObjects maps;
+} SnapshotTables;
+
+static void write_snapshot_bytes(SnapshotWriter* writer, const void* data, size_t size) {
+    if (writer->ok && size > 0 && fwrite(data, 1, size, writer->file) != size) {
+        writer->ok = false;
     }
+}
 
-    interpreter->scope_stack_length = 0;
-    interpreter->scope_stack_capacity = 10;
-    interpreter->has_return = false;
-    interpreter->base_dir = strdup(".");
+static void write_snapshot_u32(SnapshotWriter* writer, uint32_t value) {
+    write_snapshot_bytes(writer, &value, sizeof(value));
+}
 
-    // Create global scope
-    Scope* global_scope = create_scope();
-    push_scope(interpreter, global_scope);
+static void write_snapshot_string(SnapshotWriter* writer, const char* str) {
+    uint32_t length = (uint32_t)strlen(str);
+    write_snapshot_u32(writer, length);
+    write_snapshot_bytes(writer, str, length);
+}
 
-    return interpreter;
+static const void* read_snapshot_bytes(SnapshotReader* reader, size_t size) {
+    if (!reader->ok || size > reader->size - reader->position) {
+        reader->ok = false;
+        return NULL;
+    }
+
+    const void* data = reader->data + reader->position;
+    reader->position += size;
+    return data;
 }
 
-Scope* create_scope(void) {
-    Scope* scope = (Scope*)malloc(sizeof(Scope));
-    if (!scope) {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(1);
+static uint32_t read_snapshot_u32(SnapshotReader* reader) {
+    uint32_t value = 0;
+    const void* data = read_snapshot_bytes(reader, sizeof(value));
+    if (data) {
+        memcpy(&value, data, sizeof(value));
     }
+    return value;
+}
 
-    scope->names = (char**)malloc(sizeof(char*) * 10);
-    if (!scope->names) {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(1);
+// Returns a copy of the next string, or NULL at a malformed one
+static char* read_snapshot_string(SnapshotReader* reader, MemTag tag) {
+    uint32_t length = read_snapshot_u32(reader);
+    const char* data = (const char*)read_snapshot_bytes(reader, length);
+    if (data == NULL) {
+        return NULL;
     }
 
-    scope->values = (Value*)malloc(sizeof(Value) * 10);
-    if (!scope->values) {
+    char* str = (char*)asc_malloc(length + 1, tag);
+    if (!str) {
         fprintf(stderr, "Memory allocation failed\n");
         exit(1);
     }
 
-    scope->length = 0;
-    scope->capacity = 10;
-    return scope;
+    memcpy(str, data, length);
+    str[length] = '\0';
+    return str;
 }
 
-void push_scope(Interpreter* interpreter, Scope* scope) {
-    if (interpreter->scope_stack_length >= interpreter->scope_stack_capacity) {
-        interpreter->scope_stack_capacity *= 2;
-        interpreter->scope_stack = (Scope**)realloc(interpreter->scope_stack,
-            sizeof(Scope*) * interpreter->scope_stack_capacity);
-        if (!interpreter->scope_stack) {
+static int snapshot_scope_id(SnapshotTables* tables, Scope* scope) {
+    for (int i = 0; i < tables->scopes_length; i++) {
+        if (tables->scopes[i] == scope) {
+            return i;
+        }
+    }
+
+    if (tables->scopes_length >= tables->scopes_capacity) {
+        tables->scopes_capacity = tables->scopes_capacity ? tables->scopes_capacity * 2 : 16;
+        tables->scopes = (Scope**)asc_realloc(tables->scopes, sizeof(Scope*) * tables->scopes_capacity, MEM_TOOLING);
+        if (!tables->scopes) {
             fprintf(stderr, "Memory allocation failed\n");
             exit(1);
         }
     }
 
-    interpreter->scope_stack[interpreter->scope_stack_length++] = scope;
+    tables->scopes[tables->scopes_length] = scope;
+    return tables->scopes_length++;
 }
 
-Scope* pop_scope(Interpreter* interpreter) {
-    if (interpreter->scope_stack_length == 0) {
+// Scopes are numbered in the order they are first reached when writing, so
+// a closure can name a scope whose entries come later in the file. Reading
+// creates scopes up to the one asked for.
+static Scope* snapshot_scope(SnapshotTables* tables, uint32_t id) {
+    if (id > (uint32_t)tables->scopes_length + 65536) {
         return NULL;
     }
 
-    return interpreter->scope_stack[--interpreter->scope_stack_length];
-}
-
-Scope* get_current_scope(Interpreter* interpreter) {
-    if (interpreter->scope_stack_length == 0) {
-        return NULL;
+    while (tables->scopes_length <= (int)id) {
+        snapshot_scope_id(tables, create_scope());
     }
 
-    return interpreter->scope_stack[interpreter->scope_stack_length - 1];
+    return tables->scopes[id];
 }
 
-void define_variable(Scope* scope, char* name, Value value) {
-    if (scope->length >= scope->capacity) {
-        scope->capacity *= 2;
-        scope->names = (char**)realloc(scope->names, sizeof(char*) * scope->capacity);
-        if (!scope->names) {
-            fprintf(stderr, "Memory allocation failed\n");
-            exit(1);
+static int snapshot_object_id(SnapshotObjects* objects, void* object, bool* first) {
+    for (int i = 0; i < objects->length; i++) {
+        if (objects->items[i] == object) {
+            *first = false;
+            return i;
         }
+    }
 
-        scope->values = (Value*)realloc(scope->values, sizeof(Value) * scope->capacity);
-        if (!scope->values) {
+    if (objects->length >= objects->capacity) {
+        objects->capacity = objects->capacity ? objects->capacity * 2 : 16;
+        objects->items = (void**)asc_realloc(objects->items, sizeof(void*) * objects->capacity, MEM_TOOLING);
+        if (!objects->items) {
             fprintf(stderr, "Memory allocation failed\n");
             exit(1);
         }
     }
 
-    scope->names[scope->length] = strdup(name);
-    scope->values[scope->length] = value;
-    scope->length++;
+    *first = true;
+    objects->items[objects->length] = object;
+    return objects->length++;
 }
 
-Value* lookup_variable(Interpreter* interpreter, char* name) {
-    for (int i = interpreter->scope_stack_length - 1; i >= 0; i--) {
-        Scope* scope = interpreter->scope_stack[i];
-
-        for (int j = 0; j < scope->length; j++) {
-            if (strcmp(scope->names[j], name) == 0) {
-                return &scope->values[j];
-            }
+static int snapshot_program_id(SnapshotTables* tables, const ASTNode* node) {
+    for (int i = 0; i < tables->programs_length; i++) {
+        const char* image = (const char*)tables->programs[i]->image;
+        if ((const char*)node >= image && (const char*)node < image + tables->programs[i]->size) {
+            return i;
         }
     }
 
-    fprintf(stderr, "Variable '%s' is not defined\n", name);
-    exit(1);
-    return NULL; // To avoid compiler warning
-}
-
-Value evaluate(Interpreter* interpreter, ASTNode* node) {
-    switch (node->type) {
-    case NODE_PROGRAM:
-        return evaluate_program(interpreter, node);
-    case NODE_BLOCK_STATEMENT:
-        return evaluate_block_statement(interpreter, node);
-    case NODE_VARIABLE_DECLARATION:
-        return evaluate_variable_declaration(interpreter, node);
-    case NODE_ASSIGNMENT_EXPRESSION:
-        return evaluate_assignment_expression(interpreter, node);
-    case NODE_BINARY_EXPRESSION:
-        return evaluate_binary_expression(interpreter, node);
-    case NODE_LOGICAL_EXPRESSION:
-        return evaluate_logical_expression(interpreter, node);
-    case NODE_LITERAL:
-        return evaluate_literal(interpreter, node);
-    case NODE_IDENTIFIER:
-        return evaluate_identifier(interpreter, node);
-    case NODE_IF_STATEMENT:
-        return evaluate_if_statement(interpreter, node);
-    case NODE_WHILE_STATEMENT:
-        return evaluate_while_statement(interpreter, node);
-    case NODE_FUNCTION_DECLARATION:
-        return evaluate_function_declaration(interpreter, node);
-    case NODE_CALL_EXPRESSION:
-        return evaluate_call_expression(interpreter, node);
-    case NODE_RETURN_STATEMENT:
-        return evaluate_return_statement(interpreter, node);
-    case NODE_PRINT_STATEMENT:
-        return evaluate_print_statement(interpreter, node);
-    case NODE_IMPORT_STATEMENT:
-        return evaluate_import_statement(interpreter, node);
-    default:
-        fprintf(stderr, "Unknown node type: %d\n", node->type);
-        exit(1);
-    }
-
-    // To avoid compiler warning
-    Value null_value;
-    null_value.type = VALUE_NULL;
-    return null_value;
+    return -1;
 }
 
-Value evaluate_program(Interpreter* interpreter, ASTNode* node) {
-    Value result;
-    result.type = VALUE_NULL;
-
-    for (int i = 0; i < node->data.program.body_length; i++) {
-        result = evaluate(interpreter, node->data.program.body[i]);
+static void write_snapshot_value(SnapshotWriter* writer, SnapshotTables* tables, Value value) {
+    write_snapshot_u32(writer, (uint32_t)value.type);
 
-        if (interpreter->has_return) {
-            return interpreter->return_value;
+    switch (value.type) {
+    case VALUE_NUMBER:
+        write_snapshot_bytes(writer, &value.data.number, sizeof(double));
+        break;
+    case VALUE_STRING:
+        write_snapshot_string(writer, value.data.string);
+        break;
+    case VALUE_IMPORT:
+        write_snapshot_string(writer, value.data.import);
+        break;
+    case VALUE_BOOLEAN:
+        write_snapshot_u32(writer, value.data.boolean);
+        break;
+    case VALUE_FUNCTION: {
+        // A body parsed on its first call is stored as the skipped body in
+        // the image and its position in the parsed one
+        const ASTNode* node = value.data.function.body;
+        const Program* parsed = NULL;
+        int program = snapshot_program_id(tables, node);
+
+        if (program < 0 && find_lazy_body(value.data.function.body, &node, &parsed)) {
+            program = snapshot_program_id(tables, node);
         }
-    }
 
-    return result;
-}
+        if (program < 0) {
+            writer->ok = false;
+            return;
+        }
 
-Value evaluate_block_statement(Interpreter* interpreter, ASTNode* node) {
-    Value result;
-    result.type = VALUE_NULL;
+        write_snapshot_string(writer, value.data.function.name);
+        write_snapshot_u32(writer, (uint32_t)value.data.function.params_length);
+        for (int i = 0; i < value.data.function.params_length; i++) {
+            write_snapshot_string(writer, value.data.function.params[i]);
+        }
 
-    Scope* scope = create_scope();
-    push_scope(interpreter, scope);
+        write_snapshot_u32(writer, (uint32_t)program);
+        write_snapshot_u32(writer, (uint32_t)((const char*)node - (const char*)tables->programs[program]->image));
+        write_snapshot_u32(writer, parsed ? (uint32_t)((const char*)value.data.function.body - (const char*)parsed->image) : UINT32_MAX);
 
-    for (int i = 0; i < node->data.block_statement.body_length; i++) {
-        result = evaluate(interpreter, node->data.block_statement.body[i]);
+        write_snapshot_u32(writer, (uint32_t)value.data.function.closure_length);
+        for (int i = 0; i < value.data.function.closure_length; i++) {
+            write_snapshot_u32(writer, (uint32_t)snapshot_scope_id(tables, value.data.function.closure[i]));
+        }
+        break;
+    }
+    case VALUE_ARRAY: {
+        bool first = false;
+        Array* array = value.data.array;
+        write_snapshot_u32(writer, (uint32_t)snapshot_object_id(&tables->arrays, array, &first));
 
-        if (interpreter->has_return) {
+        if (!first) {
             break;
         }
-    }
 
-    pop_scope(interpreter);
-    return result;
-}
+        write_snapshot_u32(writer, array->packed);
+        write_snapshot_u32(writer, (uint32_t)array->length);
 
-Value evaluate_variable_declaration(Interpreter* interpreter, ASTNode* node) {
-    Value value = evaluate(interpreter, node->data.variable_declaration.value);
-    define_variable(get_current_scope(interpreter), node->data.variable_declaration.name, value);
-    return value;
-}
+        if (array->packed) {
+            write_snapshot_bytes(writer, array->items.numbers, sizeof(double) * array->length);
+        }
+        else {
+            for (int i = 0; i < array->length; i++) {
+                write_snapshot_value(writer, tables, array->items.values[i]);
+            }
+        }
+        break;
+    }
+    case VALUE_NATIVE:
+        write_snapshot_string(writer, value.data.native->name);
+        break;
+    case VALUE_MAP: {
+        bool first = false;
+        Map* map = value.data.map;
+        write_snapshot_u32(writer, (uint32_t)snapshot_object_id(&tables->maps, map, &first));
 
-Value evaluate_assignment_expression(Interpreter* interpreter, ASTNode* node) {
-    Value value = evaluate(interpreter, node->data.assignment_expression.value);
+        if (!first) {
+            break;
+        }
 
-    for (int i = interpreter->scope_stack_length - 1; i >= 0; i--) {
-        Scope* scope = interpreter->scope_stack[i];
+        write_snapshot_u32(writer, (uint32_t)map->length);
 
-        for (int j = 0; j < scope->length; j++) {
-            if (strcmp(scope->names[j], node->data.assignment_expression.name) == 0) {
-                scope->values[j] = value;
-                return value;
+        for (int i = 0; i < map->entries_length; i++) {
+            if (map->entries[i].key.type != VALUE_NULL) {
+                write_snapshot_value(writer, tables, map->entries[i].key);
+                write_snapshot_value(writer, tables, map->entries[i].value);
             }
         }
+        break;
+    }
+    case VALUE_NULL:
+        break;
     }
-
-    fprintf(stderr, "Variable '%s' is not defined\n", node->data.assignment_expression.name);
-    exit(1);
-
-    // To avoid compiler warning
-    Value null_value;
-    null_value.type = VALUE_NULL;
-    return null_value;
 }
 
-Value evaluate_binary_expression(Interpreter* interpreter, ASTNode* node) {
-    Value left = evaluate(interpreter, node->data.binary_expression.left);
-    Value right = evaluate(interpreter, node->data.binary_expression.right);
-    Value result;
-
-    // Handle numeric operations
-    if (left.type == VALUE_NUMBER && right.type == VALUE_NUMBER) {
-        result.type = VALUE_NUMBER;
+static bool read_snapshot_value(SnapshotReader* reader, SnapshotTables* tables, Value* value) {
+    value->type = (ValueType)read_snapshot_u32(reader);
 
-        if (strcmp(node->data.binary_expression.operator, "+") == 0) {
-            result.data.number = left.data.number + right.data.number;
-        }
-        else if (strcmp(node->data.binary_expression.operator, "-") == 0) {
-            result.data.number = left.data.number - right.data.number;
+    switch (value->type) {
+    case VALUE_NUMBER: {
+        const void* data = read_snapshot_bytes(reader, sizeof(double));
+        if (data) {
+            memcpy(&value->data.number, data, sizeof(double));
         }
-        else if (strcmp(node->data.binary_expression.operator, "*") == 0) {
-            result.data.number = left.data.number * right.data.number;
-        }
-        else if (strcmp(node->data.binary_expression.operator, "/") == 0) {
-            result.data.number = left.data.number / right.data.number;
-        }
-        else if (strcmp(node->data.binary_expression.operator, "%") == 0) {
-            result.data.number = (int)left.data.number % (int)right.data.number;
-        }
-        else if (strcmp(node->data.binary_expression.operator, "==") == 0) {
-            result.type = VALUE_BOOLEAN;
-            result.data.boolean = left.data.number == right.data.number;
-        }
-        else if (strcmp(node->data.binary_expression.operator, "!=") == 0) {
-            result.type = VALUE_BOOLEAN;
-            result.data.boolean = left.data.number != right.data.number;
-        }
-        else if (strcmp(node->data.binary_expression.operator, ">") == 0) {
-            result.type = VALUE_BOOLEAN;
-            result.data.boolean = left.data.number > right.data.number;
+        break;
+    }
+    case VALUE_STRING:
+        value->data.string = read_snapshot_string(reader, MEM_STRING);
+        break;
+    case VALUE_IMPORT:
+        value->data.import = read_snapshot_string(reader, MEM_STRING);
+        break;
+    case VALUE_BOOLEAN:
+        value->data.boolean = read_snapshot_u32(reader) != 0;
+        break;
+    case VALUE_FUNCTION: {
+        value->data.function.name = read_snapshot_string(reader, MEM_CLOSURE);
+        value->data.function.params_length = (int)read_snapshot_u32(reader);
+        if (!reader->ok || value->data.function.params_length < 0 || value->data.function.params_length > 4096) {
+            return false;
         }
-        else if (strcmp(node->data.binary_expression.operator, ">=") == 0) {
-            result.type = VALUE_BOOLEAN;
-            result.data.boolean = left.data.number >= right.data.number;
+
+        value->data.function.params = (char**)asc_malloc(sizeof(char*) * (value->data.function.params_length + 1), MEM_CLOSURE);
+        if (!value->data.function.params) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
         }
-        else if (strcmp(node->data.binary_expression.operator, "<") == 0) {
-            result.type = VALUE_BOOLEAN;
-            result.data.boolean = left.data.number < right.data.number;
+
+        for (int i = 0; i < value->data.function.params_length; i++) {
+            value->data.function.params[i] = read_snapshot_string(reader, MEM_CLOSURE);
         }
-        else if (strcmp(node->data.binary_expression.operator, "<=") == 0) {
-            result.type = VALUE_BOOLEAN;
-            result.data.boolean = left.data.number <= right.data.number;
+
+        uint32_t program = read_snapshot_u32(reader);
+        uint32_t offset = read_snapshot_u32(reader);
+        if (!reader->ok || program >= (uint32_t)tables->programs_length ||
+            (uint64_t)offset + sizeof(ASTNode) > tables->programs[program]->size) {
+            return false;
         }
-    }
-    // Handle string operations
-    else if (left.type == VALUE_STRING && right.type == VALUE_STRING) {
-        if (strcmp(node->data.binary_expression.operator, "+") == 0) {
-            result.type = VALUE_STRING;
-            result.data.string = (char*)malloc(strlen(left.data.string) + strlen(right.data.string) + 1);
-            if (!result.data.string) {
-                fprintf(stderr, "Memory allocation failed\n");
-                exit(1);
+
+        value->data.function.body = (ASTNode*)((char*)tables->programs[program]->image + offset);
+
+        uint32_t parsed_offset = read_snapshot_u32(reader);
+        if (parsed_offset != UINT32_MAX) {
+            const ASTNode* node = NULL;
+            const Program* parsed = NULL;
+            ASTNode* body = value->data.function.body->type == NODE_LAZY_BODY ? try_lazy_function_body(value->data.function.body) : NULL;
+
+            if (body == NULL || !find_lazy_body(body, &node, &parsed) || (uint64_t)parsed_offset + sizeof(ASTNode) > parsed->size) {
+                return false;
             }
 
-            strcpy(result.data.string, left.data.string);
-            strcat(result.data.string, right.data.string);
+            value->data.function.body = (ASTNode*)((char*)parsed->image + parsed_offset);
         }
-        else if (strcmp(node->data.binary_expression.operator, "==") == 0) {
-            result.type = VALUE_BOOLEAN;
-            result.data.boolean = strcmp(left.data.string, right.data.string) == 0;
-        }
-        else if (strcmp(node->data.binary_expression.operator, "!=") == 0) {
-            result.type = VALUE_BOOLEAN;
-            result.data.boolean = strcmp(left.data.string, right.data.string) != 0;
+
+        value->data.function.closure_length = (int)read_snapshot_u32(reader);
+        if (!reader->ok || value->data.function.closure_length < 0 || value->data.function.closure_length > 4096) {
+            return false;
         }
-        else {
-            fprintf(stderr, "Invalid operator '%s' for strings\n", node->data.binary_expression.operator);
+
+        value->data.function.closure = (Scope**)asc_malloc(sizeof(Scope*) * (value->data.function.closure_length + 1), MEM_CLOSURE);
+        if (!value->data.function.closure) {
+            fprintf(stderr, "Memory allocation failed\n");
             exit(1);
         }
-    }
-    // Handle boolean operations
-    else if (left.type == VALUE_BOOLEAN && right.type == VALUE_BOOLEAN) {
-        result.type = VALUE_BOOLEAN;
 
-        if (strcmp(node->data.binary_expression.operator, "==") == 0) {
-            result.data.boolean = left.data.boolean == right.data.boolean;
-        }
-        else if (strcmp(node->data.binary_expression.operator, "!=") == 0) {
-            result.data.boolean = left.data.boolean != right.data.boolean;
-        }
-        else {
-            fprintf(stderr, "Invalid operator '%s' for booleans\n", node->data.binary_expression.operator);
-            exit(1);
+        for (int i = 0; i < value->data.function.closure_length; i++) {
+            value->data.function.closure[i] = snapshot_scope(tables, read_snapshot_u32(reader));
+            if (value->data.function.closure[i] == NULL) {
+                return false;
+            }
         }
+        break;
     }
-    // Handle mixed types with type coercion for + operator
-    else if (strcmp(node->data.binary_expression.operator, "+") == 0) {
-        // Convert to string and concatenate
-        char left_str[64];
-        char right_str[64];
+    case VALUE_ARRAY: {
+        uint32_t id = read_snapshot_u32(reader);
 
-        if (left.type == VALUE_NUMBER) {
-            sprintf(left_str, "%g", left.data.number);
+        if (reader->ok && id < (uint32_t)tables->arrays.length) {
+            value->data.array = (Array*)tables->arrays.items[id];
+            break;
         }
-        else if (left.type == VALUE_STRING) {
-            strcpy(left_str, left.data.string);
+
+        bool packed = read_snapshot_u32(reader) != 0;
+        uint32_t length = read_snapshot_u32(reader);
+        if (!reader->ok || id != (uint32_t)tables->arrays.length || length > (reader->size - reader->position) / sizeof(uint32_t)) {
+            return false;
         }
-        else if (left.type == VALUE_BOOLEAN) {
-            strcpy(left_str, left.data.boolean ? "true" : "false");
+
+        // Registered before its elements, which may refer back to it
+        bool first = false;
+        Array* array = create_array((int)length);
+        snapshot_object_id(&tables->arrays, array, &first);
+        value->data.array = array;
+
+        if (packed) {
+            const void* data = read_snapshot_bytes(reader, sizeof(double) * length);
+            if (data == NULL) {
+                return false;
+            }
+
+            memcpy(array->items.numbers, data, sizeof(double) * length);
+            array->length = (int)length;
         }
         else {
-            strcpy(left_str, "null");
-        }
+            for (uint32_t i = 0; i < length; i++) {
+                Value element;
+                if (!read_snapshot_value(reader, tables, &element)) {
+                    return false;
+                }
 
-        if (right.type == VALUE_NUMBER) {
-            sprintf(right_str, "%g", right.data.number);
+                array_push(array, element);
+            }
         }
-        else if (right.type == VALUE_STRING) {
-            strcpy(right_str, right.data.string);
+        break;
+    }
+    case VALUE_NATIVE: {
+        char* name = read_snapshot_string(reader, MEM_TOOLING);
+        int builtin = name ? find_builtin(name) : -1;
+        asc_free(name);
+
+        if (builtin < 0) {
+            return false;
         }
-        else if (right.type == VALUE_BOOLEAN) {
-            strcpy(right_str, right.data.boolean ? "true" : "false");
+
+        value->data.native = &builtins[builtin];
+        break;
+    }
+    case VALUE_MAP: {
+        uint32_t id = read_snapshot_u32(reader);
+
+        if (reader->ok && id < (uint32_t)tables->maps.length) {
+            value->data.map = (Map*)tables->maps.items[id];
+            break;
         }
-        else {
-            strcpy(right_str, "null");
+
+        uint32_t length = read_snapshot_u32(reader);
+        if (!reader->ok || id != (uint32_t)tables->maps.length || length > (reader->size - reader->position) / sizeof(uint32_t)) {
+            return false;
         }
 
-        result.type = VALUE_STRING;
-        result.data.string = (char*)malloc(strlen(left_str) + strlen(right_str) + 1);
-        if (!result.data.string) {
-            fprintf(stderr, "Memory allocation failed\n");
-            exit(1);
+        bool first = false;
+        Map* map = create_map((int)length);
+        snapshot_object_id(&tables->maps, map, &first);
+        value->data.map = map;
+
+        for (uint32_t i = 0; i < length; i++) {
+            Value key;
+            Value element;
+            if (!read_snapshot_value(reader, tables, &key) || !read_snapshot_value(reader, tables, &element) ||
+                (key.type != VALUE_STRING && (key.type != VALUE_NUMBER || key.data.number != key.data.number))) {
+                return false;
+            }
+
+            map_set(map, key, element);
         }
+        break;
+    }
+    case VALUE_NULL:
+        break;
+    default:
+        return false;
+    }
+
+    return reader->ok;
+}
+
+// The leading imports, function declarations and let statements of a script
+int count_init_statements(AscProgram* program) {
+    ASTNode* root = program_root(program->program);
+    int count = 0;
 
-        strcpy(result.data.string, left_str);
-        strcat(result.data.string, right_str);
+    while (count < root->data.program.body_length) {
+        NodeType type = AST_NODE(AST_LIST(root->data.program.body)[count])->type;
+        if (type != NODE_IMPORT_STATEMENT && type != NODE_FUNCTION_DECLARATION && type != NODE_VARIABLE_DECLARATION) {
+            break;
+        }
+        count++;
     }
-    // Handle other mixed types
-    else if (strcmp(node->data.binary_expression.operator, "==") == 0) {
-        result.type = VALUE_BOOLEAN;
-        result.data.boolean = false; // Different types are never equal
+
+    return count;
+}
+
+// Writes the interpreter's state after running the first statements of the
+// script at script_path. Returns false if the file could not be written or
+// the state refers to something a snapshot cannot hold.
+bool write_snapshot(const char* path, const char* script_path, AscInterpreter* handle, AscProgram* program, int statements) {
+    Interpreter* interpreter = handle->interpreter;
+    ModuleRegistry* registry = interpreter->modules;
+    char* script = canonical_path(script_path);
+    if (script == NULL) {
+        return false;
     }
-    else if (strcmp(node->data.binary_expression.operator, "!=") == 0) {
-        result.type = VALUE_BOOLEAN;
-        result.data.boolean = true; // Different types are always not equal
+
+    // Let the loader threads finish, so every module's program is settled
+    registry_lock(registry);
+    for (int i = 0; i < registry->length; i++) {
+        while (registry->modules[i]->prefetching) {
+            cond_wait(&registry->loader->changed, &registry->loader->lock);
+        }
     }
-    else {
-        fprintf(stderr, "Invalid operator '%s' for mixed types\n", node->data.binary_expression.operator);
+    registry_unlock(registry);
+
+    // Program 0 is the script, then one per parsed module, including those
+    // only bound by lazy imports
+    SnapshotTables tables = { 0 };
+    tables.programs = (Program**)asc_malloc(sizeof(Program*) * (registry->length + 1), MEM_TOOLING);
+    if (!tables.programs) {
+        fprintf(stderr, "Memory allocation failed\n");
         exit(1);
     }
 
-    return result;
-}
+    tables.programs[tables.programs_length++] = program->program;
+    for (int i = 0; i < registry->length; i++) {
+        if (registry->modules[i]->program) {
+            tables.programs[tables.programs_length++] = registry->modules[i]->program;
+        }
+    }
 
-Value evaluate_logical_expression(Interpreter* interpreter, ASTNode* node) {
-    Value left = evaluate(interpreter, node->data.logical_expression.left);
-    Value result;
+    char* temp_path = (char*)asc_malloc(strlen(path) + 32, MEM_TOOLING);
+    if (!temp_path) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
 
-    if (strcmp(node->data.logical_expression.operator, "&&") == 0) {
-        if (left.type == VALUE_BOOLEAN && !left.data.boolean) {
-            result.type = VALUE_BOOLEAN;
-            result.data.boolean = false;
-            return result;
+#ifdef _WIN32
+    sprintf(temp_path, "%s.%d.tmp", path, _getpid());
+#else
+    sprintf(temp_path, "%s.%d.tmp", path, (int)getpid());
+#endif
+
+    SnapshotWriter writer = { fopen(temp_path, "wb"), true };
+    writer.ok = writer.file != NULL;
+
+    ImageHeader current;
+    fill_image_header(&current, "");
+    FileStamp stamp = { 0 };
+
+    write_snapshot_u32(&writer, SNAPSHOT_MAGIC);
+    write_snapshot_u32(&writer, SNAPSHOT_FORMAT);
+    write_snapshot_bytes(&writer, &current.version_hash, sizeof(current.version_hash));
+    write_snapshot_u32(&writer, current.layout);
+    write_snapshot_u32(&writer, (uint32_t)statements);
+
+    // Files, each with the stamp it must still have and its program image
+    write_snapshot_u32(&writer, (uint32_t)tables.programs_length);
+    for (int i = 0, module = 0; i < tables.programs_length; i++) {
+        const char* file = script;
+
+        if (i > 0) {
+            while (registry->modules[module]->program == NULL) {
+                module++;
+            }
+            file = registry->paths.names[module++];
         }
 
-        Value right = evaluate(interpreter, node->data.logical_expression.right);
-        result.type = VALUE_BOOLEAN;
-        result.data.boolean = (right.type == VALUE_BOOLEAN) ? right.data.boolean : false;
+        if (!get_file_stamp(file, &stamp)) {
+            writer.ok = false;
+        }
+
+        write_snapshot_string(&writer, file);
+        write_snapshot_bytes(&writer, &stamp, sizeof(stamp));
+        write_snapshot_u32(&writer, (uint32_t)tables.programs[i]->size);
+        write_snapshot_bytes(&writer, tables.programs[i]->image, tables.programs[i]->size);
     }
-    else if (strcmp(node->data.logical_expression.operator, "||") == 0) {
-        if (left.type == VALUE_BOOLEAN && left.data.boolean) {
-            result.type = VALUE_BOOLEAN;
-            result.data.boolean = true;
-            return result;
+
+    // Module exports scopes are numbered first so the registry can refer
+    // to them, then everything reachable from the global scope
+    snapshot_scope_id(&tables, interpreter->scope_stack[0]);
+    for (int i = 0; i < registry->length; i++) {
+        if (registry->modules[i]->loaded && registry->modules[i]->exports) {
+            snapshot_scope_id(&tables, registry->modules[i]->exports);
         }
+    }
 
-        Value right = evaluate(interpreter, node->data.logical_expression.right);
-        result.type = VALUE_BOOLEAN;
-        result.data.boolean = (right.type == VALUE_BOOLEAN) ? right.data.boolean : false;
+    // Writing a scope can number more scopes through closures, which this
+    // loop then reaches in turn
+    for (int i = 0; i < tables.scopes_length; i++) {
+        Scope* scope = tables.scopes[i];
+
+        write_snapshot_u32(&writer, (uint32_t)scope->length);
+        for (int j = 0; j < scope->length; j++) {
+            write_snapshot_string(&writer, scope->names[j]);
+            write_snapshot_value(&writer, &tables, scope->values[j]);
+        }
     }
 
-    return result;
-}
+    write_snapshot_u32(&writer, UINT32_MAX); // Ends the scope list
 
-Value evaluate_literal(Interpreter* interpreter, ASTNode* node) {
-    Value result;
+    // Registry: path, program number, whether it has run and exports scope
+    // of each parsed module
+    write_snapshot_u32(&writer, (uint32_t)(tables.programs_length - 1));
+    for (int i = 0, program_id = 1; i < registry->length; i++) {
+        Module* module = registry->modules[i];
+        if (module->program == NULL) {
+            continue;
+        }
 
-    switch (node->data.literal.value_type) {
-    case 'n':
-        result.type = VALUE_NUMBER;
-        result.data.number = node->data.literal.value.number;
-        break;
-    case 's':
-        result.type = VALUE_STRING;
-        result.data.string = strdup(node->data.literal.value.string);
-        break;
-    case 'b':
-        result.type = VALUE_BOOLEAN;
-        result.data.boolean = node->data.literal.value.boolean;
-        break;
-    default:
-        fprintf(stderr, "Unknown literal type: %c\n", node->data.literal.value_type);
-        exit(1);
+        write_snapshot_string(&writer, registry->paths.names[i]);
+        write_snapshot_u32(&writer, (uint32_t)program_id++);
+        write_snapshot_u32(&writer, module->loaded);
+        write_snapshot_u32(&writer, module->exports ? (uint32_t)snapshot_scope_id(&tables, module->exports) : UINT32_MAX);
     }
 
-    return result;
-}
+    bool ok = writer.ok;
+    if (writer.file && fclose(writer.file) != 0) {
+        ok = false;
+    }
 
-Value evaluate_identifier(Interpreter* interpreter, ASTNode* node) {
-    Value* value = lookup_variable(interpreter, node->data.identifier.name);
-    return *value;
+    if (ok) {
+#ifdef _WIN32
+        remove(path);
+#endif
+        ok = rename(temp_path, path) == 0;
+    }
+
+    if (!ok && writer.file) {
+        remove(temp_path);
+    }
+
+    asc_free(temp_path);
+    asc_free(tables.programs);
+    asc_free(tables.scopes);
+    asc_free(tables.arrays.items);
+    asc_free(tables.maps.items);
+    asc_free(script);
+    return ok;
 }
 
-Value evaluate_if_statement(Interpreter* interpreter, ASTNode* node) {
-    Value test = evaluate(interpreter, node->data.if_statement.test);
-    Value result;
-    result.type = VALUE_NULL;
+// Starts a new interpreter from a snapshot of the script at script_path.
+// Returns false, leaving nothing behind, if the snapshot cannot be read, was
+// written by another build, or any file in it has changed since.
+bool load_snapshot(const char* path, const char* script_path, AscInterpreter** interpreter, AscProgram** program, int* statements) {
+    SnapshotReader reader = { 0 };
+    char* script = canonical_path(script_path);
+    FILE* file = script ? fopen(path, "rb") : NULL;
 
-    if (test.type == VALUE_BOOLEAN && test.data.boolean) {
-        result = evaluate(interpreter, node->data.if_statement.consequent);
+    if (file == NULL) {
+        asc_free(script);
+        return false;
     }
-    else if (node->data.if_statement.alternate != NULL) {
-        result = evaluate(interpreter, node->data.if_statement.alternate);
+
+    fseek(file, 0, SEEK_END);
+    long file_size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    char* data = file_size > 0 ? (char*)asc_malloc((size_t)file_size, MEM_TOOLING) : NULL;
+    reader.data = data;
+    reader.size = data ? fread(data, 1, (size_t)file_size, file) : 0;
+    reader.ok = data != NULL;
+    fclose(file);
+
+    ImageHeader current;
+    fill_image_header(&current, "");
+    uint64_t version_hash = 0;
+
+    bool valid = read_snapshot_u32(&reader) == SNAPSHOT_MAGIC && read_snapshot_u32(&reader) == SNAPSHOT_FORMAT;
+    const void* version = read_snapshot_bytes(&reader, sizeof(version_hash));
+    if (version) {
+        memcpy(&version_hash, version, sizeof(version_hash));
     }
 
-    return result;
-}
+    valid = valid && version_hash == current.version_hash && read_snapshot_u32(&reader) == current.layout;
+    *statements = (int)read_snapshot_u32(&reader);
 
-Value evaluate_while_statement(Interpreter* interpreter, ASTNode* node) {
-    Value result;
-    result.type = VALUE_NULL;
+    // Every file must be unchanged, the script first
+    SnapshotTables tables = { 0 };
+    uint32_t programs_length = read_snapshot_u32(&reader);
+    valid = valid && reader.ok && programs_length >= 1 && programs_length <= 65536;
 
-    while (true) {
-        Value test = evaluate(interpreter, node->data.while_statement.test);
+    if (valid) {
+        tables.programs = (Program**)asc_calloc(programs_length, sizeof(Program*), MEM_TOOLING);
+        if (!tables.programs) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+    }
 
-        if (test.type != VALUE_BOOLEAN || !test.data.boolean) {
-            break;
+    for (uint32_t i = 0; valid && i < programs_length; i++) {
+        char* file_path = read_snapshot_string(&reader, MEM_TOOLING);
+        const void* stamp_data = read_snapshot_bytes(&reader, sizeof(FileStamp));
+        uint32_t size = read_snapshot_u32(&reader);
+        const void* image = read_snapshot_bytes(&reader, size);
+        FileStamp stamp, saved;
+
+        valid = image != NULL && get_file_stamp(file_path, &stamp) && (i > 0 || strcmp(file_path, script) == 0);
+        if (valid) {
+            memcpy(&saved, stamp_data, sizeof(saved));
+            valid = same_file_stamp(&stamp, &saved);
         }
 
-        result = evaluate(interpreter, node->data.while_statement.body);
+        if (valid) {
+            Program* loaded = (Program*)asc_malloc(sizeof(Program), MEM_AST);
+            ImageHeader* copy = (ImageHeader*)asc_malloc(size, MEM_AST);
+            if (!loaded || !copy) {
+                fprintf(stderr, "Memory allocation failed\n");
+                exit(1);
+            }
+
+            memcpy(copy, image, size);
+            loaded->image = copy;
+            loaded->size = size;
+            loaded->mapped = false;
+            tables.programs[tables.programs_length++] = loaded;
 
-        if (interpreter->has_return) {
-            break;
+            valid = check_image(copy, size, NULL);
         }
+
+        asc_free(file_path);
     }
 
-    return result;
-}
+    AscInterpreter* handle = NULL;
 
-Value evaluate_function_declaration(Interpreter* interpreter, ASTNode* node) {
-    Value result;
-    result.type = VALUE_FUNCTION;
-    result.data.function.name = strdup(node->data.function_declaration.name);
+    if (valid) {
+        handle = asc_interpreter_create();
+        Heap* previous_heap = use_heap(&handle->heap);
 
-    // Copy parameters
-    result.data.function.params = (char**)malloc(sizeof(char*) * node->data.function_declaration.params_length);
-    if (!result.data.function.params) {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(1);
-    }
+        // Scope 0 is the global scope
+        snapshot_scope_id(&tables, handle->interpreter->scope_stack[0]);
 
-    result.data.function.params_length = node->data.function_declaration.params_length;
+        for (int i = 0; valid; i++) {
+            uint32_t length = read_snapshot_u32(&reader);
+            if (length == UINT32_MAX || !reader.ok) {
+                break;
+            }
 
-    for (int i = 0; i < node->data.function_declaration.params_length; i++) {
-        result.data.function.params[i] = strdup(node->data.function_declaration.params[i]);
+            Scope* scope = snapshot_scope(&tables, (uint32_t)i);
+
+            for (uint32_t j = 0; valid && j < length; j++) {
+                char* name = read_snapshot_string(&reader, MEM_SCOPE);
+                Value value;
+
+                valid = name != NULL && read_snapshot_value(&reader, &tables, &value);
+                if (valid) {
+                    define_variable(scope, name, value);
+                }
+
+                asc_free(name);
+            }
+        }
+
+        // Programs 1 and up belong to the registry from here on
+        ModuleRegistry* registry = handle->interpreter->modules;
+        uint32_t modules_length = read_snapshot_u32(&reader);
+        valid = valid && reader.ok && modules_length == programs_length - 1;
+
+        for (uint32_t i = 0; valid && i < modules_length; i++) {
+            char* module_path = read_snapshot_string(&reader, MEM_TOOLING);
+            uint32_t program_id = read_snapshot_u32(&reader);
+            bool loaded = read_snapshot_u32(&reader) != 0;
+            uint32_t exports = read_snapshot_u32(&reader);
+
+            valid = module_path != NULL && program_id >= 1 && program_id < programs_length &&
+                tables.programs[program_id] != NULL && (exports == UINT32_MAX || exports < (uint32_t)tables.scopes_length);
+
+            if (valid) {
+                Module* module = get_module(registry, module_path);
+                module->program = tables.programs[program_id];
+                module->exports = exports == UINT32_MAX ? NULL : tables.scopes[exports];
+                module->running = loaded;
+                module->loaded = loaded;
+                tables.programs[program_id] = NULL;
+            }
+
+            asc_free(module_path);
+        }
+
+        use_heap(previous_heap);
     }
 
-    result.data.function.body = node->data.function_declaration.body;
+    if (valid) {
+        *interpreter = handle;
+        *program = create_asc_program(tables.programs[0], NULL);
+        tables.programs[0] = NULL;
+    }
+    else {
+        asc_interpreter_free(handle);
+    }
 
-    // Capture current scope (closure)
-    result.data.function.closure = (Scope**)malloc(sizeof(Scope*) * interpreter->scope_stack_length);
-    if (!result.data.function.closure) {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(1);
+    // Whatever was not handed over
+    for (int i = 0; i < tables.programs_length; i++) {
+        free_program(tables.programs[i]);
     }
 
-    result.data.function.closure_length = interpreter->scope_stack_length;
+    asc_free(tables.programs);
+    asc_free(tables.scopes);
+    asc_free(tables.arrays.items);
+    asc_free(tables.maps.items);
+    asc_free(data);
+    asc_free(script);
+    return valid;
+}
 
-    for (int i = 0; i < interpreter->scope_stack_length; i++) {
-        result.data.function.closure[i] = interpreter->scope_stack[i];
+// Bundle implementation
+// A bundle holds a script and every module it can reach, each as a program
+// image with the top-level functions and lets nothing refers to left out.
+// Modules are keyed by the normalized path of their imports, relative to the
+// directory the script ran from, so running a bundle reads nothing but the
+// bundle. It is only valid for the build that wrote it, and it uses the
+// snapshot encoding.
+#define BUNDLE_FORMAT 1
+
+void free_bundle(Bundle* bundle) {
+    if (bundle == NULL) {
+        return;
     }
 
-    define_variable(get_current_scope(interpreter), node->data.function_declaration.name, result);
+    for (int i = 0; i < bundle->length; i++) {
+        free_program(bundle->programs[i]);
+        asc_free(bundle->paths[i]);
+    }
 
-    return result;
+    free_name_table(&bundle->aliases);
+    asc_free(bundle->alias_modules);
+    asc_free(bundle->paths);
+    asc_free(bundle->programs);
+    asc_free(bundle);
 }
 
-Value evaluate_call_expression(Interpreter* interpreter, ASTNode* node) {
-    Value* func_value = lookup_variable(interpreter, node->data.call_expression.name);
+// Returns the bundle's script with its modules attached, or NULL if the file
+// cannot be read or was written by another build
+AscProgram* load_bundle(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
 
-    if (func_value->type != VALUE_FUNCTION) {
-        fprintf(stderr, "'%s' is not a function\n", node->data.call_expression.name);
-        exit(1);
+    fseek(file, 0, SEEK_END);
+    long file_size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    SnapshotReader reader = { 0 };
+    char* data = file_size > 0 ? (char*)asc_malloc((size_t)file_size, MEM_IMPORT) : NULL;
+    reader.data = data;
+    reader.size = data ? fread(data, 1, (size_t)file_size, file) : 0;
+    reader.ok = data != NULL;
+    fclose(file);
+
+    ImageHeader current;
+    fill_image_header(&current, "");
+    uint64_t version_hash = 0;
+
+    bool valid = read_snapshot_u32(&reader) == BUNDLE_MAGIC && read_snapshot_u32(&reader) == BUNDLE_FORMAT;
+    const void* version = read_snapshot_bytes(&reader, sizeof(version_hash));
+    if (version) {
+        memcpy(&version_hash, version, sizeof(version_hash));
     }
 
-    // Evaluate arguments
-    Value* args = (Value*)malloc(sizeof(Value) * node->data.call_expression.arguments_length);
-    if (!args) {
+    valid = valid && version_hash == current.version_hash && read_snapshot_u32(&reader) == current.layout;
+    uint32_t modules_length = read_snapshot_u32(&reader);
+    valid = valid && reader.ok && modules_length >= 1 && modules_length <= 65536;
+
+    Bundle* bundle = (Bundle*)asc_calloc(1, sizeof(Bundle), MEM_IMPORT);
+    if (!bundle) {
         fprintf(stderr, "Memory allocation failed\n");
         exit(1);
     }
 
-    for (int i = 0; i < node->data.call_expression.arguments_length; i++) {
-        args[i] = evaluate(interpreter, node->data.call_expression.arguments[i]);
+    if (valid) {
+        bundle->paths = (char**)asc_calloc(modules_length, sizeof(char*), MEM_IMPORT);
+        bundle->programs = (Program**)asc_calloc(modules_length, sizeof(Program*), MEM_IMPORT);
+        if (!bundle->paths || !bundle->programs) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
     }
 
-    // Save current scope
-    Scope** previous_scope = (Scope**)malloc(sizeof(Scope*) * interpreter->scope_stack_length);
-    if (!previous_scope) {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(1);
-    }
+    // Each image gets an allocation of its own, so it is aligned for its nodes
+    for (uint32_t i = 0; valid && i < modules_length; i++) {
+        char* module_path = read_snapshot_string(&reader, MEM_IMPORT);
+        uint32_t size = read_snapshot_u32(&reader);
+        const void* image = read_snapshot_bytes(&reader, size);
+
+        valid = module_path != NULL && image != NULL;
+        if (valid) {
+            Program* loaded = (Program*)asc_malloc(sizeof(Program), MEM_AST);
+            ImageHeader* copy = (ImageHeader*)asc_malloc(size, MEM_AST);
+            if (!loaded || !copy) {
+                fprintf(stderr, "Memory allocation failed\n");
+                exit(1);
+            }
 
-    int previous_scope_length = interpreter->scope_stack_length;
+            memcpy(copy, image, size);
+            loaded->image = copy;
+            loaded->size = size;
+            loaded->mapped = false;
 
-    for (int i = 0; i < interpreter->scope_stack_length; i++) {
-        previous_scope[i] = interpreter->scope_stack[i];
+            bundle->paths[i] = module_path;
+            bundle->programs[i] = loaded;
+            bundle->length++;
+
+            valid = check_image(copy, size, NULL);
+        }
+        else {
+            asc_free(module_path);
+        }
     }
 
-    // Set up function scope
-    interpreter->scope_stack_length = 0;
+    uint32_t aliases_length = read_snapshot_u32(&reader);
+    valid = valid && reader.ok && aliases_length <= 1048576;
 
-    for (int i = 0; i < func_value->data.function.closure_length; i++) {
-        push_scope(interpreter, func_value->data.function.closure[i]);
+    if (valid && aliases_length > 0) {
+        bundle->alias_modules = (int*)asc_malloc(sizeof(int) * aliases_length, MEM_IMPORT);
+        if (!bundle->alias_modules) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
     }
 
-    Scope* local_scope = create_scope();
-    push_scope(interpreter, local_scope);
+    for (uint32_t i = 0; valid && i < aliases_length; i++) {
+        char* alias = read_snapshot_string(&reader, MEM_IMPORT);
+        uint32_t module = read_snapshot_u32(&reader);
 
-    // Bind parameters to arguments
-    for (int i = 0; i < func_value->data.function.params_length; i++) {
-        if (i < node->data.call_expression.arguments_length) {
-            define_variable(local_scope, func_value->data.function.params[i], args[i]);
-        }
-        else {
-            // Default to null if not enough arguments
-            Value null_value;
-            null_value.type = VALUE_NULL;
-            define_variable(local_scope, func_value->data.function.params[i], null_value);
+        // Aliases are written once each, so their ids follow the file order
+        valid = alias != NULL && module < modules_length && intern_name(&bundle->aliases, alias) == (int)i;
+        if (valid) {
+            bundle->alias_modules[i] = (int)module;
         }
+
+        asc_free(alias);
     }
 
-    // Execute function body
-    Value result = evaluate(interpreter, func_value->data.function.body);
+    asc_free(data);
 
-    // Restore previous scope
-    interpreter->scope_stack_length = 0;
+    if (!valid) {
+        free_bundle(bundle);
+        return NULL;
+    }
 
-    for (int i = 0; i < previous_scope_length; i++) {
-        push_scope(interpreter, previous_scope[i]);
+    AscProgram* program = create_asc_program(bundle->programs[0], NULL);
+    program->bundle = bundle;
+    return program;
+}
+
+// Writing bundles is part of the command-line front end
+#ifndef ASC_LIBRARY
+typedef struct {
+    char* key;        // Normalized path imports reach it by
+    char* directory;  // Its imports are resolved from here
+    Program* program; // As parsed from its file
+    bool* kept;       // Per top-level statement
+} BundleModule;
+
+typedef struct {
+    BundleModule* modules;
+    int modules_length;
+    int modules_capacity;
+    NameTable files;    // Canonical path -> index into modules
+    NameTable aliases;  // Normalized import path -> index into alias_modules
+    int* alias_modules;
+    int alias_modules_capacity;
+    NameTable used;     // Names kept code reads, calls or assigns
+    bool ok;
+} BundleBuilder;
+
+static void scan_bundle_node(BundleBuilder* builder, int module, const ASTNode* node);
+
+// A declaration nothing refers to can be left out if leaving it out cannot
+// change what the program does: a function, or a let whose initializer is
+// built only from literals. Reading a variable can fail or run a lazy
+// import, and operators can fail on their operands' types, so anything else
+// is kept.
+static bool is_pure_initializer(const ASTNode* node) {
+    if (node == NULL) {
+        return true;
+    }
+
+    switch (node->type) {
+    case NODE_LITERAL:
+        return true;
+    case NODE_ARRAY_LITERAL:
+        for (int i = 0; i < node->data.array_literal.elements_length; i++) {
+            if (!is_pure_initializer(AST_NODE(AST_LIST(node->data.array_literal.elements)[i]))) {
+                return false;
+            }
+        }
+        return true;
+    case NODE_MAP_LITERAL:
+        // Keys can be of a type map_set rejects, so only literal ones are pure
+        for (int i = 0; i < node->data.map_literal.entries_length; i++) {
+            const ASTNode* key = AST_NODE(AST_LIST(node->data.map_literal.entries)[2 * i]);
+            if (key->type != NODE_LITERAL || key->data.literal.value_type == 'b' ||
+                !is_pure_initializer(AST_NODE(AST_LIST(node->data.map_literal.entries)[2 * i + 1]))) {
+                return false;
+            }
+        }
+        return true;
+    default:
+        return false;
     }
+}
 
-    free(previous_scope);
-    free(args);
-
-    // Handle return value
-    if (interpreter->has_return) {
-        result = interpreter->return_value;
-        interpreter->has_return = false;
+static const char* droppable_declaration(const ASTNode* statement) {
+    if (statement->type == NODE_FUNCTION_DECLARATION) {
+        return AST_STRING(statement->data.function_declaration.name);
     }
 
-    return result;
-}
+    if (statement->type == NODE_VARIABLE_DECLARATION && is_pure_initializer(AST_NODE(statement->data.variable_declaration.value))) {
+        return AST_STRING(statement->data.variable_declaration.name);
+    }
 
-Value evaluate_return_statement(Interpreter* interpreter, ASTNode* node) {
-    interpreter->return_value = evaluate(interpreter, node->data.return_statement.argument);
-    interpreter->has_return = true;
-    return interpreter->return_value;
+    return NULL;
 }
 
-Value evaluate_print_statement(Interpreter* interpreter, ASTNode* node) {
-    Value value = evaluate(interpreter, node->data.print_statement.argument);
+static void add_bundle_alias(BundleBuilder* builder, const char* key, int module) {
+    int alias = intern_name(&builder->aliases, key);
+    if (alias < builder->aliases.length - 1) {
+        return;
+    }
 
-    switch (value.type) {
-    case VALUE_NUMBER:
-        printf("%g\n", value.data.number);
-        break;
-    case VALUE_STRING:
-        printf("%s\n", value.data.string);
-        break;
-    case VALUE_BOOLEAN:
-        printf("%s\n", value.data.boolean ? "true" : "false");
-        break;
-    case VALUE_FUNCTION:
-        printf("[Function: %s]\n", value.data.function.name);
-        break;
-    case VALUE_NULL:
-        printf("null\n");
-        break;
+    if (alias >= builder->alias_modules_capacity) {
+        builder->alias_modules_capacity = builder->alias_modules_capacity ? builder->alias_modules_capacity * 2 : 16;
+        builder->alias_modules = (int*)asc_realloc(builder->alias_modules, sizeof(int) * builder->alias_modules_capacity, MEM_TOOLING);
+        if (!builder->alias_modules) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
     }
 
-    return value;
+    builder->alias_modules[alias] = module;
 }
 
-Value evaluate_import_statement(Interpreter* interpreter, ASTNode* node) {
-    char* file_path = node->data.import_statement.path;
-    char* full_path = (char*)malloc(strlen(interpreter->base_dir) + strlen(file_path) + 2);
-    if (!full_path) {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(1);
+// Adds the file that key names, once per canonical path, and scans every
+// top-level statement that has to run. The script itself is module 0, and
+// like running it resolves its imports from the current directory, so it
+// is kept apart from any import of the same file. Returns -1 if the file
+// cannot be read or parsed.
+static int add_bundle_module(BundleBuilder* builder, const char* key, const char* import_path, bool script) {
+    char* path = script ? asc_strdup("", MEM_TOOLING) : canonical_path(key);
+    if (path == NULL) {
+        // Left for the import to report if it runs
+        fprintf(stderr, "Warning: '%s' does not exist and is left out\n", import_path);
+        return -1;
     }
 
-    sprintf(full_path, "%s/%s", interpreter->base_dir, file_path);
+    int module = intern_name(&builder->files, path);
+    asc_free(path);
 
-    if (is_file_imported(full_path)) {
-        Value result;
-        result.type = VALUE_NULL;
-        free(full_path);
-        return result;
+    if (module < builder->modules_length) {
+        add_bundle_alias(builder, key, module);
+        return module;
     }
 
-    add_imported_file(full_path);
-
-    char* code = read_file(full_path);
+    char* code = read_file(key);
+    Program* program = NULL;
 
     if (code == NULL) {
-        fprintf(stderr, "Error importing file '%s'\n", file_path);
-        exit(1);
+        fprintf(stderr, "Error: Could not read file '%s'\n", import_path);
+    }
+    else {
+        program = try_compile_source(code);
+        if (program == NULL) {
+            fprintf(stderr, "%s: %s", import_path, error_message);
+        }
     }
 
-    char* previous_base_dir = interpreter->base_dir;
+    asc_free(code);
 
-    // Extract directory from full path
-    char* last_slash = strrchr(full_path, '/');
-    if (last_slash != NULL) {
-        *last_slash = '\0';
-        interpreter->base_dir = strdup(full_path);
+    // Added even when it fails, to keep module numbers in step with files
+    if (program == NULL) {
+        builder->ok = false;
     }
 
-    Value result = process_import(code, get_current_scope(interpreter), interpreter->base_dir);
-
-    free(interpreter->base_dir);
-    interpreter->base_dir = previous_base_dir;
-    free(full_path);
-    free(code);
+    if (builder->modules_length >= builder->modules_capacity) {
+        builder->modules_capacity = builder->modules_capacity ? builder->modules_capacity * 2 : 16;
+        builder->modules = (BundleModule*)asc_realloc(builder->modules, sizeof(BundleModule) * builder->modules_capacity, MEM_TOOLING);
+        if (!builder->modules) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+    }
 
-    return result;
-}
+    ASTNode* root = program ? program_root(program) : NULL;
+    int statements = root ? root->data.program.body_length : 0;
 
-void free_interpreter(Interpreter* interpreter) {
-    // Free scopes
-    for (int i = 0; i < interpreter->scope_stack_length; i++) {
-        free_scope(interpreter->scope_stack[i]);
+    BundleModule* entry = &builder->modules[builder->modules_length++];
+    entry->key = asc_strdup(key, MEM_TOOLING);
+    entry->directory = script ? asc_strdup(".", MEM_TOOLING) : path_directory(key);
+    entry->program = program;
+    entry->kept = (bool*)asc_calloc(statements + 1, sizeof(bool), MEM_TOOLING);
+    if (!entry->kept) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
     }
 
-    free(interpreter->scope_stack);
-    free(interpreter->base_dir);
-    free(interpreter);
-}
+    if (!script) {
+        add_bundle_alias(builder, key, module);
+    }
 
-void free_scope(Scope* scope) {
-    for (int i = 0; i < scope->length; i++) {
-        free(scope->names[i]);
-        free_value(scope->values[i]);
+    for (int i = 0; i < statements; i++) {
+        ASTNode* statement = AST_NODE(AST_LIST(root->data.program.body)[i]);
+        if (droppable_declaration(statement) == NULL) {
+            builder->modules[module].kept[i] = true;
+            scan_bundle_node(builder, module, statement);
+        }
     }
 
-    free(scope->names);
-    free(scope->values);
-    free(scope);
+    return program ? module : -1;
 }
 
-void free_value(Value value) {
-    if (value.type == VALUE_STRING) {
-        free(value.data.string);
+// Records the names a kept node refers to and adds the modules it imports
+static void scan_bundle_node(BundleBuilder* builder, int module, const ASTNode* node) {
+    if (node == NULL) {
+        return;
     }
-    else if (value.type == VALUE_FUNCTION) {
-        free(value.data.function.name);
 
-        for (int i = 0; i < value.data.function.params_length; i++) {
-            free(value.data.function.params[i]);
+    switch (node->type) {
+    case NODE_PROGRAM:
+    case NODE_BLOCK_STATEMENT:
+        for (int i = 0; i < node->data.block_statement.body_length; i++) {
+            scan_bundle_node(builder, module, AST_NODE(AST_LIST(node->data.block_statement.body)[i]));
+        }
+        break;
+    case NODE_VARIABLE_DECLARATION:
+        scan_bundle_node(builder, module, AST_NODE(node->data.variable_declaration.value));
+        break;
+    case NODE_ASSIGNMENT_EXPRESSION:
+        intern_name(&builder->used, AST_STRING(node->data.assignment_expression.name));
+        scan_bundle_node(builder, module, AST_NODE(node->data.assignment_expression.value));
+        break;
+    case NODE_BINARY_EXPRESSION:
+        scan_bundle_node(builder, module, AST_NODE(node->data.binary_expression.left));
+        scan_bundle_node(builder, module, AST_NODE(node->data.binary_expression.right));
+        break;
+    case NODE_LOGICAL_EXPRESSION:
+        scan_bundle_node(builder, module, AST_NODE(node->data.logical_expression.left));
+        scan_bundle_node(builder, module, AST_NODE(node->data.logical_expression.right));
+        break;
+    case NODE_IDENTIFIER:
+        intern_name(&builder->used, AST_STRING(node->data.identifier.name));
+        break;
+    case NODE_IF_STATEMENT:
+        scan_bundle_node(builder, module, AST_NODE(node->data.if_statement.test));
+        scan_bundle_node(builder, module, AST_NODE(node->data.if_statement.consequent));
+        scan_bundle_node(builder, module, AST_NODE(node->data.if_statement.alternate));
+        break;
+    case NODE_WHILE_STATEMENT:
+        scan_bundle_node(builder, module, AST_NODE(node->data.while_statement.test));
+        scan_bundle_node(builder, module, AST_NODE(node->data.while_statement.body));
+        break;
+    case NODE_FUNCTION_DECLARATION:
+        scan_bundle_node(builder, module, AST_NODE(node->data.function_declaration.body));
+        break;
+    case NODE_CALL_EXPRESSION:
+        intern_name(&builder->used, AST_STRING(node->data.call_expression.name));
+        for (int i = 0; i < node->data.call_expression.arguments_length; i++) {
+            scan_bundle_node(builder, module, AST_NODE(AST_LIST(node->data.call_expression.arguments)[i]));
+        }
+        break;
+    case NODE_RETURN_STATEMENT:
+        scan_bundle_node(builder, module, AST_NODE(node->data.return_statement.argument));
+        break;
+    case NODE_PRINT_STATEMENT:
+        for (int i = 0; i < node->data.print_statement.arguments_length; i++) {
+            scan_bundle_node(builder, module, AST_NODE(AST_LIST(node->data.print_statement.arguments)[i]));
+        }
+        break;
+    case NODE_ARRAY_LITERAL:
+        for (int i = 0; i < node->data.array_literal.elements_length; i++) {
+            scan_bundle_node(builder, module, AST_NODE(AST_LIST(node->data.array_literal.elements)[i]));
+        }
+        break;
+    case NODE_MAP_LITERAL:
+        for (int i = 0; i < 2 * node->data.map_literal.entries_length; i++) {
+            scan_bundle_node(builder, module, AST_NODE(AST_LIST(node->data.map_literal.entries)[i]));
+        }
+        break;
+    case NODE_INDEX_EXPRESSION:
+        scan_bundle_node(builder, module, AST_NODE(node->data.index_expression.object));
+        scan_bundle_node(builder, module, AST_NODE(node->data.index_expression.index));
+        break;
+    case NODE_INDEX_ASSIGNMENT:
+        scan_bundle_node(builder, module, AST_NODE(node->data.index_assignment.object));
+        scan_bundle_node(builder, module, AST_NODE(node->data.index_assignment.index));
+        scan_bundle_node(builder, module, AST_NODE(node->data.index_assignment.value));
+        break;
+    case NODE_MEMBER_EXPRESSION:
+        scan_bundle_node(builder, module, AST_NODE(node->data.member_expression.object));
+        for (int i = 0; i < node->data.member_expression.arguments_length; i++) {
+            scan_bundle_node(builder, module, AST_NODE(AST_LIST(node->data.member_expression.arguments)[i]));
+        }
+        break;
+    case NODE_IMPORT_STATEMENT: {
+        const char* file_path = AST_STRING(node->data.import_statement.path);
+        const char* directory = builder->modules[module].directory;
+        char* full_path = (char*)asc_malloc(strlen(directory) + strlen(file_path) + 2, MEM_TOOLING);
+        if (!full_path) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
         }
 
-        free(value.data.function.params);
-        free(value.data.function.closure);
+        // The same key running the bundle computes from the importer's key
+        sprintf(full_path, "%s/%s", directory, file_path);
+        char* key = normalize_path(full_path);
+        add_bundle_module(builder, key, file_path, false);
+
+        asc_free(key);
+        asc_free(full_path);
+        break;
+    }
+    case NODE_LAZY_BODY: {
+        ASTNode* body = try_lazy_function_body(node);
+        if (body == NULL) {
+            fprintf(stderr, "%s: %s", builder->modules[module].key, error_message);
+            builder->ok = false;
+        }
+        scan_bundle_node(builder, module, body);
+        break;
+    }
+    case NODE_LITERAL:
+        break;
     }
 }
 
-Value process_import(char* code, Scope* global_scope, char* base_dir) {
-    Lexer* lexer = create_lexer(code);
-    int token_count;
-    Token* tokens = tokenize(lexer, &token_count);
+static ASTNode* copy_node(ImageBuilder* image, const ASTNode* node);
 
-    Parser* parser = create_parser(tokens, token_count);
-    ASTNode* ast = parse(parser);
+static RelPtr* copy_node_list(ImageBuilder* image, RelPtr* items, int length) {
+    NodeList list = { 0 };
+    for (int i = 0; i < length; i++) {
+        node_list_push(&list, copy_node(image, AST_NODE(items[i])));
+    }
 
-    Interpreter* interpreter = create_interpreter();
-    free(interpreter->base_dir);
-    interpreter->base_dir = strdup(base_dir);
+    return image_node_list(image, &list);
+}
 
-    // Use the same global scope
-    interpreter->scope_stack[0] = global_scope;
+// Copies a node and everything under it into another image. Skipped function
+// bodies stay skipped.
+static ASTNode* copy_node(ImageBuilder* image, const ASTNode* node) {
+    if (node == NULL) {
+        return NULL;
+    }
 
-    Value result = evaluate(interpreter, ast);
+    ASTNode* copy = (ASTNode*)(image->data + image_alloc(image, sizeof(ASTNode), IMAGE_ALIGNMENT));
+    copy->type = node->type;
 
-    // Don't free the global scope as it's shared
-    interpreter->scope_stack[0] = NULL;
-    free_interpreter(interpreter);
-    free_parser(parser);
-    free_ast_node(ast);
-    free_lexer(lexer);
+    switch (node->type) {
+    case NODE_PROGRAM:
+    case NODE_BLOCK_STATEMENT:
+        copy->data.block_statement.body_length = node->data.block_statement.body_length;
+        AST_SET(copy->data.block_statement.body, copy_node_list(image, AST_LIST(node->data.block_statement.body), node->data.block_statement.body_length));
+        break;
+    case NODE_VARIABLE_DECLARATION:
+        AST_SET(copy->data.variable_declaration.name, image_string(image, AST_STRING(node->data.variable_declaration.name)));
+        AST_SET(copy->data.variable_declaration.value, copy_node(image, AST_NODE(node->data.variable_declaration.value)));
+        break;
+    case NODE_ASSIGNMENT_EXPRESSION:
+        AST_SET(copy->data.assignment_expression.name, image_string(image, AST_STRING(node->data.assignment_expression.name)));
+        AST_SET(copy->data.assignment_expression.value, copy_node(image, AST_NODE(node->data.assignment_expression.value)));
+        break;
+    case NODE_BINARY_EXPRESSION:
+    case NODE_LOGICAL_EXPRESSION:
+        AST_SET(copy->data.binary_expression.operator, image_string(image, AST_STRING(node->data.binary_expression.operator)));
+        AST_SET(copy->data.binary_expression.left, copy_node(image, AST_NODE(node->data.binary_expression.left)));
+        AST_SET(copy->data.binary_expression.right, copy_node(image, AST_NODE(node->data.binary_expression.right)));
+        break;
+    case NODE_LITERAL:
+        copy->data.literal = node->data.literal;
+        if (node->data.literal.value_type == 's') {
+            AST_SET(copy->data.literal.value.string, image_string(image, AST_STRING(node->data.literal.value.string)));
+        }
+        break;
+    case NODE_IDENTIFIER:
+        AST_SET(copy->data.identifier.name, image_string(image, AST_STRING(node->data.identifier.name)));
+        break;
+    case NODE_IF_STATEMENT:
+        AST_SET(copy->data.if_statement.test, copy_node(image, AST_NODE(node->data.if_statement.test)));
+        AST_SET(copy->data.if_statement.consequent, copy_node(image, AST_NODE(node->data.if_statement.consequent)));
+        AST_SET(copy->data.if_statement.alternate, copy_node(image, AST_NODE(node->data.if_statement.alternate)));
+        break;
+    case NODE_WHILE_STATEMENT:
+        AST_SET(copy->data.while_statement.test, copy_node(image, AST_NODE(node->data.while_statement.test)));
+        AST_SET(copy->data.while_statement.body, copy_node(image, AST_NODE(node->data.while_statement.body)));
+        break;
+    case NODE_FUNCTION_DECLARATION: {
+        NodeList params = { 0 };
+        RelPtr* names = AST_LIST(node->data.function_declaration.params);
+        for (int i = 0; i < node->data.function_declaration.params_length; i++) {
+            node_list_push(&params, (void*)image_string(image, AST_STRING(names[i])));
+        }
 
-    return result;
+        AST_SET(copy->data.function_declaration.name, image_string(image, AST_STRING(node->data.function_declaration.name)));
+        AST_SET(copy->data.function_declaration.params, image_node_list(image, &params));
+        copy->data.function_declaration.params_length = node->data.function_declaration.params_length;
+        AST_SET(copy->data.function_declaration.body, copy_node(image, AST_NODE(node->data.function_declaration.body)));
+        copy->data.function_declaration.line = node->data.function_declaration.line;
+        break;
+    }
+    case NODE_CALL_EXPRESSION:
+        AST_SET(copy->data.call_expression.name, image_string(image, AST_STRING(node->data.call_expression.name)));
+        AST_SET(copy->data.call_expression.arguments, copy_node_list(image, AST_LIST(node->data.call_expression.arguments), node->data.call_expression.arguments_length));
+        copy->data.call_expression.arguments_length = node->data.call_expression.arguments_length;
+        copy->data.call_expression.line = node->data.call_expression.line;
+        copy->data.call_expression.builtin = node->data.call_expression.builtin;
+        break;
+    case NODE_RETURN_STATEMENT:
+        AST_SET(copy->data.return_statement.argument, copy_node(image, AST_NODE(node->data.return_statement.argument)));
+        break;
+    case NODE_PRINT_STATEMENT:
+        AST_SET(copy->data.print_statement.arguments, copy_node_list(image, AST_LIST(node->data.print_statement.arguments), node->data.print_statement.arguments_length));
+        copy->data.print_statement.arguments_length = node->data.print_statement.arguments_length;
+        break;
+    case NODE_ARRAY_LITERAL:
+        AST_SET(copy->data.array_literal.elements, copy_node_list(image, AST_LIST(node->data.array_literal.elements), node->data.array_literal.elements_length));
+        copy->data.array_literal.elements_length = node->data.array_literal.elements_length;
+        break;
+    case NODE_MAP_LITERAL:
+        AST_SET(copy->data.map_literal.entries, copy_node_list(image, AST_LIST(node->data.map_literal.entries), 2 * node->data.map_literal.entries_length));
+        copy->data.map_literal.entries_length = node->data.map_literal.entries_length;
+        break;
+    case NODE_INDEX_EXPRESSION:
+        AST_SET(copy->data.index_expression.object, copy_node(image, AST_NODE(node->data.index_expression.object)));
+        AST_SET(copy->data.index_expression.index, copy_node(image, AST_NODE(node->data.index_expression.index)));
+        break;
+    case NODE_INDEX_ASSIGNMENT:
+        AST_SET(copy->data.index_assignment.object, copy_node(image, AST_NODE(node->data.index_assignment.object)));
+        AST_SET(copy->data.index_assignment.index, copy_node(image, AST_NODE(node->data.index_assignment.index)));
+        AST_SET(copy->data.index_assignment.value, copy_node(image, AST_NODE(node->data.index_assignment.value)));
+        break;
+    case NODE_MEMBER_EXPRESSION:
+        AST_SET(copy->data.member_expression.object, copy_node(image, AST_NODE(node->data.member_expression.object)));
+        AST_SET(copy->data.member_expression.name, image_string(image, AST_STRING(node->data.member_expression.name)));
+        AST_SET(copy->data.member_expression.arguments, copy_node_list(image, AST_LIST(node->data.member_expression.arguments), node->data.member_expression.arguments_length));
+        copy->data.member_expression.arguments_length = node->data.member_expression.arguments_length;
+        copy->data.member_expression.call = node->data.member_expression.call;
+        break;
+    case NODE_IMPORT_STATEMENT:
+        AST_SET(copy->data.import_statement.path, image_string(image, AST_STRING(node->data.import_statement.path)));
+        break;
+    case NODE_LAZY_BODY:
+        AST_SET(copy->data.lazy_body.source, image_string(image, AST_STRING(node->data.lazy_body.source)));
+        copy->data.lazy_body.line = node->data.lazy_body.line;
+        break;
+    }
+
+    return copy;
 }
 
-Value run_interpreter(char* code, bool is_main_file) {
-    Value result;
-    result.type = VALUE_NULL;
+// Builds the image of a module with only its kept top-level statements
+static Program* shake_module(const BundleModule* module, int* kept, int* declarations) {
+    ASTNode* root = program_root(module->program);
+    ImageBuilder image = { 0 };
+    NodeList body = { 0 };
 
-    Lexer* lexer = create_lexer(code);
-    int token_count;
-    Token* tokens = tokenize(lexer, &token_count);
+    // The copy is never larger than the original, give or take padding
+    reserve_image_builder(&image, module->program->size * 2, module->program->size / 2 + 1);
 
-    Parser* parser = create_parser(tokens, token_count);
-    ASTNode* ast = parse(parser);
+    ASTNode* copy = (ASTNode*)(image.data + image_alloc(&image, sizeof(ASTNode), IMAGE_ALIGNMENT));
+    copy->type = NODE_PROGRAM;
 
-    Interpreter* interpreter = create_interpreter();
-    result = evaluate(interpreter, ast);
+    for (int i = 0; i < root->data.program.body_length; i++) {
+        ASTNode* statement = AST_NODE(AST_LIST(root->data.program.body)[i]);
+
+        if (statement->type == NODE_FUNCTION_DECLARATION || statement->type == NODE_VARIABLE_DECLARATION) {
+            (*declarations)++;
+            *kept += module->kept[i];
+        }
 
-    if (is_main_file) {
-        clear_imported_files();
+        if (module->kept[i]) {
+            node_list_push(&body, copy_node(&image, statement));
+        }
     }
 
-    // Free resources
-    free_interpreter(interpreter);
-    free_parser(parser);
-    free_ast_node(ast);
-    free_lexer(lexer);
+    copy->data.program.body_length = body.length;
+    AST_SET(copy->data.program.body, image_node_list(&image, &body));
 
-    return result;
+    return finish_image(&image, copy, "");
 }
 
-// Utility functions
-bool is_keyword(char* identifier) {
-    const char* keywords[] = {
-        "let", "if", "else", "while", "function",
-        "return", "true", "false", "print", "import"
-    };
+// asc bundle entry.as [-o FILE]
+int run_bundle_command(int argc, char* argv[], const char* program) {
+    const char* entry = NULL;
+    const char* output_path = NULL;
 
-    for (int i = 0; i < 10; i++) {
-        if (strcmp(identifier, keywords[i]) == 0) {
-            return true;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output_path = argv[++i];
+        }
+        else if (argv[i][0] == '-' || entry != NULL) {
+            fprintf(stderr, "Unknown argument '%s'\n", argv[i]);
+            print_usage(program);
+            return 1;
+        }
+        else {
+            entry = argv[i];
         }
     }
 
-    return false;
-}
+    if (entry == NULL) {
+        print_usage(program);
+        return 1;
+    }
 
-char* read_file(const char* filename) {
-    FILE* file = fopen(filename, "r");
+    // Default output: the script's path with .asb in place of .as
+    char* default_path = NULL;
+    if (output_path == NULL) {
+        size_t length = strlen(entry);
+        default_path = (char*)asc_malloc(length + 5, MEM_TOOLING);
+        if (!default_path) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
 
-    if (file == NULL) {
-        return NULL;
+        strcpy(default_path, entry);
+        if (length > 3 && strcmp(default_path + length - 3, ".as") == 0) {
+            default_path[length - 3] = '\0';
+        }
+        strcat(default_path, ".asb");
+        output_path = default_path;
     }
 
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
+    // Every module is parsed from its file, with its bodies skipped until a
+    // kept function needs them
+    module_cache.enabled = false;
 
-    char* buffer = (char*)malloc(file_size + 1);
-    if (!buffer) {
-        fprintf(stderr, "Memory allocation failed\n");
-        fclose(file);
-        exit(1);
-    }
+    BundleBuilder builder = { 0 };
+    builder.ok = true;
 
-    size_t bytes_read = fread(buffer, 1, file_size, file);
-    buffer[bytes_read] = '\0';
+    char* entry_key = normalize_path(entry);
+    add_bundle_module(&builder, entry_key, entry, true);
+    asc_free(entry_key);
 
-    fclose(file);
-    return buffer;
-}
+    // Keep declarations whose names kept code uses until no more are found
+    bool changed = builder.ok;
+    while (changed && builder.ok) {
+        changed = false;
 
-void add_imported_file(char* filename) {
-    if (imported_files == NULL) {
-        imported_files_capacity = 10;
-        imported_files = (char**)malloc(sizeof(char*) * imported_files_capacity);
-        if (!imported_files) {
-            fprintf(stderr, "Memory allocation failed\n");
-            exit(1);
-        }
+        for (int m = 0; m < builder.modules_length; m++) {
+            ASTNode* root = program_root(builder.modules[m].program);
+
+            for (int i = 0; i < root->data.program.body_length; i++) {
+                ASTNode* statement = AST_NODE(AST_LIST(root->data.program.body)[i]);
 
-        imported_files_length = 0;
+                if (!builder.modules[m].kept[i] && find_name(&builder.used, droppable_declaration(statement)) >= 0) {
+                    builder.modules[m].kept[i] = true;
+                    scan_bundle_node(&builder, m, statement);
+                    changed = true;
+                }
+            }
+        }
     }
 
-    if (imported_files_length >= imported_files_capacity) {
-        imported_files_capacity *= 2;
-        imported_files = (char**)realloc(imported_files, sizeof(char*) * imported_files_capacity);
-        if (!imported_files) {
+    bool ok = builder.ok;
+    int kept = 0;
+    int declarations = 0;
+    size_t size = 0;
+
+    if (ok) {
+        char* temp_path = (char*)asc_malloc(strlen(output_path) + 32, MEM_TOOLING);
+        if (!temp_path) {
             fprintf(stderr, "Memory allocation failed\n");
             exit(1);
         }
-    }
 
-    imported_files[imported_files_length++] = strdup(filename);
-}
+#ifdef _WIN32
+        sprintf(temp_path, "%s.%d.tmp", output_path, _getpid());
+#else
+        sprintf(temp_path, "%s.%d.tmp", output_path, (int)getpid());
+#endif
 
-bool is_file_imported(char* filename) {
-    if (imported_files == NULL) {
-        return false;
-    }
+        SnapshotWriter writer = { fopen(temp_path, "wb"), true };
+        writer.ok = writer.file != NULL;
 
-    for (int i = 0; i < imported_files_length; i++) {
-        if (strcmp(imported_files[i], filename) == 0) {
-            return true;
+        ImageHeader current;
+        fill_image_header(&current, "");
+
+        write_snapshot_u32(&writer, BUNDLE_MAGIC);
+        write_snapshot_u32(&writer, BUNDLE_FORMAT);
+        write_snapshot_bytes(&writer, &current.version_hash, sizeof(current.version_hash));
+        write_snapshot_u32(&writer, current.layout);
+
+        write_snapshot_u32(&writer, (uint32_t)builder.modules_length);
+        for (int m = 0; m < builder.modules_length; m++) {
+            Program* shaken = shake_module(&builder.modules[m], &kept, &declarations);
+
+            write_snapshot_string(&writer, builder.modules[m].key);
+            write_snapshot_u32(&writer, (uint32_t)shaken->size);
+            write_snapshot_bytes(&writer, shaken->image, shaken->size);
+            size += shaken->size;
+
+            free_program(shaken);
         }
-    }
 
-    return false;
-}
+        write_snapshot_u32(&writer, (uint32_t)builder.aliases.length);
+        for (int i = 0; i < builder.aliases.length; i++) {
+            write_snapshot_string(&writer, builder.aliases.names[i]);
+            write_snapshot_u32(&writer, (uint32_t)builder.alias_modules[i]);
+        }
+
+        ok = writer.ok;
+        if (writer.file && fclose(writer.file) != 0) {
+            ok = false;
+        }
+
+        if (ok) {
+#ifdef _WIN32
+            remove(output_path);
+#endif
+            ok = rename(temp_path, output_path) == 0;
+        }
+
+        if (!ok && writer.file) {
+            remove(temp_path);
+        }
 
-void clear_imported_files(void) {
-    if (imported_files != NULL) {
-        for (int i = 0; i < imported_files_length; i++) {
-            free(imported_files[i]);
+        if (ok) {
+            fprintf(stderr, "%s: %d modules, %d of %d declarations kept, %llu bytes of images written to %s\n",
+                entry, builder.modules_length, kept, declarations, (unsigned long long)size, output_path);
+        }
+        else {
+            fprintf(stderr, "Error: Could not write bundle to '%s'\n", output_path);
         }
 
-        free(imported_files);
-        imported_files = NULL;
-        imported_files_length = 0;
-        imported_files_capacity = 0;
+        asc_free(temp_path);
+    }
+
+    for (int m = 0; m < builder.modules_length; m++) {
+        free_program(builder.modules[m].program);
+        asc_free(builder.modules[m].key);
+        asc_free(builder.modules[m].directory);
+        asc_free(builder.modules[m].kept);
     }
-}
\ No newline at end of file
+
+    asc_free(builder.modules);
+    asc_free(builder.alias_modules);
+    free_name_table(&builder.files);
+    free_name_table(&builder.aliases);
+    free_name_table(&builder.used);
+    asc_free(default_path);
+
+    return ok ? 0 : 1;
+}
+#endif // ASC_LIBRARY
@@ -1,8 +1,147 @@
-﻿// AbstractScriptC.h : включаемый файл для стандартных системных включаемых файлов
-// или включаемые файлы для конкретного проекта.
+// AbstractScriptC.h: public C API of libabstractscript.
+//
+// A script is compiled once into an AscProgram, an immutable image that any
+// number of interpreters can run. An AscInterpreter holds global state and
+// loaded modules; it can run programs, call their functions by name, and be
+// reset to empty globals without re-parsing anything:
+//
+//     AscProgram* program;
+//     if (asc_compile_file("rules.as", &program) != ASC_OK) {
+//         fprintf(stderr, "%s", asc_error_message());
+//     }
+//
+//     AscInterpreter* interpreter = asc_interpreter_create();
+//     asc_run(interpreter, program, NULL);
+//
+//     AscValue args[2] = { asc_number(1), asc_string("two") };
+//     AscValue result;
+//     asc_call(interpreter, "check", args, 2, &result);
+//
+//     asc_reset(interpreter);
+//     asc_interpreter_free(interpreter);
+//     asc_program_free(program);
+//
+// Errors are returned as status values, with the message available from
+// asc_error_message. After a runtime error the interpreter is back in its
+// global scope; globals defined before the error are kept.
+//
+// Interpreters are isolated from each other: each has its own heap, globals
+// and loaded modules, so separate threads can run separate interpreters at
+// the same time. One interpreter must only be used by one thread at a time.
+// Programs are read-only once compiled and can be shared between threads.
 
 #pragma once
 
-#include <iostream>
+#include <stdbool.h>
+#include <stdio.h>
 
-// TODO: установите здесь ссылки на дополнительные заголовки, требующиеся для программы.
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct AscProgram AscProgram;
+typedef struct AscInterpreter AscInterpreter;
+
+typedef enum {
+    ASC_OK = 0,
+    ASC_ERROR_SYNTAX,    // The source failed to tokenize or parse
+    ASC_ERROR_IO,        // A file could not be read
+    ASC_ERROR_NOT_FOUND, // No global with the requested name
+    ASC_ERROR_TYPE,      // The global is not a function
+    ASC_ERROR_RUNTIME    // The script failed while running
+} AscStatus;
+
+typedef enum {
+    ASC_VALUE_NULL,
+    ASC_VALUE_NUMBER,
+    ASC_VALUE_STRING,
+    ASC_VALUE_BOOLEAN,
+    ASC_VALUE_FUNCTION,
+    ASC_VALUE_ARRAY,
+    ASC_VALUE_MAP
+} AscValueType;
+
+// Strings passed in are copied. Strings returned (and function names) stay
+// valid until the next call on the same interpreter. Arrays and maps are only
+// returned, with their number of elements or entries in as.length; their
+// contents stay in the interpreter. Functions, arrays and maps passed in
+// arrive as null.
+typedef struct {
+    AscValueType type;
+    union {
+        double number;
+        const char* string;
+        bool boolean;
+        int length;
+    } as;
+} AscValue;
+
+static inline AscValue asc_null(void) {
+    AscValue value;
+    value.type = ASC_VALUE_NULL;
+    value.as.number = 0;
+    return value;
+}
+
+static inline AscValue asc_number(double number) {
+    AscValue value;
+    value.type = ASC_VALUE_NUMBER;
+    value.as.number = number;
+    return value;
+}
+
+static inline AscValue asc_string(const char* string) {
+    AscValue value;
+    value.type = ASC_VALUE_STRING;
+    value.as.string = string;
+    return value;
+}
+
+static inline AscValue asc_boolean(bool boolean) {
+    AscValue value;
+    value.type = ASC_VALUE_BOOLEAN;
+    value.as.boolean = boolean;
+    return value;
+}
+
+// Compiles source text. Imports resolve against base_dir, or the current
+// directory when it is NULL.
+AscStatus asc_compile(const char* source, const char* base_dir, AscProgram** program);
+
+// Compiles a source file, or maps a program image written by --compile.
+// Imports resolve against the file's directory.
+AscStatus asc_compile_file(const char* path, AscProgram** program);
+
+// Programs must outlive the interpreters that ran them
+void asc_program_free(AscProgram* program);
+
+AscInterpreter* asc_interpreter_create(void);
+
+// Runs a program's top level in the interpreter's global scope. result may
+// be NULL.
+AscStatus asc_run(AscInterpreter* interpreter, AscProgram* program, AscValue* result);
+
+// Calls a global script function, or a builtin a global is bound to (as
+// after let g = sqrt;). result may be NULL.
+AscStatus asc_call(AscInterpreter* interpreter, const char* name, const AscValue* args, int args_length, AscValue* result);
+
+// Defines or replaces a global before a run, e.g. to pass arguments in
+AscStatus asc_set_global(AscInterpreter* interpreter, const char* name, AscValue value);
+
+// Sends print output to a stream instead of stdout. NULL restores stdout.
+// Output is buffered per interpreter and written out when asc_run and
+// asc_call return, so it is complete then even after an error.
+void asc_set_output(AscInterpreter* interpreter, FILE* output);
+
+// Drops all globals and releases the interpreter's heap in one go. Imported
+// modules stay parsed and run again when next imported.
+void asc_reset(AscInterpreter* interpreter);
+
+void asc_interpreter_free(AscInterpreter* interpreter);
+
+// Describes the last error on the calling thread
+const char* asc_error_message(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,23 @@
+# Runs each script directly and from a bundle: both must fail with the same
+# error, as unused lets whose initializer fails are kept in the bundle
+foreach (script failing_let failing_operator)
+    execute_process(COMMAND ${INTERPRETER} ${script}.as
+        RESULT_VARIABLE direct_result OUTPUT_VARIABLE direct ERROR_VARIABLE direct)
+    execute_process(COMMAND ${INTERPRETER} bundle ${script}.as -o ${WORK_DIR}/${script}.asb
+        RESULT_VARIABLE bundle_result OUTPUT_VARIABLE bundle_output ERROR_VARIABLE bundle_output)
+    if (NOT bundle_result EQUAL 0)
+        message(FATAL_ERROR "Bundling ${script}.as failed:\n${bundle_output}")
+    endif()
+
+    execute_process(COMMAND ${INTERPRETER} ${WORK_DIR}/${script}.asb
+        RESULT_VARIABLE bundled_result OUTPUT_VARIABLE bundled ERROR_VARIABLE bundled)
+
+    # The Running line names the file
+    string(REGEX REPLACE "^Running [^\n]*\n" "" direct "${direct}")
+    string(REGEX REPLACE "^Running [^\n]*\n" "" bundled "${bundled}")
+
+    if (direct_result EQUAL 0 OR bundled_result EQUAL 0 OR NOT direct STREQUAL bundled)
+        message(FATAL_ERROR "${script}.as (exit ${direct_result}):\n${direct}\n"
+            "${script}.asb (exit ${bundled_result}):\n${bundled}")
+    endif()
+endforeach()
@@ -0,0 +1,10 @@
+# Runs SCRIPT, whose output after the "Running" line must be exactly the
+# contents of EXPECTED
+execute_process(COMMAND ${INTERPRETER} ${SCRIPT}
+    RESULT_VARIABLE result OUTPUT_VARIABLE output ERROR_VARIABLE output)
+string(REGEX REPLACE "^Running [^\n]*\n\n" "" output "${output}")
+file(READ ${EXPECTED} expected)
+
+if (NOT result EQUAL 0 OR NOT output STREQUAL expected)
+    message(FATAL_ERROR "${SCRIPT} (exit ${result}) printed:\n${output}\nexpected:\n${expected}")
+endif()
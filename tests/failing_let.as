@@ -0,0 +1,3 @@
+// Nothing reads x, but its initializer fails, so a bundle must keep it
+let x = missing_name;
+print("done");
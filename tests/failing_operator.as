@@ -0,0 +1,3 @@
+// Nothing reads y, but its initializer fails, so a bundle must keep it
+let y = "a" - 1;
+print("done");
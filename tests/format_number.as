@@ -0,0 +1,22 @@
+// Numbers print as the shortest text that reads back as the same double, in
+// exponent notation from 1e21 up
+print(0.1);
+print(1 / 3);
+print(1000000000000000000000);
+
+// The double just below 1e21, one ulp (2^17) down
+print(1000000000000000000000 - 131072);
+
+// The smallest subnormal, 2^-1074
+let tiny = 1;
+let i = 0;
+while (i < 1074) {
+    tiny = tiny / 2;
+    i = i + 1;
+}
+print(tiny);
+
+print(0 * (0 - 1));
+print(0 / 0);
+print(1 / 0);
+print(0 - 1 / 0);
@@ -0,0 +1,15 @@
+# Runs SCRIPT on the scalar kernels, on SSE2 and on the widest the CPU has,
+# which must all print the same
+execute_process(COMMAND ${CMAKE_COMMAND} -E env ASC_KERNELS=scalar ${INTERPRETER} ${SCRIPT}
+    RESULT_VARIABLE result OUTPUT_VARIABLE scalar ERROR_VARIABLE scalar)
+if (NOT result EQUAL 0 OR NOT scalar MATCHES "-0")
+    message(FATAL_ERROR "Scalar run failed (exit ${result}):\n${scalar}")
+endif()
+
+foreach (kernels sse2 widest)
+    execute_process(COMMAND ${CMAKE_COMMAND} -E env ASC_KERNELS=${kernels} ${INTERPRETER} ${SCRIPT}
+        RESULT_VARIABLE result OUTPUT_VARIABLE output ERROR_VARIABLE output)
+    if (NOT result EQUAL 0 OR NOT output STREQUAL scalar)
+        message(FATAL_ERROR "ASC_KERNELS=${kernels} (exit ${result}) differs from scalar:\n${output}")
+    endif()
+endforeach()
@@ -0,0 +1,35 @@
+// min and max of arrays holding both 0 and -0 keep the first zero, whichever
+// kernels run. The arrays are long enough for the SIMD loops and their tails.
+let negative = 0 * (0 - 1);
+
+function fill(length, at, first, rest, sign) {
+    let values = [];
+    let i = 0;
+    while (i < length) {
+        if (i < at) {
+            values.push(sign * (i + 1));
+        }
+        else {
+            if (i == at) {
+                values.push(first);
+            }
+            else {
+                values.push(rest);
+            }
+        }
+        i = i + 1;
+    }
+    return values;
+}
+
+let length = 1;
+while (length <= 19) {
+    let at = 0;
+    while (at < length) {
+        print(length, " ", at,
+            " ", min(fill(length, at, negative, 0, 1)), " ", min(fill(length, at, 0, negative, 1)),
+            " ", max(fill(length, at, negative, 0, 0 - 1)), " ", max(fill(length, at, 0, negative, 0 - 1)));
+        at = at + 1;
+    }
+    length = length + 1;
+}